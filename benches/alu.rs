@@ -0,0 +1,93 @@
+//! Compare the alu kernels using the instruction mix of the example programs
+//! and measure every alu instruction on its own
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use emulator::alu::{Alu, AluKernel};
+use emulator::parse::read_reachable_program;
+
+static EXAMPLES: [&str; 2] = [
+    include_str!("../doc/examples/answer.2i"),
+    include_str!("../doc/examples/multiply.2i"),
+];
+
+/// Alu instructions of all reachable instructions of the example programs
+fn instruction_mix() -> Vec<u8> {
+    EXAMPLES.iter().flat_map(|program| {
+        read_reachable_program(program.as_bytes()).unwrap().into_iter()
+            .map(|(_, inst)| inst.get_alu_instruction())
+    }).collect()
+}
+
+/// Deterministic pseudo random operands (xorshift)
+fn operands(count: usize) -> Vec<(u8, u8, bool)> {
+    let mut state = 0x2545F491u32;
+    (0..count).map(|_| {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        (state as u8, (state >> 8) as u8, state & 0x10000 != 0)
+    }).collect()
+}
+
+fn kernels(c: &mut Criterion) {
+    let mix = instruction_mix();
+    let operands = operands(256);
+
+    let mut group = c.benchmark_group("alu");
+    group.throughput(Throughput::Elements((mix.len() * operands.len()) as u64));
+
+    group.bench_function("match", |b| b.iter(|| {
+        let mut acc = 0u8;
+        for &instruction in mix.iter() {
+            for &(a, x, carry) in operands.iter() {
+                let (result, flags) = Alu::calculate(black_box(instruction), a, x, carry);
+                acc = acc.wrapping_add(result) ^ flags.carry() as u8;
+            }
+        }
+        acc
+    }));
+
+    for &kernel in [AluKernel::Reference, AluKernel::Specialized].iter() {
+        // Select the functions once, like when decoding a program
+        let functions: Vec<_> = mix.iter()
+            .map(|&instruction| (instruction, kernel.function(instruction)))
+            .collect();
+
+        group.bench_function(format!("{:?}", kernel), |b| b.iter(|| {
+            let mut acc = 0u8;
+            for &(instruction, function) in black_box(&functions).iter() {
+                for &(a, x, carry) in operands.iter() {
+                    let (result, flags) = function(instruction, a, x, carry);
+                    acc = acc.wrapping_add(result) ^ flags.carry() as u8;
+                }
+            }
+            acc
+        }));
+    }
+
+    group.finish();
+}
+
+fn opcodes(c: &mut Criterion) {
+    let operands = operands(256);
+
+    let mut group = c.benchmark_group("alu-opcode");
+    group.throughput(Throughput::Elements(operands.len() as u64));
+
+    for instruction in 0..16u8 {
+        let id = BenchmarkId::from_parameter(format!("{:04b}", instruction));
+        group.bench_with_input(id, &instruction, |b, &instruction| b.iter(|| {
+            let mut acc = 0u8;
+            for &(a, x, carry) in operands.iter() {
+                let (result, flags) = Alu::calculate(black_box(instruction), a, x, carry);
+                acc = acc.wrapping_add(result) ^ flags.carry() as u8;
+            }
+            acc
+        }));
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, kernels, opcodes);
+criterion_main!(benches);
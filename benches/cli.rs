@@ -0,0 +1,44 @@
+//! Measure the conversion pipelines of the command line interface
+//!
+//! The ipg-csv and latex conversions are part of the binary, so they are
+//! measured by running the compiled binary on the example programs. The
+//! times therefore include starting the process.
+
+use std::process::{Command, Stdio};
+
+use criterion::{criterion_group, criterion_main, Criterion};
+
+const EMULATOR: &str = env!("CARGO_BIN_EXE_2i-emulator");
+const EXAMPLES: [&str; 2] = [
+    concat!(env!("CARGO_MANIFEST_DIR"), "/doc/examples/answer.2i"),
+    concat!(env!("CARGO_MANIFEST_DIR"), "/doc/examples/multiply.2i"),
+];
+
+fn convert(args: &[&str]) {
+    let status = Command::new(EMULATOR)
+        .args(args)
+        .stdout(Stdio::null())
+        .status()
+        .unwrap();
+    assert!(status.success());
+}
+
+fn pipelines(c: &mut Criterion) {
+    let mut group = c.benchmark_group("cli");
+    group.sample_size(20);
+
+    group.bench_function("ipg-csv", |b| b.iter(|| {
+        convert(&["ipg-csv", EXAMPLES[1]])
+    }));
+
+    group.bench_function("latex", |b| b.iter(|| {
+        let mut args = vec!["latex"];
+        args.extend_from_slice(&EXAMPLES);
+        convert(&args)
+    }));
+
+    group.finish();
+}
+
+criterion_group!(benches, pipelines);
+criterion_main!(benches);
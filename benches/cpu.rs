@@ -0,0 +1,174 @@
+//! Measure decoding and executing single instructions on the different buses
+
+use criterion::{black_box, criterion_group, criterion_main, Criterion, Throughput};
+use emulator::{Cpu, Instruction, IoRam, IoRegisters, Ram};
+use emulator::instruction::decode_program;
+use emulator::observe::{NoObserver, Observer};
+use emulator::parse::read_program;
+
+static MULTIPLY: &str = include_str!("../doc/examples/multiply.2i");
+
+/// Deterministic pseudo random instructions (xorshift)
+fn instructions(count: usize) -> Vec<Instruction> {
+    let mut state = 0x2545F491u32;
+    (0..count).map(|_| {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        Instruction::new(state & 0x1FFFFFF).unwrap()
+    }).collect()
+}
+
+fn field_extraction(c: &mut Criterion) {
+    let instructions = instructions(1024);
+
+    let mut group = c.benchmark_group("instruction");
+    group.throughput(Throughput::Elements(instructions.len() as u64));
+
+    group.bench_function("fields", |b| b.iter(|| {
+        let mut acc = 0u32;
+        for inst in black_box(&instructions).iter() {
+            acc = acc.wrapping_add(inst.get_register_address_a() as u32)
+                ^ inst.get_register_address_b() as u32
+                ^ inst.get_alu_instruction() as u32
+                ^ inst.get_next_instruction_address() as u32
+                ^ inst.get_full_address_control() as u32
+                ^ (inst.is_bus_enabled() as u32) << 1
+                ^ (inst.is_bus_writable() as u32) << 2
+                ^ (inst.should_store_flags() as u32) << 3;
+        }
+        acc
+    }));
+
+    group.bench_function("decode", |b| b.iter(|| {
+        let mut program = [Instruction::default(); 32];
+        let mut acc = 0u8;
+        for chunk in black_box(&instructions).chunks(32) {
+            program.copy_from_slice(chunk);
+            acc ^= decode_program(&program)[black_box(7)].writes_bus() as u8;
+        }
+        acc
+    }));
+
+    group.bench_function("to_mnemonic", |b| b.iter(|| {
+        let mut length = 0;
+        for (i, inst) in black_box(&instructions).iter().enumerate() {
+            length += inst.to_mnemonic(Some(i % 32)).len();
+        }
+        length
+    }));
+
+    group.bench_function("write_mnemonic", |b| {
+        let mut buffer = String::with_capacity(64);
+        b.iter(|| {
+            let mut length = 0;
+            for (i, inst) in black_box(&instructions).iter().enumerate() {
+                buffer.clear();
+                inst.write_mnemonic(Some(i % 32), &mut buffer).unwrap();
+                length += buffer.len();
+            }
+            length
+        })
+    });
+
+    group.finish();
+}
+
+fn execute(c: &mut Criterion) {
+    let program = read_program(MULTIPLY.as_bytes()).unwrap();
+    let decoded = decode_program(&program);
+    const STEPS: u64 = 1000;
+
+    let mut group = c.benchmark_group("execute");
+    group.throughput(Throughput::Elements(STEPS));
+
+    group.bench_function("instruction-ram-ioregisters", |b| {
+        let io = IoRegisters::new();
+        io.inspect_input().borrow_mut().copy_from_slice(&[13, 17, 0, 0]);
+        let mut ram = Ram::new();
+        ram.add_overlay(0xFC, 0xFF, &io);
+
+        b.iter(|| {
+            let mut cpu = Cpu::new();
+            let mut address = 0;
+            for _ in 0..STEPS {
+                address = cpu.execute_instruction(program[address], &mut ram).unwrap().0;
+            }
+            address
+        })
+    });
+
+    group.bench_function("decoded-ram-ioregisters", |b| {
+        let io = IoRegisters::new();
+        io.inspect_input().borrow_mut().copy_from_slice(&[13, 17, 0, 0]);
+        let mut ram = Ram::new();
+        ram.add_overlay(0xFC, 0xFF, &io);
+
+        b.iter(|| {
+            let mut cpu = Cpu::new();
+            let mut address = 0;
+            for _ in 0..STEPS {
+                address = cpu.execute_decoded(&decoded[address], &mut ram).unwrap().0;
+            }
+            address
+        })
+    });
+
+    group.bench_function("decoded-ioram", |b| {
+        let mut ram = IoRam::new();
+        ram.inspect_input().copy_from_slice(&[13, 17, 0, 0]);
+
+        b.iter(|| {
+            let mut cpu = Cpu::new();
+            let mut address = 0;
+            for _ in 0..STEPS {
+                address = cpu.execute_decoded(&decoded[address], &mut ram).unwrap().0;
+            }
+            address
+        })
+    });
+
+    // Must be as fast as decoded-ioram
+    group.bench_function("observed-none-ioram", |b| {
+        let mut ram = IoRam::new();
+        ram.inspect_input().copy_from_slice(&[13, 17, 0, 0]);
+
+        b.iter(|| {
+            let mut cpu = Cpu::new();
+            let mut address = 0;
+            for _ in 0..STEPS {
+                address = cpu.execute_observed(&decoded[address], &mut ram, NoObserver).unwrap().0;
+            }
+            address
+        })
+    });
+
+    group.bench_function("observed-writes-ioram", |b| {
+        let mut ram = IoRam::new();
+        ram.inspect_input().copy_from_slice(&[13, 17, 0, 0]);
+        let mut writes = Writes([0; 256]);
+
+        b.iter(|| {
+            let mut cpu = Cpu::new();
+            let mut address = 0;
+            for _ in 0..STEPS {
+                address = cpu.execute_observed(&decoded[address], &mut ram, &mut writes).unwrap().0;
+            }
+            address
+        })
+    });
+
+    group.finish();
+}
+
+/// Observer that only counts the bus writes
+struct Writes([u64; 256]);
+
+impl Observer for Writes {
+    fn bus_write(&mut self, address: u8, _value: u8) {
+        self.0[address as usize] += 1;
+    }
+}
+
+criterion_group!(benches, field_extraction, execute);
+criterion_main!(benches);
@@ -0,0 +1,178 @@
+//! Measure complete programs with all engines, parsing and formatting
+
+use criterion::{black_box, criterion_group, criterion_main, Criterion, Throughput};
+use emulator::{Cpu, Instruction, IoRam, IoRegisters, Ram};
+use emulator::instruction::decode_program;
+use emulator::lockstep::Lockstep;
+use emulator::parse::{read_program, read_reachable_program, verify_program};
+use emulator::superblock::Superblocks;
+
+static MULTIPLY: &str = include_str!("../doc/examples/multiply.2i");
+
+/// Address of the instruction writing the result of the multiplication
+const RESULT_ADDRESS: usize = 0b01001;
+
+/// All combinations of the operands (FC, FD) that are multiplied
+fn inputs() -> Vec<(u8, u8)> {
+    (0..16).flat_map(|a| (0..16).map(move |b| (a * 3, b * 5))).collect()
+}
+
+/// Multiply all inputs until the result is calculated (in R2) with every
+/// engine
+fn multiply(c: &mut Criterion) {
+    let program = read_program(MULTIPLY.as_bytes()).unwrap();
+    let decoded = decode_program(&program);
+    let verified = verify_program(&program).unwrap();
+    let superblocks = Superblocks::<IoRam>::new(&program);
+    let inputs = inputs();
+
+    let mut group = c.benchmark_group("multiply");
+    group.throughput(Throughput::Elements(inputs.len() as u64));
+
+    group.bench_function("reference", |b| b.iter(|| {
+        let mut acc = 0u8;
+        for &(x, y) in inputs.iter() {
+            let io = IoRegisters::new();
+            io.inspect_input().borrow_mut()[..2].copy_from_slice(&[x, y]);
+            let mut ram = Ram::new();
+            ram.add_overlay(0xFC, 0xFF, &io);
+            let mut cpu = Cpu::new();
+
+            let mut address = 0;
+            while address != RESULT_ADDRESS {
+                address = cpu.execute_instruction(program[address], &mut ram).unwrap().0;
+            }
+            acc = acc.wrapping_add(cpu.inspect_registers()[2]);
+        }
+        acc
+    }));
+
+    group.bench_function("decoded", |b| b.iter(|| {
+        let mut acc = 0u8;
+        for &(x, y) in inputs.iter() {
+            let mut ram = IoRam::new();
+            ram.inspect_input()[..2].copy_from_slice(&[x, y]);
+            let mut cpu = Cpu::new();
+
+            let mut address = 0;
+            while address != RESULT_ADDRESS {
+                address = cpu.execute_decoded(&decoded[address], &mut ram).unwrap().0;
+            }
+            acc = acc.wrapping_add(cpu.inspect_registers()[2]);
+        }
+        acc
+    }));
+
+    group.bench_function("verified", |b| b.iter(|| {
+        let mut acc = 0u8;
+        for &(x, y) in inputs.iter() {
+            let mut ram = IoRam::new();
+            ram.inspect_input()[..2].copy_from_slice(&[x, y]);
+            let mut cpu = Cpu::new();
+
+            let mut address = 0;
+            while address != RESULT_ADDRESS {
+                address = cpu.execute_verified(&verified, address, &mut ram).unwrap().0;
+            }
+            acc = acc.wrapping_add(cpu.inspect_registers()[2]);
+        }
+        acc
+    }));
+
+    group.bench_function("superblock", |b| b.iter(|| {
+        let mut acc = 0u8;
+        for &(x, y) in inputs.iter() {
+            let mut ram = IoRam::new();
+            ram.inspect_input()[..2].copy_from_slice(&[x, y]);
+            let mut cpu = Cpu::new();
+
+            let mut address = 0;
+            superblocks.run(&mut cpu, &mut ram, &mut address, u64::MAX, Some(RESULT_ADDRESS))
+                .unwrap();
+            acc = acc.wrapping_add(cpu.inspect_registers()[2]);
+        }
+        acc
+    }));
+
+    group.bench_function("lockstep", |b| b.iter(|| {
+        let mut acc = 0u8;
+        for chunk in inputs.chunks(64) {
+            let mut lanes = Lockstep::<64>::new();
+            for (lane, &(x, y)) in chunk.iter().enumerate() {
+                lanes.set_input(lane, 0, x);
+                lanes.set_input(lane, 1, y);
+            }
+
+            lanes.run(&decoded, u64::MAX, Some(RESULT_ADDRESS));
+            for lane in 0..chunk.len() {
+                acc = acc.wrapping_add(lanes.registers(lane)[2]);
+            }
+        }
+        acc
+    }));
+
+    group.finish();
+}
+
+/// Multiplication with many comments and empty lines between the instructions
+fn commented_program() -> String {
+    let mut program = String::new();
+    for _ in 0..100 {
+        program.push_str("# Multiplication: (FE) = (FC) * (FD), see doc/examples\n\n");
+    }
+    for line in MULTIPLY.lines().filter(|line| line.contains(':')) {
+        for _ in 0..20 {
+            program.push_str("   # Add the first operand to the result until the counter is zero\n\n");
+        }
+        program.push_str(line);
+        program.push_str("  # inline comment\n");
+    }
+    program
+}
+
+fn parse(c: &mut Criterion) {
+    let program = commented_program();
+
+    let mut group = c.benchmark_group("parse");
+    group.throughput(Throughput::Bytes(program.len() as u64));
+
+    group.bench_function("read_program", |b| b.iter(|| {
+        read_program(black_box(program.as_bytes())).unwrap()
+    }));
+
+    group.bench_function("read_reachable_program", |b| b.iter(|| {
+        read_reachable_program(black_box(program.as_bytes())).unwrap()
+    }));
+
+    group.finish();
+}
+
+fn mnemonic(c: &mut Criterion) {
+    let program = read_program(MULTIPLY.as_bytes()).unwrap();
+    let mut instructions: Vec<Instruction> = program.to_vec();
+
+    // Also include unusual combinations like conditional jumps and bus writes
+    let mut state = 0x2545F491u32;
+    for _ in 0..32 {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        instructions.push(Instruction::new(state & 0x1FFFFFF).unwrap());
+    }
+
+    let mut group = c.benchmark_group("format");
+    group.throughput(Throughput::Elements(instructions.len() as u64));
+
+    group.bench_function("to_mnemonic", |b| b.iter(|| {
+        let mut length = 0;
+        for (address, inst) in black_box(&instructions).iter().enumerate() {
+            length += inst.to_mnemonic(Some(address % 32)).len();
+        }
+        length
+    }));
+
+    group.finish();
+}
+
+criterion_group!(benches, multiply, parse, mnemonic);
+criterion_main!(benches);
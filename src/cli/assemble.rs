@@ -0,0 +1,40 @@
+use std::fs::{self, File};
+use std::path::Path;
+
+use clap::ArgMatches;
+
+use emulator::binary::BinaryProgram;
+
+pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
+    let source_path = Path::new(args.value_of("2i-programm").unwrap());
+    let source = fs::read(source_path).map_err(|e| {
+        println!("Die angegebene Datei konnte nicht geöffnet werden: {}", e);
+        2
+    })?;
+
+    let mut program = BinaryProgram::assemble(&source).map_err(|e| {
+        println!("Das Mikroprogramm konnte nicht geladen werden: {}", e);
+        3
+    })?;
+    if args.is_present("strip") {
+        program.strip();
+    }
+
+    let output_path = match args.value_of("output") {
+        Some(path) => Path::new(path).to_path_buf(),
+        None => source_path.with_extension("2ib"),
+    };
+    if output_path == source_path {
+        println!("Die Ausgabedatei muss sich vom Mikroprogramm unterscheiden");
+        return Err(1);
+    }
+
+    let output = File::create(&output_path).map_err(|e| {
+        println!("Die Ausgabedatei konnte nicht erstellt werden: {}", e);
+        4
+    })?;
+    program.write(output).map_err(|e| {
+        println!("Die Ausgabedatei konnte nicht geschrieben werden: {}", e);
+        4
+    })
+}
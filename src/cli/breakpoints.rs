@@ -0,0 +1,210 @@
+use regex::Regex;
+
+use super::{Computer, Program};
+
+/// Maximum number of steps executed by `run` and `continue` without reaching
+/// a breakpoint, so endless loops do not block the ui forever
+pub const MAX_STEPS: u64 = 100_000_000;
+
+/// Number of steps between two calls of the frame function of `run_with`
+const FRAME_STEPS: u64 = 1024;
+
+/// Part of the state that can be watched
+#[derive(Clone, Copy, PartialEq)]
+enum Location {
+    Register(usize),
+    Carry,
+    Negative,
+    Zero,
+    /// FC and FD
+    Input(usize),
+    /// FE and FF
+    Output(usize),
+    Memory(u8),
+}
+
+impl Location {
+    fn value(self, computer: &mut Computer<'_>) -> u8 {
+        match self {
+            Location::Register(register) => computer.cpu.inspect_registers()[register],
+            Location::Carry => computer.cpu.inspect_flags().carry() as u8,
+            Location::Negative => computer.cpu.inspect_flags().negative() as u8,
+            Location::Zero => computer.cpu.inspect_flags().zero() as u8,
+            Location::Input(index) => computer.io.inspect_input().borrow()[index],
+            Location::Output(index) => computer.io.inspect_output().borrow()[index],
+            Location::Memory(address) => computer.ram.inspect().borrow()[address as usize],
+        }
+    }
+}
+
+/// Condition that is checked after every step
+#[derive(Clone, Copy)]
+enum Condition {
+    Address(usize),
+    Equal(Location, u8),
+    NotEqual(Location, u8),
+    /// The value when the condition was last checked
+    Changed(Location, u8),
+}
+
+/// Breakpoints and conditions of the interactive ui
+///
+/// Conditions are parsed once when they are added, so checking them after
+/// every step only compares a few values.
+#[derive(Default)]
+pub struct Breakpoints {
+    conditions: Vec<(String, Condition)>,
+}
+
+impl Breakpoints {
+    /// Stop before executing the instruction at the given address (eg: 01001)
+    pub fn add_break(&mut self, address: &str) -> Result<(), String> {
+        if address.is_empty() || address.len() > 5 {
+            return Err(format!("Ungültige Befehlsadresse: {}", address));
+        }
+        let address = usize::from_str_radix(address, 2).map_err(|_| {
+            format!("Ungültige Befehlsadresse: {}", address)
+        })?;
+
+        self.conditions.push((format!("break {:05b}", address), Condition::Address(address)));
+        Ok(())
+    }
+
+    /// Stop when the given condition (eg: `R2 == 0b1010`, `FE changed`) is met
+    pub fn add_condition(&mut self, condition: &str, computer: &mut Computer<'_>) -> Result<(), String> {
+        let pattern = Regex::new(r"^(?P<location>R[0-7]|[CNZ]|F[C-F]|\((?P<address>[0-9A-Fa-f]{1,2})\))\s*(?:(?P<operator>==|!=)\s*(?P<value>\w+)|(?P<changed>changed))$").unwrap();
+        let invalid = || format!("Ungültige Bedingung: {} (zB: R2 == 0b1010, FE changed, C == 1)", condition);
+
+        let matches = pattern.captures(condition.trim()).ok_or_else(invalid)?;
+        let location = match &matches["location"] {
+            "C" => Location::Carry,
+            "N" => Location::Negative,
+            "Z" => Location::Zero,
+            "FC" => Location::Input(0),
+            "FD" => Location::Input(1),
+            "FE" => Location::Output(0),
+            "FF" => Location::Output(1),
+            register if register.starts_with('R') => {
+                Location::Register(register[1..].parse().unwrap())
+            }
+            _ => match u8::from_str_radix(&matches["address"], 16).unwrap() {
+                // The io registers are not part of the ram
+                address @ 0xFC..=0xFD => Location::Input(address as usize - 0xFC),
+                address @ 0xFE..=0xFF => Location::Output(address as usize - 0xFE),
+                address => Location::Memory(address),
+            },
+        };
+
+        let condition = if matches.name("changed").is_some() {
+            Condition::Changed(location, location.value(computer))
+        } else {
+            let value = parse_value(&matches["value"]).ok_or_else(invalid)?;
+            match &matches["operator"] {
+                "==" => Condition::Equal(location, value),
+                _ => Condition::NotEqual(location, value),
+            }
+        };
+
+        let text = format!("break if {}", matches.get(0).unwrap().as_str());
+        self.conditions.push((text, condition));
+        Ok(())
+    }
+
+    /// Remove the condition with the given number (starting at 1) or all
+    pub fn delete(&mut self, number: Option<usize>) -> bool {
+        match number {
+            Some(number) if number >= 1 && number <= self.conditions.len() => {
+                self.conditions.remove(number - 1);
+                true
+            }
+            Some(_) => false,
+            None => {
+                self.conditions.clear();
+                true
+            }
+        }
+    }
+
+    /// List all conditions with their number
+    pub fn list(&self) -> Vec<String> {
+        self.conditions.iter().enumerate().map(|(i, &(ref text, _))| {
+            format!("{}: {}", i + 1, text)
+        }).collect()
+    }
+
+    /// Execute steps until a condition is met and return its description.
+    ///
+    /// At least one step is executed, so a breakpoint at the current address
+    /// does not stop immediately. Returns the flags of the last step and the
+    /// condition or `None` if `MAX_STEPS` was reached.
+    pub fn run(&mut self, computer: &mut Computer<'_>, program: &Program)
+               -> emulator::Result<(u64, emulator::Flags, Option<String>)> {
+        self.run_with(computer, program, |_, _| ())
+    }
+
+    /// Like `run`, but call `frame` every few steps with the current state
+    /// and the flags of the last step (eg: to update the ui)
+    pub fn run_with<F>(&mut self, computer: &mut Computer<'_>, program: &Program, mut frame: F)
+                       -> emulator::Result<(u64, emulator::Flags, Option<String>)>
+                       where F: FnMut(&mut Computer<'_>, emulator::Flags) {
+        // Changes are relative to the state before continuing
+        for &mut (_, ref mut condition) in self.conditions.iter_mut() {
+            if let Condition::Changed(location, ref mut value) = *condition {
+                *value = location.value(computer);
+            }
+        }
+
+        let mut steps = 0;
+        loop {
+            let flags = computer.step(program)?;
+            steps += 1;
+
+            if let Some(index) = self.check(computer) {
+                return Ok((steps, flags, Some(self.conditions[index].0.clone())));
+            }
+            if steps == MAX_STEPS {
+                return Ok((steps, flags, None));
+            }
+            if steps % FRAME_STEPS == 0 {
+                frame(computer, flags);
+            }
+        }
+    }
+
+    /// Return the index of the first condition that is met
+    fn check(&mut self, computer: &mut Computer<'_>) -> Option<usize> {
+        let mut result = None;
+
+        // Update all changed conditions, so they only fire once per change
+        for (i, &mut (_, ref mut condition)) in self.conditions.iter_mut().enumerate() {
+            let met = match *condition {
+                Condition::Address(address) => computer.instruction_pointer == address,
+                Condition::Equal(location, value) => location.value(computer) == value,
+                Condition::NotEqual(location, value) => location.value(computer) != value,
+                Condition::Changed(location, ref mut old) => {
+                    let value = location.value(computer);
+                    let changed = value != *old;
+                    *old = value;
+                    changed
+                }
+            };
+            if met && result.is_none() {
+                result = Some(i);
+            }
+        }
+
+        result
+    }
+}
+
+/// Parse a binary (0b), hexadecimal (0x) or decimal value
+fn parse_value(value: &str) -> Option<u8> {
+    if value.starts_with("0b") {
+        u8::from_str_radix(&value[2..], 2).ok()
+    } else if value.starts_with("0x") {
+        u8::from_str_radix(&value[2..], 16).ok()
+    } else {
+        value.parse().ok()
+    }
+}
+
@@ -0,0 +1,131 @@
+use std::fs;
+use std::io::Write;
+use std::path::PathBuf;
+
+use clap::ArgMatches;
+
+use super::Program;
+use super::run::Limits;
+
+/// Version of the cached results, which is part of every key
+///
+/// Increase it whenever the format of the results or the behaviour of the
+/// emulator changes, so old results are never used.
+const VERSION: &str = concat!("2i-emulator-cache/1/", env!("CARGO_PKG_VERSION"));
+
+/// Cache of execution results on disk
+///
+/// Results are stored content-addressed: the key is a hash of everything that
+/// influences the result and each result is a file named after the key in a
+/// subdirectory of its first two hex digits (like git objects). Looking up a
+/// key therefore only opens a single file, regardless of the number of
+/// entries, and files are written atomically by renaming.
+pub struct Cache {
+    directory: PathBuf,
+}
+
+impl Cache {
+    /// Open the cache given by the `cache` arg (None if not given)
+    pub fn from_args(args: &ArgMatches<'_>) -> Result<Option<Cache>, i32> {
+        let directory = match args.value_of("cache") {
+            Some(directory) => PathBuf::from(directory),
+            None => return Ok(None),
+        };
+
+        fs::create_dir_all(&directory).map_err(|e| {
+            println!("Das Cache-Verzeichnis konnte nicht erstellt werden: {}", e);
+            2
+        })?;
+
+        Ok(Some(Cache { directory: directory }))
+    }
+
+    /// Read the result stored for the key
+    pub fn get(&self, key: &Key) -> Option<Vec<u8>> {
+        fs::read(self.path(key)).ok()
+    }
+
+    /// Store the result for the key
+    ///
+    /// Errors are ignored, because the result can always be calculated again.
+    pub fn put(&self, key: &Key, result: &[u8]) {
+        let path = self.path(key);
+        let temporary = path.with_extension(format!("tmp{}", std::process::id()));
+
+        let written = fs::create_dir_all(path.parent().unwrap())
+            .and_then(|_| fs::File::create(&temporary))
+            .and_then(|mut file| file.write_all(result));
+        if written.and_then(|_| fs::rename(&temporary, &path)).is_err() {
+            let _ = fs::remove_file(&temporary);
+        }
+    }
+
+    fn path(&self, key: &Key) -> PathBuf {
+        let name = format!("{:016x}{:016x}", key.0, key.1);
+        self.directory.join(&name[..2]).join(&name[2..])
+    }
+}
+
+/// 128 bit hash identifying a result
+pub struct Key(u64, u64);
+
+/// Builder of keys using two 64 bit FNV-1a hashes with different offsets
+#[derive(Clone)]
+pub struct KeyBuilder {
+    hashes: [u64; 2],
+}
+
+impl KeyBuilder {
+    /// Start a key for the given kind of result (eg: `run`)
+    pub fn new(kind: &str) -> KeyBuilder {
+        let mut builder = KeyBuilder {
+            hashes: [0xCBF29CE484222325, 0x84222325CBF29CE4],
+        };
+        builder.bytes(VERSION.as_bytes());
+        builder.bytes(kind.as_bytes());
+        builder
+    }
+
+    /// Add the given bytes (prefixed with their length, so the boundaries
+    /// between different parts are unambiguous)
+    pub fn bytes(&mut self, bytes: &[u8]) -> &mut KeyBuilder {
+        for &byte in (bytes.len() as u64).to_le_bytes().iter().chain(bytes.iter()) {
+            for hash in self.hashes.iter_mut() {
+                *hash = (*hash ^ byte as u64).wrapping_mul(0x100000001B3);
+            }
+        }
+        self
+    }
+
+    /// Add all instructions of the program
+    pub fn program(&mut self, program: &Program) -> &mut KeyBuilder {
+        let mut words = [0; 32 * 4];
+        for (word, instruction) in words.chunks_mut(4).zip(program.instructions.iter()) {
+            word.copy_from_slice(&instruction.get_instruction().to_le_bytes());
+        }
+        self.bytes(&words)
+    }
+
+    /// Add the limits and interrupts of the execution
+    pub fn limits(&mut self, limits: &Limits) -> &mut KeyBuilder {
+        self.bytes(&limits.max_steps.to_le_bytes());
+        self.bytes(&[
+            limits.until_stable as u8,
+            limits.until_address.is_some() as u8,
+            limits.until_address.unwrap_or(0) as u8,
+        ]);
+
+        // Interrupts as their kind, cycle and period (0 for single ones)
+        let mut interrupts = Vec::with_capacity(17 * limits.interrupts.events().len());
+        for event in limits.interrupts.events() {
+            interrupts.push(event.interrupt as u8);
+            interrupts.extend_from_slice(&event.cycle.to_le_bytes());
+            interrupts.extend_from_slice(&event.period.unwrap_or(0).to_le_bytes());
+        }
+        self.bytes(&interrupts)
+    }
+
+    pub fn finish(&self) -> Key {
+        Key(self.hashes[0], self.hashes[1])
+    }
+}
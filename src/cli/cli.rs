@@ -17,6 +17,65 @@ pub fn build() -> App<'static, 'static> {
             .arg(Arg::with_name("shell")
                 .help("bash, fish, zsh, or powershell")
                 .required(true)))
+        .subcommand(SubCommand::with_name("equiv")
+            .about("Prüfe durch Untersuchen aller Zustände, ob zwei Mikroprogramme für alle Werte von FC und FD dieselben Ausgaben liefern.")
+            .arg(Arg::with_name("input")
+                .help("Eingaberegister FE und FF setzen (zB: FE=1,FF=0)")
+                .long("input")
+                .short("i")
+                .takes_value(true)
+                .multiple(true)
+                .use_delimiter(true)
+                .require_delimiter(true))
+            .arg(Arg::with_name("steps")
+                .help("Maximale Anzahl auszuführender Befehle pro Eingabe")
+                .long("steps")
+                .short("n")
+                .default_value("1000000"))
+            .arg(threads_arg())
+            .arg(Arg::with_name("programm-a")
+                .help("Das erste Mikroprogramm")
+                .required(true))
+            .arg(Arg::with_name("programm-b")
+                .help("Das zweite Mikroprogramm")
+                .required(true)))
+        .subcommand(SubCommand::with_name("fuzz")
+            .about("Vergleiche alle Ausführungsarten mit zufälligen Mikroprogrammen, Eingaben und Interrupts und speichere minimierte Mikroprogramme für jede Abweichung.")
+            .arg(Arg::with_name("cases")
+                .help("Anzahl der zufälligen Mikroprogramme (mit jeweils 64 Eingaben)")
+                .long("cases")
+                .default_value("1000"))
+            .arg(Arg::with_name("steps")
+                .help("Anzahl auszuführender Befehle pro Eingabe")
+                .long("steps")
+                .short("n")
+                .default_value("4096"))
+            .arg(Arg::with_name("seed")
+                .help("Startwert der Zufallszahlen (Standard: aktuelle Zeit)")
+                .long("seed")
+                .takes_value(true))
+            .arg(Arg::with_name("output")
+                .help("Verzeichnis für die Mikroprogramme der gefundenen Abweichungen")
+                .long("output")
+                .short("o")
+                .default_value("."))
+            .arg(threads_arg()))
+        .subcommand(SubCommand::with_name("grade")
+            .about("Führe alle Mikroprogramme eines Verzeichnisses parallel mit den Testfällen einer CSV-Datei aus und gib einen Bericht aus.")
+            .arg(Arg::with_name("vectors")
+                .help("CSV-Datei mit den Testfällen (Spalten FC, FD, FE_in, FF_in und die erwarteten Ausgaben FE, FF; hexadezimal)")
+                .long("vectors")
+                .takes_value(true)
+                .required(true))
+            .args(&limit_args())
+            .arg(Arg::with_name("format")
+                .help("Format des Berichts: csv oder json")
+                .long("format")
+                .default_value("csv"))
+            .arg(threads_arg())
+            .arg(Arg::with_name("verzeichnis")
+                .help("Verzeichnis mit den Mikroprogrammen (.2i und .2ib)")
+                .required(true)))
         .subcommand(SubCommand::with_name("ipg-csv")
             .about("Konvertiere ein Programm in das ipg-csv-Format, das mit Hilfe von mcontrol auf den Minirechner geladen werden kann.")
             .arg(Arg::with_name("2i-programm")
@@ -33,6 +92,150 @@ pub fn build() -> App<'static, 'static> {
                 .help("Die darzustellenden Programme")
                 .required(true)
                 .multiple(true)))
+        .subcommand(SubCommand::with_name("assemble")
+            .about("Übersetze ein Mikroprogramm in das Binärformat (.2ib), das ohne erneutes Parsen geladen werden kann.")
+            .arg(Arg::with_name("output")
+                .help("Die zu erstellende Datei (Standard: Mikroprogramm mit der Endung .2ib)")
+                .long("output")
+                .short("o")
+                .takes_value(true))
+            .arg(Arg::with_name("strip")
+                .help("Keine erreichbaren Adressen und Zeilennummern speichern")
+                .long("strip"))
+            .arg(Arg::with_name("2i-programm")
+                .help("Das zu übersetzende Mikroprogramm")
+                .required(true)))
+        .subcommand(SubCommand::with_name("run")
+            .about("Führe ein Mikroprogramm ohne Benutzeroberfläche aus und gib den finalen Zustand maschinenlesbar aus.")
+            .args(&execution_args())
+            .arg(Arg::with_name("trace")
+                .help("Jeden ausgeführten Befehl in die angegebene Trace-Datei schreiben")
+                .long("trace")
+                .takes_value(true))
+            .arg(Arg::with_name("profile")
+                .help("Nach dem Zustand ein Profil der Ausführung ausgeben (Befehle, Sprünge, Schleifen, Buszugriffe)")
+                .long("profile"))
+            .arg(Arg::with_name("input-stream")
+                .help("Eingaberegister FC oder FD aus einer Datei lesen, die bei jedem Lesezugriff den nächsten Wert (ein Byte) liefert (zB: FC=eingabe.bin)")
+                .long("input-stream")
+                .number_of_values(1)
+                .multiple(true))
+            .arg(Arg::with_name("output-stream")
+                .help("Alle Schreibzugriffe auf die Ausgaberegister mit der Anzahl der vorher ausgeführten Befehle als csv in die angegebene Datei schreiben")
+                .long("output-stream")
+                .takes_value(true))
+            .arg(Arg::with_name("2i-programm")
+                .help("Das auszuführende Mikroprogramm")
+                .required(true)))
+        .subcommand(SubCommand::with_name("trace")
+            .about("Zeige den Zustand zu einem Zeitpunkt einer mit run --trace erstellten Trace-Datei an oder vergleiche zwei Trace-Dateien.")
+            .arg(Arg::with_name("step")
+                .help("Anzahl der ausgeführten Befehle (Standard: alle)")
+                .long("step")
+                .short("n")
+                .takes_value(true))
+            .arg(Arg::with_name("records")
+                .help("Alle Befehle ab --step (Standard: 0) zeilenweise ausgeben")
+                .long("records"))
+            .arg(Arg::with_name("diff")
+                .help("Ersten Befehl ausgeben, in dem sich die Trace-Dateien unterscheiden")
+                .long("diff")
+                .takes_value(true))
+            .arg(Arg::with_name("trace-datei")
+                .help("Die zu lesende Trace-Datei")
+                .required(true)))
+        .subcommand(SubCommand::with_name("serve")
+            .about("Stelle viele gleichzeitige Sitzungen über ein JSON-Zeilenprotokoll bereit (load, step, run, input, reset, snapshot).")
+            .arg(Arg::with_name("listen")
+                .help("Adresse und Port, an denen auf Verbindungen gewartet wird")
+                .long("listen")
+                .default_value("127.0.0.1:2220"))
+            .arg(Arg::with_name("threads")
+                .help("Anzahl der Threads, die Befehle ausführen (Standard: alle Prozessorkerne)")
+                .long("threads")
+                .short("j")
+                .takes_value(true)))
+        .subcommand(SubCommand::with_name("sweep")
+            .about("Führe ein Mikroprogramm parallel für alle Werte der angegebenen Eingaberegister aus und gib eine Tabelle der Ausgaberegister aus.")
+            .args(&execution_args())
+            .arg(Arg::with_name("inputs")
+                .help("Die zu durchlaufenden Eingaberegister (zB: FC,FD)")
+                .long("inputs")
+                .takes_value(true)
+                .required(true)
+                .multiple(true)
+                .use_delimiter(true)
+                .require_delimiter(true))
+            .arg(threads_arg())
+            .arg(Arg::with_name("check-termination")
+                .help("Jede Eingabe bis zur Wiederholung eines Zustands untersuchen und in einer weiteren Spalte ausgeben, ob die Ausgaben danach gleich bleiben (settled, loop, steps oder error)")
+                .long("check-termination"))
+            .arg(Arg::with_name("2i-programm")
+                .help("Das auszuführende Mikroprogramm")
+                .required(true)))
+}
+
+/// Arguments of all subcommands that execute programs without the ui
+fn execution_args() -> Vec<Arg<'static, 'static>> {
+    let mut args = vec![
+        Arg::with_name("input")
+            .help("Eingaberegister setzen (zB: FC=00000101,FD=1100)")
+            .long("input")
+            .short("i")
+            .takes_value(true)
+            .multiple(true)
+            .use_delimiter(true)
+            .require_delimiter(true),
+        Arg::with_name("engine")
+            .help("Ausführungsart: scalar, superblock (verkettete Sprünge, ohne --until-stable) oder lockstep (64 Eingaben gleichzeitig, nur sweep, ohne --until-stable)")
+            .long("engine")
+            .default_value("scalar"),
+        Arg::with_name("until-stable")
+            .help("Anhalten, sobald sich der Zustand wiederholt (Endlosschleife)")
+            .long("until-stable"),
+    ];
+    args.extend(limit_args());
+    args
+}
+
+/// Limits of the execution (see `Limits::from_args`) and the cache, shared by
+/// all subcommands executing programs without the ui
+fn limit_args() -> Vec<Arg<'static, 'static>> {
+    vec![
+        Arg::with_name("steps")
+            .help("Maximale Anzahl auszuführender Befehle (pro Eingabe)")
+            .long("steps")
+            .short("n")
+            .default_value("1000000"),
+        Arg::with_name("until-ip")
+            .help("Anhalten, sobald die angegebene Befehlsadresse erreicht wird (zB: 01001)")
+            .long("until-ip")
+            .takes_value(true),
+        Arg::with_name("cache")
+            .help("Ergebnisse im angegebenen Verzeichnis zwischenspeichern und bei gleichem Programm, gleichen Eingaben und Grenzen wiederverwenden")
+            .long("cache")
+            .takes_value(true),
+        Arg::with_name("interrupt")
+            .help("Interrupt einmal nach n Befehlen (zB: INTB@1000) oder periodisch auslösen (zB: INTA+37, INTA@5+37)")
+            .long("interrupt")
+            .takes_value(true)
+            .multiple(true)
+            .use_delimiter(true)
+            .require_delimiter(true),
+        Arg::with_name("interrupts")
+            .help("Interrupts aus der angegebenen Datei auslösen (einer pro Zeile wie bei --interrupt)")
+            .long("interrupts")
+            .takes_value(true),
+    ]
+}
+
+/// Number of worker threads of all parallel subcommands
+fn threads_arg() -> Arg<'static, 'static> {
+    Arg::with_name("threads")
+        .help("Anzahl der zu verwendenden Threads (Standard: alle Prozessorkerne)")
+        .long("threads")
+        .short("j")
+        .takes_value(true)
 }
 
 pub fn gen_completions(args: &ArgMatches<'_>) -> Result<(), i32> {
@@ -0,0 +1,103 @@
+use std::fmt::Write as FmtWrite;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+use std::thread;
+
+use clap::ArgMatches;
+
+use emulator::Machine;
+use emulator::explore::{Explorer, Outcome};
+
+use super::{load_programm, Program};
+use super::run::{set_inputs, threads_from_args};
+
+pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
+    let a = load_programm(Path::new(args.value_of("programm-a").unwrap())).map_err(|_| 2)?;
+    let b = load_programm(Path::new(args.value_of("programm-b").unwrap())).map_err(|_| 2)?;
+    let max_steps = args.value_of("steps").unwrap().parse::<u64>().map_err(|_| {
+        println!("Ungültige Anzahl an Befehlen: {}", args.value_of("steps").unwrap());
+        1
+    })?;
+
+    // FC and FD are explored, FE and FF are fixed
+    let mut initial: Machine = Machine::default();
+    if let Some(inputs) = args.values_of("input") {
+        set_inputs(&mut initial.bus, inputs)?;
+    }
+
+    let threads = threads_from_args(args)?.min(256);
+
+    // Every thread explores a contiguous range of FC, so the states shared
+    // between the inputs of a range are found by the same explorers
+    let rows = thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads).map(|thread| {
+            let (a, b, initial) = (&a, &b, &initial);
+            let first = 256 * thread / threads;
+            let last = 256 * (thread + 1) / threads;
+            scope.spawn(move || compare(a, b, initial, max_steps, first..last))
+        }).collect();
+
+        workers.into_iter().map(|worker| worker.join().unwrap()).collect::<Vec<_>>()
+    });
+
+    let differences: usize = rows.iter().map(|&(differences, _)| differences).sum();
+
+    let stdout = io::stdout();
+    let mut output = BufWriter::new(stdout.lock());
+    write!(output, "equivalent={}\ninputs=65536\ndifferences={}\n",
+        (differences == 0) as u8, differences).map_err(|_| 4)?;
+    if differences > 0 {
+        output.write_all(b"FC FD a     b\n").map_err(|_| 4)?;
+        for (_, rows) in rows {
+            output.write_all(rows.as_bytes()).map_err(|_| 4)?;
+        }
+    }
+    output.flush().map_err(|_| 4)
+}
+
+/// Explore both programs for the given values of FC and all values of FD
+///
+/// Returns the number of inputs for which the programs differ and a table
+/// row for each of them. Inputs only count as equal if both programs settle
+/// with the same outputs.
+fn compare(a: &Program, b: &Program, initial: &Machine, max_steps: u64,
+           inputs: std::ops::Range<usize>) -> (usize, String) {
+    let mut explorers = [Explorer::new(&a.decoded, max_steps), Explorer::new(&b.decoded, max_steps)];
+    let mut differences = 0;
+    let mut rows = String::new();
+
+    for fc in inputs {
+        for fd in 0..256 {
+            let mut state = initial.clone();
+            state.bus.inspect_input()[0] = fc as u8;
+            state.bus.inspect_input()[1] = fd as u8;
+
+            let outcomes: Vec<_> = explorers.iter_mut().map(|explorer| {
+                explorer.explore(state.clone())
+            }).collect();
+
+            let equal = match (&outcomes[0], &outcomes[1]) {
+                (&Outcome::Settled { output: a, .. }, &Outcome::Settled { output: b, .. }) => a == b,
+                _ => false,
+            };
+            if ! equal {
+                differences += 1;
+                write!(rows, "{:02X} {:02X} {:5} {}\n", fc, fd,
+                    format_outcome(&outcomes[0]), format_outcome(&outcomes[1])).unwrap();
+            }
+        }
+    }
+
+    (differences, rows)
+}
+
+/// Format the outcome as the settled outputs or the reason why the outputs
+/// are unknown (`loop`, `steps` or `error`)
+fn format_outcome(outcome: &Outcome) -> String {
+    match outcome {
+        &Outcome::Settled { output, .. } => format!("{:02X} {:02X}", output[0], output[1]),
+        &Outcome::Oscillating { .. } => "loop".to_string(),
+        &Outcome::Limit => "steps".to_string(),
+        &Outcome::Failed { .. } => "error".to_string(),
+    }
+}
@@ -0,0 +1,137 @@
+use std::fmt::Write as FmtWrite;
+use std::fs;
+use std::path::Path;
+use std::thread;
+use std::time::{Instant, SystemTime, UNIX_EPOCH};
+
+use clap::ArgMatches;
+
+use emulator::Instruction;
+use emulator::fuzz::{Case, Divergence, Generator, Harness, LANES};
+use emulator::interrupt::Interrupt;
+
+use super::run::threads_from_args;
+
+/// Number of instructions between two comparisons of the states
+const CHECKPOINT_INTERVAL: u64 = 64;
+
+pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
+    let cases = args.value_of("cases").unwrap().parse::<u64>().map_err(|_| {
+        println!("Ungültige Anzahl an Fällen: {}", args.value_of("cases").unwrap());
+        1
+    })?;
+    let steps = args.value_of("steps").unwrap().parse::<u64>().map_err(|_| {
+        println!("Ungültige Anzahl an Befehlen: {}", args.value_of("steps").unwrap());
+        1
+    })?;
+    let seed = match args.value_of("seed") {
+        Some(seed) => seed.parse::<u64>().map_err(|_| {
+            println!("Ungültiger Startwert: {}", seed);
+            1
+        })?,
+        None => SystemTime::now().duration_since(UNIX_EPOCH).map_or(0, |time| time.as_nanos() as u64),
+    };
+    let directory = Path::new(args.value_of("output").unwrap());
+    let threads = threads_from_args(args)?;
+
+    // Every case has its own generator, so the cases do not depend on the
+    // number of threads
+    let start = Instant::now();
+    let results = thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads as u64).map(|thread| {
+            scope.spawn(move || fuzz(seed, steps, (thread..cases).step_by(threads)))
+        }).collect();
+
+        workers.into_iter().map(|worker| worker.join().unwrap()).collect::<Vec<_>>()
+    });
+    let elapsed = start.elapsed().as_secs_f64();
+
+    let executed: u64 = results.iter().map(|&(executed, _)| executed).sum();
+    let mut divergences: Vec<_> = results.into_iter().flat_map(|(_, divergences)| divergences).collect();
+    divergences.sort_by_key(|&(case, _, _)| case);
+
+    let mut rows = String::new();
+    for &(index, ref case, ref divergence) in divergences.iter() {
+        let path = directory.join(format!("fuzz-{}-{}.2i", seed, index));
+        write_reproducer(&path, seed, index, case, divergence)?;
+        write!(rows, "{:11} {:6} {}\n", divergence.engine, divergence.steps, path.display()).unwrap();
+    }
+
+    print!("seed={}\ncases={}\nsteps={}\nsteps_per_second={:.0}\ndivergences={}\n",
+        seed, cases, executed, executed as f64 / elapsed.max(1e-9), divergences.len());
+    if ! divergences.is_empty() {
+        print!("engine      steps  reproducer\n{}", rows);
+    }
+
+    Ok(())
+}
+
+/// Check the given cases and return the number of executed instructions and
+/// the minimized divergences
+fn fuzz<I>(seed: u64, steps: u64, cases: I) -> (u64, Vec<(u64, Case, Divergence)>)
+    where I: Iterator<Item = u64> {
+    let mut harness = Harness::new(CHECKPOINT_INTERVAL);
+    let mut case = Case::default();
+    let mut divergences = Vec::new();
+
+    for index in cases {
+        Generator::new(seed ^ index.wrapping_mul(0x2545F4914F6CDD1D)).generate(&mut case, LANES, steps);
+        if let Some(divergence) = harness.check(&case) {
+            let (minimal, divergence) = harness.minimize(&case, &divergence);
+            divergences.push((index, minimal, divergence));
+        }
+    }
+
+    (harness.steps(), divergences)
+}
+
+/// Write the minimized case as a program with the inputs and interrupts in
+/// the comments, using the arguments of `run`
+fn write_reproducer(path: &Path, seed: u64, index: u64, case: &Case, divergence: &Divergence)
+                    -> Result<(), i32> {
+    let mut content = String::new();
+    write!(content, "# Abweichung von {} nach {} Befehl(en) (fuzz --seed {}, Fall {})\n",
+        divergence.engine, divergence.steps, seed, index).unwrap();
+
+    for inputs in case.inputs.iter() {
+        write!(content, "# --input FC={:08b},FD={:08b},FE={:08b},FF={:08b}\n",
+            inputs[0], inputs[1], inputs[2], inputs[3]).unwrap();
+    }
+    for event in case.interrupts.events() {
+        let interrupt = match event.interrupt {
+            Interrupt::A => "INTA",
+            Interrupt::B => "INTB",
+        };
+        write!(content, "# --interrupt {}@{}", interrupt, event.cycle).unwrap();
+        if let Some(period) = event.period {
+            write!(content, "+{}", period).unwrap();
+        }
+        content.push('\n');
+    }
+    content.push('\n');
+
+    // Missing instructions are loops, so only the others are written
+    for (address, &inst) in case.program.iter().enumerate() {
+        if inst != Instruction::new_looping(address).unwrap() {
+            write!(content, "{:05b}: {}\n", address, format_instruction(inst)).unwrap();
+        }
+    }
+
+    fs::write(path, content).map_err(|e| {
+        println!("Die Datei {} konnte nicht geschrieben werden: {}", path.display(), e);
+        4
+    })
+}
+
+/// Format the instruction in the groups of the 2i source format
+/// (eg: `00 00001 00 000 1100 01 01 1100 0`)
+fn format_instruction(inst: Instruction) -> String {
+    let bits = format!("{:025b}", inst.get_instruction());
+    let mut groups = Vec::with_capacity(9);
+    let mut start = 0;
+    for &length in [2, 5, 2, 3, 4, 2, 2, 4, 1].iter() {
+        groups.push(&bits[start..start + length]);
+        start += length;
+    }
+    groups.join(" ")
+}
@@ -0,0 +1,366 @@
+use std::fmt::Write as FmtWrite;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+
+use clap::ArgMatches;
+
+use emulator::Machine;
+use emulator::binary::BinaryProgram;
+use emulator::parse::load_files;
+
+use super::Program;
+use super::cache::{Cache, KeyBuilder};
+use super::run::{run_program, threads_from_args, Compiled, Engine, Limits, Stop};
+
+/// Test case with the inputs and the expected outputs
+struct Vector {
+    /// Values of FC, FD, FE and FF (unset registers are 0)
+    input: [u8; 4],
+    /// Expected values of the output registers FE and FF (None: any value)
+    expected: [Option<u8>; 2],
+}
+
+/// Result of executing a program with a single test vector
+enum Outcome {
+    /// Steps, reason for stopping, outputs and if they were expected
+    Finished(u64, Stop, [u8; 2], bool),
+    Error(String),
+}
+
+impl Outcome {
+    /// Decode outcomes stored by `encode` (None if the data is invalid)
+    fn decode(data: &[u8]) -> Option<Vec<Outcome>> {
+        std::str::from_utf8(data).ok()?.lines().map(|line| {
+            if line.starts_with("error,") {
+                return Some(Outcome::Error(line[6..].replace("\\n", "\n")));
+            }
+            let mut fields = line.split(',').skip(1);
+            let mut next = || fields.next();
+            let steps = next()?.parse().ok()?;
+            let stop = match next()? {
+                "steps" => Stop::Steps,
+                "ip" => Stop::Address,
+                period => Stop::Cycle(period.parse().ok()?),
+            };
+            let output = [u8::from_str_radix(next()?, 16).ok()?, u8::from_str_radix(next()?, 16).ok()?];
+            Some(Outcome::Finished(steps, stop, output, next()? == "1"))
+        }).collect()
+    }
+
+    /// Encode the outcomes of a program as one line per vector
+    fn encode(outcomes: &[Outcome]) -> String {
+        let mut data = String::with_capacity(32 * outcomes.len());
+        for outcome in outcomes.iter() {
+            match *outcome {
+                Outcome::Finished(steps, stop, output, passed) => {
+                    let stop = match stop {
+                        Stop::Steps => "steps".to_owned(),
+                        Stop::Address => "ip".to_owned(),
+                        Stop::Cycle(period) => period.to_string(),
+                    };
+                    writeln!(data, "ok,{},{},{:02X},{:02X},{}", steps, stop,
+                        output[0], output[1], passed as u8).unwrap();
+                }
+                Outcome::Error(ref error) => {
+                    writeln!(data, "error,{}", error.replace('\n', "\\n")).unwrap();
+                }
+            }
+        }
+        data
+    }
+
+    fn result(&self) -> &'static str {
+        match *self {
+            Outcome::Finished(_, _, _, true) => "pass",
+            Outcome::Finished(_, _, _, false) => "fail",
+            Outcome::Error(_) => "error",
+        }
+    }
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum Format {
+    Csv,
+    Json,
+}
+
+pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
+    // Grading always stops early as soon as the program is stable
+    let mut limits = Limits::from_args(args)?;
+    limits.until_stable = true;
+    let threads = threads_from_args(args)?;
+    let format = match args.value_of("format").unwrap() {
+        "csv" => Format::Csv,
+        "json" => Format::Json,
+        format => {
+            println!("Ungültiges Ausgabeformat: {}", format);
+            return Err(1);
+        }
+    };
+
+    let vectors = read_vectors(Path::new(args.value_of("vectors").unwrap()))?;
+    let paths = find_programs(Path::new(args.value_of("verzeichnis").unwrap()))?;
+
+    // Programs that cannot be loaded are reported as errors for all vectors
+    let programs: Vec<Result<(Program, Compiled), String>> = load_files(&paths, BinaryProgram::load)
+        .into_iter().zip(paths.iter()).map(|(result, path)| {
+            let program = result.map_err(|e| e.to_string())?.map_err(|e| e.to_string())?;
+            let program = Program::new(path, program.instructions);
+            let compiled = Compiled::new(&program, Engine::Scalar);
+            Ok((program, compiled))
+        }).collect();
+
+    // Programs with known results for all vectors are not executed again
+    let cache = Cache::from_args(args)?;
+    let mut key = KeyBuilder::new("grade");
+    key.limits(&limits);
+    for vector in vectors.iter() {
+        key.bytes(&vector.input);
+        key.bytes(&[vector.expected[0].is_some() as u8, vector.expected[0].unwrap_or(0),
+                    vector.expected[1].is_some() as u8, vector.expected[1].unwrap_or(0)]);
+    }
+    let keys: Vec<_> = programs.iter().map(|program| {
+        let (program, _) = program.as_ref().ok()?;
+        Some(key.clone().program(program).finish())
+    }).collect();
+    let mut cached: Vec<Option<Vec<Outcome>>> = keys.iter().map(|key| {
+        let data = cache.as_ref()?.get(key.as_ref()?)?;
+        Outcome::decode(&data).filter(|outcomes| outcomes.len() == vectors.len())
+    }).collect();
+
+    let pending: Vec<usize> = (0..programs.len()).filter(|&p| cached[p].is_none()).collect();
+    let pending_programs: Vec<_> = pending.iter().map(|&p| &programs[p]).collect();
+    let mut executed = grade(&pending_programs, &vectors, &limits, threads).into_iter();
+    for &p in pending.iter() {
+        let outcomes: Vec<Outcome> = executed.by_ref().take(vectors.len()).collect();
+        if let (Some(cache), &Some(ref key)) = (cache.as_ref(), &keys[p]) {
+            cache.put(key, Outcome::encode(&outcomes).as_bytes());
+        }
+        cached[p] = Some(outcomes);
+    }
+    let outcomes: Vec<Outcome> = cached.into_iter().flat_map(|o| o.unwrap()).collect();
+
+    let stdout = io::stdout();
+    let mut output = BufWriter::new(stdout.lock());
+    let report = match format {
+        Format::Csv => format_csv(&paths, &outcomes, vectors.len()),
+        Format::Json => format_json(&paths, &outcomes, vectors.len()),
+    };
+    output.write_all(report.as_bytes()).and_then(|_| output.flush()).map_err(|_| 4)
+}
+
+/// Execute every program with every vector using the given number of threads
+///
+/// The jobs are claimed one after another, so slow programs do not delay the
+/// others. Returns the outcomes ordered by program and then vector.
+fn grade(programs: &[&Result<(Program, Compiled), String>], vectors: &[Vector],
+         limits: &Limits, threads: usize) -> Vec<Outcome> {
+    let jobs = programs.len() * vectors.len();
+    let next_job = AtomicUsize::new(0);
+
+    let mut outcomes: Vec<(usize, Outcome)> = thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads.min(jobs).max(1)).map(|_| scope.spawn(|| {
+            let mut outcomes = Vec::new();
+            loop {
+                let job = next_job.fetch_add(1, Ordering::Relaxed);
+                if job >= jobs {
+                    return outcomes;
+                }
+
+                let vector = &vectors[job % vectors.len()];
+                let outcome = match *programs[job / vectors.len()] {
+                    Ok((ref program, ref compiled)) => execute(program, compiled, vector, limits),
+                    Err(ref error) => Outcome::Error(error.clone()),
+                };
+                outcomes.push((job, outcome));
+            }
+        })).collect();
+        workers.into_iter().flat_map(|worker| worker.join().unwrap()).collect()
+    });
+
+    outcomes.sort_unstable_by_key(|&(job, _)| job);
+    outcomes.into_iter().map(|(_, outcome)| outcome).collect()
+}
+
+/// Execute the program with the inputs of the vector on a fresh machine
+fn execute(program: &Program, compiled: &Compiled, vector: &Vector, limits: &Limits) -> Outcome {
+    let mut state: Machine = Machine::default();
+    *state.bus.inspect_input() = vector.input;
+
+    match run_program(&mut state, program, compiled, limits) {
+        Ok((steps, stop)) => {
+            let output = *state.bus.inspect_output();
+            let passed = vector.expected.iter().zip(output.iter()).all(|(expected, &value)| {
+                expected.map_or(true, |expected| expected == value)
+            });
+            Outcome::Finished(steps, stop, output, passed)
+        }
+        Err(err) => Outcome::Error(err.to_string()),
+    }
+}
+
+/// Find all programs (.2i and .2ib) in the given directory sorted by name
+fn find_programs(directory: &Path) -> Result<Vec<PathBuf>, i32> {
+    let entries = fs::read_dir(directory).map_err(|e| {
+        println!("Das angegebene Verzeichnis konnte nicht geöffnet werden: {}", e);
+        2
+    })?;
+
+    let mut paths: Vec<PathBuf> = entries.filter_map(|entry| entry.ok()).map(|entry| {
+        entry.path()
+    }).filter(|path| {
+        path.is_file() && path.extension().map_or(false, |e| e == "2i" || e == "2ib")
+    }).collect();
+    paths.sort();
+
+    Ok(paths)
+}
+
+/// Read the test vectors from a csv file like
+///
+/// ```text
+/// FC,FD,FE,FF
+/// 05,0C,3C,00
+/// ```
+///
+/// All values are hexadecimal. The columns FC and FD contain the inputs, FE
+/// and FF the expected outputs (empty: any value) and FE_in and FF_in the
+/// inputs of FE and FF. Empty lines and lines starting with # are ignored.
+fn read_vectors(path: &Path) -> Result<Vec<Vector>, i32> {
+    let content = fs::read_to_string(path).map_err(|e| {
+        println!("Die Testdatei konnte nicht geöffnet werden: {}", e);
+        2
+    })?;
+
+    let mut lines = content.lines().enumerate().filter(|&(_, line)| {
+        let line = line.trim();
+        ! line.is_empty() && ! line.starts_with('#')
+    });
+
+    // Columns are either inputs (0-3) or outputs (4-5)
+    let header = lines.next().map_or("", |(_, line)| line);
+    let columns = header.split(',').map(|column| match column.trim() {
+        "FC" => Ok(0),
+        "FD" => Ok(1),
+        "FE_in" => Ok(2),
+        "FF_in" => Ok(3),
+        "FE" => Ok(4),
+        "FF" => Ok(5),
+        column => {
+            println!("Ungültige Spalte in der Testdatei: {}", column);
+            Err(3)
+        }
+    }).collect::<Result<Vec<usize>, i32>>()?;
+
+    lines.map(|(number, line)| {
+        let values: Vec<&str> = line.split(',').map(str::trim).collect();
+        if values.len() != columns.len() {
+            println!("Falsche Anzahl an Werten in Zeile {} der Testdatei", number + 1);
+            return Err(3);
+        }
+
+        let mut vector = Vector { input: [0; 4], expected: [None; 2] };
+        for (&column, &value) in columns.iter().zip(values.iter()) {
+            let parsed = if value.is_empty() && column >= 4 {
+                None
+            } else {
+                Some(u8::from_str_radix(value, 16).map_err(|_| {
+                    println!("Ungültiger Wert in Zeile {} der Testdatei: {}", number + 1, value);
+                    3
+                })?)
+            };
+            match column {
+                0..=3 => vector.input[column] = parsed.unwrap(),
+                _ => vector.expected[column - 4] = parsed,
+            }
+        }
+
+        Ok(vector)
+    }).collect()
+}
+
+/// Format the outcomes as csv with one line per program and vector
+fn format_csv(paths: &[PathBuf], outcomes: &[Outcome], vectors: usize) -> String {
+    let mut report = String::with_capacity(64 * outcomes.len() + 64);
+    report.push_str("program,vector,result,steps,stop,FE,FF,error\n");
+
+    for (i, outcome) in outcomes.iter().enumerate() {
+        let path = escape_csv(&paths[i / vectors].to_string_lossy());
+        write!(report, "{},{},{},", path, i % vectors + 1, outcome.result()).unwrap();
+        match *outcome {
+            Outcome::Finished(steps, stop, output, _) => {
+                writeln!(report, "{},{},{:02X},{:02X},", steps, stop.name(),
+                    output[0], output[1]).unwrap();
+            }
+            Outcome::Error(ref error) => writeln!(report, ",,,,{}", escape_csv(error)).unwrap(),
+        }
+    }
+
+    report
+}
+
+/// Format the outcomes as a json object with the totals and the outcomes of
+/// every program
+fn format_json(paths: &[PathBuf], outcomes: &[Outcome], vectors: usize) -> String {
+    let count = |outcomes: &[Outcome], result| {
+        outcomes.iter().filter(|o| o.result() == result).count()
+    };
+
+    let mut report = String::with_capacity(128 * outcomes.len() + 128);
+    write!(report, "{{\"passed\":{},\"failed\":{},\"errors\":{},\"programs\":[",
+        count(outcomes, "pass"), count(outcomes, "fail"), count(outcomes, "error")).unwrap();
+
+    for (p, path) in paths.iter().enumerate() {
+        let outcomes = &outcomes[p * vectors..(p + 1) * vectors];
+        write!(report, "{}\n{{\"path\":{},\"passed\":{},\"failed\":{},\"errors\":{},\"results\":[",
+            if p == 0 { "" } else { "," }, escape_json(&path.to_string_lossy()),
+            count(outcomes, "pass"), count(outcomes, "fail"), count(outcomes, "error")).unwrap();
+
+        for (v, outcome) in outcomes.iter().enumerate() {
+            write!(report, "{}\n{{\"vector\":{},\"result\":\"{}\",", if v == 0 { "" } else { "," },
+                v + 1, outcome.result()).unwrap();
+            match *outcome {
+                Outcome::Finished(steps, stop, output, _) => {
+                    write!(report, "\"steps\":{},\"stop\":\"{}\",\"FE\":\"{:02X}\",\"FF\":\"{:02X}\"}}",
+                        steps, stop.name(), output[0], output[1]).unwrap();
+                }
+                Outcome::Error(ref error) => {
+                    write!(report, "\"error\":{}}}", escape_json(error)).unwrap();
+                }
+            }
+        }
+        report.push_str("]}");
+    }
+
+    report.push_str("]}\n");
+    report
+}
+
+/// Quote a csv field if necessary
+fn escape_csv(field: &str) -> String {
+    if field.contains(|c| c == ',' || c == '"' || c == '\n') {
+        format!("\"{}\"", field.replace('"', "\"\""))
+    } else {
+        field.to_owned()
+    }
+}
+
+/// Format a string as a json string literal
+pub fn escape_json(string: &str) -> String {
+    let mut escaped = String::with_capacity(string.len() + 2);
+    escaped.push('"');
+    for c in string.chars() {
+        match c {
+            '"' => escaped.push_str("\\\""),
+            '\\' => escaped.push_str("\\\\"),
+            '\n' => escaped.push_str("\\n"),
+            c if (c as u32) < 0x20 => write!(escaped, "\\u{:04x}", c as u32).unwrap(),
+            c => escaped.push(c),
+        }
+    }
+    escaped.push('"');
+    escaped
+}
@@ -1,18 +1,25 @@
 use std::fs::File;
+use std::io::Read;
 use std::path::Path;
 
 use chrono::prelude::Local;
 use clap::ArgMatches;
-use emulator::parse::read_reachable_program;
+use emulator::Error;
+use emulator::binary::BinaryProgram;
+use emulator::listing::Listing;
 
 pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
     // Load the program from the given path
     let program_path = Path::new(args.value_of("2i-programm").unwrap());
-    let program_file = File::open(program_path).map_err(|e| {
+    let mut program_file = File::open(program_path).map_err(|e| {
         println!("Die angegebene Datei konnte nicht geöffnet werden: {}", e);
         2
     })?;
-    let program = read_reachable_program(&program_file).map_err(|e| {
+    let mut content = Vec::new();
+    let listing = program_file.read_to_end(&mut content).map_err(Error::from).and_then(|_| {
+        let program = BinaryProgram::load(&content)?;
+        Ok(Listing::with_reachable(&program.instructions, program.reachable_addresses()?))
+    }).map_err(|e| {
         println!("Das Mikroprogramm konnte nicht geladen werden: {}", e);
         3
     })?;
@@ -35,25 +42,26 @@ pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
     );
 
     // Print all instructions
-    for (i, &(addr, inst)) in program.iter().enumerate() {
+    for (i, addr) in listing.reachable().enumerate() {
+        let fields = listing.fields(addr);
         print!("{index};{address};\"{mnemonic}\";;{address:05b};",
             index = i,
             address = addr,
-            mnemonic = inst.to_mnemonic(Some(addr as usize)),
+            mnemonic = listing.mnemonic(addr),
         );
         println!("{:02b};{:05b};{};{};{:03b};{:04b};{};{};{};{};{:04b};{};",
-            inst.get_address_control(),
-            inst.get_next_instruction_address(),
-            inst.is_bus_writable() as u8,
-            inst.is_bus_enabled() as u8,
-            inst.get_register_address_a(),
-            inst.get_constant_input() & 0b1111,
-            inst.should_write_register_b() as u8,
-            inst.should_write_register() as u8,
-            inst.is_alu_input_a_bus() as u8,
-            inst.is_alu_input_b_const() as u8,
-            inst.get_alu_instruction(),
-            inst.should_store_flags() as u8,
+            fields.address_control,
+            fields.next_address,
+            fields.bus_writable as u8,
+            fields.bus_enabled as u8,
+            fields.register_a,
+            fields.register_b,
+            fields.write_register_b as u8,
+            fields.write_register as u8,
+            fields.alu_input_a_bus as u8,
+            fields.alu_input_b_const as u8,
+            fields.alu_instruction,
+            fields.store_flags as u8,
         );
     }
 
@@ -1,27 +1,29 @@
 use std::borrow::Cow;
-use std::fs::File;
 use std::path::Path;
 
 use clap::ArgMatches;
-use emulator::Instruction;
-use emulator::parse::read_reachable_program;
+use emulator::binary::BinaryProgram;
+use emulator::listing::Listing;
+use emulator::parse::load_files;
 
 static TEMPLATE: &'static str = include_str!("latex.tex");
 
 pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
-    // Load programs eagerly and remember their paths
-    let programs = args.values_of("2i-programm").unwrap().map(|arg| {
-        let program_path = Path::new(arg);
-        let program_file = File::open(program_path).map_err(|e| {
+    // Load all programs in parallel, but report errors in the given order
+    let paths: Vec<&Path> = args.values_of("2i-programm").unwrap().map(Path::new).collect();
+    let programs = paths.iter().zip(load_files(&paths, |program| {
+        let program = BinaryProgram::load(program)?;
+        Ok(Listing::with_reachable(&program.instructions, program.reachable_addresses()?))
+    })).map(|(path, result)| {
+        let program = result.map_err(|e| {
             println!("Die angegebene Datei konnte nicht geöffnet werden: {}", e);
             2
-        })?;
-        let program = read_reachable_program(&program_file).map_err(|e| {
+        })?.map_err(|e| {
             println!("Das Mikroprogramm konnte nicht geladen werden: {}", e);
             3
         })?;
 
-        Ok((program_path.to_owned(), program))
+        Ok((path.to_path_buf(), program))
     }).collect::<Result<Vec<_>,i32>>()?;
 
     // Load and split template
@@ -43,13 +45,14 @@ pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
     let mut lines_remaining = 37;
     for (path, program) in programs {
         // 2 lines are used for the program header and some margin
-        if lines_remaining < program.len() + 2 {
+        let length = program.reachable().count();
+        if lines_remaining < length + 2 {
             // Start new program table on new page (works because programs
             // cannot be longer than 32 + 2 lines)
             print!("{}", page_separator);
             lines_remaining = 40;
         }
-        lines_remaining -= program.len() + 2;
+        lines_remaining -= length + 2;
 
         print_program(&path.to_string_lossy(), &program);
     }
@@ -60,28 +63,29 @@ pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
     Ok(())
 }
 
-fn print_program(filename: &str, program: &Vec<(u8, Instruction)>) {
+fn print_program(filename: &str, program: &Listing) {
     println!();
     println!("    % Generated from {}", filename);
     println!("    \\multicolumn{{15}}{{l}}{{}}\\\\\\multicolumn{{15}}{{l}}{{\\textbf{{{}}}}}\\\\\\hline", escape_latex(filename));
 
-    for &(addr, inst) in program.iter() {
+    for addr in program.reachable() {
+        let fields = program.fields(addr);
         println!("    {}&\\verb|{}|&{:05b}&{:02b}&{:05b}&{:01b}&{:01b}&{:03b}&{:04b}&{:01b}&{:01b}&{:01b}&{:01b}&{:04b}&{:01b}\\\\\\hline",
             addr,
-            inst.to_mnemonic(Some(addr as usize)),
+            program.mnemonic(addr),
             addr,
-            inst.get_address_control(),
-            inst.get_next_instruction_address(),
-            inst.is_bus_writable() as u8,
-            inst.is_bus_enabled() as u8,
-            inst.get_register_address_a(),
-            inst.get_constant_input() & 0b1111,
-            inst.should_write_register_b() as u8,
-            inst.should_write_register() as u8,
-            inst.is_alu_input_a_bus() as u8,
-            inst.is_alu_input_b_const() as u8,
-            inst.get_alu_instruction(),
-            inst.should_store_flags() as u8);
+            fields.address_control,
+            fields.next_address,
+            fields.bus_writable as u8,
+            fields.bus_enabled as u8,
+            fields.register_a,
+            fields.register_b,
+            fields.write_register_b as u8,
+            fields.write_register as u8,
+            fields.alu_input_a_bus as u8,
+            fields.alu_input_b_const as u8,
+            fields.alu_instruction,
+            fields.store_flags as u8);
     }
 }
 
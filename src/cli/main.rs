@@ -1,14 +1,30 @@
+mod assemble;
+mod breakpoints;
+mod cache;
 mod cli;
+mod equiv;
+mod fuzz;
+mod grade;
 mod ipg;
 mod latex;
+mod profile;
+mod run;
+mod serve;
+mod sweep;
+mod trace;
 mod ui;
 
-use std::fs::File;
+use std::fs::{self, File};
+use std::io::Read;
 use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant, SystemTime};
 
 use regex::Regex;
 use rustyline::{CompletionType, Editor};
 
+/// Number of steps that can be undone using `back`
+const UNDO_STEPS: usize = 10_000;
+
 fn main() {
     if let Err(e) = _main() {
         std::process::exit(e);
@@ -20,9 +36,17 @@ fn _main() -> Result<(), i32> {
 
     // Execute subcommand instead of main program if specified
     match args.subcommand() {
+        ("assemble", Some(args)) => return assemble::main(args),
         ("completions", Some(args)) => return cli::gen_completions(args),
+        ("equiv", Some(args)) => return equiv::main(args),
+        ("fuzz", Some(args)) => return fuzz::main(args),
+        ("grade", Some(args)) => return grade::main(args),
         ("ipg-csv", Some(args)) => return ipg::main(args),
         ("latex", Some(args)) => return latex::main(args),
+        ("run", Some(args)) => return run::main(args),
+        ("serve", Some(args)) => return serve::main(args),
+        ("sweep", Some(args)) => return sweep::main(args),
+        ("trace", Some(args)) => return trace::main(args),
         _ => (),
     }
 
@@ -35,10 +59,15 @@ fn _main() -> Result<(), i32> {
 
     let io = emulator::IoRegisters::new();
     let mut computer = Computer::new(&io);
+    let mut breakpoints = breakpoints::Breakpoints::default();
+    let mut renderer = ui::Renderer::new();
 
     println!("2i-emulator {}, GPLv3, https://github.com/klemens/2i-emulator",
              option_env!("CARGO_PKG_VERSION").unwrap_or("*"));
-    ui::status(&mut computer, &io, &program, None);
+    renderer.status(&mut computer, &io, &program, None);
+
+    // Whether the status was printed last, so a step can update it in place
+    let mut status_last = true;
 
     // Set up line editing and completion
     let completer = Completer::default();
@@ -49,9 +78,21 @@ fn _main() -> Result<(), i32> {
     // eg: FD = 1101
     let input_pattern = Regex::new(r"^(?P<index>F[C-F])\s+=\s+(?P<value>[01]{1,8})$").unwrap();
 
+    // Reload the program before every command if its file was changed
+    let mut watch = false;
+
     while let Ok(line) = line_reader.readline("> ") {
         let line = line.trim();
 
+        if let (true, Some(program_inner)) = (watch, program.as_mut()) {
+            if let Some(changed) = reload_programm(program_inner) {
+                renderer.status(&mut computer, &io, &program, None);
+                print_reloaded(&changed);
+                status_last = false;
+            }
+        }
+        let updatable = std::mem::replace(&mut status_last, false);
+
         // Add all non-empty inputs to the history
         if ! line.is_empty() {
             line_reader.add_history_entry(line);
@@ -61,8 +102,13 @@ fn _main() -> Result<(), i32> {
             if let Some(ref program_inner) = program {
                 // Execute next instruction and display the updated ui
                 match computer.step(&program_inner) {
+                    Ok(flags) if updatable => {
+                        renderer.update_after_prompt(&mut computer, &io, &program, Some(flags));
+                        status_last = true;
+                    }
                     Ok(flags) => {
-                        ui::status(&mut computer, &io, &program, Some(flags));
+                        renderer.status(&mut computer, &io, &program, Some(flags));
+                        status_last = true;
                     }
                     Err(err) => {
                         println!("Fehler beim Ausführen des Befehls: \"{}\"", err);
@@ -79,7 +125,128 @@ fn _main() -> Result<(), i32> {
                 program = Some(prog);
                 // Reset computer (only keep io registers)
                 computer = Computer::new(&io);
-                ui::status(&mut computer, &io, &program, None);
+                renderer.status(&mut computer, &io, &program, None);
+                status_last = true;
+            }
+        } else if line == "watch" {
+            // Changes since loading the program are already picked up by the
+            // next input
+            if let Some(ref program) = program {
+                watch = true;
+                println!("Überwache {} auf Änderungen.", program.path.display());
+            } else {
+                println!("Aktuell kein Mikroprogramm geladen.")
+            }
+        } else if line == "watch off" {
+            watch = false;
+            println!("Mikroprogramm wird nicht mehr überwacht.");
+        } else if line == "back" || line.starts_with("back ") {
+            let steps = match line[4..].trim() {
+                "" => 1,
+                steps => match steps.parse::<usize>() {
+                    Ok(steps) => steps,
+                    Err(_) => {
+                        println!("Ungültige Anzahl an Befehlen: {}", steps);
+                        continue;
+                    }
+                }
+            };
+
+            let undone = computer.back(steps);
+            renderer.status(&mut computer, &io, &program, None);
+            if undone < steps {
+                println!("Nur {} Befehl(e) rückgängig gemacht (Anfang des Verlaufs erreicht).",
+                    undone);
+            }
+        } else if line == "break" {
+            let list = breakpoints.list();
+            if list.is_empty() {
+                println!("Keine Haltepunkte gesetzt.");
+            }
+            for breakpoint in list {
+                println!("{}", breakpoint);
+            }
+        } else if line.starts_with("break ") {
+            let result = if line.starts_with("break if ") {
+                breakpoints.add_condition(&line[9..], &mut computer)
+            } else {
+                breakpoints.add_break(line[6..].trim())
+            };
+            match result {
+                Ok(()) => println!("{}", breakpoints.list().last().unwrap()),
+                Err(err) => println!("{}", err),
+            }
+        } else if line == "delete" || line.starts_with("delete ") {
+            let number = match line[6..].trim() {
+                "" => None,
+                number => Some(number.parse::<usize>().unwrap_or(0)),
+            };
+            if ! breakpoints.delete(number) {
+                println!("Ungültiger Haltepunkt: {}", line[6..].trim());
+            }
+        } else if line == "run" || line == "continue" {
+            if let Some(ref program_inner) = program {
+                if line == "run" {
+                    // Start again from the beginning (only keep io registers)
+                    computer = Computer::new(&io);
+                }
+
+                // Execute without updating the ui until a breakpoint is reached
+                match breakpoints.run(&mut computer, &program_inner) {
+                    Ok((steps, flags, breakpoint)) => {
+                        renderer.status(&mut computer, &io, &program, Some(flags));
+                        match breakpoint {
+                            Some(breakpoint) => println!("Nach {} Befehl(en) angehalten: {}",
+                                steps, breakpoint),
+                            None => println!("Nach {} Befehlen ohne Haltepunkt angehalten.",
+                                steps),
+                        }
+                    }
+                    Err(err) => {
+                        println!("Fehler beim Ausführen des Befehls: \"{}\"", err);
+                        return Err(100);
+                    }
+                }
+            } else {
+                println!("Fehler: Kein Mikroprogramm geladen! (Laden per \"load prog.2i\")");
+            }
+        } else if line.starts_with("animate ") {
+            let interval = match line[8..].trim().parse::<u32>() {
+                Ok(hz) if hz > 0 => Duration::from_secs(1) / hz,
+                _ => {
+                    println!("Ungültige Bildrate: {}", line[8..].trim());
+                    continue;
+                }
+            };
+
+            if let Some(ref program_inner) = program {
+                // Execute continuously, but only redraw if the interval elapsed
+                renderer.status(&mut computer, &io, &program, None);
+                let mut drawn = Instant::now();
+                let result = breakpoints.run_with(&mut computer, &program_inner, |computer, flags| {
+                    if drawn.elapsed() >= interval {
+                        renderer.update(computer, &io, &program, Some(flags));
+                        drawn = Instant::now();
+                    }
+                });
+
+                match result {
+                    Ok((steps, flags, breakpoint)) => {
+                        renderer.update(&mut computer, &io, &program, Some(flags));
+                        match breakpoint {
+                            Some(breakpoint) => println!("Nach {} Befehl(en) angehalten: {}",
+                                steps, breakpoint),
+                            None => println!("Nach {} Befehlen ohne Haltepunkt angehalten.",
+                                steps),
+                        }
+                    }
+                    Err(err) => {
+                        println!("Fehler beim Ausführen des Befehls: \"{}\"", err);
+                        return Err(100);
+                    }
+                }
+            } else {
+                println!("Fehler: Kein Mikroprogramm geladen! (Laden per \"load prog.2i\")");
             }
         } else if line.starts_with("trigger ") {
             match &line[8..] {
@@ -90,13 +257,23 @@ fn _main() -> Result<(), i32> {
                     continue;
                 }
             };
-            ui::status(&mut computer, &io, &program, None);
+            renderer.status(&mut computer, &io, &program, None);
+            status_last = true;
         } else if line == "exit" || line == "quit" {
             break;
         } else if line == "help" {
             ui::display_help();
         } else if line == "ram" {
             ui::display_ram(&computer.ram);
+        } else if line == "profile" {
+            if let Some(ref program) = program {
+                print!("\n{}\n", profile::format_profile(&computer.profile, &program));
+            } else {
+                println!("Aktuell kein Mikroprogramm geladen.")
+            }
+        } else if line == "profile reset" {
+            computer.profile.clear();
+            println!("Profil zurückgesetzt.");
         } else if line == "program" {
             if let Some(ref program) = program {
                 ui::display_program(&program);
@@ -113,7 +290,8 @@ fn _main() -> Result<(), i32> {
                     "FF" => io.inspect_input().borrow_mut()[3] = value,
                     _ => panic!("Invalid regex match"),
                 }
-                ui::status(&mut computer, &io, &program, None);
+                renderer.status(&mut computer, &io, &program, None);
+                status_last = true;
             } else {
                 println!("Ungültiger Wert.");
             }
@@ -125,11 +303,20 @@ fn _main() -> Result<(), i32> {
     Ok(())
 }
 
-/// Load 2i program from path and print errors to stdout if it failes
+/// Load 2i program (text or binary) from path and print errors to stdout if
+/// it failes
 fn load_programm(path: &Path) -> Result<Program, ()> {
-    if let Ok(file) = File::open(&path) {
-        match emulator::parse::read_program(file) {
-            Ok(program) => Ok(Program { path: path.into(), instructions: program }),
+    if let Ok(mut file) = File::open(&path) {
+        let modified = file.metadata().and_then(|metadata| metadata.modified()).ok();
+        let mut content = Vec::new();
+        let program = file.read_to_end(&mut content).map_err(emulator::Error::from)
+            .and_then(|_| emulator::binary::BinaryProgram::load(&content));
+        match program {
+            Ok(program) => {
+                let mut program = Program::new(path, program.instructions);
+                program.modified = modified;
+                Ok(program)
+            }
             Err(err) => {
                 println!("Fehler beim Laden des Programms: {}", err);
                 Err(())
@@ -141,33 +328,131 @@ fn load_programm(path: &Path) -> Result<Program, ()> {
     }
 }
 
-#[derive(Default)]
+/// Load the program again if its file was modified since it was loaded.
+///
+/// Only the changed instructions are decoded again and the computer keeps
+/// its state, so the execution can be continued with the new program.
+/// Returns the addresses of the changed instructions or `None` if the file
+/// was not modified or could not be loaded (the error is printed and the
+/// old program kept until the file is modified again).
+fn reload_programm(program: &mut Program) -> Option<Vec<usize>> {
+    let modified = fs::metadata(&program.path).and_then(|metadata| metadata.modified()).ok();
+    if modified == program.modified {
+        return None;
+    }
+    program.modified = modified;
+
+    let reloaded = load_programm(&program.path).ok()?;
+    Some(program.update(&reloaded.instructions))
+}
+
+/// Print the addresses of the changed instructions after reloading
+fn print_reloaded(changed: &[usize]) {
+    if changed.is_empty() {
+        println!("Mikroprogramm neu geladen (keine Befehle geändert).");
+    } else {
+        let addresses: Vec<_> = changed.iter().map(|address| format!("{:05b}", address)).collect();
+        println!("Mikroprogramm neu geladen, geänderte Befehle: {}", addresses.join(", "));
+    }
+}
+
 pub struct Computer<'a> {
     cpu: emulator::Cpu,
     instruction_pointer: usize,
     ram: emulator::Ram<'a>,
+    io: &'a emulator::IoRegisters,
+    history: emulator::history::History,
+    profile: emulator::profile::Profile,
 }
 
 impl<'a> Computer<'a> {
     fn new(io: &'a emulator::IoRegisters) -> Computer<'a> {
-        let mut computer = Computer::default();
+        let mut computer = Computer {
+            cpu: emulator::Cpu::new(),
+            instruction_pointer: 0,
+            ram: emulator::Ram::new(),
+            io: io,
+            history: emulator::history::History::new(UNDO_STEPS),
+            profile: emulator::profile::Profile::new(),
+        };
         computer.ram.add_overlay(0xFC, 0xFF, io);
         computer
     }
 
     /// Execute next instruction and update the instruction pointer
     fn step(&mut self, program: &Program) -> emulator::Result<emulator::Flags> {
-        let instruction = program.instructions[self.instruction_pointer];
-        self.cpu.execute_instruction(instruction, &mut self.ram).map(|(ip, flags)| {
-            self.instruction_pointer = ip;
-            flags
-        })
+        let Computer { cpu, instruction_pointer, ram, io, history, profile } = self;
+        let address = *instruction_pointer;
+        let instruction = &program.decoded[address];
+
+        // Remember overwritten values of the ram and the output registers
+        let flags = history.execute(cpu, instruction_pointer, instruction,
+                                    &mut profile.bus(ram), |bus, address| {
+            if address >= 0xFE {
+                io.inspect_output().borrow()[(address - 0xFE) as usize]
+            } else {
+                bus.inner().inspect().borrow()[address as usize]
+            }
+        })?;
+
+        profile.record(address, instruction, *instruction_pointer);
+        Ok(flags)
+    }
+
+    /// Undo at most the given number of steps and return how many were undone
+    fn back(&mut self, steps: usize) -> usize {
+        let Computer { cpu, instruction_pointer, ram, io, history, .. } = self;
+
+        (0..steps).take_while(|_| {
+            history.undo(cpu, instruction_pointer, |address, value| {
+                if address >= 0xFE {
+                    io.inspect_output().borrow_mut()[(address - 0xFE) as usize] = value;
+                } else {
+                    ram.inspect().borrow_mut()[address as usize] = value;
+                }
+            })
+        }).count()
     }
 }
 
 pub struct Program {
     path: PathBuf,
+    /// Modification time of the file when it was loaded (see `watch`)
+    modified: Option<SystemTime>,
     instructions: [emulator::Instruction; 32],
+    decoded: [emulator::DecodedInstruction; 32],
+    listing: emulator::listing::Listing,
+}
+
+impl Program {
+    fn new(path: &Path, instructions: [emulator::Instruction; 32]) -> Program {
+        Program {
+            path: path.into(),
+            modified: None,
+            decoded: emulator::instruction::decode_program(&instructions),
+            listing: emulator::listing::Listing::new(&instructions),
+            instructions: instructions,
+        }
+    }
+
+    /// Replace the instructions with the given ones and return the addresses
+    /// of the changed instructions, which are the only ones decoded again
+    fn update(&mut self, instructions: &[emulator::Instruction; 32]) -> Vec<usize> {
+        let changed: Vec<_> = (0..32).filter(|&address| {
+            self.instructions[address] != instructions[address]
+        }).collect();
+
+        for &address in &changed {
+            self.instructions[address] = instructions[address];
+            self.decoded[address] = emulator::DecodedInstruction::new(instructions[address]);
+        }
+        if ! changed.is_empty() {
+            // Reachability can change with every instruction
+            self.listing = emulator::listing::Listing::new(&self.instructions);
+        }
+
+        changed
+    }
 }
 
 #[derive(Default)]
@@ -188,18 +473,29 @@ impl rustyline::completion::Completer for Completer {
         }
 
         let commands = [
+            "animate ",
+            "back ",
+            "break ",
+            "break if ",
+            "continue",
+            "delete ",
             "exit",
             "load ",
             "FC = ",
             "FD = ",
             "FE = ",
             "FF = ",
+            "watch",
+            "watch off",
             "trigger INTA",
             "trigger INTB",
             "help",
             "quit",
             "ram",
+            "profile",
+            "profile reset",
             "program",
+            "run",
         ];
 
         let completions = commands.iter().filter_map(|&command| {
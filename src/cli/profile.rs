@@ -0,0 +1,85 @@
+use std::fmt::Write;
+
+use emulator::profile::Profile;
+
+use super::Program;
+
+/// Conditional address controls (MAC with the last bit of NA) and the
+/// condition they jump on
+const CONDITIONS: [(u8, &str); 6] = [
+    (0b010, "INTA"),
+    (0b011, "C im Flag-Register"),
+    (0b100, "C"),
+    (0b101, "Z"),
+    (0b110, "N"),
+    (0b111, "INTB"),
+];
+
+/// Format a profile as a report with the executed instructions sorted by
+/// their number of executions, the conditional jumps, loops and bus accesses
+///
+/// Sections without any entries are omitted.
+pub fn format_profile(profile: &Profile, program: &Program) -> String {
+    let mut result = String::with_capacity(2048);
+    let steps = profile.steps();
+
+    writeln!(result, "Ausgeführte Befehle: {}", steps).unwrap();
+    if steps == 0 {
+        return result;
+    }
+
+    // Hot instructions first, equally hot ones in program order
+    let mut addresses: Vec<usize> = (0..32).filter(|&a| profile.hits(a) > 0).collect();
+    addresses.sort_by_key(|&a| std::cmp::Reverse(profile.hits(a)));
+
+    writeln!(result, "\nBefehle (Adresse, Ausführungen, Anteil):").unwrap();
+    for &address in addresses.iter() {
+        let hits = profile.hits(address);
+        writeln!(result, "  {:05b} {:>10} {:>5.1}%  {}", address, hits,
+            hits as f64 * 100.0 / steps as f64,
+            program.listing.mnemonic(address)).unwrap();
+    }
+
+    let mut header = "\nBedingte Sprünge (genommen / nicht genommen):\n";
+    for &(control, condition) in CONDITIONS.iter() {
+        let jumps: Vec<(usize, u64, u64)> = (0..32).filter(|&a| {
+            program.instructions[a].get_full_address_control() == control
+        }).filter_map(|a| {
+            let (taken, not_taken) = profile.branches(a);
+            if taken + not_taken > 0 { Some((a, taken, not_taken)) } else { None }
+        }).collect();
+        if jumps.is_empty() {
+            continue;
+        }
+
+        let taken: u64 = jumps.iter().map(|j| j.1).sum();
+        let not_taken: u64 = jumps.iter().map(|j| j.2).sum();
+        result.push_str(header);
+        header = "";
+        writeln!(result, "  MAC {:03b} ({}): {} / {}", control, condition, taken, not_taken).unwrap();
+        for (address, taken, not_taken) in jumps {
+            writeln!(result, "    {:05b} {:>10} / {}", address, taken, not_taken).unwrap();
+        }
+    }
+
+    let mut header = "\nSchleifen (Anfang, Durchläufe, Befehle pro Durchlauf):\n";
+    for address in (0..32).filter(|&a| profile.loop_iterations(a) > 0) {
+        result.push_str(header);
+        header = "";
+        let iterations = profile.loop_iterations(address);
+        writeln!(result, "  {:05b} {:>10} {:>8.1}", address, iterations,
+            profile.loop_cycles(address) as f64 / iterations as f64).unwrap();
+    }
+
+    let mut header = "\nBuszugriffe (Adresse, gelesen / geschrieben):\n";
+    for address in 0..=255u8 {
+        let (reads, writes) = (profile.reads(address), profile.writes(address));
+        if reads + writes > 0 {
+            result.push_str(header);
+            header = "";
+            writeln!(result, "  {:02X} {:>10} / {}", address, reads, writes).unwrap();
+        }
+    }
+
+    result
+}
@@ -0,0 +1,561 @@
+use std::fmt::Write;
+use std::fs::{self, File};
+use std::io::{BufReader, BufWriter};
+use std::path::Path;
+use std::thread;
+
+use clap::ArgMatches;
+use regex::Regex;
+
+use emulator::{DecodedInstruction, Flags, IoRam, IoRegisters, Machine, Ram};
+use emulator::instruction::VerifiedProgram;
+use emulator::cycle::CycleDetector;
+use emulator::device::{Advance, InputDevice, OutputSink};
+use emulator::interrupt::{Event, Schedule};
+use emulator::parse::verify_program;
+use emulator::profile::Profile;
+use emulator::superblock::Superblocks;
+use emulator::trace::{execute_traced, TraceWriter};
+
+use super::{load_programm, Program};
+use super::cache::{Cache, KeyBuilder};
+use super::profile::format_profile;
+
+/// Number of steps between two keyframes in traces
+const KEYFRAME_INTERVAL: u16 = 4096;
+
+/// Reason why the execution of the program was stopped
+#[derive(Clone, Copy, PartialEq)]
+pub enum Stop {
+    Steps,
+    Address,
+    /// The state repeats with the given period (1 for a fixed-point)
+    Cycle(u64),
+}
+
+impl Stop {
+    /// Name of the reason in the output (eg: `stop=stable`)
+    pub fn name(self) -> &'static str {
+        match self {
+            Stop::Steps => "steps",
+            Stop::Address => "ip",
+            Stop::Cycle(1) => "stable",
+            Stop::Cycle(_) => "loop",
+        }
+    }
+}
+
+pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
+    let program = load_programm(Path::new(args.value_of("2i-programm").unwrap()))
+        .map_err(|_| 2)?;
+    let limits = Limits::from_args(args)?;
+    let engine = Engine::from_args(args, &limits)?;
+    if engine == Engine::Lockstep {
+        println!("Die Ausführungsart lockstep ist nur für sweep verfügbar");
+        return Err(1);
+    }
+
+    // The exclusive variants of the bus avoid all runtime borrow checks
+    let mut state: Machine = Machine::default();
+    if let Some(inputs) = args.values_of("input") {
+        set_inputs(&mut state.bus, inputs)?;
+    }
+
+    if engine != Engine::Scalar && args.is_present("profile") {
+        println!("Profile können nur mit der Ausführungsart scalar erstellt werden");
+        return Err(1);
+    }
+    if args.is_present("trace") && args.is_present("profile") {
+        println!("--trace und --profile können nicht gleichzeitig verwendet werden");
+        return Err(1);
+    }
+
+    if args.is_present("input-stream") || args.is_present("output-stream") {
+        if engine != Engine::Scalar || limits.until_stable || args.is_present("trace")
+           || args.is_present("profile") {
+            println!("Ein- und Ausgabeströme können nur mit der Ausführungsart scalar und ohne \
+                      --until-stable, --trace oder --profile verwendet werden");
+            return Err(1);
+        }
+        return run_streamed(&mut state, &program, &limits, args);
+    }
+
+    // Traces and profiles need the actual execution
+    let cache = Cache::from_args(args)?;
+    let cached = cache.as_ref().filter(|_| {
+        ! args.is_present("trace") && ! args.is_present("profile")
+    }).map(|cache| {
+        let key = KeyBuilder::new("run").program(&program).limits(&limits)
+            .bytes(state.bus.inspect_input()).finish();
+        (cache, key)
+    });
+    if let Some((cache, key)) = cached.as_ref() {
+        if let Some(result) = cache.get(key) {
+            print!("{}", String::from_utf8_lossy(&result));
+            return Ok(());
+        }
+    }
+
+    let mut profile = Profile::new();
+    let result = if let Some(path) = args.value_of("trace") {
+        if engine != Engine::Scalar {
+            println!("Traces können nur mit der Ausführungsart scalar erstellt werden");
+            return Err(1);
+        }
+        let file = File::create(path).map_err(|e| {
+            println!("Die Trace-Datei konnte nicht erstellt werden: {}", e);
+            2
+        })?;
+        run_traced(&mut state, &program, &limits, file)
+    } else if args.is_present("profile") {
+        run_profiled(&mut state, &program, &limits, &mut profile)
+    } else {
+        let compiled = Compiled::new(&program, engine);
+        run_program(&mut state, &program, &compiled, &limits)
+    };
+
+    match result {
+        Ok((steps, stop)) => {
+            let result = format_result(&mut state, steps, stop);
+            if let Some((cache, key)) = cached {
+                cache.put(&key, result.as_bytes());
+            }
+            print!("{}", result);
+            if args.is_present("profile") {
+                print!("\n{}", format_profile(&profile, &program));
+            }
+            Ok(())
+        }
+        Err(err) => {
+            println!("Fehler beim Ausführen des Befehls: \"{}\"", err);
+            Err(100)
+        }
+    }
+}
+
+/// Conditions for stopping the execution and the interrupts triggered
+/// during it
+pub struct Limits {
+    pub max_steps: u64,
+    pub until_stable: bool,
+    pub until_address: Option<usize>,
+    pub interrupts: Schedule,
+}
+
+impl Limits {
+    /// Read the limits from the `steps`, `until-stable` and `until-ip` args
+    /// and the interrupts from the `interrupt` and `interrupts` args
+    pub fn from_args(args: &ArgMatches<'_>) -> Result<Limits, i32> {
+        let max_steps = args.value_of("steps").unwrap().parse::<u64>().map_err(|_| {
+            println!("Ungültige Anzahl an Befehlen: {}", args.value_of("steps").unwrap());
+            1
+        })?;
+        let until_address = if let Some(address) = args.value_of("until-ip") {
+            Some(parse_address(address).ok_or_else(|| {
+                println!("Ungültige Befehlsadresse: {}", address);
+                1
+            })?)
+        } else {
+            None
+        };
+
+        let mut interrupts = Schedule::new();
+        for event in args.values_of("interrupt").into_iter().flatten() {
+            interrupts.add(Event::parse(event).map_err(|_| {
+                println!("Ungültiger Interrupt: {} (zB: INTB@1000, INTA+37, INTA@5+37)", event);
+                1
+            })?);
+        }
+        if let Some(path) = args.value_of("interrupts") {
+            read_interrupts(Path::new(path), &mut interrupts)?;
+        }
+
+        Ok(Limits {
+            max_steps: max_steps,
+            until_stable: args.is_present("until-stable"),
+            until_address: until_address,
+            interrupts: interrupts,
+        })
+    }
+}
+
+/// Read interrupts from a file with one event per line (like `--interrupt`)
+///
+/// Empty lines and lines starting with # are ignored.
+fn read_interrupts(path: &Path, interrupts: &mut Schedule) -> Result<(), i32> {
+    let content = fs::read_to_string(path).map_err(|e| {
+        println!("Die Interrupt-Datei konnte nicht geöffnet werden: {}", e);
+        2
+    })?;
+
+    for (number, line) in content.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        interrupts.add(Event::parse(line).map_err(|_| {
+            println!("Ungültiger Interrupt in Zeile {} der Interrupt-Datei: {}", number + 1, line);
+            3
+        })?);
+    }
+
+    Ok(())
+}
+
+/// Engine used to execute programs
+#[derive(Clone, Copy, PartialEq)]
+pub enum Engine {
+    /// Single steps of predecoded (and if possible verified) instructions
+    Scalar,
+    /// Chains of unconditional jumps executed at once
+    Superblock,
+    /// Many inputs executed together (only for sweeps)
+    Lockstep,
+}
+
+impl Engine {
+    /// Read the engine from the `engine` arg and check it against the limits
+    pub fn from_args(args: &ArgMatches<'_>, limits: &Limits) -> Result<Engine, i32> {
+        let engine = match args.value_of("engine").unwrap() {
+            "scalar" => Engine::Scalar,
+            "superblock" => Engine::Superblock,
+            "lockstep" => Engine::Lockstep,
+            engine => {
+                println!("Ungültige Ausführungsart: {}", engine);
+                return Err(1);
+            }
+        };
+
+        // Both execute several instructions at once, so the states in between
+        // are not available for detecting cycles
+        if engine != Engine::Scalar && limits.until_stable {
+            println!("Die Ausführungsart {} unterstützt --until-stable nicht",
+                args.value_of("engine").unwrap());
+            return Err(1);
+        }
+
+        Ok(engine)
+    }
+}
+
+/// Translations of a program that are prepared once for all executions
+pub struct Compiled {
+    verified: Option<VerifiedProgram>,
+    superblocks: Option<Superblocks<IoRam>>,
+}
+
+impl Compiled {
+    /// Prepare the program for the given engine
+    pub fn new(program: &Program, engine: Engine) -> Compiled {
+        Compiled {
+            verified: verify_program(&program.instructions).ok(),
+            superblocks: if engine == Engine::Superblock {
+                Some(Superblocks::new(&program.instructions))
+            } else {
+                None
+            },
+        }
+    }
+}
+
+/// Execute the program on the given state until one of the limits is reached.
+///
+/// Verified programs skip the checks of the bus access in every step.
+pub fn run_program(state: &mut Machine, program: &Program, compiled: &Compiled,
+                   limits: &Limits) -> emulator::Result<(u64, Stop)> {
+    if let Some(ref superblocks) = compiled.superblocks {
+        // Superblocks are executed straight until the next interrupt
+        let mut interrupts = limits.interrupts.queue();
+        let mut steps = 0;
+        loop {
+            let until = next_stop(interrupts.next_cycle(), limits);
+            steps += superblocks.run(&mut state.cpu, &mut state.bus,
+                &mut state.instruction_pointer, until - steps, limits.until_address)?;
+
+            if limits.until_address == Some(state.instruction_pointer) {
+                return Ok((steps, Stop::Address));
+            } else if steps == limits.max_steps {
+                return Ok((steps, Stop::Steps));
+            }
+            interrupts.trigger(steps, &mut state.cpu);
+        }
+    } else if let Some(ref verified) = compiled.verified {
+        execute(state, &program.decoded, limits, |state| state.step_verified(verified))
+    } else {
+        execute(state, &program.decoded, limits, |state| state.step(&program.decoded))
+    }
+}
+
+/// Execute the program like `run_program` and write a trace of every step.
+pub fn run_traced(state: &mut Machine, program: &Program, limits: &Limits, file: File)
+                  -> emulator::Result<(u64, Stop)> {
+    let mut writer = TraceWriter::new(file, KEYFRAME_INTERVAL, &state.snapshot())?;
+
+    let result = execute(state, &program.decoded, limits, |state| {
+        let instruction = &program.decoded[state.instruction_pointer];
+        let mut next_address = state.instruction_pointer;
+        let record = execute_traced(&mut state.cpu, &mut next_address, instruction,
+                                    &mut state.bus)?;
+        state.instruction_pointer = next_address;
+        writer.write(&record, || state.snapshot())?;
+        Ok(record.flags)
+    });
+
+    // The steps until an error are also written to the trace
+    writer.finish()?;
+    result
+}
+
+/// Execute the program like `run_program` and count every step in the profile.
+pub fn run_profiled(state: &mut Machine, program: &Program, limits: &Limits,
+                    profile: &mut Profile) -> emulator::Result<(u64, Stop)> {
+    execute(state, &program.decoded, limits, |state| {
+        let instruction = &program.decoded[state.instruction_pointer];
+        let mut next_address = state.instruction_pointer;
+        let flags = profile.execute(&mut state.cpu, &mut next_address, instruction,
+                                    &mut state.bus)?;
+        state.instruction_pointer = next_address;
+        Ok(flags)
+    })
+}
+
+/// Execute the program with input registers reading from the files given by
+/// the `input-stream` args and print the final state.
+///
+/// All writes to the output registers are recorded in the file given by the
+/// `output-stream` arg. The initial inputs of the state are used for all
+/// other input registers.
+fn run_streamed(state: &mut Machine, program: &Program, limits: &Limits, args: &ArgMatches<'_>)
+                -> Result<(), i32> {
+    let mut inputs = Vec::new();
+    for stream in args.values_of("input-stream").into_iter().flatten() {
+        let (register, path) = match stream.find('=').map(|split| stream.split_at(split)) {
+            Some(("FC", path)) => (0xFC, &path[1..]),
+            Some(("FD", path)) => (0xFD, &path[1..]),
+            _ => {
+                println!("Ungültiger Eingabestrom: {} (zB: FC=eingabe.bin)", stream);
+                return Err(1);
+            }
+        };
+        let file = File::open(path).map_err(|e| {
+            println!("Der Eingabestrom konnte nicht geöffnet werden: {}", e);
+            2
+        })?;
+        inputs.push((register, InputDevice::new(BufReader::new(file), Advance::Read)));
+    }
+    let sink = if let Some(path) = args.value_of("output-stream") {
+        let file = File::create(path).map_err(|e| {
+            println!("Der Ausgabestrom konnte nicht erstellt werden: {}", e);
+            2
+        })?;
+        Some(OutputSink::new(BufWriter::new(file)))
+    } else {
+        None
+    };
+
+    // Streams take precedence over the static registers
+    let io = IoRegisters::new();
+    let initial_input = *state.bus.inspect_input();
+    *io.inspect_input().borrow_mut() = initial_input;
+    let mut ram = Ram::new();
+    for &(register, ref device) in inputs.iter() {
+        ram.add_overlay(register, register, device);
+    }
+    if let Some(ref sink) = sink {
+        sink.set_input([initial_input[2], initial_input[3]]);
+        ram.add_overlay(0xFE, 0xFF, sink);
+    }
+    ram.add_overlay(0xFC, 0xFF, &io);
+
+    // The bus of the state is replaced by the ram with the streams, so the
+    // step function executes on it directly
+    let mut cycle = 0;
+    let result = execute(state, &program.decoded, limits, |state| {
+        if let Some(ref sink) = sink {
+            sink.set_cycle(cycle);
+        }
+        let instruction = &program.decoded[state.instruction_pointer];
+        let (next_address, flags) = state.cpu.execute_decoded(instruction, &mut ram)?;
+        state.instruction_pointer = next_address;
+        cycle += 1;
+        Ok(flags)
+    });
+
+    *state.bus.inspect() = ram.snapshot();
+    *state.bus.inspect_output() = match sink {
+        Some(ref sink) => sink.output(),
+        None => *io.inspect_output().borrow(),
+    };
+
+    // The writes until an error are also recorded
+    if let Some(sink) = sink {
+        sink.finish().map_err(|e| {
+            println!("Der Ausgabestrom konnte nicht geschrieben werden: {}", e);
+            4
+        })?;
+    }
+
+    match result {
+        Ok((steps, stop)) => {
+            print!("{}", format_result(state, steps, stop));
+            Ok(())
+        }
+        Err(err) => {
+            println!("Fehler beim Ausführen des Befehls: \"{}\"", err);
+            Err(100)
+        }
+    }
+}
+
+/// Execute the program using the given step function (which also moves the
+/// instruction pointer) until one of the limits is reached. Returns the
+/// number of executed steps and the reason for stopping.
+///
+/// Interrupts are triggered before the step at their cycle, so apart from
+/// them only a single comparison per step is needed for both.
+fn execute<F>(state: &mut Machine, program: &[DecodedInstruction; 32], limits: &Limits,
+              mut step: F) -> emulator::Result<(u64, Stop)>
+    where F: FnMut(&mut Machine) -> emulator::Result<Flags> {
+    let mut steps = 0;
+    let mut interrupts = limits.interrupts.queue();
+    let mut until = next_stop(interrupts.next_cycle(), limits);
+
+    // With interrupts, states are only compared at cycles with the same
+    // position in the schedule (every step without interrupts)
+    let (start, period) = limits.interrupts.steady_state()
+        .filter(|_| limits.until_stable).unwrap_or((u64::MAX, 1));
+    let mut detector = if start == 0 {
+        Some(CycleDetector::new(state))
+    } else {
+        None
+    };
+    let mut next_check = if start == 0 { period } else { start };
+
+    loop {
+        if limits.until_address == Some(state.instruction_pointer) {
+            return Ok((steps, Stop::Address));
+        } else if steps == until {
+            if steps == limits.max_steps {
+                return Ok((steps, Stop::Steps));
+            }
+            interrupts.trigger(steps, &mut state.cpu);
+            until = next_stop(interrupts.next_cycle(), limits);
+        }
+
+        let address = state.instruction_pointer;
+        let cpu = state.cpu.clone();
+
+        step(state)?;
+        steps += 1;
+
+        if steps == next_check {
+            next_check = next_check.saturating_add(period);
+
+            // A self-looping instruction that changes neither the cpu nor the
+            // bus is a fixed-point, which can be detected immediately (but
+            // only if no more interrupts are pending)
+            if state.instruction_pointer == address && state.cpu == cpu &&
+               ! program[address].writes_bus() && interrupts.next_cycle().is_none() {
+                return Ok((steps, Stop::Cycle(1)));
+            }
+
+            // All other cycles (including the ones only changing the ip) are
+            // found by comparing complete states
+            match detector {
+                Some(ref mut detector) => if let Some(length) = detector.check(state) {
+                    return Ok((steps, Stop::Cycle(length * period)));
+                },
+                None => detector = Some(CycleDetector::new(state)),
+            }
+        }
+    }
+}
+
+/// Number of steps until the execution has to stop for the next interrupt or
+/// the step limit
+pub fn next_stop(interrupt: Option<u64>, limits: &Limits) -> u64 {
+    interrupt.map_or(limits.max_steps, |cycle| cycle.min(limits.max_steps))
+}
+
+/// Read the number of threads from the `threads` arg (default: all cores)
+pub fn threads_from_args(args: &ArgMatches<'_>) -> Result<usize, i32> {
+    if let Some(threads) = args.value_of("threads") {
+        threads.parse::<usize>().ok().filter(|&t| t > 0).ok_or_else(|| {
+            println!("Ungültige Anzahl an Threads: {}", threads);
+            1
+        })
+    } else {
+        Ok(thread::available_parallelism().map(|t| t.get()).unwrap_or(1))
+    }
+}
+
+/// Set the input registers from strings like `FC=00000101`
+pub fn set_inputs<'a, I>(ram: &mut IoRam, inputs: I) -> Result<(), i32>
+    where I: Iterator<Item = &'a str> {
+    let input_pattern = Regex::new(r"^(?P<index>F[C-F])\s*=\s*(?P<value>[01]{1,8})$").unwrap();
+
+    for input in inputs {
+        let matches = input_pattern.captures(input.trim()).ok_or_else(|| {
+            println!("Ungültiges Eingaberegister: {}", input);
+            1
+        })?;
+        let value = u8::from_str_radix(&matches["value"], 2).unwrap();
+
+        let index = match &matches["index"] {
+            "FC" => 0,
+            "FD" => 1,
+            "FE" => 2,
+            "FF" => 3,
+            _ => panic!("Invalid regex match"),
+        };
+        ram.inspect_input()[index] = value;
+    }
+
+    Ok(())
+}
+
+/// Parse a binary instruction address (eg: 01001)
+pub fn parse_address(address: &str) -> Option<usize> {
+    if address.is_empty() || address.len() > 5 {
+        return None;
+    }
+
+    usize::from_str_radix(address, 2).ok()
+}
+
+/// Format the final state as `key=value` lines
+fn format_result(state: &mut Machine, steps: u64, stop: Stop) -> String {
+    let mut result = String::with_capacity(256);
+
+    writeln!(result, "steps={}", steps).unwrap();
+    writeln!(result, "stop={}", stop.name()).unwrap();
+    if let Stop::Cycle(period) = stop {
+        if period > 1 {
+            writeln!(result, "period={}", period).unwrap();
+        }
+    }
+
+    result + &format_state(state)
+}
+
+/// Format the state (ip, registers, flags and outputs) as `key=value` lines
+pub fn format_state(state: &mut Machine) -> String {
+    let mut result = String::with_capacity(256);
+
+    writeln!(result, "ip={:05b}", state.instruction_pointer).unwrap();
+
+    for (i, register) in state.cpu.inspect_registers().iter().enumerate() {
+        writeln!(result, "R{}={:08b}", i, register).unwrap();
+    }
+
+    let flags = *state.cpu.inspect_flags();
+    writeln!(result, "C={}", flags.carry() as u8).unwrap();
+    writeln!(result, "N={}", flags.negative() as u8).unwrap();
+    writeln!(result, "Z={}", flags.zero() as u8).unwrap();
+
+    let output = state.bus.inspect_output();
+    writeln!(result, "FE={:08b}", output[0]).unwrap();
+    writeln!(result, "FF={:08b}", output[1]).unwrap();
+
+    result
+}
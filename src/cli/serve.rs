@@ -0,0 +1,589 @@
+use std::collections::{HashMap, VecDeque};
+use std::fmt::Write as FmtWrite;
+use std::io::{BufRead, BufReader, BufWriter, Write};
+use std::net::{TcpListener, TcpStream};
+use std::path::Path;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard, PoisonError, Weak};
+use std::thread;
+use std::time::Duration;
+
+use clap::ArgMatches;
+
+use emulator::Machine;
+use emulator::interrupt::Schedule;
+use emulator::parse::parse_program;
+
+use super::Program;
+use super::grade::escape_json;
+use super::run::{parse_address, run_program, threads_from_args, Compiled, Engine, Limits, Stop};
+
+/// Number of steps a session executes before the next session is scheduled
+const SLICE_STEPS: u64 = 65536;
+
+/// Default number of steps executed by a `run` without `steps`
+const DEFAULT_RUN_STEPS: u64 = 1_000_000;
+
+/// Maximum number of steps of a single `run` or `step`
+const MAX_RUN_STEPS: u64 = 100_000_000;
+
+/// Maximum number of requests of a session waiting to be handled
+const MAX_PENDING_REQUESTS: usize = 256;
+
+/// Time after which writing a response to a client that does not read fails
+const WRITE_TIMEOUT: Duration = Duration::from_secs(10);
+
+pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
+    let address = args.value_of("listen").unwrap();
+    let listener = TcpListener::bind(address).map_err(|e| {
+        println!("Der Server konnte nicht gestartet werden: {}", e);
+        2
+    })?;
+    let threads = threads_from_args(args)?;
+    println!("Warte auf Verbindungen an {}", address);
+
+    let server = Arc::new(Server::default());
+    for _ in 0..threads {
+        let server = server.clone();
+        thread::spawn(move || server.work());
+    }
+
+    for stream in listener.incoming() {
+        let stream = match stream {
+            Ok(stream) => stream,
+            Err(_) => continue,
+        };
+        let server = server.clone();
+        thread::spawn(move || server.connect(stream));
+    }
+
+    Ok(())
+}
+
+/// Program shared by all sessions that loaded the same instructions
+struct Loaded {
+    program: Program,
+    compiled: Compiled,
+}
+
+/// Sessions of all clients and the programs loaded by them
+///
+/// Every connection is a session, whose requests are handled in order, but
+/// sessions are executed concurrently by a fixed number of workers. Long
+/// executions are split into slices of `SLICE_STEPS` and the session is
+/// queued again after each slice (round-robin), so no session can block the
+/// others.
+#[derive(Default)]
+struct Server {
+    /// Sessions with pending requests in the order they are executed next
+    queue: Mutex<VecDeque<Arc<Mutex<Session>>>>,
+    ready: Condvar,
+    /// Programs by their instructions, dropped when no session uses them
+    programs: Mutex<HashMap<[u32; 32], Weak<Loaded>>>,
+}
+
+impl Server {
+    /// Read the requests of a client until it stops sending
+    ///
+    /// The pending requests are still answered afterwards, but runs are
+    /// cancelled. Requests exceeding `MAX_PENDING_REQUESTS` are rejected
+    /// immediately. The connection is closed when the session is dropped by
+    /// the last worker.
+    fn connect(&self, stream: TcpStream) {
+        let writer = match stream.try_clone() {
+            Ok(writer) => writer,
+            Err(_) => return,
+        };
+        let _ = writer.set_write_timeout(Some(WRITE_TIMEOUT));
+        let session = Arc::new(Mutex::new(Session::new(writer)));
+
+        for line in BufReader::new(stream).lines() {
+            let line = match line {
+                Ok(line) => line,
+                Err(_) => break,
+            };
+            if line.trim().is_empty() {
+                continue;
+            }
+
+            let schedule = {
+                let mut session = match session.lock() {
+                    Ok(session) => session,
+                    Err(_) => break,
+                };
+                if session.closed {
+                    break;
+                }
+                if session.requests.len() >= MAX_PENDING_REQUESTS {
+                    let (id, _) = parse_request(&line);
+                    session.respond(id, &error_response("Zu viele ausstehende Anfragen"));
+                    session.flush();
+                    continue;
+                }
+                session.requests.push_back(line);
+                ! std::mem::replace(&mut session.scheduled, true)
+            };
+            if schedule {
+                self.schedule(session.clone());
+            }
+        }
+
+        lock(&session).hangup = true;
+    }
+
+    fn schedule(&self, session: Arc<Mutex<Session>>) {
+        lock(&self.queue).push_back(session);
+        self.ready.notify_one();
+    }
+
+    /// Execute slices of the queued sessions forever
+    fn work(&self) {
+        loop {
+            let session = {
+                let mut queue = lock(&self.queue);
+                loop {
+                    match queue.pop_front() {
+                        Some(session) => break session,
+                        None => queue = self.ready.wait(queue).unwrap_or_else(PoisonError::into_inner),
+                    }
+                }
+            };
+
+            // A panic while handling a request only closes its session, the
+            // lock is not poisoned because the guard is dropped afterwards
+            let mut guard = match session.lock() {
+                Ok(guard) => guard,
+                Err(_) => continue,
+            };
+            let pending = match panic::catch_unwind(AssertUnwindSafe(|| guard.work(self))) {
+                Ok(pending) => pending,
+                Err(_) => {
+                    guard.closed = true;
+                    guard.requests.clear();
+                    false
+                }
+            };
+            drop(guard);
+            if pending {
+                self.schedule(session);
+            }
+        }
+    }
+
+    /// Return the shared program with the given instructions
+    fn load(&self, instructions: [emulator::Instruction; 32]) -> Arc<Loaded> {
+        let mut key = [0; 32];
+        for (word, instruction) in key.iter_mut().zip(instructions.iter()) {
+            *word = instruction.get_instruction();
+        }
+
+        let mut programs = lock(&self.programs);
+        if let Some(loaded) = programs.get(&key).and_then(Weak::upgrade) {
+            return loaded;
+        }
+
+        let program = Program::new(Path::new("<serve>"), instructions);
+        let loaded = Arc::new(Loaded {
+            compiled: Compiled::new(&program, Engine::Scalar),
+            program: program,
+        });
+        programs.retain(|_, loaded| loaded.strong_count() > 0);
+        programs.insert(key, Arc::downgrade(&loaded));
+        loaded
+    }
+}
+
+/// Lock the mutex even if another thread panicked while holding it (the
+/// queue and the programs are consistent after every operation)
+fn lock<T>(mutex: &Mutex<T>) -> MutexGuard<'_, T> {
+    mutex.lock().unwrap_or_else(PoisonError::into_inner)
+}
+
+/// State of the machine of a client and its pending requests
+struct Session {
+    state: Machine,
+    program: Option<Arc<Loaded>>,
+    requests: VecDeque<String>,
+    /// Steps already executed by the run at the front of the requests
+    progress: u64,
+    /// Whether the session is in the queue or being executed
+    scheduled: bool,
+    /// Whether the client stopped sending, which cancels all runs
+    hangup: bool,
+    /// Whether writing a response failed
+    closed: bool,
+    writer: BufWriter<TcpStream>,
+}
+
+impl Session {
+    fn new(writer: TcpStream) -> Session {
+        Session {
+            state: Machine::default(),
+            program: None,
+            requests: VecDeque::new(),
+            progress: 0,
+            scheduled: false,
+            hangup: false,
+            closed: false,
+            writer: BufWriter::new(writer),
+        }
+    }
+
+    /// Handle requests until all are done or a slice of steps is executed.
+    ///
+    /// Returns whether requests are still pending.
+    fn work(&mut self, server: &Server) -> bool {
+        let mut budget = SLICE_STEPS;
+
+        while budget > 0 && ! self.closed {
+            let (id, command) = match self.requests.front() {
+                Some(line) => parse_request(line),
+                None => break,
+            };
+
+            let response = match command {
+                Ok(command) => match self.handle(server, command, &mut budget) {
+                    Some(response) => response,
+                    // The run is continued in the next slice
+                    None => continue,
+                },
+                Err(error) => error_response(&error),
+            };
+
+            self.requests.pop_front();
+            self.progress = 0;
+            self.respond(id, &response);
+        }
+
+        self.flush();
+        if self.closed {
+            self.requests.clear();
+        }
+
+        self.scheduled = ! self.requests.is_empty();
+        self.scheduled
+    }
+
+    /// Write the response with the fields of the request with the given id
+    fn respond(&mut self, id: Option<String>, response: &str) {
+        let response = match id {
+            Some(id) => format!("{{\"id\":{},{}}}\n", id, response),
+            None => format!("{{{}}}\n", response),
+        };
+        if self.writer.write_all(response.as_bytes()).is_err() {
+            self.closed = true;
+        }
+    }
+
+    fn flush(&mut self) {
+        if self.writer.flush().is_err() {
+            self.closed = true;
+        }
+    }
+
+    /// Execute a command and return the fields of its response (None if a
+    /// run has used up the budget and has to be continued)
+    fn handle(&mut self, server: &Server, command: Command, budget: &mut u64) -> Option<String> {
+        match command {
+            Command::Load(source) => match parse_program(source.as_bytes()) {
+                Ok(instructions) => {
+                    self.program = Some(server.load(instructions));
+                    self.reset();
+                    Some(format!("\"ok\":true,\"state\":{}", format_state(&mut self.state)))
+                }
+                Err(error) => {
+                    Some(error_response(&format!("Fehler beim Laden des Programms: {}", error)))
+                }
+            },
+            Command::Reset => {
+                self.reset();
+                Some(format!("\"ok\":true,\"state\":{}", format_state(&mut self.state)))
+            }
+            Command::Input(register, value) => {
+                self.state.bus.inspect_input()[register] = value;
+                Some("\"ok\":true".to_string())
+            }
+            Command::Snapshot => {
+                Some(format!("\"ok\":true,\"state\":{}", format_state(&mut self.state)))
+            }
+            Command::Run { steps, until } => {
+                let loaded = match self.program {
+                    Some(ref loaded) => loaded.clone(),
+                    None => return Some(error_response("Kein Mikroprogramm geladen")),
+                };
+                if self.hangup {
+                    return Some(error_response("Ausführung abgebrochen, die Verbindung wurde geschlossen"));
+                }
+
+                let limits = Limits {
+                    max_steps: (steps - self.progress).min(*budget),
+                    until_stable: false,
+                    until_address: until,
+                    interrupts: Schedule::new(),
+                };
+                let stop = match run_program(&mut self.state, &loaded.program, &loaded.compiled, &limits) {
+                    Ok((executed, stop)) => {
+                        self.progress += executed;
+                        *budget -= executed;
+                        stop
+                    }
+                    Err(error) => return Some(error_response(
+                        &format!("Fehler beim Ausführen des Befehls: {}", error))),
+                };
+
+                if stop != Stop::Address && self.progress < steps {
+                    *budget = 0;
+                    return None;
+                }
+                Some(format!("\"ok\":true,\"steps\":{},\"stop\":\"{}\",\"state\":{}",
+                    self.progress, stop.name(), format_state(&mut self.state)))
+            }
+        }
+    }
+
+    /// Reset the machine, but keep the input registers
+    fn reset(&mut self) {
+        let input = *self.state.bus.inspect_input();
+        self.state = Machine::default();
+        *self.state.bus.inspect_input() = input;
+    }
+}
+
+/// Command of a request
+enum Command {
+    /// `{"cmd":"load","program":"00000: 00 00000 ..."}`
+    Load(String),
+    /// `{"cmd":"reset"}`
+    Reset,
+    /// `{"cmd":"input","register":"FC","value":42}`
+    Input(usize, u8),
+    /// `{"cmd":"snapshot"}`
+    Snapshot,
+    /// `{"cmd":"step"}` (one step), `{"cmd":"step","count":10}` or
+    /// `{"cmd":"run","until":"01001","steps":5000}`
+    Run { steps: u64, until: Option<usize> },
+}
+
+/// Parse a request line into its id (formatted as json) and command
+fn parse_request(line: &str) -> (Option<String>, Result<Command, String>) {
+    let fields = match parse_object(line) {
+        Ok(fields) => fields,
+        Err(error) => return (None, Err(format!("Ungültige Anfrage: {}", error))),
+    };
+    let get = |name| fields.iter().find(|field| field.0 == name).map(|field| &field.1);
+
+    let id = match get("id") {
+        Some(&Value::String(ref id)) => Some(escape_json(id)),
+        Some(&Value::Number(id)) => Some(id.to_string()),
+        _ => None,
+    };
+
+    let string = |name| match get(name) {
+        Some(&Value::String(ref value)) => Ok(Some(value.as_str())),
+        Some(_) => Err(format!("{} muss ein String sein", name)),
+        None => Ok(None),
+    };
+    let number = |name| match get(name) {
+        Some(&Value::Number(value)) => Ok(Some(value)),
+        Some(_) => Err(format!("{} muss eine Zahl sein", name)),
+        None => Ok(None),
+    };
+
+    let command = (|| Ok(match string("cmd")? {
+        Some("load") => Command::Load(string("program")?.ok_or("program fehlt")?.to_string()),
+        Some("reset") => Command::Reset,
+        Some("snapshot") => Command::Snapshot,
+        Some("input") => {
+            let register = match string("register")? {
+                Some("FC") => 0,
+                Some("FD") => 1,
+                Some("FE") => 2,
+                Some("FF") => 3,
+                _ => return Err("Ungültiges Eingaberegister".to_string()),
+            };
+            match number("value")? {
+                Some(value) if value <= 255 => Command::Input(register, value as u8),
+                _ => return Err("Ungültiger Wert".to_string()),
+            }
+        }
+        Some("step") => Command::Run { steps: run_steps(number("count")?, 1)?, until: None },
+        Some("run") => Command::Run {
+            steps: run_steps(number("steps")?, DEFAULT_RUN_STEPS)?,
+            until: match string("until")? {
+                Some(until) => Some(parse_address(until).ok_or_else(|| {
+                    format!("Ungültige Befehlsadresse: {}", until)
+                })?),
+                None => None,
+            },
+        },
+        Some(command) => return Err(format!("Unbekannter Befehl: {}", command)),
+        None => return Err("cmd fehlt".to_string()),
+    }))();
+
+    (id, command)
+}
+
+/// Number of steps of a run, at most `MAX_RUN_STEPS`
+fn run_steps(steps: Option<u64>, default: u64) -> Result<u64, String> {
+    match steps.unwrap_or(default) {
+        steps if steps <= MAX_RUN_STEPS => Ok(steps),
+        _ => Err(format!("Höchstens {} Schritte pro Anfrage", MAX_RUN_STEPS)),
+    }
+}
+
+fn error_response(error: &str) -> String {
+    format!("\"ok\":false,\"error\":{}", escape_json(error))
+}
+
+/// Format the state as a json object (the ram as a string of hex digits)
+fn format_state(state: &mut Machine) -> String {
+    let mut result = String::with_capacity(768);
+
+    write!(result, "{{\"ip\":\"{:05b}\",\"registers\":[", state.instruction_pointer).unwrap();
+    for (i, register) in state.cpu.inspect_registers().iter().enumerate() {
+        write!(result, "{}{}", if i == 0 { "" } else { "," }, register).unwrap();
+    }
+
+    let flags = *state.cpu.inspect_flags();
+    write!(result, "],\"flags\":{{\"C\":{},\"N\":{},\"Z\":{}}}", flags.carry() as u8,
+        flags.negative() as u8, flags.zero() as u8).unwrap();
+
+    let input = *state.bus.inspect_input();
+    let output = *state.bus.inspect_output();
+    write!(result, ",\"input\":[{},{},{},{}],\"output\":[{},{}],\"ram\":\"", input[0], input[1],
+        input[2], input[3], output[0], output[1]).unwrap();
+    for byte in state.bus.inspect().iter() {
+        write!(result, "{:02X}", byte).unwrap();
+    }
+
+    result.push_str("\"}");
+    result
+}
+
+/// Value of a field of a request
+enum Value {
+    String(String),
+    Number(u64),
+    Other,
+}
+
+/// Parse a json object without nested objects or arrays (all requests are
+/// flat) into its fields
+fn parse_object(line: &str) -> Result<Vec<(String, Value)>, &'static str> {
+    let mut chars = line.chars().peekable();
+    let mut fields = Vec::new();
+
+    skip_whitespace(&mut chars);
+    if chars.next() != Some('{') {
+        return Err("Objekt erwartet");
+    }
+    skip_whitespace(&mut chars);
+    if chars.peek() == Some(&'}') {
+        chars.next();
+    } else {
+        loop {
+            skip_whitespace(&mut chars);
+            let key = parse_string(&mut chars)?;
+            skip_whitespace(&mut chars);
+            if chars.next() != Some(':') {
+                return Err(": erwartet");
+            }
+            skip_whitespace(&mut chars);
+            fields.push((key, parse_value(&mut chars)?));
+            skip_whitespace(&mut chars);
+            match chars.next() {
+                Some(',') => continue,
+                Some('}') => break,
+                _ => return Err(", oder } erwartet"),
+            }
+        }
+    }
+
+    skip_whitespace(&mut chars);
+    if chars.next().is_some() {
+        return Err("Zeichen nach dem Objekt");
+    }
+    Ok(fields)
+}
+
+type Chars<'a> = std::iter::Peekable<std::str::Chars<'a>>;
+
+fn skip_whitespace(chars: &mut Chars<'_>) {
+    while chars.peek().map_or(false, |c| c.is_whitespace()) {
+        chars.next();
+    }
+}
+
+fn parse_value(chars: &mut Chars<'_>) -> Result<Value, &'static str> {
+    match chars.peek() {
+        Some('"') => Ok(Value::String(parse_string(chars)?)),
+        Some(c) if c.is_ascii_digit() => {
+            let mut number = 0u64;
+            while let Some(digit) = chars.peek().and_then(|c| c.to_digit(10)) {
+                number = number.checked_mul(10).and_then(|n| n.checked_add(digit as u64))
+                    .ok_or("Zahl zu groß")?;
+                chars.next();
+            }
+            Ok(Value::Number(number))
+        }
+        _ => {
+            for literal in ["true", "false", "null"].iter() {
+                if chars.clone().take(literal.len()).eq(literal.chars()) {
+                    chars.nth(literal.len() - 1);
+                    return Ok(Value::Other);
+                }
+            }
+            Err("Ungültiger Wert (nur Strings, positive ganze Zahlen, true, false und null)")
+        }
+    }
+}
+
+fn parse_string(chars: &mut Chars<'_>) -> Result<String, &'static str> {
+    if chars.next() != Some('"') {
+        return Err("String erwartet");
+    }
+
+    let mut string = String::new();
+    loop {
+        match chars.next().ok_or("Unvollständiger String")? {
+            '"' => return Ok(string),
+            '\\' => string.push(match chars.next().ok_or("Unvollständiger String")? {
+                '"' => '"',
+                '\\' => '\\',
+                '/' => '/',
+                'b' => '\u{8}',
+                'f' => '\u{c}',
+                'n' => '\n',
+                'r' => '\r',
+                't' => '\t',
+                'u' => {
+                    let mut code = parse_hex(chars)?;
+                    // Characters outside the BMP are escaped as surrogate pairs
+                    if (0xD800..0xDC00).contains(&code) {
+                        if chars.next() != Some('\\') || chars.next() != Some('u') {
+                            return Err("Ungültiges Escape");
+                        }
+                        let low = parse_hex(chars)?;
+                        if ! (0xDC00..0xE000).contains(&low) {
+                            return Err("Ungültiges Escape");
+                        }
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    std::char::from_u32(code).ok_or("Ungültiges Escape")?
+                }
+                _ => return Err("Ungültiges Escape"),
+            }),
+            c if (c as u32) < 0x20 => return Err("Steuerzeichen im String"),
+            c => string.push(c),
+        }
+    }
+}
+
+fn parse_hex(chars: &mut Chars<'_>) -> Result<u32, &'static str> {
+    let mut code = 0;
+    for _ in 0..4 {
+        let digit = chars.next().and_then(|c| c.to_digit(16)).ok_or("Ungültiges Escape")?;
+        code = code << 4 | digit;
+    }
+    Ok(code)
+}
@@ -0,0 +1,346 @@
+use std::collections::BTreeMap;
+use std::fmt::Write as FmtWrite;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{mpsc, Condvar, Mutex};
+use std::thread;
+
+use clap::ArgMatches;
+
+use emulator::Machine;
+use emulator::explore::{Explorer, Outcome};
+use emulator::interrupt::Interrupt;
+use emulator::lockstep::Lockstep;
+
+use super::{load_programm, Program};
+use super::cache::{Cache, KeyBuilder};
+use super::run::{next_stop, run_program, set_inputs, threads_from_args, Compiled, Engine,
+                 Limits};
+
+/// Number of input combinations that a worker claims at once
+const CHUNK_SIZE: u64 = 1024;
+
+/// Maximum size of tables that are stored in the cache (2 swept registers)
+const MAX_CACHED_SIZE: usize = 1 << 20;
+
+/// Number of input combinations executed together by the lockstep engine
+const LANES: usize = 64;
+
+pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
+    let program = load_programm(Path::new(args.value_of("2i-programm").unwrap()))
+        .map_err(|_| 2)?;
+    let limits = Limits::from_args(args)?;
+
+    // Fixed inputs are used for all registers that are not swept
+    let mut initial: Machine = Machine::default();
+    if let Some(inputs) = args.values_of("input") {
+        set_inputs(&mut initial.bus, inputs)?;
+    }
+
+    let registers = parse_registers(args.values_of("inputs").unwrap())?;
+
+    let threads = threads_from_args(args)?;
+
+    let engine = Engine::from_args(args, &limits)?;
+
+    // The explorer executes single steps without interrupts
+    let check_termination = args.is_present("check-termination");
+    if check_termination && (engine != Engine::Scalar || ! limits.interrupts.is_empty()
+                             || limits.until_address.is_some()) {
+        println!("--check-termination kann nur mit der Ausführungsart scalar und ohne \
+                  Interrupts oder --until-ip verwendet werden");
+        return Err(1);
+    }
+
+    // The complete table is cached, but only if it is not too large
+    let cache = Cache::from_args(args)?;
+    let key = KeyBuilder::new("sweep").program(&program).limits(&limits)
+        .bytes(initial.bus.inspect_input())
+        .bytes(&registers.iter().map(|&r| r as u8).collect::<Vec<_>>())
+        .bytes(&[check_termination as u8])
+        .finish();
+    if let Some(table) = cache.as_ref().and_then(|cache| cache.get(&key)) {
+        let stdout = io::stdout();
+        let mut output = stdout.lock();
+        return output.write_all(&table).and_then(|_| output.flush()).map_err(|_| 4);
+    }
+
+    let sweep = Sweep {
+        program: &program,
+        engine: engine,
+        check_termination: check_termination,
+        compiled: Compiled::new(&program, engine),
+        limits: &limits,
+        initial: &initial,
+        registers: &registers,
+        next_chunk: AtomicU64::new(0),
+        window: 4 * threads as u64,
+        printed: Mutex::new(0),
+        printed_changed: Condvar::new(),
+    };
+
+    let stdout = io::stdout();
+    let mut output = BufWriter::new(stdout.lock());
+    let mut table = cache.as_ref().map(|_| Vec::new());
+
+    // Print the header of the table
+    let header: Vec<_> = registers.iter().map(|&r| format!("F{:X}", 0xC + r)).collect();
+    let header = format!("{} FE FF{}\n", header.join(" "),
+        if check_termination { " stop" } else { "" });
+    output.write_all(header.as_bytes()).map_err(|_| 4)?;
+    if let Some(ref mut table) = table {
+        table.extend_from_slice(header.as_bytes());
+    }
+
+    let (sender, receiver) = mpsc::sync_channel(4 * threads);
+
+    thread::scope(|scope| {
+        for _ in 0..threads {
+            let sender = sender.clone();
+            let sweep = &sweep;
+            scope.spawn(move || sweep.work(sender));
+        }
+        drop(sender);
+
+        // Chunks are finished out of order, but must be printed in order.
+        // Workers wait before claiming chunks beyond the window, so at most
+        // `window` chunks are pending.
+        let mut pending = BTreeMap::new();
+        let mut next_chunk = 0;
+        let result = (|| {
+            for (chunk, rows) in receiver.iter() {
+                pending.insert(chunk, rows);
+                while let Some(rows) = pending.remove(&next_chunk) {
+                    // Dropping the receiver on errors also stops the workers
+                    output.write_all(rows.as_bytes()).map_err(|_| 4)?;
+                    next_chunk += 1;
+                    sweep.set_printed(next_chunk);
+
+                    if table.as_ref().map_or(false, |t| t.len() + rows.len() > MAX_CACHED_SIZE) {
+                        table = None;
+                    } else if let Some(ref mut table) = table {
+                        table.extend_from_slice(rows.as_bytes());
+                    }
+                }
+            }
+
+            output.flush().map_err(|_| 4)
+        })();
+
+        // Waiting workers have to stop after errors
+        sweep.set_printed(u64::MAX);
+        drop(receiver);
+        result
+    })?;
+
+    if let (Some(cache), Some(table)) = (cache, table) {
+        cache.put(&key, &table);
+    }
+    Ok(())
+}
+
+/// Parse a list of input registers (FC-FF) into their indices
+fn parse_registers<'a, I>(names: I) -> Result<Vec<usize>, i32>
+    where I: Iterator<Item = &'a str> {
+    let mut registers = Vec::new();
+
+    for name in names {
+        let register = match name.trim() {
+            "FC" => 0,
+            "FD" => 1,
+            "FE" => 2,
+            "FF" => 3,
+            _ => {
+                println!("Ungültiges Eingaberegister: {}", name);
+                return Err(1);
+            }
+        };
+
+        if registers.contains(&register) {
+            println!("Eingaberegister mehrfach angegeben: {}", name);
+            return Err(1);
+        }
+        registers.push(register);
+    }
+
+    Ok(registers)
+}
+
+/// Input space and program shared read-only by all workers
+struct Sweep<'a> {
+    program: &'a Program,
+    engine: Engine,
+    /// Explore the states of every input to find out whether it settles
+    check_termination: bool,
+    compiled: Compiled,
+    limits: &'a Limits,
+    initial: &'a Machine,
+    registers: &'a [usize],
+    next_chunk: AtomicU64,
+    /// Maximum number of chunks claimed ahead of the printed ones
+    window: u64,
+    /// Number of chunks printed in order
+    printed: Mutex<u64>,
+    printed_changed: Condvar,
+}
+
+impl<'a> Sweep<'a> {
+    /// Claim and execute chunks of the input space until it is exhausted
+    fn work(&self, results: mpsc::SyncSender<(u64, String)>) {
+        let cases = 1u64 << (8 * self.registers.len());
+
+        // States are only shared between the inputs of the same worker
+        let mut explorer = Explorer::new(&self.program.decoded, self.limits.max_steps);
+        let mut machine = Lockstep::<LANES>::new();
+
+        loop {
+            let chunk = self.next_chunk.fetch_add(1, Ordering::Relaxed);
+            let first = chunk * CHUNK_SIZE;
+            if first >= cases {
+                return;
+            }
+
+            if ! self.wait_for_window(chunk) {
+                return;
+            }
+
+            let last = cases.min(first + CHUNK_SIZE);
+            let mut rows = String::with_capacity(CHUNK_SIZE as usize * 16);
+            match self.engine {
+                _ if self.check_termination => for case in first..last {
+                    self.explore(&mut explorer, case, &mut rows);
+                },
+                Engine::Scalar | Engine::Superblock => for case in first..last {
+                    self.execute(case, &mut rows);
+                },
+                Engine::Lockstep => for lanes in (first..last).step_by(LANES) {
+                    machine.reset();
+                    let end = last.min(lanes + LANES as u64);
+                    self.execute_lockstep(&mut machine, lanes, end, &mut rows);
+                },
+            }
+
+            if results.send((chunk, rows)).is_err() {
+                return;
+            }
+        }
+    }
+
+    /// Wait until the chunk is within the window of the printed chunks (false
+    /// if the printing stopped)
+    fn wait_for_window(&self, chunk: u64) -> bool {
+        let mut printed = self.printed.lock().unwrap();
+        while chunk >= printed.saturating_add(self.window) {
+            printed = self.printed_changed.wait(printed).unwrap();
+        }
+        *printed != u64::MAX
+    }
+
+    fn set_printed(&self, printed: u64) {
+        *self.printed.lock().unwrap() = printed;
+        self.printed_changed.notify_all();
+    }
+
+    /// Execute a single input combination on a fresh machine and append its
+    /// row to the table
+    fn execute(&self, case: u64, rows: &mut String) {
+        let mut state = self.initial.clone();
+
+        for (register, value) in self.inputs(case) {
+            state.bus.inspect_input()[register] = value;
+            write!(rows, "{:02X} ", value).unwrap();
+        }
+
+        match run_program(&mut state, self.program, &self.compiled, self.limits) {
+            Ok(_) => {
+                let output = state.bus.inspect_output();
+                writeln!(rows, "{:02X} {:02X}", output[0], output[1]).unwrap();
+            }
+            Err(_) => rows.push_str("-- --\n"),
+        }
+    }
+
+    /// Explore a single input combination until its state repeats and append
+    /// its row with the reason for stopping (`settled` if the outputs never
+    /// change again, `loop` if they do, `steps` or `error`)
+    fn explore(&self, explorer: &mut Explorer<'_>, case: u64, rows: &mut String) {
+        let mut state = self.initial.clone();
+
+        for (register, value) in self.inputs(case) {
+            state.bus.inspect_input()[register] = value;
+            write!(rows, "{:02X} ", value).unwrap();
+        }
+
+        match explorer.explore(state) {
+            Outcome::Settled { output, .. } => {
+                writeln!(rows, "{:02X} {:02X} settled", output[0], output[1]).unwrap();
+            }
+            Outcome::Oscillating { .. } => rows.push_str("-- -- loop\n"),
+            Outcome::Limit => rows.push_str("-- -- steps\n"),
+            Outcome::Failed { .. } => rows.push_str("-- -- error\n"),
+        }
+    }
+
+    /// Execute the input combinations `first..last` (at most `LANES`)
+    /// together on the reset `machine` and append their rows to the table
+    fn execute_lockstep(&self, machine: &mut Lockstep<LANES>, first: u64, last: u64,
+                        rows: &mut String) {
+        let mut initial = self.initial.clone();
+        let initial_input = *initial.bus.inspect_input();
+
+        for (lane, case) in (first..last).enumerate() {
+            for (register, &value) in initial_input.iter().enumerate() {
+                machine.set_input(lane, register, value);
+            }
+            for (register, value) in self.inputs(case) {
+                machine.set_input(lane, register, value);
+            }
+        }
+
+        // Lanes without a combination are not executed at all
+        for lane in (last - first) as usize..LANES {
+            machine.stop(lane);
+        }
+
+        // All lanes are executed straight until the next interrupt
+        let mut interrupts = self.limits.interrupts.queue();
+        let mut steps = 0;
+        loop {
+            let until = next_stop(interrupts.next_cycle(), self.limits);
+            steps += machine.run(&self.program.decoded, until - steps, self.limits.until_address);
+            if steps != until || steps == self.limits.max_steps {
+                break;
+            }
+
+            interrupts.trigger_with(steps, |interrupt| for lane in 0..LANES {
+                match interrupt {
+                    Interrupt::A => machine.trigger_volatile_interrupt(lane),
+                    Interrupt::B => machine.trigger_stored_interrupt(lane),
+                }
+            });
+        }
+
+        for (lane, case) in (first..last).enumerate() {
+            for (_, value) in self.inputs(case) {
+                write!(rows, "{:02X} ", value).unwrap();
+            }
+            if machine.error(lane).is_some() {
+                rows.push_str("-- --\n");
+            } else {
+                let output = machine.output(lane);
+                writeln!(rows, "{:02X} {:02X}", output[0], output[1]).unwrap();
+            }
+        }
+    }
+
+    /// The swept input registers and their values for the given case
+    ///
+    /// The first register is the most significant part of the case.
+    fn inputs(&self, case: u64) -> impl Iterator<Item = (usize, u8)> + '_ {
+        let last = self.registers.len() - 1;
+        self.registers.iter().enumerate().map(move |(i, &register)| {
+            (register, (case >> (8 * (last - i))) as u8)
+        })
+    }
+}
@@ -0,0 +1,80 @@
+use std::fmt::Write as FmtWrite;
+use std::fs::File;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+
+use clap::ArgMatches;
+
+use emulator::Machine;
+use emulator::trace::{Record, Trace};
+
+use super::run::format_state;
+
+pub fn main(args: &ArgMatches<'_>) -> Result<(), i32> {
+    let trace = read_trace(Path::new(args.value_of("trace-datei").unwrap()))?;
+
+    if let Some(other) = args.value_of("diff") {
+        let other = read_trace(Path::new(other))?;
+        match trace.first_difference(&other) {
+            Some(step) => println!("diff={}", step),
+            None => println!("diff=none"),
+        }
+        return Ok(());
+    }
+
+    let step = if let Some(step) = args.value_of("step") {
+        step.parse::<u64>().map_err(|_| {
+            println!("Ungültige Anzahl an Befehlen: {}", step);
+            1
+        })?
+    } else if args.is_present("records") {
+        0
+    } else {
+        trace.len()
+    };
+    if step > trace.len() {
+        println!("Der Trace enthält nur {} Befehle", trace.len());
+        return Err(1);
+    }
+
+    if args.is_present("records") {
+        let stdout = io::stdout();
+        let mut output = BufWriter::new(stdout.lock());
+        let mut line = String::with_capacity(64);
+        for (i, record) in trace.records(step).enumerate() {
+            line.clear();
+            format_record(&mut line, step + i as u64, &record);
+            output.write_all(line.as_bytes()).map_err(|_| 4)?;
+        }
+        output.flush().map_err(|_| 4)
+    } else {
+        let mut state = Machine::from(trace.state(step).unwrap());
+        print!("steps={}\n{}", step, format_state(&mut state));
+        Ok(())
+    }
+}
+
+/// Read a trace file and print errors to stdout if it fails
+fn read_trace(path: &Path) -> Result<Trace, i32> {
+    let file = File::open(path).map_err(|e| {
+        println!("Die angegebene Datei konnte nicht geöffnet werden: {}", e);
+        2
+    })?;
+    Trace::read(file).map_err(|e| {
+        println!("Die Trace-Datei konnte nicht gelesen werden: {}", e);
+        3
+    })
+}
+
+/// Format a record as a line (eg: `12 00110 -> 01000 R0=00000100 C=0 N=0 Z=0`)
+fn format_record(line: &mut String, step: u64, record: &Record) {
+    write!(line, "{} {:05b} -> {:05b}", step, record.address, record.next_address).unwrap();
+    if let Some((register, value)) = record.register {
+        write!(line, " R{}={:08b}", register, value).unwrap();
+    }
+    if let Some((address, value)) = record.bus {
+        write!(line, " ({:02X})={:08b}", address, value).unwrap();
+    }
+    writeln!(line, " C={} N={} Z={}", record.flags.carry() as u8,
+        record.flags.negative() as u8, record.flags.zero() as u8).unwrap();
+}
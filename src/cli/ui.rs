@@ -1,32 +1,113 @@
-use std::borrow::Cow;
+use std::fmt::{self, Write as FmtWrite};
 use std::io::{self, Write};
 use std::path::Path;
 
-use emulator::{Flags, Instruction, IoRegisters, Ram};
+use emulator::{Flags, IoRegisters, Ram};
+use emulator::listing::Fields;
 use super::*;
 
-/// Display the status UI of the cli
-pub fn status(computer: &mut Computer<'_>, io: &IoRegisters,
+/// Renderer of the status UI of the cli
+///
+/// The status is formatted into a reusable buffer without any intermediate
+/// allocations. Besides drawing it completely (after commands that print
+/// other output), the last drawn status can be updated in place, in which
+/// case only the changed parts of each line are written using cursor
+/// movements.
+#[derive(Default)]
+pub struct Renderer {
+    /// Status that is currently formatted
+    frame: String,
+    /// Status that was drawn last
+    previous: String,
+    /// Text and escape sequences written to the terminal
+    output: String,
+}
+
+impl Renderer {
+    pub fn new() -> Renderer {
+        Renderer::default()
+    }
+
+    /// Draw the complete status below the current output
+    pub fn status(&mut self, computer: &mut Computer<'_>, io: &IoRegisters,
+                  program: &Option<Program>, flags: Option<Flags>) {
+        self.format(computer, io, program, flags);
+        write_flushed(&self.frame);
+        std::mem::swap(&mut self.frame, &mut self.previous);
+    }
+
+    /// Update the status drawn last by `status` or `update` in place
+    ///
+    /// Nothing else must have been printed since then, because the cursor is
+    /// moved back relative to its current position.
+    pub fn update(&mut self, computer: &mut Computer<'_>, io: &IoRegisters,
+                  program: &Option<Program>, flags: Option<Flags>) {
+        self.redraw(computer, io, program, flags, false);
+    }
+
+    /// Update the status drawn last like `update`, but with the line of an
+    /// empty input below it, which is cleared for the next prompt
+    pub fn update_after_prompt(&mut self, computer: &mut Computer<'_>, io: &IoRegisters,
+                               program: &Option<Program>, flags: Option<Flags>) {
+        self.redraw(computer, io, program, flags, true);
+    }
+
+    fn redraw(&mut self, computer: &mut Computer<'_>, io: &IoRegisters,
+              program: &Option<Program>, flags: Option<Flags>, after_prompt: bool) {
+        self.format(computer, io, program, flags);
+        let lines = self.frame.matches('\n').count();
+        if lines != self.previous.matches('\n').count() {
+            return self.status(computer, io, program, flags);
+        }
+
+        // Move to the start of the status and then line by line to its end,
+        // rewriting every line from its first changed character
+        self.output.clear();
+        if self.frame != self.previous {
+            write!(self.output, "\x1b[{}F", lines + after_prompt as usize).unwrap();
+            for (line, previous) in self.frame.split('\n').zip(self.previous.split('\n')).take(lines) {
+                if line != previous {
+                    let (column, offset) = common_prefix(line, previous);
+                    write!(self.output, "\x1b[{}G{}\x1b[K", column + 1, &line[offset..]).unwrap();
+                }
+                self.output.push_str("\x1b[E");
+            }
+        } else if after_prompt {
+            self.output.push_str("\x1b[F");
+        }
+        if after_prompt {
+            self.output.push_str("\x1b[K");
+        }
+
+        if ! self.output.is_empty() {
+            write_flushed(&self.output);
+        }
+        std::mem::swap(&mut self.frame, &mut self.previous);
+    }
+
+    /// Format the status into the frame buffer
+    fn format(&mut self, computer: &mut Computer<'_>, io: &IoRegisters,
               program: &Option<Program>, flags: Option<Flags>) {
-    let flag_register = computer.cpu.inspect_flags().clone();
-    let volatile_interrupt = computer.cpu.check_volatile_interrupt();
-    let stored_interrupt = computer.cpu.check_stored_interrupt();
-    let reg = computer.cpu.inspect_registers();
-    let input = io.inspect_input().borrow();
-    let output = io.inspect_output().borrow();
-
-    let (path, instruction, mnemonic) = if let &Some(ref program) = program {
-        let inst = program.instructions[computer.instruction_pointer];
-        (
-            ellipsize_path(&program.path, 41),
-            format_instruction(inst),
-            inst.to_mnemonic(Some(computer.instruction_pointer)),
-        )
-    } else {
-        ("-".into(), "-".into(), "".into())
-    };
-
-    print!("
+        let flag_register = computer.cpu.inspect_flags().clone();
+        let volatile_interrupt = computer.cpu.check_volatile_interrupt();
+        let stored_interrupt = computer.cpu.check_stored_interrupt();
+        let reg = computer.cpu.inspect_registers();
+        let input = io.inspect_input().borrow();
+        let output = io.inspect_output().borrow();
+
+        let (path, instruction, mnemonic) = if let &Some(ref program) = program {
+            let address = computer.instruction_pointer;
+            (
+                Some(Ellipsized(&program.path, 41)),
+                Some(Grouped(program.listing.fields(address))),
+                Some(program.listing.mnemonic(address)),
+            )
+        } else {
+            (None, None, None)
+        };
+
+        self.frame.clear();
+        write!(self.frame, "
 Register:        Eingaberegister:   Aktuelles Mikroprogramm:
   R0: {0:08b }     FC: {8:08b }       {program_path}
   R1: {1:08b }     FD: {9:08b }
@@ -38,54 +119,104 @@ Register:        Eingaberegister:   Aktuelles Mikroprogramm:
   R7: {7:08b }     FF: {13:08b}       C: {co} ({cf}), N: {no} ({nf}), Z: {zo} ({zf}) | INT: {ia}, {ib}
 
 ",
-        reg[0], reg[1], reg[2], reg[3],
-        reg[4], reg[5], reg[6], reg[7],
-        input[0], input[1], input[2], input[3],
-        output[0], output[1],
-        program_path = path,
-        instruction = instruction,
-        mnemonic = mnemonic,
-        ip = computer.instruction_pointer,
-        co = flags.map_or("-".into(), |f| format!("{}", f.carry() as u8)),
-        no = flags.map_or("-".into(), |f| format!("{}", f.negative() as u8)),
-        zo = flags.map_or("-".into(), |f| format!("{}", f.zero() as u8)),
-        ia = volatile_interrupt as u8,
-        ib = stored_interrupt as u8,
-        cf = flag_register.carry() as u8,
-        nf = flag_register.negative() as u8,
-        zf = flag_register.zero() as u8);
-    io::stdout().flush().unwrap();
+            reg[0], reg[1], reg[2], reg[3],
+            reg[4], reg[5], reg[6], reg[7],
+            input[0], input[1], input[2], input[3],
+            output[0], output[1],
+            program_path = Or(path, "-"),
+            instruction = Or(instruction, "-"),
+            mnemonic = Or(mnemonic, ""),
+            ip = computer.instruction_pointer,
+            co = flag(flags.map(|f| f.carry())),
+            no = flag(flags.map(|f| f.negative())),
+            zo = flag(flags.map(|f| f.zero())),
+            ia = volatile_interrupt as u8,
+            ib = stored_interrupt as u8,
+            cf = flag_register.carry() as u8,
+            nf = flag_register.negative() as u8,
+            zf = flag_register.zero() as u8).unwrap();
+    }
+}
+
+/// Length of the common prefix of both lines in characters and in bytes of
+/// the first line
+fn common_prefix(line: &str, other: &str) -> (usize, usize) {
+    let mut column = 0;
+    for ((offset, a), b) in line.char_indices().zip(other.chars()) {
+        if a != b {
+            return (column, offset);
+        }
+        column += 1;
+    }
+    (column, line.char_indices().nth(column).map_or(line.len(), |(offset, _)| offset))
+}
+
+fn write_flushed(text: &str) {
+    let stdout = io::stdout();
+    let mut stdout = stdout.lock();
+    stdout.write_all(text.as_bytes()).and_then(|_| stdout.flush()).unwrap();
+}
+
+/// Optional flag of the last step (- if unknown)
+fn flag(flag: Option<bool>) -> char {
+    match flag {
+        Some(true) => '1',
+        Some(false) => '0',
+        None => '-',
+    }
 }
 
-/// Ellipsize path if necessary
-fn ellipsize_path(path: &Path, max_length: usize) -> Cow<'_, str> {
-    assert!(max_length >= 4);
-
-    let path_string = path.to_string_lossy();
-    // This only works for ascii-like strings
-    if path_string.chars().count() > max_length {
-        let rev_short: String = path_string.chars().rev().take(max_length - 3).collect();
-        "...".chars().chain(rev_short.chars().rev()).collect()
-    } else {
-        path_string
+/// Display the value or the default if it is missing
+struct Or<T>(Option<T>, &'static str);
+
+impl<T: fmt::Display> fmt::Display for Or<T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self.0 {
+            Some(ref value) => value.fmt(f),
+            None => f.write_str(self.1),
+        }
+    }
+}
+
+/// Path that is ellipsized if necessary
+struct Ellipsized<'a>(&'a Path, usize);
+
+impl fmt::Display for Ellipsized<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        assert!(self.1 >= 4);
+
+        let path_string = self.0.to_string_lossy();
+        // This only works for ascii-like strings
+        let length = path_string.chars().count();
+        if length > self.1 {
+            f.write_str("...")?;
+            path_string.chars().skip(length - (self.1 - 3)).try_for_each(|c| f.write_char(c))
+        } else {
+            f.write_str(&path_string)
+        }
     }
 }
 
-/// Format the given instruction as a logically grouped "binary" string
-fn format_instruction(inst: Instruction) -> String {
-    format!("{:02b} {:05b} | {}{} | {:03b} {:04b} {}{} | {}{} {:04b} | {}",
-        inst.get_address_control(),
-        inst.get_next_instruction_address(),
-        inst.is_bus_writable() as u8,
-        inst.is_bus_enabled() as u8,
-        inst.get_register_address_a(),
-        inst.get_constant_input() & 0b1111,
-        inst.should_write_register_b() as u8,
-        inst.should_write_register() as u8,
-        inst.is_alu_input_a_bus() as u8,
-        inst.is_alu_input_b_const() as u8,
-        inst.get_alu_instruction(),
-        inst.should_store_flags() as u8)
+/// Fields of an instruction displayed as a logically grouped "binary" string
+struct Grouped<'a>(&'a Fields);
+
+impl fmt::Display for Grouped<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let fields = self.0;
+        write!(f, "{:02b} {:05b} | {}{} | {:03b} {:04b} {}{} | {}{} {:04b} | {}",
+            fields.address_control,
+            fields.next_address,
+            fields.bus_writable as u8,
+            fields.bus_enabled as u8,
+            fields.register_a,
+            fields.register_b,
+            fields.write_register_b as u8,
+            fields.write_register as u8,
+            fields.alu_input_a_bus as u8,
+            fields.alu_input_b_const as u8,
+            fields.alu_instruction,
+            fields.store_flags as u8)
+    }
 }
 
 /// Print a overview of the ram in common hex-editor format
@@ -104,9 +235,9 @@ pub fn display_ram(ram: &Ram<'_>) {
 
 pub fn display_program(program: &Program) {
     println!();
-    for (addr, inst) in program.instructions.iter().enumerate() {
-        println!("{:05b}: {:30} {}", addr, inst.to_mnemonic(Some(addr)),
-            format_instruction(*inst));
+    for addr in 0..32 {
+        println!("{:05b}: {:30} {}", addr, program.listing.mnemonic(addr),
+            Grouped(program.listing.fields(addr)));
     }
     println!();
 }
@@ -116,12 +247,27 @@ pub fn display_help() {
     println!("\n\
         FX = <value>  Eingaberegister setzen (zB: FC = 11010)\n\
         ENTER         Nächsten Befehl ausführen\n\
+        back [n]      Die letzten n Befehle rückgängig machen (Standard: 1)\n\
+        run           Programm von vorne ausführen, bis ein Haltepunkt erreicht wird\n\
+        continue      Programm fortsetzen, bis ein Haltepunkt erreicht wird\n\
+        animate <hz>  Programm fortsetzen, bis ein Haltepunkt erreicht wird, und den\
+      \n                Zustand dabei höchstens hz-mal pro Sekunde anzeigen\n\
+        break <addr>  Vor dem Befehl an der Adresse anhalten (zB: break 01001)\n\
+        break if <b>  Anhalten, sobald die Bedingung erfüllt ist (zB: R2 == 0b1010,\
+      \n                C == 1, FE != 0x2A, (3A) changed, FF changed; FE/FF sind\
+      \n                die Ausgaberegister)\n\
+        break         Alle Haltepunkte anzeigen\n\
+        delete [n]    Haltepunkt n löschen (Standard: alle)\n\
         load <path>   Neues Mikroprogramm laden (CPU wird zurückgesetzt)\n\
+        watch [off]   Mikroprogramm vor jeder Eingabe neu laden, falls die Datei\
+      \n                geändert wurde (CPU und RAM bleiben erhalten)\n\
         trigger <int> Interrupt auslösen:\
       \n                INTA (MAC 010): Nur für den nächsten Befehl gültig\
       \n                INTB (MAC 111): Gültig bis zum nächsten Befehl mit MAC = 111\n\
         ram           RAM-Übersicht anzeigen\n\
         program       Mikroprogramm anzeigen (ohne NOPs)\n\
+        profile       Profil der ausgeführten Befehle anzeigen\
+      \n                (profile reset: Profil zurücksetzen)\n\
         help          Hilfe anzeigen\n\
         exit/quit     Emulator beenden (alternativ: STRG-D)\n")
 }
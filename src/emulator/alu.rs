@@ -5,11 +5,94 @@
 /// Alu of the 2i.
 pub struct Alu;
 
+/// Function calculating an alu instruction.
+///
+/// Takes the same arguments as `Alu::calculate` (instruction, both operands
+/// and the carry) and returns the result and the resulting flags.
+pub type AluFunction = fn(u8, u8, u8, bool) -> (u8, Flags);
+
+/// Function calculating only the result of a fixed alu instruction.
+///
+/// Takes both operands and the carry. Used where the flags are not needed.
+pub type AluResultFunction = fn(u8, u8, bool) -> u8;
+
+/// Select the function calculating only the result of the given instruction.
+///
+/// Higher instructions than 1111 == 15 will result in a panic.
+pub fn result_function(instruction: u8) -> AluResultFunction {
+    match RESULT_ONLY.get(instruction as usize) {
+        Some(&function) => function,
+        None => panic!("Invalid alu instruction {}", instruction),
+    }
+}
+
+/// Implementation used to calculate alu instructions.
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub enum AluKernel {
+    /// `Alu::calculate`, which matches on the instruction in every call
+    Reference,
+    /// One function per instruction, selected once when decoding
+    Specialized,
+}
+
+impl AluKernel {
+    /// Select the function calculating the given instruction.
+    ///
+    /// Higher instructions than 1111 == 15 will result in a panic.
+    pub fn function(self, instruction: u8) -> AluFunction {
+        match self {
+            AluKernel::Reference if instruction <= 0b1111 => Alu::calculate,
+            AluKernel::Reference => panic!("Invalid alu instruction {}", instruction),
+            AluKernel::Specialized => match SPECIALIZED.get(instruction as usize) {
+                Some(&function) => function,
+                None => panic!("Invalid alu instruction {}", instruction),
+            }
+        }
+    }
+}
+
+impl Default for AluKernel {
+    fn default() -> AluKernel {
+        AluKernel::Reference
+    }
+}
+
+/// `Alu::calculate` specialized for every instruction
+static SPECIALIZED: [AluFunction; 16] = [
+    specialized::<0b0000>, specialized::<0b0001>, specialized::<0b0010>, specialized::<0b0011>,
+    specialized::<0b0100>, specialized::<0b0101>, specialized::<0b0110>, specialized::<0b0111>,
+    specialized::<0b1000>, specialized::<0b1001>, specialized::<0b1010>, specialized::<0b1011>,
+    specialized::<0b1100>, specialized::<0b1101>, specialized::<0b1110>, specialized::<0b1111>,
+];
+
+/// `Alu::calculate` specialized for every instruction without the flags
+static RESULT_ONLY: [AluResultFunction; 16] = [
+    result_only::<0b0000>, result_only::<0b0001>, result_only::<0b0010>, result_only::<0b0011>,
+    result_only::<0b0100>, result_only::<0b0101>, result_only::<0b0110>, result_only::<0b0111>,
+    result_only::<0b1000>, result_only::<0b1001>, result_only::<0b1010>, result_only::<0b1011>,
+    result_only::<0b1100>, result_only::<0b1101>, result_only::<0b1110>, result_only::<0b1111>,
+];
+
+/// Calculate only the result of the constant instruction `I`, so the flag
+/// calculations are removed completely.
+fn result_only<const I: u8>(a: u8, b: u8, carry: bool) -> u8 {
+    Alu::calculate(I, a, b, carry).0
+}
+
+/// Calculate the constant instruction `I`, ignoring the passed instruction.
+///
+/// Because `Alu::calculate` is inlined with a constant instruction, only the
+/// code of the matching arm and the necessary flag calculations remain.
+fn specialized<const I: u8>(_: u8, a: u8, b: u8, carry: bool) -> (u8, Flags) {
+    Alu::calculate(I, a, b, carry)
+}
+
 impl Alu {
     /// Execute an instruction with two operands on the alu.
     ///
     /// Returns the result and the resulting flags. Higher instructions than
     /// 1111 == 15 will result in a panic.
+    #[inline]
     pub fn calculate(instruction: u8, a: u8, b: u8, carry: bool) -> (u8, Flags) {
         let (result, carry) = match instruction {
             0b0000 => { // hold carry
@@ -185,6 +268,34 @@ mod tests {
         assert_eq!(Alu::calculate(0b1111, 0, b,  true), (b, Flags::new(false, false, false)));
     }
 
+    #[test]
+    fn kernels() {
+        let operands = [0, 1, 0b00101101, 0b01111111, 0b10000000, 0b11010100, 0xFF];
+
+        for instruction in 0..16 {
+            let reference = AluKernel::Reference.function(instruction);
+            let specialized = AluKernel::Specialized.function(instruction);
+            let result_only = result_function(instruction);
+
+            for &a in operands.iter() {
+                for &b in operands.iter() {
+                    for &carry in [false, true].iter() {
+                        let expected = Alu::calculate(instruction, a, b, carry);
+                        assert_eq!(reference(instruction, a, b, carry), expected);
+                        assert_eq!(specialized(instruction, a, b, carry), expected);
+                        assert_eq!(result_only(a, b, carry), expected.0);
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    #[should_panic(expected = "Invalid alu instruction")]
+    fn invalid_kernel_instruction() {
+        AluKernel::Specialized.function(0b10000);
+    }
+
     #[test]
     #[should_panic(expected = "Invalid alu instruction")]
     fn invalid_instruction() {
@@ -0,0 +1,313 @@
+//! Pre-assembled binary programs of the 2i.
+//!
+//! This module contains a compact binary format for programs, which can be
+//! loaded without parsing the text representation again.
+//!
+//! A binary program starts with a 12 byte header (`2ibp`, the version, a
+//! byte of flags, two reserved bytes and a FNV-1a checksum of everything
+//! after the header as little endian `u32`). It is followed by the 32
+//! instructions packed into 25 bits each (100 bytes, least significant bit
+//! first). If the corresponding flags are set, a bitmap of the reachable
+//! addresses (`u32`) and the source line of every instruction (32 × `u32`,
+//! 0 for addresses without an instruction) follow.
+
+use std::io::Write;
+
+use super::{Error, Result};
+use super::cfg::Cfg;
+use super::instruction::Instruction;
+use super::parse::parse_source;
+
+const MAGIC: &[u8; 4] = b"2ibp";
+const VERSION: u8 = 1;
+const HEADER_SIZE: usize = 12;
+const INSTRUCTIONS_SIZE: usize = 32 * 25 / 8;
+
+const FLAG_REACHABLE: u8 = 0b01;
+const FLAG_LINES: u8 = 0b10;
+
+/// Program with the optional information of the binary format.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::binary::BinaryProgram;
+/// use emulator::parse::parse_program;
+///
+/// let source = b"00 00001 00 000 0101 01 01 1100 0\n00 00000 00 000 0000 01 00 0100 0\n";
+/// let assembled = BinaryProgram::assemble(source).unwrap();
+///
+/// let mut binary = Vec::new();
+/// assembled.write(&mut binary).unwrap();
+/// assert!(BinaryProgram::is_binary(&binary));
+///
+/// let loaded = BinaryProgram::read(&binary).unwrap();
+/// assert_eq!(loaded.instructions, parse_program(source).unwrap());
+/// assert_eq!(loaded.reachable_program().unwrap().len(), 2);
+/// assert_eq!(loaded.lines.unwrap()[1], 2);
+/// ```
+#[derive(Clone, Debug, PartialEq)]
+pub struct BinaryProgram {
+    /// All instructions (missing ones are self-looping like in `read_program`)
+    pub instructions: [Instruction; 32],
+    /// Bitmap of the addresses reachable from address 0
+    ///
+    /// Not available for programs without an instruction at address 0.
+    pub reachable: Option<u32>,
+    /// Source line of every instruction (0 for missing instructions)
+    pub lines: Option<[u32; 32]>,
+}
+
+impl BinaryProgram {
+    /// Parse the text representation of a program (see `parse::read_program`)
+    /// including the reachable addresses and source lines.
+    pub fn assemble(source: &[u8]) -> Result<BinaryProgram> {
+        let (parsed, lines) = parse_source(source)?;
+
+        let mut instructions = [Instruction::default(); 32];
+        for (address, instruction) in instructions.iter_mut().enumerate() {
+            *instruction = parsed[address]
+                .unwrap_or_else(|| Instruction::new_looping(address).unwrap());
+        }
+
+        let reachable = if parsed[0].is_some() {
+            Some(Cfg::new(&instructions).reachable().fold(0u32, |bitmap, address| {
+                bitmap | 1 << address
+            }))
+        } else {
+            None
+        };
+
+        Ok(BinaryProgram {
+            instructions: instructions,
+            reachable: reachable,
+            lines: Some(lines),
+        })
+    }
+
+    /// Check if the given bytes start like a binary program.
+    pub fn is_binary(bytes: &[u8]) -> bool {
+        bytes.len() >= MAGIC.len() && &bytes[..MAGIC.len()] == MAGIC
+    }
+
+    /// Load a binary program or parse the text representation, depending on
+    /// the content.
+    pub fn load(bytes: &[u8]) -> Result<BinaryProgram> {
+        if BinaryProgram::is_binary(bytes) {
+            BinaryProgram::read(bytes)
+        } else {
+            BinaryProgram::assemble(bytes)
+        }
+    }
+
+    /// Read a binary program and verify its checksum.
+    pub fn read(bytes: &[u8]) -> Result<BinaryProgram> {
+        if bytes.len() < HEADER_SIZE + INSTRUCTIONS_SIZE || ! BinaryProgram::is_binary(bytes) {
+            return Err(Error::Parse("Invalid binary program"));
+        }
+        if bytes[4] != VERSION {
+            return Err(Error::Parse("Unsupported binary program version"));
+        }
+
+        let flags = bytes[5];
+        let size = HEADER_SIZE + INSTRUCTIONS_SIZE
+            + if flags & FLAG_REACHABLE != 0 { 4 } else { 0 }
+            + if flags & FLAG_LINES != 0 { 32 * 4 } else { 0 };
+        if bytes.len() != size {
+            return Err(Error::Parse("Invalid binary program size"));
+        }
+        if read_u32(&bytes[8..]) != checksum(&bytes[HEADER_SIZE..]) {
+            return Err(Error::Parse("Invalid binary program checksum"));
+        }
+
+        // Unpack the instructions
+        let mut instructions = [Instruction::default(); 32];
+        let (mut buffer, mut bits) = (0u64, 0);
+        let mut packed = bytes[HEADER_SIZE..].iter();
+        for instruction in instructions.iter_mut() {
+            while bits < 25 {
+                buffer |= (*packed.next().unwrap() as u64) << bits;
+                bits += 8;
+            }
+            *instruction = Instruction::new(buffer as u32 & 0x1FFFFFF)?;
+            buffer >>= 25;
+            bits -= 25;
+        }
+
+        let mut offset = HEADER_SIZE + INSTRUCTIONS_SIZE;
+        let reachable = if flags & FLAG_REACHABLE != 0 {
+            offset += 4;
+            Some(read_u32(&bytes[offset - 4..]))
+        } else {
+            None
+        };
+        let lines = if flags & FLAG_LINES != 0 {
+            let mut lines = [0; 32];
+            for (i, line) in lines.iter_mut().enumerate() {
+                *line = read_u32(&bytes[offset + 4 * i..]);
+            }
+            Some(lines)
+        } else {
+            None
+        };
+
+        Ok(BinaryProgram {
+            instructions: instructions,
+            reachable: reachable,
+            lines: lines,
+        })
+    }
+
+    /// Write the program in the binary format.
+    pub fn write<W: Write>(&self, mut writer: W) -> Result<()> {
+        let mut body = Vec::with_capacity(INSTRUCTIONS_SIZE + 4 + 32 * 4);
+
+        // Pack the instructions
+        let (mut buffer, mut bits) = (0u64, 0);
+        for instruction in self.instructions.iter() {
+            buffer |= (instruction.get_instruction() as u64) << bits;
+            bits += 25;
+            while bits >= 8 {
+                body.push(buffer as u8);
+                buffer >>= 8;
+                bits -= 8;
+            }
+        }
+
+        let mut flags = 0;
+        if let Some(reachable) = self.reachable {
+            flags |= FLAG_REACHABLE;
+            body.extend_from_slice(&reachable.to_le_bytes());
+        }
+        if let Some(lines) = self.lines {
+            flags |= FLAG_LINES;
+            for line in lines.iter() {
+                body.extend_from_slice(&line.to_le_bytes());
+            }
+        }
+
+        writer.write_all(MAGIC)?;
+        writer.write_all(&[VERSION, flags, 0, 0])?;
+        writer.write_all(&checksum(&body).to_le_bytes())?;
+        writer.write_all(&body)?;
+        Ok(())
+    }
+
+    /// Return only the reachable instructions like
+    /// `parse::read_reachable_program`.
+    pub fn reachable_program(&self) -> Result<Vec<(u8, Instruction)>> {
+        let reachable = self.reachable_addresses()?;
+        Ok((0..32).filter(|address| reachable & 1 << address != 0).map(|address| {
+            (address, self.instructions[address as usize])
+        }).collect())
+    }
+
+    /// Return the bitmap of the reachable addresses.
+    ///
+    /// Uses the stored bitmap if available and finds the reachable addresses
+    /// otherwise. Fails for programs that are known to have no instruction
+    /// at address 0.
+    pub fn reachable_addresses(&self) -> Result<u32> {
+        match (self.reachable, self.lines) {
+            (Some(reachable), _) => Ok(reachable),
+            (None, Some(lines)) if lines[0] == 0 => Err(Error::Parse("No instruction reachable")),
+            (None, _) => Ok(Cfg::new(&self.instructions).reachable().fold(0u32, |bitmap, address| {
+                bitmap | 1 << address
+            })),
+        }
+    }
+
+    /// Remove the optional reachable addresses and source lines.
+    pub fn strip(&mut self) {
+        self.reachable = None;
+        self.lines = None;
+    }
+}
+
+/// 32 bit FNV-1a hash of the given bytes
+fn checksum(bytes: &[u8]) -> u32 {
+    bytes.iter().fold(0x811C9DC5, |hash, &byte| {
+        (hash ^ byte as u32).wrapping_mul(0x01000193)
+    })
+}
+
+fn read_u32(bytes: &[u8]) -> u32 {
+    u32::from_le_bytes([bytes[0], bytes[1], bytes[2], bytes[3]])
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parse::{parse_program, parse_reachable_program};
+
+    static MULTIPLY: &[u8] = b"# Multiplication: (FE) = (FC) * (FD)
+
+        00000: 00 00001 00 000 1100 01 01 1100 0
+        00001: 00 00010 01 000 0000 01 10 0001 0
+        00010: 00 00011 00 001 1101 01 01 1100 0
+        00011: 00 00100 01 001 0000 01 10 0001 0
+        00100: 00 00101 00 010 0000 01 00 0011 0
+        00101: 10 00111 00 000 0000 00 00 0001 0
+        00110: 00 01000 00 000 1111 01 01 0100 0
+        00111: 00 01001 00 001 1110 01 01 1100 0
+        01000: 00 00101 00 010 0001 01 00 0100 0
+        01001: 00 00000 11 001 0010 00 00 1100 0
+        11111: 11 11111 11 111 1111 11 11 1111 1";
+
+    #[test]
+    fn roundtrip() {
+        let assembled = BinaryProgram::assemble(MULTIPLY).unwrap();
+        assert_eq!(assembled.instructions, parse_program(MULTIPLY).unwrap());
+        assert_eq!(assembled.lines.unwrap()[0], 3);
+        assert_eq!(assembled.lines.unwrap()[10], 0);
+        assert_eq!(assembled.lines.unwrap()[31], 13);
+
+        let mut binary = Vec::new();
+        assembled.write(&mut binary).unwrap();
+        assert_eq!(binary.len(), HEADER_SIZE + INSTRUCTIONS_SIZE + 4 + 32 * 4);
+        let loaded = BinaryProgram::load(&binary).unwrap();
+        assert_eq!(loaded, assembled);
+        assert_eq!(loaded.reachable_program().unwrap(),
+                   parse_reachable_program(MULTIPLY).unwrap());
+
+        // Without the optional parts the reachable addresses are calculated
+        let mut stripped = assembled.clone();
+        stripped.strip();
+        let mut binary = Vec::new();
+        stripped.write(&mut binary).unwrap();
+        assert_eq!(binary.len(), HEADER_SIZE + INSTRUCTIONS_SIZE);
+        let loaded = BinaryProgram::load(&binary).unwrap();
+        assert_eq!(loaded, stripped);
+        assert_eq!(loaded.reachable_program().unwrap(),
+                   parse_reachable_program(MULTIPLY).unwrap());
+    }
+
+    #[test]
+    fn invalid() {
+        let mut binary = Vec::new();
+        BinaryProgram::assemble(MULTIPLY).unwrap().write(&mut binary).unwrap();
+
+        let mut corrupted = binary.clone();
+        corrupted[20] ^= 1;
+        match BinaryProgram::read(&corrupted) {
+            Err(Error::Parse("Invalid binary program checksum")) => (),
+            _ => panic!("Corrupted program not detected"),
+        }
+
+        match BinaryProgram::read(&binary[..binary.len() - 1]) {
+            Err(Error::Parse("Invalid binary program size")) => (),
+            _ => panic!("Truncated program not detected"),
+        }
+
+        let mut version = binary.clone();
+        version[4] = 2;
+        match BinaryProgram::read(&version) {
+            Err(Error::Parse("Unsupported binary program version")) => (),
+            _ => panic!("Unknown version not detected"),
+        }
+
+        // Text programs are still parsed
+        assert!(BinaryProgram::load(b"11111: 00 00000 00 000 0000 00 00 0000 0").unwrap()
+            .reachable_program().is_err());
+    }
+}
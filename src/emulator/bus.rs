@@ -14,12 +14,31 @@ pub trait Bus {
     fn write(&self, address: u8, value: u8) -> Result<()>;
 }
 
+/// Bus of the 2i with exclusive access.
+///
+/// Like `Bus`, but requires exclusive access for reading and writing, which
+/// allows implementations without interior mutability. Every `Bus` is also
+/// a `BusMut`, so the cpu only has to support this trait.
+pub trait BusMut {
+    fn read(&mut self, address: u8) -> Result<u8>;
+    fn write(&mut self, address: u8, value: u8) -> Result<()>;
+}
+
+impl<B: Bus + ?Sized> BusMut for B {
+    fn read(&mut self, address: u8) -> Result<u8> {
+        Bus::read(self, address)
+    }
+    fn write(&mut self, address: u8, value: u8) -> Result<()> {
+        Bus::write(self, address, value)
+    }
+}
+
 /// Ram of the 2i.
 ///
 /// Represents the 8 bit ram of the 2i.
 pub struct Ram<'a> {
     memory: RefCell<[u8; 256]>,
-    overlays: Vec<(u8, u8, &'a dyn Bus)>,
+    overlays: [Option<&'a dyn Bus>; 256],
 }
 
 impl<'a> Ram<'a> {
@@ -33,14 +52,36 @@ impl<'a> Ram<'a> {
         &self.memory
     }
 
+    /// Copy of the ram (without the overlays).
+    pub fn snapshot(&self) -> [u8; 256] {
+        *self.memory.borrow()
+    }
+
+    /// Replace the ram (without the overlays) with a snapshot.
+    pub fn restore(&self, snapshot: &[u8; 256]) {
+        *self.memory.borrow_mut() = *snapshot;
+    }
+
     /// Add a bus as an overlay to the ram.
     ///
     /// When a read or write lies in the given (inclusive) range, the request
-    /// is forwarded to the given bus. All overlays are checked in the order
-    /// they were added.
+    /// is forwarded to the given bus. Addresses that are already covered by
+    /// an earlier overlay keep using it.
+    ///
+    /// The overlay is stored for every address in the range, so dispatching
+    /// a request costs a single lookup regardless of the number of overlays.
     pub fn add_overlay(&mut self, first_address: u8, last_address: u8,
         overlay_bus: &'a dyn Bus) {
-        self.overlays.push((first_address, last_address, overlay_bus));
+        if first_address > last_address {
+            return;
+        }
+
+        let range = first_address as usize..=last_address as usize;
+        for overlay in self.overlays[range].iter_mut() {
+            if overlay.is_none() {
+                *overlay = Some(overlay_bus);
+            }
+        }
     }
 }
 
@@ -48,30 +89,26 @@ impl<'a> Default for Ram<'a> {
     fn default() -> Ram<'a> {
         Ram {
             memory: RefCell::new([0; 256]),
-            overlays: Default::default(),
+            overlays: [None; 256],
         }
     }
 }
 
 impl<'a> Bus for Ram<'a> {
     fn read(&self, address: u8) -> Result<u8> {
-        for &(first_address, last_address, bus) in self.overlays.iter() {
-            if address >= first_address && address <= last_address {
-                return bus.read(address);
-            }
+        match self.overlays[address as usize] {
+            Some(bus) => bus.read(address),
+            None => Ok(self.memory.borrow()[address as usize]),
         }
-
-        Ok(self.memory.borrow()[address as usize])
     }
     fn write(&self, address: u8, value: u8) -> Result<()> {
-        for &(first_address, last_address, bus) in self.overlays.iter() {
-            if address >= first_address && address <= last_address {
-                return bus.write(address, value);
+        match self.overlays[address as usize] {
+            Some(bus) => bus.write(address, value),
+            None => {
+                self.memory.borrow_mut()[address as usize] = value;
+                Ok(())
             }
         }
-
-        self.memory.borrow_mut()[address as usize] = value;
-        Ok(())
     }
 }
 
@@ -123,6 +160,130 @@ impl Bus for IoRegisters {
     }
 }
 
+/// Ram of the 2i with the input and output registers at FC-FF.
+///
+/// Behaves exactly like a `Ram` with an `IoRegisters` overlay at FC-FF, but
+/// only implements `BusMut` and therefore needs no `RefCell`s or dynamic
+/// dispatch.
+#[derive(Clone, Debug, PartialEq)]
+pub struct IoRam {
+    pub(crate) memory: [u8; 256],
+    pub(crate) input: [u8; 4],
+    pub(crate) output: [u8; 2],
+}
+
+impl IoRam {
+    /// Create a new ram with all addresses and registers initialised to zero.
+    pub fn new() -> IoRam {
+        IoRam::default()
+    }
+
+    /// Direct access to the ram (addresses FC-FF are never used).
+    pub fn inspect(&mut self) -> &mut [u8; 256] {
+        &mut self.memory
+    }
+
+    /// Direct access to the input registers.
+    pub fn inspect_input(&mut self) -> &mut [u8; 4] {
+        &mut self.input
+    }
+
+    /// Direct access to the output registers.
+    pub fn inspect_output(&mut self) -> &mut [u8; 2] {
+        &mut self.output
+    }
+
+    /// Value that a write to the given address would overwrite (ram or
+    /// output register).
+    pub fn peek(&self, address: u8) -> u8 {
+        if address >= 0xFE {
+            self.output[(address - 0xFE) as usize]
+        } else {
+            self.memory[address as usize]
+        }
+    }
+
+    /// Set the value that `peek` returns for the given address without the
+    /// checks of a bus write.
+    pub fn poke(&mut self, address: u8, value: u8) {
+        if address >= 0xFE {
+            self.output[(address - 0xFE) as usize] = value;
+        } else {
+            self.memory[address as usize] = value;
+        }
+    }
+}
+
+impl Default for IoRam {
+    fn default() -> IoRam {
+        IoRam {
+            memory: [0; 256],
+            input: [0; 4],
+            output: [0; 2],
+        }
+    }
+}
+
+impl BusMut for IoRam {
+    fn read(&mut self, address: u8) -> Result<u8> {
+        if address >= 0xFC {
+            Ok(self.input[(address - 0xFC) as usize])
+        } else {
+            Ok(self.memory[address as usize])
+        }
+    }
+    fn write(&mut self, address: u8, value: u8) -> Result<()> {
+        if address < 0xFC {
+            self.memory[address as usize] = value;
+            Ok(())
+        } else if address >= 0xFE {
+            self.output[(address - 0xFE) as usize] = value;
+            Ok(())
+        } else {
+            Err(Error::Bus("Cannot write to input register"))
+        }
+    }
+}
+
+/// Bus with a device at the addresses `FIRST` to `LAST` in front of another
+/// bus (eg: an `IoRam`).
+///
+/// The addresses are resolved at compile time and the device is owned, so
+/// their combination needs neither dynamic dispatch nor lifetimes, unlike
+/// the overlays of `Ram`. Several devices can be stacked.
+pub struct Mapped<D, const FIRST: u8, const LAST: u8, B = IoRam> {
+    pub device: D,
+    pub inner: B,
+}
+
+impl<D, B, const FIRST: u8, const LAST: u8> Mapped<D, FIRST, LAST, B> {
+    pub fn new(device: D, inner: B) -> Mapped<D, FIRST, LAST, B> {
+        Mapped {
+            device: device,
+            inner: inner,
+        }
+    }
+}
+
+impl<D: BusMut, B: BusMut, const FIRST: u8, const LAST: u8> BusMut for Mapped<D, FIRST, LAST, B> {
+    #[inline]
+    fn read(&mut self, address: u8) -> Result<u8> {
+        if address >= FIRST && address <= LAST {
+            self.device.read(address)
+        } else {
+            self.inner.read(address)
+        }
+    }
+    #[inline]
+    fn write(&mut self, address: u8, value: u8) -> Result<()> {
+        if address >= FIRST && address <= LAST {
+            self.device.write(address, value)
+        } else {
+            self.inner.write(address, value)
+        }
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -179,6 +340,33 @@ mod tests {
         assert_eq!(base.inspect().borrow()[0..5], [42, 43, 0, 0, 46]);
     }
 
+    #[test]
+    fn overlay_order() {
+        let first = Ram::new();
+        let second = Ram::new();
+        let mut base = Ram::new();
+
+        base.add_overlay(0x10, 0x1F, &first);
+        base.add_overlay(0x18, 0x27, &second);
+        base.add_overlay(0xFF, 0xFF, &second);
+        base.add_overlay(0x31, 0x30, &second); // empty range
+
+        for address in 0x00..=0xFF {
+            base.write(address, address).unwrap();
+        }
+
+        assert_eq!(first.inspect().borrow()[0x0F..0x21], (0x0F..0x21).map(|a| {
+            if a >= 0x10 && a <= 0x1F { a } else { 0 }
+        }).collect::<Vec<u8>>()[..]);
+        assert_eq!(second.inspect().borrow()[0x1F..0x29], [0, 0x20, 0x21, 0x22,
+            0x23, 0x24, 0x25, 0x26, 0x27, 0]);
+        assert_eq!(second.inspect().borrow()[0x30..0x32], [0, 0]);
+        assert_eq!(second.inspect().borrow()[0xFF], 0xFF);
+        assert_eq!(base.inspect().borrow()[0x10..0x28], [0; 0x18]);
+        assert_eq!(base.inspect().borrow()[0x30..0x32], [0x30, 0x31]);
+        assert_eq!(base.inspect().borrow()[0xFF], 0);
+    }
+
     #[test]
     fn io_register() {
         let io = IoRegisters::new();
@@ -202,4 +390,31 @@ mod tests {
         assert!(io.write(0xFC, 0).is_err());
         assert!(io.write(0xFD, 0).is_err());
     }
+
+    #[test]
+    fn io_ram() {
+        // Both variants must behave identically
+        let io = IoRegisters::new();
+        let mut shared = Ram::new();
+        shared.add_overlay(0xFC, 0xFF, &io);
+        let mut exclusive = IoRam::new();
+
+        io.inspect_input().borrow_mut().clone_from_slice(&[42, 43, 44, 45]);
+        exclusive.inspect_input().clone_from_slice(&[42, 43, 44, 45]);
+
+        for address in 0x00..=0xFF {
+            let value = address ^ 0b10101010;
+            assert_eq!(BusMut::write(&mut shared, address, value).is_ok(),
+                       exclusive.write(address, value).is_ok());
+        }
+        for address in 0x00..=0xFF {
+            assert_eq!(BusMut::read(&mut shared, address).unwrap(),
+                       exclusive.read(address).unwrap());
+        }
+
+        assert_eq!(shared.inspect().borrow()[..0xFC], exclusive.inspect()[..0xFC]);
+        assert_eq!(*io.inspect_output().borrow(), *exclusive.inspect_output());
+        assert!(exclusive.write(0xFC, 0).is_err());
+        assert!(exclusive.write(0xFD, 0).is_err());
+    }
 }
@@ -0,0 +1,397 @@
+//! Control flow graph of programs.
+//!
+//! This module contains the control flow graph of a program, which is used to
+//! determine the reachable instructions, its basic blocks and which registers
+//! and flags are still needed after each instruction.
+
+use super::alu::Flags;
+use super::instruction::{decode_program, AddressControl, AluInputA, AluInputB,
+    DecodedInstruction, Instruction};
+
+/// Condition under which an edge of the control flow graph is taken.
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub enum Condition {
+    /// Unconditional jump (`MAC = 00`)
+    Always,
+    /// The source of the address control (eg the zero flag) has the value
+    If(AddressControl, bool),
+}
+
+/// Possible transition from one instruction to the next.
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub struct Edge {
+    pub source: u8,
+    pub target: u8,
+    pub condition: Condition,
+}
+
+/// Registers and flags whose values may still be read later.
+#[derive(Copy, Clone, Debug, Default, Eq, PartialEq)]
+pub struct Liveness {
+    /// Bitmask of the registers (bit i for register Ri)
+    pub registers: u8,
+    /// Carry of the flag register (the only stored flag that can be read)
+    pub carry: bool,
+}
+
+/// Sequence of instructions that is always executed completely.
+///
+/// Only the first instruction is the target of jumps from other blocks and
+/// only the last one can jump to other blocks.
+#[derive(Clone, Debug)]
+pub struct BasicBlock {
+    /// Addresses of the instructions in execution order
+    pub addresses: Vec<u8>,
+    /// Edges from the last instruction to the following blocks
+    pub edges: Vec<Edge>,
+    /// Flags read by the instructions, either from the flag register or from
+    /// the result of the alu for conditional jumps
+    pub flag_uses: Flags,
+    pub live_in: Liveness,
+    pub live_out: Liveness,
+}
+
+/// Control flow graph of the instructions reachable from address 0.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::cfg::{Cfg, Condition};
+/// use emulator::instruction::AddressControl;
+/// use emulator::Instruction;
+///
+/// // 0: JMP 1; 1: R0 = R0 + 1; ZO 0001Z; 2: JMP 1; 3: LOOP
+/// let mut program = [Instruction::default(); 32];
+/// program[0] = Instruction::new(0b00_00001_00_000_0000_00_00_0000_0).unwrap();
+/// program[1] = Instruction::new(0b10_00011_00_000_0001_01_01_0100_0).unwrap();
+/// program[2] = Instruction::new(0b00_00001_00_000_0000_00_00_0000_0).unwrap();
+/// program[3] = Instruction::new(0b00_00011_00_000_0000_00_00_0000_0).unwrap();
+///
+/// let cfg = Cfg::new(&program);
+/// assert_eq!(cfg.reachable().collect::<Vec<_>>(), vec![0, 1, 2, 3]);
+/// assert_eq!(cfg.blocks().len(), 4);
+///
+/// let edges: Vec<_> = cfg.successors(1).map(|edge| edge.condition).collect();
+/// assert_eq!(edges, vec![Condition::If(AddressControl::Zero, false),
+///                        Condition::If(AddressControl::Zero, true)]);
+/// ```
+#[derive(Clone, Debug)]
+pub struct Cfg {
+    /// Bitmask of the reachable addresses
+    reachable: u32,
+    /// Outgoing edges of every reachable instruction
+    successors: [[Option<Edge>; 2]; 32],
+    /// Bitmask of the predecessors of every instruction
+    predecessors: [u32; 32],
+    blocks: Vec<BasicBlock>,
+    /// Index of the block of every reachable instruction
+    block_of: [Option<usize>; 32],
+    decoded: [DecodedInstruction; 32],
+}
+
+impl Cfg {
+    /// Build the control flow graph of the given program.
+    pub fn new(program: &[Instruction; 32]) -> Cfg {
+        let mut cfg = Cfg {
+            reachable: 0,
+            successors: [[None; 2]; 32],
+            predecessors: [0; 32],
+            blocks: Vec::new(),
+            block_of: [None; 32],
+            decoded: decode_program(program),
+        };
+
+        cfg.traverse();
+        cfg.build_blocks();
+        cfg.analyse_liveness();
+
+        cfg
+    }
+
+    /// Check if the instruction at the given address is reachable.
+    pub fn is_reachable(&self, address: usize) -> bool {
+        address < 32 && self.reachable & 1 << address != 0
+    }
+
+    /// All reachable addresses in ascending order.
+    pub fn reachable(&self) -> impl Iterator<Item = u8> + '_ {
+        (0..32).filter(move |&address| self.is_reachable(address as usize))
+    }
+
+    /// Outgoing edges of the instruction at the given address (none if it is
+    /// not reachable).
+    pub fn successors(&self, address: usize) -> impl Iterator<Item = &Edge> {
+        self.successors[address & 0b11111].iter().flatten()
+    }
+
+    /// Reachable instructions that can be executed directly before the given
+    /// address.
+    pub fn predecessors(&self, address: usize) -> impl Iterator<Item = u8> {
+        let predecessors = self.predecessors[address & 0b11111];
+        (0..32).filter(move |&source| predecessors & 1 << source != 0)
+    }
+
+    /// The basic blocks, the first one starts at address 0.
+    pub fn blocks(&self) -> &[BasicBlock] {
+        &self.blocks
+    }
+
+    /// The basic block containing the given address.
+    pub fn block_of(&self, address: usize) -> Option<&BasicBlock> {
+        self.block_of[address & 0b11111].map(|block| &self.blocks[block])
+    }
+
+    /// Registers and flags that may still be read after the instruction at
+    /// the given address was executed.
+    ///
+    /// If the carry is not live after an instruction that stores the flags,
+    /// storing them has no effect on the program.
+    pub fn live_after(&self, address: usize) -> Liveness {
+        let block = match self.block_of(address) {
+            Some(block) => block,
+            None => return Liveness::default(),
+        };
+
+        let mut live = block.live_out;
+        for &inner in block.addresses.iter().rev() {
+            if inner as usize == address & 0b11111 {
+                break;
+            }
+            live = transfer(&self.decoded[inner as usize], live);
+        }
+        live
+    }
+
+    /// Find all reachable instructions and their edges using a worklist
+    fn traverse(&mut self) {
+        let mut worklist = vec![0u8];
+        self.reachable = 1;
+
+        while let Some(source) = worklist.pop() {
+            let inst = &self.decoded[source as usize];
+
+            self.successors[source as usize] = match inst.address_control {
+                AddressControl::Jump => [Some(Edge {
+                    source: source,
+                    target: inst.next_address,
+                    condition: Condition::Always,
+                }), None],
+                control => [false, true].map(|value| Some(Edge {
+                    source: source,
+                    target: inst.next_address | value as u8,
+                    condition: Condition::If(control, value),
+                })),
+            };
+
+            for edge in self.successors[source as usize].iter().flatten() {
+                self.predecessors[edge.target as usize] |= 1 << source;
+                if self.reachable & 1 << edge.target == 0 {
+                    self.reachable |= 1 << edge.target;
+                    worklist.push(edge.target);
+                }
+            }
+        }
+    }
+
+    /// Check if the given address starts a basic block
+    fn is_leader(&self, address: usize) -> bool {
+        let predecessors = self.predecessors[address];
+
+        // Other instructions have exactly one predecessor which always jumps
+        // to them, so they continue the block of the predecessor
+        address == 0 || predecessors.count_ones() != 1 ||
+            self.successors[predecessors.trailing_zeros() as usize][1].is_some()
+    }
+
+    /// Split the reachable instructions into basic blocks
+    fn build_blocks(&mut self) {
+        for start in 0..32 {
+            if !self.is_reachable(start) || !self.is_leader(start) {
+                continue;
+            }
+
+            let mut addresses = vec![start as u8];
+            let mut last = start;
+            loop {
+                let mut successors = self.successors(last);
+                let next = match (successors.next(), successors.next()) {
+                    (Some(edge), None) => edge.target as usize,
+                    _ => break,
+                };
+                if self.is_leader(next) {
+                    break;
+                }
+                addresses.push(next as u8);
+                last = next;
+            }
+
+            let mut flag_uses = (false, false, false);
+            for &address in &addresses {
+                let inst = &self.decoded[address as usize];
+                flag_uses.0 |= reads_carry(inst) || inst.address_control == AddressControl::Carry;
+                flag_uses.1 |= inst.address_control == AddressControl::Negative;
+                flag_uses.2 |= inst.address_control == AddressControl::Zero;
+            }
+
+            for &address in &addresses {
+                self.block_of[address as usize] = Some(self.blocks.len());
+            }
+            self.blocks.push(BasicBlock {
+                edges: self.successors(last).cloned().collect(),
+                addresses: addresses,
+                flag_uses: Flags::new(flag_uses.0, flag_uses.1, flag_uses.2),
+                live_in: Liveness::default(),
+                live_out: Liveness::default(),
+            });
+        }
+    }
+
+    /// Calculate the live registers and flags of all blocks using a worklist
+    fn analyse_liveness(&mut self) {
+        let mut worklist: Vec<usize> = (0..self.blocks.len()).collect();
+
+        while let Some(index) = worklist.pop() {
+            let block = &self.blocks[index];
+
+            let mut live_out = Liveness::default();
+            for edge in &block.edges {
+                let successor = &self.blocks[self.block_of[edge.target as usize].unwrap()];
+                live_out.registers |= successor.live_in.registers;
+                live_out.carry |= successor.live_in.carry;
+            }
+
+            let live_in = block.addresses.iter().rev().fold(live_out, |live, &address| {
+                transfer(&self.decoded[address as usize], live)
+            });
+
+            let changed = live_in != block.live_in;
+            let first = block.addresses[0] as usize;
+            self.blocks[index].live_in = live_in;
+            self.blocks[index].live_out = live_out;
+
+            // The predecessors have to be updated if the input changed
+            if changed {
+                for predecessor in self.predecessors(first) {
+                    let predecessor = self.block_of[predecessor as usize].unwrap();
+                    if !worklist.contains(&predecessor) {
+                        worklist.push(predecessor);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Check if the instruction reads the carry of the flag register
+fn reads_carry(inst: &DecodedInstruction) -> bool {
+    match inst.alu_instruction {
+        0b0000 | 0b0110 | 0b0111 | 0b1010 | 0b1110 | 0b1111 => true,
+        _ => inst.address_control == AddressControl::StoredCarry,
+    }
+}
+
+/// Calculate the liveness before the instruction from the one after it
+fn transfer(inst: &DecodedInstruction, mut live: Liveness) -> Liveness {
+    // The bus address is read after the result was written to the register
+    if let Some(address) = inst.write_bus {
+        live.registers |= 1 << address;
+    }
+    if let Some(address) = inst.write_register {
+        live.registers &= !(1 << address);
+    }
+
+    // Registers are only read if the alu uses the input, but bus addresses
+    // are always read
+    let (uses_a, uses_b) = match inst.alu_instruction {
+        0b0011 => (false, false),
+        0b0001 | 0b1000..=0b1011 => (true, false),
+        0b1100..=0b1111 => (false, true),
+        _ => (true, true),
+    };
+    match inst.input_a {
+        AluInputA::Register(address) if uses_a => live.registers |= 1 << address,
+        AluInputA::Bus(address) => live.registers |= 1 << address,
+        _ => (),
+    }
+    match inst.input_b {
+        AluInputB::Register(address) if uses_b => live.registers |= 1 << address,
+        _ => (),
+    }
+
+    // The flags are stored after they were read by the alu and the jump
+    if inst.store_flags {
+        live.carry = false;
+    }
+    live.carry |= reads_carry(inst);
+
+    live
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parse::read_program;
+
+    const MULTIPLY: &[u8] = b"
+        00 00001 00 000 1100 01 01 1100 0
+        00 00010 01 000 0000 01 10 0001 0
+        00 00011 00 001 1101 01 01 1100 0
+        00 00100 01 001 0000 01 10 0001 0
+        00 00101 00 010 0000 01 00 0011 0
+        10 00111 00 000 0000 00 00 0001 0
+        00 01000 00 000 1111 01 01 0100 0
+        00 01001 00 001 1110 01 01 1100 0
+        00 00101 00 010 0001 01 00 0100 0
+        00 00000 11 001 0010 00 00 1100 0";
+
+    #[test]
+    fn blocks() {
+        let cfg = Cfg::new(&read_program(MULTIPLY).unwrap());
+
+        assert_eq!(cfg.reachable().collect::<Vec<_>>(), (0..10).collect::<Vec<_>>());
+        assert!(!cfg.is_reachable(10));
+
+        let blocks: Vec<_> = cfg.blocks().iter().map(|b| b.addresses.clone()).collect();
+        assert_eq!(blocks, vec![vec![0, 1, 2, 3, 4], vec![5], vec![6, 8], vec![7, 9]]);
+
+        let targets: Vec<_> = cfg.block_of(5).unwrap().edges.iter()
+            .map(|edge| (edge.target, edge.condition)).collect();
+        assert_eq!(targets, vec![(6, Condition::If(AddressControl::Zero, false)),
+                                 (7, Condition::If(AddressControl::Zero, true))]);
+        assert_eq!(cfg.block_of(5).unwrap().flag_uses, Flags::new(false, false, true));
+
+        assert_eq!(cfg.predecessors(5).collect::<Vec<_>>(), vec![4, 8]);
+        assert_eq!(cfg.predecessors(0).collect::<Vec<_>>(), vec![9]);
+    }
+
+    #[test]
+    fn liveness() {
+        let cfg = Cfg::new(&read_program(MULTIPLY).unwrap());
+
+        // R0 (counter) and R2 (result) are used in the loop, R1 (second
+        // operand) only while adding
+        assert_eq!(cfg.block_of(5).unwrap().live_in.registers, 0b111);
+        assert_eq!(cfg.block_of(7).unwrap().live_in.registers, 0b100);
+        assert_eq!(cfg.block_of(0).unwrap().live_in.registers, 0);
+        assert_eq!(cfg.live_after(8).registers, 0b111);
+        assert_eq!(cfg.live_after(9).registers, 0);
+
+        // The carry is never read
+        assert!(cfg.blocks().iter().all(|block| !block.live_in.carry));
+    }
+
+    #[test]
+    fn carry_liveness() {
+        // 0: R0 = R0 + R0, store flags; 1: R0 = R0 + 0 + carry; 2: store flags; loop
+        let mut program = [Instruction::default(); 32];
+        program[0] = Instruction::new(0b00_00001_00_000_0000_00_01_0100_1).unwrap();
+        program[1] = Instruction::new(0b00_00010_00_000_0000_01_01_0110_0).unwrap();
+        program[2] = Instruction::new(0b00_00010_00_000_0000_00_01_0100_1).unwrap();
+
+        let cfg = Cfg::new(&program);
+        assert!(cfg.live_after(0).carry);
+        assert!(!cfg.live_after(1).carry);
+        assert!(!cfg.live_after(2).carry);
+        assert!(!cfg.block_of(0).unwrap().live_in.carry);
+    }
+}
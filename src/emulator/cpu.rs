@@ -4,8 +4,10 @@
 
 use super::{Error, Result};
 use super::alu::{Alu, Flags};
-use super::bus::Bus;
-use super::instruction::Instruction;
+use super::bus::BusMut;
+use super::instruction::{AddressControl, AluInputA, AluInputB, DecodedInstruction, Instruction,
+    VerifiedProgram};
+use super::observe::{NoObserver, Observer};
 
 /// Cpu of the 2i.
 ///
@@ -26,12 +28,12 @@ use super::instruction::Instruction;
 /// let _ = cpu.execute_instruction(inst, &mut ram);
 /// assert_eq!(6, cpu.inspect_registers()[0]);
 /// ```
-#[derive(Default)]
+#[derive(Copy, Clone, Debug, Default, PartialEq)]
 pub struct Cpu {
-    registers: [u8; 8],
-    flag_register: Flags,
-    stored_interrupt: bool,
-    volatile_interrupt: bool,
+    pub(crate) registers: [u8; 8],
+    pub(crate) flag_register: Flags,
+    pub(crate) stored_interrupt: bool,
+    pub(crate) volatile_interrupt: bool,
 }
 
 impl Cpu {
@@ -42,7 +44,10 @@ impl Cpu {
 
     /// Execute the given instruction on the cpu using the given, bus, input
     /// and output. Returns the address of the next instruction and the alu flags.
-    pub fn execute_instruction<B: Bus>(&mut self, inst: Instruction, bus: &mut B) -> Result<(usize, Flags)> {
+    ///
+    /// The bus is statically dispatched, so using a `BusMut` without interior
+    /// mutability (like `IoRam`) avoids all runtime borrow checks.
+    pub fn execute_instruction<B: BusMut>(&mut self, inst: Instruction, bus: &mut B) -> Result<(usize, Flags)> {
         // Determine alu input a (bus or register)
         let a = if inst.is_alu_input_a_bus() {
             if ! inst.is_bus_enabled() {
@@ -99,6 +104,96 @@ impl Cpu {
         Ok((next_address as usize, flags))
     }
 
+    /// Execute the given predecoded instruction on the cpu using the given
+    /// bus. Behaves exactly like `execute_instruction`, but without extracting
+    /// the fields of the instruction again.
+    pub fn execute_decoded<B: BusMut>(&mut self, inst: &DecodedInstruction, bus: &mut B) -> Result<(usize, Flags)> {
+        self.execute::<B, _, true>(inst, bus, NoObserver)
+    }
+
+    /// Execute the given predecoded instruction like `execute_decoded` and
+    /// call the hooks of the observer for every change.
+    ///
+    /// The observer is statically dispatched, so only the hooks it
+    /// implements cost anything.
+    pub fn execute_observed<B: BusMut, O: Observer>(&mut self, inst: &DecodedInstruction, bus: &mut B, observer: O) -> Result<(usize, Flags)> {
+        self.execute::<B, O, true>(inst, bus, observer)
+    }
+
+    /// Execute the instruction at the given address of a verified program.
+    ///
+    /// Skips the checks for invalid bus accesses, which were already done for
+    /// all reachable instructions by `parse::verify_program`. Only errors of
+    /// the bus itself are returned, except for unreachable instructions that
+    /// were not verified, which fail like in `execute_decoded`.
+    pub fn execute_verified<B: BusMut>(&mut self, program: &VerifiedProgram, address: usize, bus: &mut B) -> Result<(usize, Flags)> {
+        // Masking the address allows the compiler to omit the bounds check
+        self.execute::<B, _, false>(&program.decoded[address & 0b11111], bus, NoObserver)
+    }
+
+    /// Execute a decoded instruction with or without checking the bus access
+    #[inline(always)]
+    fn execute<B: BusMut, O: Observer, const CHECKED: bool>(&mut self, inst: &DecodedInstruction, bus: &mut B, mut observer: O) -> Result<(usize, Flags)> {
+        // Determine alu input a (bus or register)
+        let a = match inst.input_a {
+            AluInputA::Register(address) => self.registers[address],
+            AluInputA::Bus(address) => {
+                let value = bus.read(self.registers[address])?;
+                observer.bus_read(self.registers[address], value);
+                value
+            }
+            AluInputA::Invalid(error) if CHECKED => return Err(Error::Cpu(error)),
+            AluInputA::Invalid(error) => return unverified(error),
+        };
+
+        // Determine alu input b (constant or register)
+        let b = match inst.input_b {
+            AluInputB::Register(address) => self.registers[address],
+            AluInputB::Constant(constant) => constant,
+        };
+
+        // Calculate result using the alu function selected when decoding
+        let (result, flags) = (inst.alu)(inst.alu_instruction, a, b,
+            self.flag_register.carry());
+
+        // Write result to registers
+        if let Some(address) = inst.write_register {
+            self.registers[address] = result;
+            observer.register_write(address, result);
+        }
+
+        // Write results to the bus
+        if let Some(address) = inst.write_bus {
+            bus.write(self.registers[address], result)?;
+            observer.bus_write(self.registers[address], result);
+        }
+
+        // Calculate the next instruction address
+        let next_address = inst.next_address | match inst.address_control {
+            AddressControl::Jump => 0,
+            AddressControl::VolatileInterrupt => self.volatile_interrupt as u8,
+            AddressControl::StoredCarry => self.flag_register.carry() as u8,
+            AddressControl::Carry => flags.carry() as u8,
+            AddressControl::Zero => flags.zero() as u8,
+            AddressControl::Negative => flags.negative() as u8,
+            AddressControl::StoredInterrupt => self.stored_interrupt as u8,
+        };
+
+        // Store flags in the flag register
+        if inst.store_flags {
+            self.flag_register = flags;
+        }
+
+        // Reset interrupts (stored only if MAC = 111)
+        self.volatile_interrupt = false;
+        if inst.address_control == AddressControl::StoredInterrupt {
+            self.stored_interrupt = false;
+        }
+
+        observer.step(inst, next_address as usize, flags);
+        Ok((next_address as usize, flags))
+    }
+
     /// Enable the volatile interrupt (MAC 010) for the next instruction executed
     pub fn trigger_volatile_interrupt(&mut self) {
         self.volatile_interrupt = true;
@@ -164,12 +259,19 @@ impl Cpu {
     }
 }
 
+/// Error of an unverified instruction executed by `Cpu::execute_verified`,
+/// which is only possible for unreachable addresses
+#[cold]
+fn unverified(error: &'static str) -> Result<(usize, Flags)> {
+    Err(Error::Cpu(error))
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
     use crate::alu::Flags;
     use crate::bus::IoRegisters;
-    use crate::instruction::Instruction;
+    use crate::instruction::{DecodedInstruction, Instruction};
 
     #[test]
     fn address_calculation() {
@@ -266,6 +368,101 @@ mod tests {
         assert_eq!(mult(142, 142, 434), 196);
     }
 
+    #[test]
+    fn decoded_matches_reference() {
+        let program: Vec<_> = [
+            0b00_00001_00_000_1100_01_01_1100_0, // in:  R0 = FC
+            0b00_00010_01_000_0000_01_10_0001_0, //      R0 = (R0)
+            0b00_00011_00_001_1101_01_01_1100_0, //      R1 = FD
+            0b00_00100_01_001_0000_01_10_0001_0, //      R1 = (R1)
+            0b00_00101_00_010_0000_01_00_0011_0, //      R2 = 0
+            0b10_00111_00_000_0000_00_00_0001_1, // tst: TEST R0, ZO; CHFL
+            0b01_01001_00_000_1111_01_01_0100_0, //        R0 = R0 + FF, CF 0100C
+            0b00_01001_00_001_1110_01_01_1100_0, //        R1 = FF, JP out
+            0b00_00101_00_010_0001_01_00_0110_1, // add: R2 = R2 + R1 + C, JP tst; CHFL
+            0b11_00001_11_001_0010_00_00_1100_0, // out: (R1) = R2, INTB 0000I
+            0b00_00000_01_000_0000_01_00_0001_0, //      R0 = (R0) with disabled bus
+        ].iter().map(|&i| Instruction::new(i).unwrap()).collect();
+
+        for &(a, b) in [(0, 0), (3, 7), (22, 12), (142, 142)].iter() {
+            let mut reference = (Cpu::new(), IoRegisters::new(), 0);
+            let mut decoded = (Cpu::new(), IoRegisters::new(), 0);
+            reference.1.inspect_input().borrow_mut()[0..2].clone_from_slice(&[a, b]);
+            decoded.1.inspect_input().borrow_mut()[0..2].clone_from_slice(&[a, b]);
+
+            for step in 0..500 {
+                if step % 7 == 0 {
+                    reference.0.trigger_volatile_interrupt();
+                    decoded.0.trigger_volatile_interrupt();
+                }
+                if step % 11 == 0 {
+                    reference.0.trigger_stored_interrupt();
+                    decoded.0.trigger_stored_interrupt();
+                }
+
+                let inst = program[reference.2 % program.len()];
+                let r1 = reference.0.execute_instruction(inst, &mut reference.1).map(|r| r.0);
+                let r2 = decoded.0.execute_decoded(&DecodedInstruction::new(inst), &mut decoded.1).map(|r| r.0);
+                assert_eq!(format!("{:?}", r1), format!("{:?}", r2));
+
+                reference.2 = r1.unwrap_or(0);
+                decoded.2 = r2.unwrap_or(0);
+                assert!(reference.0 == decoded.0);
+                assert_eq!(*reference.1.inspect_output().borrow(), *decoded.1.inspect_output().borrow());
+            }
+        }
+    }
+
+    #[test]
+    fn verified_matches_decoded() {
+        let program = crate::parse::read_program(&b"\
+            00000: 00 00001 00 000 1100 01 01 1100 0\n\
+            00001: 00 00010 01 000 0000 01 10 0001 0\n\
+            00010: 00 00011 00 001 1101 01 01 1100 0\n\
+            00011: 00 00100 01 001 0000 01 10 0001 0\n\
+            00100: 00 00101 00 010 0000 01 00 0011 0\n\
+            00101: 10 00111 00 000 0000 00 00 0001 0\n\
+            00110: 00 01000 00 000 1111 01 01 0100 0\n\
+            00111: 00 01001 00 001 1110 01 01 1100 0\n\
+            01000: 00 00101 00 010 0001 01 00 0100 0\n\
+            01001: 00 00000 11 001 0010 00 00 1100 0\n\
+        "[..]).unwrap();
+        let verified = crate::parse::verify_program(&program).unwrap();
+
+        let mut decoded = (Cpu::new(), IoRegisters::new(), 0);
+        let mut unchecked = (Cpu::new(), IoRegisters::new(), 0);
+        decoded.1.inspect_input().borrow_mut()[0..2].clone_from_slice(&[22, 11]);
+        unchecked.1.inspect_input().borrow_mut()[0..2].clone_from_slice(&[22, 11]);
+
+        for _ in 0..74 {
+            let inst = DecodedInstruction::new(program[decoded.2]);
+            decoded.2 = decoded.0.execute_decoded(&inst, &mut decoded.1).unwrap().0;
+            unchecked.2 = unchecked.0.execute_verified(&verified, unchecked.2, &mut unchecked.1).unwrap().0;
+
+            assert_eq!(decoded.2, unchecked.2);
+            assert!(decoded.0 == unchecked.0);
+        }
+        assert_eq!(unchecked.1.inspect_output().borrow()[0], 242);
+    }
+
+    #[test]
+    fn verified_unreachable_instruction() {
+        // Address 00011 reads from the disabled bus, but is never reached
+        let program = crate::parse::read_program(&b"\
+            00000: 00 00001 00 000 1100 01 01 1100 0\n\
+            00001: 00 00000 01 000 0000 01 10 0001 0\n\
+            00011: 00 00011 00 000 0000 01 10 0001 0\n\
+        "[..]).unwrap();
+        let verified = crate::parse::verify_program(&program).unwrap();
+
+        let mut cpu = Cpu::new();
+        let mut io = IoRegisters::new();
+        match cpu.execute_verified(&verified, 0b00011, &mut io) {
+            Err(Error::Cpu("Cannot read from disabled bus")) => (),
+            result => panic!("Unverified instruction executed: {:?}", result.map(|r| r.0)),
+        }
+    }
+
     #[test]
     fn update_flag_register_after_address_calculation() {
         let mut cpu = Cpu::new();
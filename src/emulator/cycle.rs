@@ -0,0 +1,106 @@
+//! Detection of repeating states.
+//!
+//! The 2i is deterministic, so as soon as the complete state of the machine
+//! repeats, all following states repeat as well and continuing the execution
+//! cannot produce any new results.
+
+/// Detector for cycles in a sequence of states.
+///
+/// Uses Brent's algorithm, which only stores a single previous state and
+/// finds the exact length of any cycle at the latest after twice the number
+/// of steps needed to enter it.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::cycle::CycleDetector;
+///
+/// let mut detector = CycleDetector::new(&0);
+/// let mut cycle = None;
+/// for state in [1, 2, 3, 4, 2, 3, 4, 2, 3, 4].iter() {
+///     cycle = cycle.or(detector.check(state));
+/// }
+/// assert_eq!(cycle, Some(3));
+/// ```
+pub struct CycleDetector<S> {
+    saved: S,
+    power: u64,
+    length: u64,
+}
+
+impl<S: Clone + PartialEq> CycleDetector<S> {
+    /// Create a new detector starting at the given state.
+    pub fn new(initial: &S) -> CycleDetector<S> {
+        CycleDetector {
+            saved: initial.clone(),
+            power: 1,
+            length: 0,
+        }
+    }
+
+    /// Check the state after the next step.
+    ///
+    /// Returns the length of the cycle if the state was already seen before.
+    pub fn check(&mut self, state: &S) -> Option<u64> {
+        self.length += 1;
+
+        if *state == self.saved {
+            return Some(self.length);
+        }
+
+        // Move the saved state forward in exponentially growing intervals
+        if self.length == self.power {
+            self.saved = state.clone();
+            self.power *= 2;
+            self.length = 0;
+        }
+
+        None
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Return the step at which the cycle was detected and its length
+    fn detect(start: u32, steps: u32, f: impl Fn(u32) -> u32) -> Option<(u32, u64)> {
+        let mut state = start;
+        let mut detector = CycleDetector::new(&state);
+
+        for step in 1..=steps {
+            state = f(state);
+            if let Some(length) = detector.check(&state) {
+                return Some((step, length));
+            }
+        }
+
+        None
+    }
+
+    #[test]
+    fn fixed_point() {
+        assert_eq!(detect(0, 100, |s| s), Some((1, 1)));
+        assert_eq!(detect(0, 100, |s| (s + 1).min(10)).map(|r| r.1), Some(1));
+    }
+
+    #[test]
+    fn cycles() {
+        for &length in [2, 3, 7, 32, 1000].iter() {
+            for &start in [0, 1, 5, 100].iter() {
+                // Counts up to start and then cycles with the given length
+                let result = detect(0, 10000, |s| {
+                    if s + 1 == start + length { start } else { s + 1 }
+                }).unwrap();
+
+                assert_eq!(result.1, length as u64);
+                assert!(result.0 <= 2 * (start + length) + length);
+            }
+        }
+    }
+
+    #[test]
+    fn no_cycle() {
+        assert_eq!(detect(0, 10000, |s| s + 1), None);
+    }
+}
@@ -0,0 +1,286 @@
+//! Streaming devices for the io registers.
+//!
+//! This module contains buses that connect the input and output registers
+//! to streams, so long executions can be driven by recorded inputs and their
+//! outputs can be captured. They are connected using `Ram::add_overlay`.
+
+use std::cell::{Cell, RefCell};
+use std::io::{self, BufRead, Write};
+
+use super::{Bus, Error, Result};
+
+/// Number of output records that are formatted and written at once
+const BATCH_SIZE: usize = 4096;
+
+/// When an input device continues with the next value of its stream
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Advance {
+    /// Every read returns the next value
+    Read,
+    /// Reads return the same value until `InputDevice::trigger` is called
+    Trigger,
+}
+
+/// Input register that reads its values from a stream (one byte per value).
+///
+/// Any `BufRead` can be used as the source, eg: a buffered file or pipe or a
+/// byte slice of data that is already in memory. Reading after the end of
+/// the stream is an error.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::{Bus, Ram};
+/// use emulator::device::{Advance, InputDevice};
+///
+/// let device = InputDevice::new(&[1u8, 2, 3][..], Advance::Read);
+/// let mut ram = Ram::new();
+/// ram.add_overlay(0xFC, 0xFC, &device);
+///
+/// assert_eq!(ram.read(0xFC).unwrap(), 1);
+/// assert_eq!(ram.read(0xFC).unwrap(), 2);
+/// assert_eq!(ram.read(0xFC).unwrap(), 3);
+/// assert!(ram.read(0xFC).is_err());
+/// ```
+pub struct InputDevice<R> {
+    source: RefCell<R>,
+    advance: Advance,
+    /// Current value if advancing on triggers (None before the first read)
+    value: Cell<Option<u8>>,
+}
+
+impl<R: BufRead> InputDevice<R> {
+    pub fn new(source: R, advance: Advance) -> InputDevice<R> {
+        InputDevice {
+            source: RefCell::new(source),
+            advance: advance,
+            value: Cell::new(None),
+        }
+    }
+
+    /// Continue with the next value of the stream (only for `Advance::Trigger`)
+    pub fn trigger(&self) -> Result<()> {
+        self.value.set(Some(self.next()?));
+        Ok(())
+    }
+
+    fn next(&self) -> Result<u8> {
+        let mut source = self.source.borrow_mut();
+        let value = match source.fill_buf()?.first() {
+            Some(&value) => value,
+            None => return Err(Error::Bus("End of input stream")),
+        };
+        source.consume(1);
+        Ok(value)
+    }
+}
+
+impl<R: BufRead> Bus for InputDevice<R> {
+    fn read(&self, _address: u8) -> Result<u8> {
+        match (self.advance, self.value.get()) {
+            (Advance::Trigger, Some(value)) => Ok(value),
+            (Advance::Trigger, None) => {
+                self.trigger()?;
+                Ok(self.value.get().unwrap())
+            }
+            (Advance::Read, _) => self.next(),
+        }
+    }
+    fn write(&self, _address: u8, _value: u8) -> Result<()> {
+        Err(Error::Bus("Cannot write to input register"))
+    }
+}
+
+/// Output registers (FE and FF) that record every write with its cycle.
+///
+/// Writes are collected and formatted in batches as csv lines
+/// (`cycle,register,value` with hexadecimal registers and values) into the
+/// writer, which should be buffered. The cycle is the number of instructions
+/// executed before the writing one and has to be updated by the caller
+/// using `set_cycle`. Reads of FE and FF return the input registers like
+/// `IoRegisters`.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::{Bus, Ram};
+/// use emulator::device::OutputSink;
+///
+/// let sink = OutputSink::new(Vec::new());
+/// let mut ram = Ram::new();
+/// ram.add_overlay(0xFE, 0xFF, &sink);
+///
+/// sink.set_cycle(3);
+/// ram.write(0xFE, 0x2A).unwrap();
+/// sink.set_cycle(10);
+/// ram.write(0xFF, 0x01).unwrap();
+///
+/// assert_eq!(sink.output(), [0x2A, 0x01]);
+/// let csv = sink.finish().unwrap();
+/// assert_eq!(csv, b"cycle,register,value\n3,FE,2A\n10,FF,01\n");
+/// ```
+pub struct OutputSink<W: Write> {
+    writer: RefCell<W>,
+    cycle: Cell<u64>,
+    input: Cell<[u8; 2]>,
+    output: Cell<[u8; 2]>,
+    /// Cycle, register (0: FE, 1: FF) and value of writes not yet formatted
+    records: RefCell<Vec<(u64, u8, u8)>>,
+    buffer: RefCell<Vec<u8>>,
+    /// First error of the writer, which is returned by `finish`
+    error: RefCell<Option<io::Error>>,
+}
+
+impl<W: Write> OutputSink<W> {
+    pub fn new(writer: W) -> OutputSink<W> {
+        OutputSink {
+            writer: RefCell::new(writer),
+            cycle: Cell::new(0),
+            input: Cell::new([0; 2]),
+            output: Cell::new([0; 2]),
+            records: RefCell::new(Vec::with_capacity(BATCH_SIZE)),
+            buffer: RefCell::new(b"cycle,register,value\n".to_vec()),
+            error: RefCell::new(None),
+        }
+    }
+
+    /// Set the cycle of the following writes
+    pub fn set_cycle(&self, cycle: u64) {
+        self.cycle.set(cycle);
+    }
+
+    /// Set the values of the input registers FE and FF
+    pub fn set_input(&self, input: [u8; 2]) {
+        self.input.set(input);
+    }
+
+    /// Values last written to FE and FF
+    pub fn output(&self) -> [u8; 2] {
+        self.output.get()
+    }
+
+    /// Write all remaining records and return the writer
+    pub fn finish(self) -> io::Result<W> {
+        self.flush();
+        if let Some(error) = self.error.into_inner() {
+            return Err(error);
+        }
+
+        let mut writer = self.writer.into_inner();
+        writer.flush()?;
+        Ok(writer)
+    }
+
+    /// Format all collected records and write them at once
+    fn flush(&self) {
+        let mut buffer = self.buffer.borrow_mut();
+        for (cycle, register, value) in self.records.borrow_mut().drain(..) {
+            write_decimal(&mut buffer, cycle);
+            buffer.extend_from_slice(if register == 0 { b",FE," } else { b",FF," });
+            buffer.push(HEX_DIGITS[(value >> 4) as usize]);
+            buffer.push(HEX_DIGITS[(value & 0xF) as usize]);
+            buffer.push(b'\n');
+        }
+
+        // Later records are dropped after an error
+        if self.error.borrow().is_none() {
+            if let Err(error) = self.writer.borrow_mut().write_all(&buffer) {
+                *self.error.borrow_mut() = Some(error);
+            }
+        }
+        buffer.clear();
+    }
+}
+
+impl<W: Write> Bus for OutputSink<W> {
+    fn read(&self, address: u8) -> Result<u8> {
+        if address >= 0xFE {
+            Ok(self.input.get()[(address - 0xFE) as usize])
+        } else {
+            Err(Error::Bus("Only supports reading from input registers"))
+        }
+    }
+    fn write(&self, address: u8, value: u8) -> Result<()> {
+        if address < 0xFE {
+            return Err(Error::Bus("Only supports writing to output registers"));
+        }
+
+        let register = address - 0xFE;
+        let mut output = self.output.get();
+        output[register as usize] = value;
+        self.output.set(output);
+
+        let full = {
+            let mut records = self.records.borrow_mut();
+            records.push((self.cycle.get(), register, value));
+            records.len() == BATCH_SIZE
+        };
+        if full {
+            self.flush();
+        }
+        Ok(())
+    }
+}
+
+const HEX_DIGITS: &[u8; 16] = b"0123456789ABCDEF";
+
+fn write_decimal(buffer: &mut Vec<u8>, mut number: u64) {
+    let mut digits = [0; 20];
+    let mut length = 0;
+    loop {
+        digits[digits.len() - 1 - length] = b'0' + (number % 10) as u8;
+        length += 1;
+        number /= 10;
+        if number == 0 {
+            break;
+        }
+    }
+    buffer.extend_from_slice(&digits[digits.len() - length..]);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{IoRegisters, Ram};
+
+    #[test]
+    fn trigger() {
+        let device = InputDevice::new(&[5u8, 6][..], Advance::Trigger);
+        assert_eq!(device.read(0xFD).unwrap(), 5);
+        assert_eq!(device.read(0xFD).unwrap(), 5);
+        device.trigger().unwrap();
+        assert_eq!(device.read(0xFD).unwrap(), 6);
+        assert!(device.trigger().is_err());
+        assert!(device.write(0xFD, 1).is_err());
+    }
+
+    #[test]
+    fn batches() {
+        let input = InputDevice::new(&[0u8][..], Advance::Read);
+        let sink = OutputSink::new(Vec::new());
+        let io = IoRegisters::new();
+        io.inspect_input().borrow_mut()[1] = 7;
+
+        // Earlier overlays take precedence, so the remaining registers are
+        // provided by the static ones
+        let mut ram = Ram::new();
+        ram.add_overlay(0xFC, 0xFC, &input);
+        ram.add_overlay(0xFE, 0xFF, &sink);
+        ram.add_overlay(0xFC, 0xFF, &io);
+        assert_eq!(ram.read(0xFD).unwrap(), 7);
+        assert!(ram.write(0xFD, 0).is_err());
+
+        for cycle in 0..2 * BATCH_SIZE as u64 + 1 {
+            sink.set_cycle(cycle * 1000);
+            ram.write(0xFE + (cycle % 2) as u8, cycle as u8).unwrap();
+        }
+        assert_eq!(sink.output(), [0, 255]);
+
+        let csv = String::from_utf8(sink.finish().unwrap()).unwrap();
+        let lines: Vec<&str> = csv.lines().collect();
+        assert_eq!(lines.len(), 2 * BATCH_SIZE + 2);
+        assert_eq!(lines[1], "0,FE,00");
+        assert_eq!(lines[12], "11000,FF,0B");
+        assert_eq!(lines[2 * BATCH_SIZE + 1], "8192000,FE,00");
+    }
+}
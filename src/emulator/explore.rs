@@ -0,0 +1,449 @@
+//! Exploration of the state space of programs.
+//!
+//! The complete state of the 2i (instruction pointer, registers, flags,
+//! interrupts and ram) is small and every step is deterministic, so an
+//! execution either fails or runs into a cycle of states at some point. The
+//! explorer remembers all states of an execution and therefore finds this
+//! cycle the first time a state repeats, which proves whether the outputs of
+//! the program settle or keep changing forever.
+//!
+//! States are not stored, but only a 128 bit fingerprint of them, so
+//! different states are only mistaken for each other with a negligible
+//! probability.
+
+use super::Result;
+use super::bus::{BusMut, IoRam};
+use super::cpu::Cpu;
+use super::instruction::DecodedInstruction;
+use super::machine::Machine;
+
+/// Only every n-th state of an execution (by fingerprint) is shared with the
+/// following executions, apart from the states of the final cycle
+const SAMPLE_MASK: u64 = 0b111;
+
+/// Maximum number of states shared between the executions of an explorer
+const MAX_SHARED_STATES: usize = 1 << 22;
+
+/// Result of exploring the execution of a program on a single input
+#[derive(Clone, Debug, PartialEq)]
+pub enum Outcome {
+    /// The state repeats with the given period and the outputs are the same
+    /// in all states of the cycle, so they never change again
+    Settled { steps: u64, period: u64, output: [u8; 2] },
+    /// The state repeats, but the outputs change within the cycle
+    Oscillating { steps: u64, period: u64 },
+    /// No state repeated within the maximum number of steps
+    Limit,
+    /// Executing the instruction after the given number of steps failed
+    Failed { steps: u64, error: String },
+}
+
+impl Outcome {
+    /// Same outcome reached after a different number of steps
+    fn with_steps(&self, steps: u64) -> Outcome {
+        match self {
+            &Outcome::Settled { period, output, .. } => Outcome::Settled { steps, period, output },
+            &Outcome::Oscillating { period, .. } => Outcome::Oscillating { steps, period },
+            other => other.clone(),
+        }
+    }
+}
+
+/// Explorer of the executions of a program on many inputs.
+///
+/// The input registers FC and FD are read-only, so the executions of two
+/// different inputs never reach the same state. But as soon as an execution
+/// no longer reads them, its future is the same for all values of FC and FD.
+/// Such states are shared (without FC and FD) with the following executions,
+/// which stop as soon as they reach one of them and reuse its outcome.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::Machine;
+/// use emulator::explore::{Explorer, Outcome};
+/// use emulator::instruction::decode_program;
+/// use emulator::parse::read_program;
+///
+/// // FE = FC + 1 and then loop forever
+/// let program = decode_program(&read_program(&b"
+///     00000: 00 00001 00 001 1100 01 01 1100 0
+///     00001: 00 00010 01 001 0001 01 11 0100 0
+///     00010: 00 00011 00 010 1110 01 01 1100 0
+///     00011: 00 00011 11 010 0001 00 00 1100 0"[..]).unwrap());
+///
+/// let mut explorer = Explorer::new(&program, 1000);
+/// let mut machine: Machine = Machine::default();
+/// machine.bus.inspect_input()[0] = 41;
+///
+/// let outcome = explorer.explore(machine);
+/// assert_eq!(outcome, Outcome::Settled { steps: 5, period: 1, output: [42, 0] });
+/// ```
+pub struct Explorer<'a> {
+    program: &'a [DecodedInstruction; 32],
+    max_steps: u64,
+    /// Outcome and number of remaining steps of the shared states
+    shared: StateMap<(u32, u64)>,
+    outcomes: Vec<Outcome>,
+    /// Step at which every state of the current execution was reached
+    visited: StateMap<u64>,
+    trajectory: Vec<Step>,
+}
+
+/// State of an execution before a step
+struct Step {
+    shared: Fingerprint,
+    output: [u8; 2],
+    reads_input: bool,
+}
+
+impl<'a> Explorer<'a> {
+    /// Create an explorer that executes at most `max_steps` per input
+    pub fn new(program: &'a [DecodedInstruction; 32], max_steps: u64) -> Explorer<'a> {
+        Explorer {
+            program: program,
+            max_steps: max_steps,
+            shared: StateMap::new(),
+            outcomes: Vec::new(),
+            visited: StateMap::new(),
+            trajectory: Vec::new(),
+        }
+    }
+
+    /// Execute the program on the given machine until its state repeats
+    pub fn explore(&mut self, machine: Machine) -> Outcome {
+        let Machine { mut instruction_pointer, mut cpu, bus: mut ram } = machine;
+        self.visited.clear();
+        self.trajectory.clear();
+
+        let mut steps = 0;
+        let mut memory = hash_memory(&ram.memory);
+        let (index, total, cycle) = loop {
+            let (shared, full) = fingerprints(&cpu, instruction_pointer, &ram, memory);
+
+            if let Some((index, remaining)) = self.shared.get(shared) {
+                break (index, steps + remaining, None);
+            }
+
+            if let Some(first) = self.visited.insert(full, steps) {
+                let cycle = &self.trajectory[first as usize..];
+                let period = steps - first;
+                let outcome = if cycle.iter().all(|step| step.output == ram.output) {
+                    Outcome::Settled { steps, period, output: ram.output }
+                } else {
+                    Outcome::Oscillating { steps, period }
+                };
+
+                // A cycle reading FC or FD can never be shared
+                if cycle.iter().any(|step| step.reads_input) {
+                    return outcome;
+                }
+                self.outcomes.push(outcome);
+                break (self.outcomes.len() as u32 - 1, steps, Some(first as usize));
+            }
+
+            if steps == self.max_steps {
+                return Outcome::Limit;
+            }
+
+            let output = ram.output;
+            let mut bus = Tracked { ram: &mut ram, reads_input: false, writes_memory: false };
+            match cpu.execute_decoded(&self.program[instruction_pointer], &mut bus) {
+                Ok((next_address, _)) => instruction_pointer = next_address,
+                Err(error) => return Outcome::Failed { steps, error: error.to_string() },
+            }
+            let (reads_input, writes_memory) = (bus.reads_input, bus.writes_memory);
+            if writes_memory {
+                memory = hash_memory(&ram.memory);
+            }
+            self.trajectory.push(Step { shared, output, reads_input });
+            steps += 1;
+        };
+
+        // Share all states after the last read of FC or FD
+        for (step, state) in self.trajectory.iter().enumerate().rev() {
+            if state.reads_input || self.shared.len() >= MAX_SHARED_STATES {
+                break;
+            }
+            if cycle.map_or(false, |first| step >= first) || state.shared.1 & SAMPLE_MASK == 0 {
+                self.shared.insert(state.shared, (index, total - step as u64));
+            }
+        }
+
+        // Shared states may be reached after fewer steps than this execution
+        if total > self.max_steps {
+            return Outcome::Limit;
+        }
+        self.outcomes[index as usize].with_steps(total)
+    }
+}
+
+/// Bus that remembers whether FC or FD were read and the ram was written
+struct Tracked<'a> {
+    ram: &'a mut IoRam,
+    reads_input: bool,
+    writes_memory: bool,
+}
+
+impl BusMut for Tracked<'_> {
+    fn read(&mut self, address: u8) -> Result<u8> {
+        self.reads_input |= address == 0xFC || address == 0xFD;
+        self.ram.read(address)
+    }
+    fn write(&mut self, address: u8, value: u8) -> Result<()> {
+        self.writes_memory |= address < 0xFC;
+        self.ram.write(address, value)
+    }
+}
+
+/// 128 bit hash of a state (never zero)
+#[derive(Clone, Copy, Debug, PartialEq)]
+struct Fingerprint(u64, u64);
+
+/// Return the fingerprints of the state without and with FC and FD
+///
+/// The state is packed into 64 bit words: the instruction pointer, flags,
+/// interrupts, FE, FF and both outputs into the first one and the registers
+/// into the second one. They are added to the hash of the ram, which only
+/// changes after writes to it.
+fn fingerprints(cpu: &Cpu, instruction_pointer: usize, ram: &IoRam, memory: Hasher)
+                -> (Fingerprint, Fingerprint) {
+    let flags = &cpu.flag_register;
+    let header = instruction_pointer as u64
+        | (flags.carry() as u64) << 8
+        | (flags.negative() as u64) << 9
+        | (flags.zero() as u64) << 10
+        | (cpu.stored_interrupt as u64) << 11
+        | (cpu.volatile_interrupt as u64) << 12
+        | (ram.input[2] as u64) << 16
+        | (ram.input[3] as u64) << 24
+        | (ram.output[0] as u64) << 32
+        | (ram.output[1] as u64) << 40;
+
+    let mut hash = memory;
+    hash.word(header);
+    hash.word(u64::from_le_bytes(cpu.registers));
+
+    let shared = hash.finish();
+    hash.word(ram.input[0] as u64 | (ram.input[1] as u64) << 8);
+    (shared, hash.finish())
+}
+
+/// Hash of the ram (FC-FF are never used)
+fn hash_memory(memory: &[u8; 256]) -> Hasher {
+    let mut hash = Hasher::new();
+    for word in memory.chunks(8) {
+        let mut bytes = [0; 8];
+        bytes.copy_from_slice(word);
+        hash.word(u64::from_le_bytes(bytes));
+    }
+    hash
+}
+
+/// Two independent lanes of a multiplicative hash over 64 bit words
+#[derive(Clone, Copy)]
+struct Hasher(u64, u64);
+
+impl Hasher {
+    fn new() -> Hasher {
+        Hasher(0x243F6A8885A308D3, 0x13198A2E03707344)
+    }
+
+    fn word(&mut self, word: u64) {
+        self.0 = (self.0 ^ word).wrapping_mul(0x9E3779B97F4A7C15).rotate_left(31);
+        self.1 = (self.1 ^ word.rotate_left(32)).wrapping_mul(0xC2B2AE3D27D4EB4F).rotate_left(29);
+    }
+
+    fn finish(&self) -> Fingerprint {
+        Fingerprint(mix(self.0) | 1, mix(self.1))
+    }
+}
+
+/// Final mixing step of MurmurHash3
+fn mix(mut hash: u64) -> u64 {
+    hash ^= hash >> 33;
+    hash = hash.wrapping_mul(0xFF51AFD7ED558CCD);
+    hash ^= hash >> 33;
+    hash = hash.wrapping_mul(0xC4CEB9FE1A85EC53);
+    hash ^ hash >> 33
+}
+
+/// Map from fingerprints to values using open addressing.
+///
+/// Every entry belongs to a generation and only entries of the current one
+/// are part of the map, so clearing it after every execution does not have
+/// to touch the whole table.
+struct StateMap<V> {
+    slots: Vec<(Fingerprint, u32, V)>,
+    generation: u32,
+    len: usize,
+}
+
+impl<V: Copy + Default> StateMap<V> {
+    fn new() -> StateMap<V> {
+        StateMap {
+            slots: vec![(Fingerprint(0, 0), 0, V::default()); 1024],
+            generation: 1,
+            len: 0,
+        }
+    }
+
+    fn len(&self) -> usize {
+        self.len
+    }
+
+    fn clear(&mut self) {
+        self.len = 0;
+        self.generation = self.generation.wrapping_add(1);
+        if self.generation == 0 {
+            for slot in self.slots.iter_mut() {
+                slot.1 = 0;
+            }
+            self.generation = 1;
+        }
+    }
+
+    fn get(&self, key: Fingerprint) -> Option<V> {
+        let slot = &self.slots[self.find(key)];
+        if slot.1 == self.generation { Some(slot.2) } else { None }
+    }
+
+    /// Insert the value if the key is new, otherwise return the existing one
+    fn insert(&mut self, key: Fingerprint, value: V) -> Option<V> {
+        let index = self.find(key);
+        if self.slots[index].1 == self.generation {
+            return Some(self.slots[index].2);
+        }
+
+        self.slots[index] = (key, self.generation, value);
+        self.len += 1;
+        if 2 * self.len > self.slots.len() {
+            self.grow();
+        }
+        None
+    }
+
+    /// Index of the slot of the key or of the empty slot where it belongs
+    fn find(&self, key: Fingerprint) -> usize {
+        let mask = self.slots.len() - 1;
+        let mut index = key.0 as usize & mask;
+        loop {
+            let slot = &self.slots[index];
+            if slot.1 != self.generation || slot.0 == key {
+                return index;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    fn grow(&mut self) {
+        let capacity = 2 * self.slots.len();
+        let slots = std::mem::replace(&mut self.slots,
+            vec![(Fingerprint(0, 0), 0, V::default()); capacity]);
+        let generation = self.generation;
+        self.generation = 1;
+        for (key, _, value) in slots.into_iter().filter(|slot| slot.1 == generation) {
+            let index = self.find(key);
+            self.slots[index] = (key, 1, value);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::instruction::decode_program;
+    use crate::parse::read_program;
+
+    fn explore_all(program: &[u8], max_steps: u64) -> Vec<Outcome> {
+        let program = decode_program(&read_program(program).unwrap());
+        let mut explorer = Explorer::new(&program, max_steps);
+        (0..=255).map(|input| {
+            let mut machine = Machine::<IoRam>::default();
+            machine.bus.inspect_input()[0] = input;
+            explorer.explore(machine)
+        }).collect()
+    }
+
+    #[test]
+    fn settled_and_shared() {
+        // Reads FC into R0, but clears it again before writing FE = 1, so
+        // all inputs converge
+        let program = decode_program(&read_program(&b"
+            00000: 00 00001 00 001 1100 01 01 1100 0
+            00001: 00 00010 01 001 0000 11 10 0001 0
+            00010: 00 00011 00 000 0000 01 00 0011 0
+            00011: 00 00100 00 010 1110 01 01 1100 0
+            00100: 00 00100 11 010 0001 00 01 1100 0"[..]).unwrap());
+        let mut explorer = Explorer::new(&program, 1000);
+
+        for input in 0..=255 {
+            let mut machine = Machine::<IoRam>::default();
+            machine.bus.inspect_input()[0] = input;
+            assert_eq!(explorer.explore(machine),
+                       Outcome::Settled { steps: 6, period: 1, output: [1, 0] });
+        }
+        assert_eq!(explorer.outcomes.len(), 1);
+    }
+
+    #[test]
+    fn shared_within_limit() {
+        // Counts R1 up from (FC) to zero and then R2 once around, so
+        // larger inputs reach the shared states of R1 after fewer steps
+        let program = decode_program(&read_program(&b"
+            00000: 00 00001 00 001 1100 01 01 1100 0
+            00001: 00 00010 01 001 0001 11 10 0001 0
+            00010: 10 00011 00 001 0001 01 01 0100 0
+            00011: 00 00100 00 000 0000 00 00 0000 0
+            00100: 10 00101 00 010 0001 01 01 0100 0
+            00101: 00 00101 00 000 0000 00 00 0000 0"[..]).unwrap());
+        let explore = |explorer: &mut Explorer<'_>, input| {
+            let mut machine = Machine::<IoRam>::default();
+            machine.bus.inspect_input()[0] = input;
+            explorer.explore(machine)
+        };
+
+        let mut fresh = Explorer::new(&program, 280);
+        let expected = explore(&mut fresh, 200);
+        assert_eq!(expected, Outcome::Limit);
+
+        let mut explorer = Explorer::new(&program, 280);
+        assert!(match explore(&mut explorer, 250) { Outcome::Settled { .. } => true, _ => false });
+        assert_eq!(explore(&mut explorer, 200), expected);
+    }
+
+    #[test]
+    fn oscillating_limit_and_failed() {
+        // Counts FE up forever
+        let outcomes = explore_all(&b"
+            00000: 00 00001 00 010 1110 01 01 1100 0
+            00001: 00 00010 00 000 0001 01 01 0100 0
+            00010: 00 00001 11 010 0000 00 00 1100 0"[..], 10000);
+        assert_eq!(outcomes[3], Outcome::Oscillating { steps: 513, period: 512 });
+
+        // R0 counts up, but no state repeats within the limit
+        let outcomes = explore_all(&b"
+            00000: 00 00000 00 000 0001 01 01 0100 0"[..], 100);
+        assert_eq!(outcomes[0], Outcome::Limit);
+
+        // Reading from a disabled bus
+        let outcomes = explore_all(&b"
+            00000: 00 00000 00 000 0000 00 10 0001 0"[..], 100);
+        assert!(match outcomes[0] { Outcome::Failed { steps: 0, .. } => true, _ => false });
+    }
+
+    #[test]
+    fn state_map() {
+        let mut map = StateMap::new();
+        for i in 0..5000u64 {
+            assert_eq!(map.insert(Fingerprint(mix(i) | 1, i), i), None);
+        }
+        assert_eq!(map.len(), 5000);
+        assert_eq!(map.insert(Fingerprint(mix(42) | 1, 42), 0), Some(42));
+        assert_eq!(map.get(Fingerprint(mix(4999) | 1, 4999)), Some(4999));
+
+        map.clear();
+        assert_eq!(map.len(), 0);
+        assert_eq!(map.get(Fingerprint(mix(42) | 1, 42)), None);
+    }
+}
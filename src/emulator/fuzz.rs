@@ -0,0 +1,648 @@
+//! Differential fuzzing of the execution engines.
+//!
+//! This module contains a harness that executes random programs with random
+//! inputs and interrupts on every engine and compares them with the
+//! reference `Cpu::execute_instruction` at regular checkpoints. Divergent
+//! cases can be minimized to a single lane with as few instructions as
+//! possible. The harness keeps all buffers between cases, so checking a case
+//! only allocates the superblocks of its program.
+
+use std::fmt;
+use std::mem;
+
+use super::{Error, Result};
+use super::alu::AluKernel;
+use super::bus::IoRam;
+use super::instruction::{decode_program, DecodedInstruction, Instruction, VerifiedProgram};
+use super::interrupt::{Event, Interrupt, Schedule};
+use super::lockstep::Lockstep;
+use super::machine::Machine;
+use super::parse::verify_program;
+use super::superblock::Superblocks;
+
+/// Maximum number of lanes of a case, which are executed together by the
+/// lockstep engine
+pub const LANES: usize = 64;
+
+/// Engine compared with the reference
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum Engine {
+    /// `Cpu::execute_decoded` with `AluKernel::Reference`
+    Decoded,
+    /// `Cpu::execute_decoded` with `AluKernel::Specialized`
+    Specialized,
+    /// `Cpu::execute_verified`, only for programs accepted by `verify_program`
+    Verified,
+    Superblock,
+    Lockstep,
+}
+
+impl fmt::Display for Engine {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.write_str(match *self {
+            Engine::Decoded => "decoded",
+            Engine::Specialized => "specialized",
+            Engine::Verified => "verified",
+            Engine::Superblock => "superblock",
+            Engine::Lockstep => "lockstep",
+        })
+    }
+}
+
+/// Program executed with the inputs of every lane and the same interrupts
+#[derive(Clone, Debug, Default)]
+pub struct Case {
+    pub program: [Instruction; 32],
+    /// Input registers FC-FF of every lane (at most `LANES`)
+    pub inputs: Vec<[u8; 4]>,
+    pub interrupts: Schedule,
+    /// Number of instructions executed on every lane
+    pub steps: u64,
+}
+
+/// First difference between an engine and the reference
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct Divergence {
+    pub engine: Engine,
+    pub lane: usize,
+    /// Number of executed instructions at the first checkpoint with a
+    /// different state (or a different error)
+    pub steps: u64,
+}
+
+/// Generator of random cases (xorshift).
+pub struct Generator {
+    state: u64,
+}
+
+impl Generator {
+    /// Create a generator, where similar seeds still generate unrelated cases
+    pub fn new(seed: u64) -> Generator {
+        // splitmix64 finalizer, which never maps to zero for xorshift
+        let mut state = seed.wrapping_add(0x9E3779B97F4A7C15);
+        state = (state ^ state >> 30).wrapping_mul(0xBF58476D1CE4E5B9);
+        state = (state ^ state >> 27).wrapping_mul(0x94D049BB133111EB);
+        Generator {
+            state: state ^ state >> 31 | 1,
+        }
+    }
+
+    fn next(&mut self) -> u64 {
+        self.state ^= self.state << 13;
+        self.state ^= self.state >> 7;
+        self.state ^= self.state << 17;
+        self.state
+    }
+
+    /// Replace the case with a random one with the given number of lanes
+    /// that executes `steps` instructions
+    pub fn generate(&mut self, case: &mut Case, lanes: usize, steps: u64) {
+        // Most programs only read the bus when it is enabled for reading, so
+        // they run long enough and can be executed by the verified engine.
+        // Unconditional jumps are more likely to get longer superblocks.
+        let valid = self.next() % 4 != 0;
+        for inst in case.program.iter_mut() {
+            let mut raw = self.next() as u32 & 0x1FFFFFF;
+            if valid && raw & 1 << 6 != 0 {
+                raw = raw & !(1 << 17) | 1 << 16;
+            }
+            if self.next() % 3 == 0 {
+                raw &= !(0b11 << 23);
+            }
+            *inst = Instruction::new(raw).unwrap();
+        }
+
+        case.inputs.clear();
+        for _ in 0..lanes.min(LANES) {
+            let inputs = self.next() as u32;
+            case.inputs.push(inputs.to_le_bytes());
+        }
+
+        case.interrupts.clear();
+        for _ in 0..self.next() % 4 {
+            let interrupt = if self.next() & 1 == 0 { Interrupt::A } else { Interrupt::B };
+            let cycle = self.next() % steps.max(1);
+            let period = if self.next() & 1 == 0 { Some(1 + self.next() % 64) } else { None };
+            case.interrupts.add(Event {
+                interrupt: interrupt,
+                cycle: cycle,
+                period: period,
+            });
+        }
+
+        case.steps = steps;
+    }
+}
+
+/// Execution of a lane on one engine up to the current checkpoint
+#[derive(Clone, Default)]
+struct Run {
+    machine: Machine,
+    /// Number of successfully executed instructions
+    steps: u64,
+    /// Index of the next interrupt in the triggers
+    next: usize,
+    error: Option<&'static str>,
+}
+
+impl Run {
+    fn reset(&mut self, inputs: [u8; 4]) {
+        self.machine = Machine::default();
+        *self.machine.bus.inspect_input() = inputs;
+        self.steps = 0;
+        self.next = 0;
+        self.error = None;
+    }
+
+    /// Execute single steps until `until` (or an error)
+    #[inline(always)]
+    fn advance<F>(&mut self, until: u64, triggers: &[(u64, Interrupt)], step: F)
+        where F: FnMut(&mut Machine) -> Result<()> {
+        let result = run_steps(&mut self.machine, &mut self.steps, until, triggers, &mut self.next, step);
+        self.error = result.err().as_ref().map(message);
+    }
+
+    fn equals(&self, other: &Run) -> bool {
+        self.error == other.error && self.steps == other.steps && self.machine == other.machine
+    }
+}
+
+/// Harness comparing the engines with the reference.
+///
+/// All engines are executed together with the reference from one checkpoint
+/// to the next, so only the current state of every lane is kept. States are
+/// compared every `interval` instructions. Errors must happen in the same
+/// step with the same message and leave the same state, except for
+/// superblocks, which only have to fail between the same checkpoints (their
+/// state after an error is not compared).
+///
+/// # Examples
+///
+/// ```
+/// use emulator::fuzz::{Case, Generator, Harness};
+///
+/// let mut generator = Generator::new(42);
+/// let mut harness = Harness::new(64);
+/// let mut case = Case::default();
+///
+/// for _ in 0..10 {
+///     generator.generate(&mut case, 8, 256);
+///     assert_eq!(harness.check(&case), None);
+/// }
+/// ```
+pub struct Harness {
+    interval: u64,
+    /// Interrupts of the current case in the order they are triggered
+    triggers: Vec<(u64, Interrupt)>,
+    /// Runs of every lane on the reference and the scalar engines (in the
+    /// order of `SCALAR`)
+    runs: Vec<[Run; 5]>,
+    decoded: [DecodedInstruction; 32],
+    specialized: [DecodedInstruction; 32],
+    lockstep: Lockstep<LANES>,
+    /// Step in which every lockstep lane failed
+    failed: [Option<u64>; LANES],
+    steps: u64,
+}
+
+/// Scalar engines in the order of their runs after the reference
+const SCALAR: [Engine; 4] = [Engine::Decoded, Engine::Specialized, Engine::Verified, Engine::Superblock];
+
+impl Harness {
+    /// Create a harness that compares the states every `interval` (at least
+    /// one) instructions.
+    pub fn new(interval: u64) -> Harness {
+        Harness {
+            interval: interval.max(1),
+            triggers: Vec::new(),
+            runs: Vec::new(),
+            decoded: decode_program(&[Instruction::default(); 32]),
+            specialized: decode_program(&[Instruction::default(); 32]),
+            lockstep: Lockstep::new(),
+            failed: [None; LANES],
+            steps: 0,
+        }
+    }
+
+    /// Total number of instructions executed by the reference.
+    pub fn steps(&self) -> u64 {
+        self.steps
+    }
+
+    /// Execute the case on all engines and return the first divergence.
+    pub fn check(&mut self, case: &Case) -> Option<Divergence> {
+        assert!(case.inputs.len() <= LANES, "Cases have at most {} lanes", LANES);
+        let lanes = case.inputs.len();
+
+        let mut queue = case.interrupts.queue();
+        self.triggers.clear();
+        while let Some(cycle) = queue.next_cycle().filter(|&cycle| cycle < case.steps) {
+            let triggers = &mut self.triggers;
+            queue.trigger_with(cycle, |interrupt| triggers.push((cycle, interrupt)));
+        }
+
+        for (address, &inst) in case.program.iter().enumerate() {
+            self.decoded[address] = DecodedInstruction::with_alu_kernel(inst, AluKernel::Reference);
+            self.specialized[address] = DecodedInstruction::with_alu_kernel(inst, AluKernel::Specialized);
+        }
+        let verified = verify_program(&case.program).ok();
+        let superblocks = Superblocks::<IoRam>::new(&case.program);
+
+        self.runs.resize_with(lanes, Default::default);
+        for (runs, &inputs) in self.runs.iter_mut().zip(case.inputs.iter()) {
+            for run in runs.iter_mut() {
+                run.reset(inputs);
+            }
+        }
+        self.reset_lockstep(case);
+
+        // Lanes that have not failed on the reference before the checkpoint
+        let mut active = (0..lanes).fold(0u64, |active, lane| active | 1 << lane);
+        let (mut steps, mut next) = (0, 0);
+        let checkpoints = ((case.steps + self.interval - 1) / self.interval).max(1);
+
+        for index in 0..checkpoints {
+            if active == 0 {
+                break;
+            }
+            let until = ((index + 1) * self.interval).min(case.steps);
+
+            for lane in (0..lanes).filter(|&lane| active >> lane & 1 == 1) {
+                let divergence = self.compare_scalar(case, lane, until, verified.as_ref(), &superblocks);
+                if divergence.is_some() {
+                    return divergence;
+                }
+            }
+
+            let divergence = self.compare_lockstep(active, until, &mut steps, &mut next);
+            if divergence.is_some() {
+                return divergence;
+            }
+
+            for (lane, runs) in self.runs.iter().enumerate() {
+                if runs[0].error.is_some() {
+                    active &= !(1 << lane);
+                }
+            }
+        }
+
+        None
+    }
+
+    /// Reduce the divergent case to the smallest case (a single lane if
+    /// possible) that still diverges on the same engine.
+    ///
+    /// States are compared after every instruction while minimizing, so the
+    /// returned divergence has the exact step.
+    pub fn minimize(&mut self, case: &Case, divergence: &Divergence) -> (Case, Divergence) {
+        let interval = mem::replace(&mut self.interval, 1);
+        let minimal = minimize_by(case, divergence, |case| self.check(case));
+        self.interval = interval;
+        minimal
+    }
+
+    /// Execute the lane on the reference and the scalar engines until the
+    /// checkpoint and compare them
+    fn compare_scalar(&mut self, case: &Case, lane: usize, until: u64, verified: Option<&VerifiedProgram>,
+                      superblocks: &Superblocks<IoRam>) -> Option<Divergence> {
+        let triggers = &self.triggers;
+        let (decoded, specialized) = (&self.decoded, &self.specialized);
+        let (reference, engines) = self.runs[lane].split_first_mut().unwrap();
+
+        let before = reference.steps;
+        reference.advance(until, triggers, |machine| {
+            let inst = case.program[machine.instruction_pointer];
+            machine.instruction_pointer = machine.cpu.execute_instruction(inst, &mut machine.bus)?.0;
+            Ok(())
+        });
+        self.steps += reference.steps - before;
+
+        for (run, &engine) in engines.iter_mut().zip(SCALAR.iter()) {
+            let equal = match engine {
+                Engine::Decoded => {
+                    run.advance(until, triggers, |machine| machine.step(decoded).map(|_| ()));
+                    run.equals(reference)
+                }
+                Engine::Specialized => {
+                    run.advance(until, triggers, |machine| machine.step(specialized).map(|_| ()));
+                    run.equals(reference)
+                }
+                Engine::Verified => match verified {
+                    Some(verified) => {
+                        run.advance(until, triggers, |machine| machine.step_verified(verified).map(|_| ()));
+                        run.equals(reference)
+                    }
+                    None => true,
+                },
+                Engine::Superblock => {
+                    advance_superblocks(run, until, triggers, superblocks);
+                    // Only the interval of the error is known, not its exact step
+                    match run.error {
+                        None => reference.error.is_none() && run.machine == reference.machine,
+                        error => error == reference.error,
+                    }
+                }
+                Engine::Lockstep => unreachable!(),
+            };
+
+            if ! equal {
+                return Some(Divergence {
+                    engine: engine,
+                    lane: lane,
+                    steps: until,
+                });
+            }
+        }
+
+        None
+    }
+
+    /// Reset the lockstep engine to the inputs of the case
+    fn reset_lockstep(&mut self, case: &Case) {
+        self.lockstep.reset();
+        for (lane, inputs) in case.inputs.iter().enumerate() {
+            for (register, &value) in inputs.iter().enumerate() {
+                self.lockstep.set_input(lane, register, value);
+            }
+        }
+        for lane in case.inputs.len()..LANES {
+            self.lockstep.stop(lane);
+        }
+        self.failed = [None; LANES];
+    }
+
+    /// Execute all lanes together until the checkpoint and compare the active
+    /// lanes with the reference
+    fn compare_lockstep(&mut self, active: u64, until: u64, steps: &mut u64, next: &mut usize)
+                        -> Option<Divergence> {
+        // Single steps, so the exact step of every error is known
+        while *steps < until && self.lockstep.running() != 0 {
+            while let Some(&(cycle, interrupt)) = self.triggers.get(*next) {
+                if cycle > *steps {
+                    break;
+                }
+                for lane in 0..self.runs.len() {
+                    match interrupt {
+                        Interrupt::A => self.lockstep.trigger_volatile_interrupt(lane),
+                        Interrupt::B => self.lockstep.trigger_stored_interrupt(lane),
+                    }
+                }
+                *next += 1;
+            }
+
+            let running = self.lockstep.running();
+            self.lockstep.step(&self.specialized);
+            let mut stopped = running & !self.lockstep.running();
+            while stopped != 0 {
+                self.failed[stopped.trailing_zeros() as usize] = Some(*steps);
+                stopped &= stopped - 1;
+            }
+            *steps += 1;
+        }
+
+        for lane in (0..self.runs.len()).filter(|&lane| active >> lane & 1 == 1) {
+            let reference = &self.runs[lane][0];
+            let equal = match (reference.error, self.failed[lane]) {
+                (None, None) => lane_equals(&self.lockstep, lane, &reference.machine),
+                (Some(error), Some(failed)) => failed == reference.steps &&
+                    self.lockstep.error(lane).map(message) == Some(error) &&
+                    lane_equals(&self.lockstep, lane, &reference.machine),
+                _ => false,
+            };
+            if ! equal {
+                return Some(Divergence {
+                    engine: Engine::Lockstep,
+                    lane: lane,
+                    steps: until,
+                });
+            }
+        }
+
+        None
+    }
+}
+
+/// Execute the lane using superblocks, which run straight until the next
+/// interrupt or `until`
+fn advance_superblocks(run: &mut Run, until: u64, triggers: &[(u64, Interrupt)],
+                       superblocks: &Superblocks<IoRam>) {
+    let machine = &mut run.machine;
+    loop {
+        // Interrupts are triggered before the next step like in `run_steps`,
+        // so not yet at the checkpoint
+        if run.steps == until {
+            return;
+        }
+        while let Some(&(cycle, interrupt)) = triggers.get(run.next) {
+            if cycle > run.steps {
+                break;
+            }
+            interrupt.trigger(&mut machine.cpu);
+            run.next += 1;
+        }
+
+        let stop = triggers.get(run.next).map_or(until, |&(cycle, _)| cycle.min(until));
+        match superblocks.run(&mut machine.cpu, &mut machine.bus,
+                              &mut machine.instruction_pointer, stop - run.steps, None) {
+            Ok(executed) => run.steps += executed,
+            Err(ref error) => {
+                run.error = Some(message(error));
+                return;
+            }
+        }
+    }
+}
+
+/// Execute single steps until `until` and trigger the interrupts due before
+/// every step. `steps` is the number of successfully executed steps.
+#[inline(always)]
+fn run_steps<F>(machine: &mut Machine, steps: &mut u64, until: u64, triggers: &[(u64, Interrupt)],
+                next: &mut usize, mut step: F) -> Result<()>
+    where F: FnMut(&mut Machine) -> Result<()> {
+    while *steps < until {
+        while let Some(&(cycle, interrupt)) = triggers.get(*next) {
+            if cycle > *steps {
+                break;
+            }
+            interrupt.trigger(&mut machine.cpu);
+            *next += 1;
+        }
+
+        step(machine)?;
+        *steps += 1;
+    }
+
+    Ok(())
+}
+
+/// Compare a lane of the lockstep engine with a machine (without the
+/// interrupts, which have no accessors)
+fn lane_equals(lockstep: &Lockstep<LANES>, lane: usize, machine: &Machine) -> bool {
+    lockstep.instruction_pointer(lane) == machine.instruction_pointer &&
+        lockstep.registers(lane) == machine.cpu.registers &&
+        lockstep.flags(lane) == machine.cpu.flag_register &&
+        lockstep.output(lane) == machine.bus.output &&
+        (0..0xFC).all(|address| lockstep.memory(lane, address) == machine.bus.memory[address as usize])
+}
+
+/// Message of errors raised by the cpu or the bus
+fn message(error: &Error) -> &'static str {
+    match *error {
+        Error::Bus(message) | Error::Cpu(message) => message,
+        _ => "",
+    }
+}
+
+/// Minimize the case using the given check (see `Harness::minimize`)
+fn minimize_by<F>(case: &Case, divergence: &Divergence, mut check: F) -> (Case, Divergence)
+    where F: FnMut(&Case) -> Option<Divergence> {
+    let engine = divergence.engine;
+    let mut diverges = |case: &Case| check(case).filter(|divergence| divergence.engine == engine);
+
+    // Divergences of the lockstep engine can depend on the other lanes
+    let mut minimal = Case {
+        program: case.program,
+        inputs: vec![case.inputs[divergence.lane]],
+        interrupts: case.interrupts.clone(),
+        steps: divergence.steps,
+    };
+    let mut current = match diverges(&minimal) {
+        Some(divergence) => divergence,
+        None => {
+            minimal.inputs = case.inputs.clone();
+            match diverges(&minimal) {
+                Some(divergence) => divergence,
+                None => return (case.clone(), *divergence),
+            }
+        }
+    };
+
+    let mut reduce = |change: &dyn Fn(&mut Case), minimal: &mut Case, current: &mut Divergence| {
+        let mut candidate = minimal.clone();
+        change(&mut candidate);
+        candidate.steps = current.steps;
+        if let Some(divergence) = diverges(&candidate) {
+            candidate.steps = divergence.steps;
+            *minimal = candidate;
+            *current = divergence;
+            true
+        } else {
+            false
+        }
+    };
+
+    loop {
+        minimal.steps = current.steps;
+        let mut reduced = false;
+
+        // Missing instructions of a program are loops, so they are omitted
+        for address in 0..32 {
+            let looping = Instruction::new_looping(address).unwrap();
+            if minimal.program[address] != looping {
+                reduced |= reduce(&|case| case.program[address] = looping, &mut minimal, &mut current);
+            }
+        }
+
+        for address in 0..32 {
+            if minimal.program[address] == Instruction::new_looping(address).unwrap() {
+                continue;
+            }
+            for bit in (0..25).rev() {
+                let raw = minimal.program[address].get_instruction();
+                if raw & 1 << bit != 0 {
+                    let inst = Instruction::new(raw & !(1 << bit)).unwrap();
+                    reduced |= reduce(&|case| case.program[address] = inst, &mut minimal, &mut current);
+                }
+            }
+        }
+
+        for removed in (0..minimal.interrupts.events().len()).rev() {
+            reduced |= reduce(&|case| {
+                let events = case.interrupts.events().to_vec();
+                case.interrupts.clear();
+                for (i, &event) in events.iter().enumerate() {
+                    if i != removed {
+                        case.interrupts.add(event);
+                    }
+                }
+            }, &mut minimal, &mut current);
+        }
+
+        for lane in 0..minimal.inputs.len() {
+            for register in 0..4 {
+                if minimal.inputs[lane][register] != 0 {
+                    reduced |= reduce(&|case| case.inputs[lane][register] = 0, &mut minimal, &mut current);
+                }
+            }
+        }
+
+        if ! reduced {
+            return (minimal, current);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn engines_agree() {
+        let mut generator = Generator::new(0x2111);
+        let mut harness = Harness::new(16);
+        let mut case = Case::default();
+
+        for _ in 0..100 {
+            generator.generate(&mut case, 16, 300);
+            assert_eq!(harness.check(&case), None, "{:?}", case);
+        }
+        assert!(harness.steps() > 0);
+    }
+
+    #[test]
+    fn generator() {
+        let (mut a, mut b) = (Case::default(), Case::default());
+        Generator::new(7).generate(&mut a, 4, 100);
+        Generator::new(7).generate(&mut b, 4, 100);
+        assert_eq!(a.program, b.program);
+        assert_eq!(a.inputs, b.inputs);
+        assert_eq!(a.interrupts, b.interrupts);
+
+        Generator::new(8).generate(&mut b, 4, 100);
+        assert!(a.program != b.program);
+    }
+
+    #[test]
+    fn minimize() {
+        // Pretend that the superblocks diverge after the second step on all
+        // programs with bit 9 of address 3 set and FD != 0
+        let check = |case: &Case| {
+            let diverges = case.program[3].get_instruction() & 1 << 9 != 0 &&
+                case.inputs.iter().any(|inputs| inputs[1] != 0) && case.steps >= 2;
+            Some(Divergence {
+                engine: if diverges { Engine::Superblock } else { Engine::Decoded },
+                lane: 0,
+                steps: 2,
+            })
+        };
+
+        let mut case = Case::default();
+        Generator::new(1).generate(&mut case, 8, 100);
+        case.program[3] = Instruction::new(case.program[3].get_instruction() | 1 << 9).unwrap();
+        case.inputs[5][1] = 1;
+        let divergence = Divergence { engine: Engine::Superblock, lane: 5, steps: 64 };
+
+        let (minimal, divergence) = minimize_by(&case, &divergence, check);
+        assert_eq!(divergence, Divergence { engine: Engine::Superblock, lane: 0, steps: 2 });
+        assert_eq!(minimal.steps, 2);
+        assert_eq!(minimal.inputs, vec![[0, 1, 0, 0]]);
+        assert!(minimal.interrupts.is_empty());
+        for address in 0..32 {
+            if address == 3 {
+                assert_eq!(minimal.program[3].get_instruction(), 1 << 9);
+            } else {
+                assert!(minimal.program[address] == Instruction::new_looping(address).unwrap());
+            }
+        }
+    }
+}
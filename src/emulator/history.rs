@@ -0,0 +1,351 @@
+//! Snapshots and undo history of the 2i.
+//!
+//! This module contains a copyable snapshot of the complete machine and a
+//! fixed-size history of executed steps that can be undone.
+
+use super::Result;
+use super::alu::Flags;
+use super::bus::{BusMut, IoRam, IoRegisters, Ram};
+use super::cpu::Cpu;
+use super::instruction::DecodedInstruction;
+
+/// Complete state of a 2i with a `Ram` and `IoRegisters`.
+///
+/// The state is only a few hundred bytes and can be copied freely.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::{Cpu, IoRegisters, Ram};
+/// use emulator::history::MachineState;
+///
+/// let mut cpu = Cpu::new();
+/// let mut instruction_pointer = 3;
+/// let io = IoRegisters::new();
+/// let mut ram = Ram::new();
+/// ram.add_overlay(0xFC, 0xFF, &io);
+///
+/// let snapshot = MachineState::capture(&cpu, instruction_pointer, &ram, &io);
+/// cpu.inspect_registers()[0] = 42;
+/// ram.inspect().borrow_mut()[7] = 42;
+/// instruction_pointer = 4;
+///
+/// snapshot.restore(&mut cpu, &mut instruction_pointer, &ram, &io);
+/// assert_eq!(cpu.inspect_registers()[0], 0);
+/// assert_eq!(ram.inspect().borrow()[7], 0);
+/// assert_eq!(instruction_pointer, 3);
+/// ```
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub struct MachineState {
+    pub cpu: Cpu,
+    pub instruction_pointer: u8,
+    pub memory: [u8; 256],
+    pub input: [u8; 4],
+    pub output: [u8; 2],
+}
+
+impl MachineState {
+    /// Take a snapshot of the given machine.
+    pub fn capture(cpu: &Cpu, instruction_pointer: usize, ram: &Ram<'_>, io: &IoRegisters) -> MachineState {
+        MachineState {
+            cpu: *cpu,
+            instruction_pointer: instruction_pointer as u8,
+            memory: ram.snapshot(),
+            input: *io.inspect_input().borrow(),
+            output: *io.inspect_output().borrow(),
+        }
+    }
+
+    /// Reset the given machine to the state of the snapshot.
+    pub fn restore(&self, cpu: &mut Cpu, instruction_pointer: &mut usize, ram: &Ram<'_>, io: &IoRegisters) {
+        *cpu = self.cpu;
+        *instruction_pointer = self.instruction_pointer as usize;
+        ram.restore(&self.memory);
+        *io.inspect_input().borrow_mut() = self.input;
+        *io.inspect_output().borrow_mut() = self.output;
+    }
+
+    /// Take a snapshot of the given machine using an `IoRam`.
+    pub fn from_io_ram(cpu: &Cpu, instruction_pointer: usize, ram: &IoRam) -> MachineState {
+        MachineState {
+            cpu: *cpu,
+            instruction_pointer: instruction_pointer as u8,
+            memory: ram.memory,
+            input: ram.input,
+            output: ram.output,
+        }
+    }
+
+    /// Reset the given machine using an `IoRam` to the state of the snapshot.
+    pub fn restore_io_ram(&self, cpu: &mut Cpu, instruction_pointer: &mut usize, ram: &mut IoRam) {
+        *cpu = self.cpu;
+        *instruction_pointer = self.instruction_pointer as usize;
+        ram.memory = self.memory;
+        ram.input = self.input;
+        ram.output = self.output;
+    }
+}
+
+/// Changes of a single step, which are needed to undo it.
+///
+/// An instruction writes at most one register and one address of the bus, so
+/// only their old values are stored together with the flags and interrupts.
+#[derive(Copy, Clone, Debug, Default)]
+struct Delta {
+    instruction_pointer: u8,
+    flags: Flags,
+    volatile_interrupt: bool,
+    stored_interrupt: bool,
+    /// Index and old value of the written register
+    register: Option<(u8, u8)>,
+    /// Address and old value of the written bus address
+    bus: Option<(u8, u8)>,
+}
+
+/// History of the last executed steps.
+///
+/// The steps are stored in a ring buffer of fixed size that is allocated
+/// once, so recording a step never allocates. When the buffer is full, the
+/// oldest steps are dropped.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::{Cpu, DecodedInstruction, Instruction, IoRam};
+/// use emulator::history::History;
+///
+/// let mut history = History::new(10);
+/// let mut cpu = Cpu::new();
+/// let mut ram = IoRam::new();
+/// let mut instruction_pointer = 0;
+///
+/// // R0 = 6; JMP 00001
+/// let inst = DecodedInstruction::new(Instruction::new(0b00_00001_00_000_0110_01_01_1100_0).unwrap());
+/// history.execute(&mut cpu, &mut instruction_pointer, &inst, &mut ram, IoRam::peek).unwrap();
+/// assert_eq!(cpu.inspect_registers()[0], 6);
+///
+/// assert!(history.undo(&mut cpu, &mut instruction_pointer, |address, value| {
+///     ram.poke(address, value)
+/// }));
+/// assert_eq!(cpu.inspect_registers()[0], 0);
+/// assert_eq!(instruction_pointer, 0);
+/// assert!(!history.undo(&mut cpu, &mut instruction_pointer, |_, _| ()));
+/// ```
+pub struct History {
+    deltas: Vec<Delta>,
+    /// Index after the newest step
+    end: usize,
+    len: usize,
+}
+
+impl History {
+    /// Create an empty history that remembers at most `capacity` steps.
+    pub fn new(capacity: usize) -> History {
+        History {
+            deltas: vec![Delta::default(); capacity.max(1)],
+            end: 0,
+            len: 0,
+        }
+    }
+
+    /// Number of steps that can currently be undone.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Check if there are no steps that can be undone.
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Forget all steps.
+    pub fn clear(&mut self) {
+        self.len = 0;
+    }
+
+    /// Execute the given instruction and remember how to undo it.
+    ///
+    /// Behaves like `Cpu::execute_decoded`, but also updates the instruction
+    /// pointer. `peek` must return the current value at the given address of
+    /// the bus without side effects, eg the value of an output register. It
+    /// is used to remember the value that is overwritten. Failed steps are
+    /// recorded as well, because they may already have written a register,
+    /// but keep the instruction pointer.
+    pub fn execute<B, P>(&mut self, cpu: &mut Cpu, instruction_pointer: &mut usize,
+                         inst: &DecodedInstruction, bus: &mut B, peek: P) -> Result<Flags>
+        where B: BusMut, P: Fn(&B, u8) -> u8 {
+        let mut delta = Delta {
+            instruction_pointer: *instruction_pointer as u8,
+            flags: cpu.flag_register,
+            volatile_interrupt: cpu.volatile_interrupt,
+            stored_interrupt: cpu.stored_interrupt,
+            register: inst.write_register.map(|r| (r as u8, cpu.registers[r])),
+            bus: None,
+        };
+
+        let mut recording = Recording {
+            bus: bus,
+            peek: peek,
+            written: None,
+        };
+        let result = cpu.execute_decoded(inst, &mut recording);
+        delta.bus = recording.written;
+
+        if let Ok((next_address, _)) = result {
+            *instruction_pointer = next_address;
+        }
+        self.deltas[self.end] = delta;
+        self.end = (self.end + 1) % self.deltas.len();
+        self.len = (self.len + 1).min(self.deltas.len());
+
+        result.map(|(_, flags)| flags)
+    }
+
+    /// Undo the newest step and return if there was one.
+    ///
+    /// `poke` is called with the address and the old value if the step wrote
+    /// to the bus. It has to restore the value directly (eg in the output
+    /// registers), because writing to the bus could behave differently.
+    pub fn undo<F>(&mut self, cpu: &mut Cpu, instruction_pointer: &mut usize, mut poke: F) -> bool
+        where F: FnMut(u8, u8) {
+        if self.len == 0 {
+            return false;
+        }
+
+        self.end = (self.end + self.deltas.len() - 1) % self.deltas.len();
+        self.len -= 1;
+        let delta = self.deltas[self.end];
+
+        if let Some((address, value)) = delta.bus {
+            poke(address, value);
+        }
+        if let Some((register, value)) = delta.register {
+            cpu.registers[register as usize] = value;
+        }
+        cpu.flag_register = delta.flags;
+        cpu.volatile_interrupt = delta.volatile_interrupt;
+        cpu.stored_interrupt = delta.stored_interrupt;
+        *instruction_pointer = delta.instruction_pointer as usize;
+
+        true
+    }
+}
+
+/// Bus that remembers the old value of the first written address
+struct Recording<'b, B, P> {
+    bus: &'b mut B,
+    peek: P,
+    written: Option<(u8, u8)>,
+}
+
+impl<'b, B: BusMut, P: Fn(&B, u8) -> u8> BusMut for Recording<'b, B, P> {
+    fn read(&mut self, address: u8) -> Result<u8> {
+        self.bus.read(address)
+    }
+    fn write(&mut self, address: u8, value: u8) -> Result<()> {
+        if self.written.is_none() {
+            self.written = Some((address, (self.peek)(&*self.bus, address)));
+        }
+        self.bus.write(address, value)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::Instruction;
+    use crate::instruction::decode_program;
+    use crate::parse::read_program;
+
+    #[test]
+    fn undo_multiply() {
+        let program = read_program(&b"
+            00 00001 00 000 1100 01 01 1100 0
+            00 00010 01 000 0000 01 10 0001 0
+            00 00011 00 001 1101 01 01 1100 0
+            00 00100 01 001 0000 01 10 0001 0
+            00 00101 00 010 0000 01 00 0011 0
+            10 00111 00 000 0000 00 00 0001 0
+            00 01000 00 000 1111 01 01 0100 0
+            00 01001 00 001 1110 01 01 1100 0
+            00 00101 00 010 0001 01 00 0100 0
+            00 00000 11 001 0010 00 00 1100 0"[..]).unwrap();
+        let program = decode_program(&program);
+
+        let io = IoRegisters::new();
+        io.inspect_input().borrow_mut()[0] = 7;
+        io.inspect_input().borrow_mut()[1] = 6;
+        let mut ram = Ram::new();
+        ram.add_overlay(0xFC, 0xFF, &io);
+        let mut cpu = Cpu::new();
+        let mut instruction_pointer = 0;
+
+        let peek = |ram: &Ram<'_>, address: u8| match address {
+            0xFE | 0xFF => io.inspect_output().borrow()[address as usize - 0xFE],
+            _ => ram.inspect().borrow()[address as usize],
+        };
+
+        // Remember the state before every step and compare while undoing
+        let mut history = History::new(100);
+        let mut states = Vec::new();
+        for _ in 0..80 {
+            states.push(MachineState::capture(&cpu, instruction_pointer, &ram, &io));
+            let inst = &program[instruction_pointer];
+            history.execute(&mut cpu, &mut instruction_pointer, inst, &mut ram, peek).unwrap();
+            if instruction_pointer == 0 {
+                cpu.trigger_stored_interrupt();
+            }
+        }
+        assert_eq!(io.inspect_output().borrow()[0], 42);
+
+        while let Some(state) = states.pop() {
+            let poke = |address: u8, value: u8| match address {
+                0xFE | 0xFF => io.inspect_output().borrow_mut()[address as usize - 0xFE] = value,
+                _ => ram.inspect().borrow_mut()[address as usize] = value,
+            };
+            assert!(history.undo(&mut cpu, &mut instruction_pointer, poke));
+            assert_eq!(MachineState::capture(&cpu, instruction_pointer, &ram, &io), state);
+        }
+        assert!(!history.undo(&mut cpu, &mut instruction_pointer, |_, _| ()));
+    }
+
+    #[test]
+    fn capacity() {
+        // R0 = R0 + 1; LOOP
+        let inst = Instruction::new(0b00_00000_00_000_0001_01_01_0100_0).unwrap();
+        let inst = DecodedInstruction::new(inst);
+        let mut ram = crate::IoRam::new();
+        let mut cpu = Cpu::new();
+        let mut instruction_pointer = 0;
+
+        let mut history = History::new(3);
+        for _ in 0..5 {
+            history.execute(&mut cpu, &mut instruction_pointer, &inst, &mut ram, |_, _| 0).unwrap();
+        }
+        assert_eq!(history.len(), 3);
+
+        while history.undo(&mut cpu, &mut instruction_pointer, |_, _| ()) {}
+        assert_eq!(cpu.inspect_registers()[0], 2);
+        assert!(history.is_empty());
+    }
+
+    #[test]
+    fn undo_failed_write() {
+        // R0 = R0 + 1; (R0) = R0 with R0 pointing to FC afterwards
+        let inst = Instruction::new(0b00_00000_11_000_0001_01_01_0100_0).unwrap();
+        let inst = DecodedInstruction::new(inst);
+        let mut ram = crate::IoRam::new();
+        let mut cpu = Cpu::new();
+        cpu.inspect_registers()[0] = 0xFB;
+        let mut instruction_pointer = 3;
+
+        let mut history = History::new(3);
+        assert!(history.execute(&mut cpu, &mut instruction_pointer, &inst, &mut ram, |_, _| 0).is_err());
+        assert_eq!(cpu.inspect_registers()[0], 0xFC);
+        assert_eq!(instruction_pointer, 3);
+
+        assert!(history.undo(&mut cpu, &mut instruction_pointer, |_, _| ()));
+        assert_eq!(cpu.inspect_registers()[0], 0xFB);
+        assert_eq!(instruction_pointer, 3);
+    }
+}
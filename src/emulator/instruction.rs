@@ -3,6 +3,7 @@
 use std::fmt;
 
 use super::{Error, Result};
+use super::alu::{AluFunction, AluKernel};
 
 /// Instruction of the 2i.
 ///
@@ -150,113 +151,333 @@ impl Instruction {
     /// assert_eq!("R0 = R0 + 6", &inst.to_mnemonic(Some(0)));
     /// ```
     pub fn to_mnemonic(&self, address: Option<usize>) -> String {
-        // Determine input a
+        let mut mnemonic = String::with_capacity(32);
+        self.write_mnemonic(address, &mut mnemonic).unwrap();
+        mnemonic
+    }
+
+    /// Write the textual representation of `to_mnemonic` without allocating
+    ///
+    /// # Examples
+    ///
+    /// ```
+    /// use emulator::Instruction;
+    ///
+    /// let mut listing = String::new();
+    /// for address in 0..2 {
+    ///     let inst = Instruction::new(0b00_00001_00_000_0110_01_01_0100_0).unwrap();
+    ///     inst.write_mnemonic(Some(address), &mut listing).unwrap();
+    ///     listing.push('\n');
+    /// }
+    /// assert_eq!("R0 = R0 + 6\nR0 = R0 + 6; LOOP\n", listing);
+    /// ```
+    pub fn write_mnemonic<W: fmt::Write>(&self, address: Option<usize>, out: &mut W) -> fmt::Result {
+        let mac = self.get_address_control();
+        let mac_full = self.get_full_address_control();
+        let nop = self.instruction & 0b0000000111111111111111110 == 0 &&
+            (mac == 0b00 || mac_full == 0b010 || mac_full == 0b111);
+
+        if nop {
+            // NOP if everything except NA and CHFL is zero
+            // or if full NA specifies an interrupt as source
+            out.write_str("NOP")?;
+        } else {
+            self.write_operation(out)?;
+        }
+
+        // Determine address control and next address
+        let next_address = self.get_next_instruction_address();
+        if mac == 0 && address.map(|a| a + 1) == Some(next_address as usize) {
+            // Continues with the next instruction
+        } else if mac == 0 && address == Some(next_address as usize) {
+            out.write_str("; LOOP")?;
+        } else {
+            let next_address_base = next_address >> 1; // Cut off last bit
+
+            match mac_full {
+                0b000 | 0b001 => write!(out, "; JMP {:05b}", next_address)?,
+                0b010 => write!(out, "; INTA {:04b}I", next_address_base)?,
+                0b011 => write!(out, "; CF {:04b}C", next_address_base)?,
+                0b100 => write!(out, "; CO {:04b}C", next_address_base)?,
+                0b101 => write!(out, "; ZO {:04b}Z", next_address_base)?,
+                0b110 => write!(out, "; NO {:04b}N", next_address_base)?,
+                0b111 => write!(out, "; INTB {:04b}I", next_address_base)?,
+                _ => panic!("Invalid address control"),
+            }
+        }
+
+        // Determine flag storage
+        if self.should_store_flags() {
+            out.write_str("; CHFL")?;
+        }
+
+        Ok(())
+    }
+
+    /// Write the output and the alu function of the mnemonic
+    fn write_operation<W: fmt::Write>(&self, out: &mut W) -> fmt::Result {
+        // Determine inputs a and b
         let a = if self.is_alu_input_a_bus() {
-            format!("(R{})", self.get_register_address_a())
+            Operand::Memory(self.get_register_address_a())
         } else {
-            format!("R{}", self.get_register_address_a())
+            Operand::Register(self.get_register_address_a())
         };
-
-        // Determine input b
         let b = if self.is_alu_input_b_const() {
-            format!("{:X}", self.get_constant_input())
+            Operand::Constant(self.get_constant_input())
         } else {
-            format!("R{}", self.get_register_address_b())
-        };
-
-        // Determine alu function
-        let result = match self.get_alu_instruction() {
-            0b0000 if a == b => format!("{} << 1; HLDC", a),
-            0b0000 => format!("{} + {}; HLDC", a, b),
-            0b0001 => a,
-            0b0010 if a == b => format!("¬{}", a),
-            0b0010 => format!("{} NOR {}", a, b),
-            0b0011 => "0".to_string(),
-            0b0100 if a == b => format!("{} << 1", a),
-            0b0100 => format!("{} + {}", a, b),
-            0b0101 if a == b => format!("({} << 1) + 1", a),
-            0b0101 => format!("{} + {} + 1", a, b),
-            0b0110 if a == b => format!("({} << 1) + C", a),
-            0b0110 => format!("{} + {} + C", a, b),
-            0b0111 if a == b => format!("({} << 1) + ¬C", a),
-            0b0111 => format!("{} + {} + ¬C", a, b),
-            0b1000 => format!("{} >> 1", a),
-            0b1001 => format!("{} R> 1", a),
-            0b1010 => format!("{} C> 1", a),
-            0b1011 => format!("{} ?> 1", a),
-            0b1100 => b,
-            0b1101 => format!("{}; SETC", b),
-            0b1110 => format!("{}; HLDC", b),
-            0b1111 => format!("{}; INVC", b),
-            i => panic!("Invalid instruction {}", i),
+            Operand::Register(self.get_register_address_b())
         };
 
         // Determine output
-        let format_register = || {
-            format!("R{}", if self.should_write_register_b() {
-                self.get_register_address_b()
-            } else {
-                self.get_register_address_a()
-            })
+        let register = if self.should_write_register_b() {
+            self.get_register_address_b()
+        } else {
+            self.get_register_address_a()
         };
-        let output = if self.is_bus_enabled() && self.is_bus_writable() {
+        if self.is_bus_enabled() && self.is_bus_writable() {
             if self.should_write_register() {
-                format!("(R{}),{} = ", self.get_register_address_a(), format_register())
+                write!(out, "(R{}),R{} = ", self.get_register_address_a(), register)?;
             } else {
-                format!("(R{}) = ", self.get_register_address_a())
+                write!(out, "(R{}) = ", self.get_register_address_a())?;
             }
         } else if self.should_write_register() {
-            format!("{} = ", format_register())
+            write!(out, "R{} = ", register)?;
+        } else {
+            out.write_str("TEST ")?;
+        }
+
+        // Determine alu function
+        match self.get_alu_instruction() {
+            0b0000 if a == b => write!(out, "{} << 1; HLDC", a),
+            0b0000 => write!(out, "{} + {}; HLDC", a, b),
+            0b0001 => write!(out, "{}", a),
+            0b0010 if a == b => write!(out, "¬{}", a),
+            0b0010 => write!(out, "{} NOR {}", a, b),
+            0b0011 => out.write_str("0"),
+            0b0100 if a == b => write!(out, "{} << 1", a),
+            0b0100 => write!(out, "{} + {}", a, b),
+            0b0101 if a == b => write!(out, "({} << 1) + 1", a),
+            0b0101 => write!(out, "{} + {} + 1", a, b),
+            0b0110 if a == b => write!(out, "({} << 1) + C", a),
+            0b0110 => write!(out, "{} + {} + C", a, b),
+            0b0111 if a == b => write!(out, "({} << 1) + ¬C", a),
+            0b0111 => write!(out, "{} + {} + ¬C", a, b),
+            0b1000 => write!(out, "{} >> 1", a),
+            0b1001 => write!(out, "{} R> 1", a),
+            0b1010 => write!(out, "{} C> 1", a),
+            0b1011 => write!(out, "{} ?> 1", a),
+            0b1100 => write!(out, "{}", b),
+            0b1101 => write!(out, "{}; SETC", b),
+            0b1110 => write!(out, "{}; HLDC", b),
+            0b1111 => write!(out, "{}; INVC", b),
+            i => panic!("Invalid instruction {}", i),
+        }
+    }
+}
+
+/// Input of the alu in a mnemonic
+#[derive(Clone, Copy, PartialEq)]
+enum Operand {
+    Register(usize),
+    Memory(usize),
+    Constant(u8),
+}
+
+impl fmt::Display for Operand {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match *self {
+            Operand::Register(register) => write!(f, "R{}", register),
+            Operand::Memory(register) => write!(f, "(R{})", register),
+            Operand::Constant(constant) => write!(f, "{:X}", constant),
+        }
+    }
+}
+
+impl fmt::Debug for Instruction {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "Instruction {{ {:025b} }}", self.instruction)
+    }
+}
+
+/// Instruction of the 2i with all fields already extracted.
+///
+/// Decoding an `Instruction` once and executing the decoded form using
+/// `Cpu::execute_decoded` avoids extracting the bit fields again in every
+/// step. Invalid combinations of the bus fields are preserved and only
+/// result in an error when the instruction is executed.
+#[derive(Copy, Clone, Debug)]
+pub struct DecodedInstruction {
+    pub(crate) instruction: Instruction,
+    pub(crate) input_a: AluInputA,
+    pub(crate) input_b: AluInputB,
+    pub(crate) alu_instruction: u8,
+    pub(crate) alu: AluFunction,
+    pub(crate) write_register: Option<usize>,
+    pub(crate) write_bus: Option<usize>,
+    pub(crate) address_control: AddressControl,
+    pub(crate) next_address: u8,
+    pub(crate) store_flags: bool,
+}
+
+/// Source of the alu input a
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub enum AluInputA {
+    /// The register with the given address
+    Register(usize),
+    /// The bus at the address contained in the given register
+    Bus(usize),
+    /// Reading from the bus is not possible (disabled or in write mode)
+    Invalid(&'static str),
+}
+
+/// Source of the alu input b
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub enum AluInputB {
+    /// The register with the given address
+    Register(usize),
+    /// The sign extended constant
+    Constant(u8),
+}
+
+/// Kind of the address control (MAC1-0 + NA0)
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+pub enum AddressControl {
+    /// 000, 001: Unconditional jump to the full next address
+    Jump,
+    /// 010: Last bit is the volatile interrupt
+    VolatileInterrupt,
+    /// 011: Last bit is the carry of the flag register
+    StoredCarry,
+    /// 100: Last bit is the carry out of the alu
+    Carry,
+    /// 101: Last bit is the zero out of the alu
+    Zero,
+    /// 110: Last bit is the negative out of the alu
+    Negative,
+    /// 111: Last bit is the stored interrupt, which is reset afterwards
+    StoredInterrupt,
+}
+
+impl DecodedInstruction {
+    /// Extract all fields of the given instruction using the default
+    /// alu kernel.
+    pub fn new(inst: Instruction) -> DecodedInstruction {
+        DecodedInstruction::with_alu_kernel(inst, AluKernel::default())
+    }
+
+    /// Extract all fields of the given instruction and select the function
+    /// calculating its alu instruction using the given kernel.
+    pub fn with_alu_kernel(inst: Instruction, kernel: AluKernel) -> DecodedInstruction {
+        let input_a = if ! inst.is_alu_input_a_bus() {
+            AluInputA::Register(inst.get_register_address_a())
+        } else if ! inst.is_bus_enabled() {
+            AluInputA::Invalid("Cannot read from disabled bus")
+        } else if inst.is_bus_writable() {
+            AluInputA::Invalid("Cannot read from bus while it is in write mode")
         } else {
-            "TEST ".to_string()
+            AluInputA::Bus(inst.get_register_address_a())
         };
 
-        // Determine address control and next address
-        let next_address = self.get_next_instruction_address();
-        let address_control = if self.get_address_control() == 0 &&
-            address.map(|a| a + 1) == Some(next_address as usize) {
-            String::new()
-        } else if self.get_address_control() == 0 &&
-                  address == Some(next_address as usize) {
-            "; LOOP".to_string()
+        let input_b = if inst.is_alu_input_b_const() {
+            AluInputB::Constant(inst.get_constant_input())
         } else {
-            let next_address_base = next_address >> 1; // Cut off last bit
+            AluInputB::Register(inst.get_register_address_b())
+        };
 
-            match self.get_full_address_control() {
-                0b000 | 0b001 => format!("; JMP {:05b}", next_address),
-                0b010 => format!("; INTA {:04b}I", next_address_base),
-                0b011 => format!("; CF {:04b}C", next_address_base),
-                0b100 => format!("; CO {:04b}C", next_address_base),
-                0b101 => format!("; ZO {:04b}Z", next_address_base),
-                0b110 => format!("; NO {:04b}N", next_address_base),
-                0b111 => format!("; INTB {:04b}I", next_address_base),
-                _ => panic!("Invalid address control"),
-            }
+        let write_register = if ! inst.should_write_register() {
+            None
+        } else if inst.should_write_register_b() {
+            Some(inst.get_register_address_b())
+        } else {
+            Some(inst.get_register_address_a())
         };
 
-        // Determine flag storage
-        let change_flags = if self.should_store_flags() {
-            "; CHFL".to_string()
+        let write_bus = if inst.is_bus_enabled() && inst.is_bus_writable() {
+            Some(inst.get_register_address_a())
         } else {
-            String::new()
+            None
         };
 
-        let mac = self.get_address_control();
-        let mac_full = self.get_full_address_control();
-        if self.instruction & 0b0000000111111111111111110 == 0 &&
-           (mac == 0b00 || mac_full == 0b010 || mac_full == 0b111) {
-            // NOP if everything except NA and CHFL is zero
-            // or if full NA specifies an interrupt as source
-            format!("NOP{}{}", address_control, change_flags)
+        let address_control = match inst.get_full_address_control() {
+            0b000 | 0b001 => AddressControl::Jump,
+            0b010 => AddressControl::VolatileInterrupt,
+            0b011 => AddressControl::StoredCarry,
+            0b100 => AddressControl::Carry,
+            0b101 => AddressControl::Zero,
+            0b110 => AddressControl::Negative,
+            0b111 => AddressControl::StoredInterrupt,
+            _ => panic!("Invalid address control"),
+        };
+
+        // Conditional jumps only use the base address without the last bit
+        let next_address = if address_control == AddressControl::Jump {
+            inst.get_next_instruction_address()
         } else {
-            format!("{}{}{}{}", output, result, address_control, change_flags)
+            inst.get_next_instruction_address() & 0b11110
+        };
+
+        DecodedInstruction {
+            instruction: inst,
+            input_a: input_a,
+            input_b: input_b,
+            alu_instruction: inst.get_alu_instruction(),
+            alu: kernel.function(inst.get_alu_instruction()),
+            write_register: write_register,
+            write_bus: write_bus,
+            address_control: address_control,
+            next_address: next_address,
+            store_flags: inst.should_store_flags(),
         }
     }
+
+    /// The original instruction.
+    pub fn instruction(&self) -> Instruction {
+        self.instruction
+    }
+
+    /// The kind of the address control.
+    pub fn address_control(&self) -> AddressControl {
+        self.address_control
+    }
+
+    /// Check if the instruction writes to the bus.
+    pub fn writes_bus(&self) -> bool {
+        self.write_bus.is_some()
+    }
 }
 
-impl fmt::Debug for Instruction {
-    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
-        write!(f, "Instruction {{ {:025b} }}", self.instruction)
+impl From<Instruction> for DecodedInstruction {
+    fn from(inst: Instruction) -> Self {
+        DecodedInstruction::new(inst)
+    }
+}
+
+/// Decode all instructions of a program.
+pub fn decode_program(program: &[Instruction; 32]) -> [DecodedInstruction; 32] {
+    let mut decoded = [DecodedInstruction::new(Instruction::default()); 32];
+
+    for (decoded, &instruction) in decoded.iter_mut().zip(program.iter()) {
+        *decoded = DecodedInstruction::new(instruction);
+    }
+
+    decoded
+}
+
+/// Decoded program without invalid bus accesses.
+///
+/// Can only be created by `parse::verify_program`, which guarantees that no
+/// reachable instruction reads from a disabled bus or from a bus in write
+/// mode. Use `Cpu::execute_verified` to execute it without these checks
+/// (unreachable instructions are still checked).
+#[derive(Clone)]
+pub struct VerifiedProgram {
+    pub(crate) decoded: [DecodedInstruction; 32],
+}
+
+impl VerifiedProgram {
+    /// The decoded instruction at the given address.
+    pub fn get(&self, address: usize) -> &DecodedInstruction {
+        &self.decoded[address]
     }
 }
 
@@ -305,6 +526,34 @@ mod tests {
         assert_eq!(i1.get_address_control(), 0b00);
     }
 
+    #[test]
+    fn decode_fields() {
+        // Load from memory location FC (register 0) into register 2
+        let d = DecodedInstruction::new(Instruction::new(0b00_00010_01_000_0010_11_10_0000_0).unwrap());
+        assert_eq!(d.input_a, AluInputA::Bus(0b000));
+        assert_eq!(d.input_b, AluInputB::Register(0b010));
+        assert_eq!(d.alu_instruction, 0b0000);
+        assert_eq!(d.write_register, Some(0b010));
+        assert_eq!(d.write_bus, None);
+        assert_eq!(d.address_control, AddressControl::Jump);
+        assert_eq!(d.next_address, 0b00010);
+        assert_eq!(d.store_flags, false);
+
+        // (R1) = -2; ZO 0100Z; CHFL
+        let d = DecodedInstruction::new(Instruction::new(0b10_01001_11_001_1110_00_01_1100_1).unwrap());
+        assert_eq!(d.input_a, AluInputA::Register(0b001));
+        assert_eq!(d.input_b, AluInputB::Constant(0b11111110));
+        assert_eq!(d.write_register, None);
+        assert_eq!(d.write_bus, Some(0b001));
+        assert_eq!(d.address_control, AddressControl::Zero);
+        assert_eq!(d.next_address, 0b01000);
+        assert_eq!(d.store_flags, true);
+
+        // Reading from a disabled bus
+        let d = DecodedInstruction::new(Instruction::new(0b00_00000_00_000_0000_01_10_0001_0).unwrap());
+        assert_eq!(d.input_a, AluInputA::Invalid("Cannot read from disabled bus"));
+    }
+
     #[test]
     fn looping() {
         let testcases = [
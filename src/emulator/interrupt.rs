@@ -0,0 +1,246 @@
+//! Interrupts triggered at given cycles.
+//!
+//! This module contains schedules of interrupts, which are triggered after a
+//! given number of executed instructions (cycles) once or periodically. A
+//! schedule is turned into a queue of events ordered by their cycle, so an
+//! execution can run straight until the next event instead of checking the
+//! schedule in every step.
+
+use std::cmp::Reverse;
+use std::collections::BinaryHeap;
+
+use super::{Cpu, Error, Result};
+
+/// Interrupt input of the 2i
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Interrupt {
+    /// Volatile interrupt (MAC 010), only valid for the next instruction
+    A,
+    /// Stored interrupt (MAC 111), valid until used by an instruction
+    B,
+}
+
+impl Interrupt {
+    /// Trigger the interrupt on the given cpu
+    pub fn trigger(self, cpu: &mut Cpu) {
+        match self {
+            Interrupt::A => cpu.trigger_volatile_interrupt(),
+            Interrupt::B => cpu.trigger_stored_interrupt(),
+        }
+    }
+}
+
+/// Interrupt triggered at a cycle and optionally repeated with a period.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct Event {
+    pub interrupt: Interrupt,
+    /// Number of instructions executed before the interrupt is triggered
+    pub cycle: u64,
+    pub period: Option<u64>,
+}
+
+impl Event {
+    /// Parse an event like `INTB@1000` (once at cycle 1000), `INTA@5+37` (at
+    /// cycle 5 and then every 37 cycles) or `INTA+37` (every 37 cycles,
+    /// starting at cycle 37).
+    pub fn parse(event: &str) -> Result<Event> {
+        let event = event.trim();
+        let interrupt = match event.get(..4) {
+            Some("INTA") => Interrupt::A,
+            Some("INTB") => Interrupt::B,
+            _ => return Err(Error::Parse("Invalid interrupt")),
+        };
+
+        let parse = |number: &str| number.parse::<u64>().map_err(|_| {
+            Error::Parse("Invalid interrupt cycle")
+        });
+        let (cycle, period) = match event[4..].find('+') {
+            Some(split) => (&event[4..4 + split], Some(parse(&event[5 + split..])?)),
+            None => (&event[4..], None),
+        };
+        let cycle = match (cycle, period) {
+            ("", Some(period)) => period,
+            (cycle, _) if cycle.starts_with('@') => parse(&cycle[1..])?,
+            _ => return Err(Error::Parse("Invalid interrupt cycle")),
+        };
+        if period == Some(0) {
+            return Err(Error::Parse("Invalid interrupt period"));
+        }
+
+        Ok(Event {
+            interrupt: interrupt,
+            cycle: cycle,
+            period: period,
+        })
+    }
+}
+
+/// Schedule of interrupts for an execution.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::Cpu;
+/// use emulator::interrupt::{Event, Schedule};
+///
+/// let mut schedule = Schedule::new();
+/// schedule.add(Event::parse("INTA+37").unwrap());
+/// schedule.add(Event::parse("INTB@1000").unwrap());
+///
+/// let mut queue = schedule.queue();
+/// assert_eq!(queue.next_cycle(), Some(37));
+///
+/// let mut cpu = Cpu::new();
+/// queue.trigger(37, &mut cpu);
+/// assert!(cpu.check_volatile_interrupt());
+/// assert_eq!(queue.next_cycle(), Some(74));
+///
+/// // Starting at cycle 1000 the schedule repeats every 37 cycles
+/// assert_eq!(schedule.steady_state(), Some((1001, 37)));
+/// ```
+#[derive(Clone, Debug, Default, PartialEq)]
+pub struct Schedule {
+    events: Vec<Event>,
+}
+
+impl Schedule {
+    pub fn new() -> Schedule {
+        Schedule::default()
+    }
+
+    pub fn add(&mut self, event: Event) {
+        self.events.push(event);
+    }
+
+    pub fn clear(&mut self) {
+        self.events.clear();
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.events.is_empty()
+    }
+
+    pub fn events(&self) -> &[Event] {
+        &self.events
+    }
+
+    /// Create a queue of the events for a new execution
+    pub fn queue(&self) -> Queue<'_> {
+        Queue {
+            events: &self.events,
+            pending: self.events.iter().enumerate().map(|(i, event)| {
+                Reverse((event.cycle, i))
+            }).collect(),
+        }
+    }
+
+    /// Return the first cycle after which the schedule repeats and its period
+    ///
+    /// Two states of the machine at cycles `start + k * period` are only
+    /// followed by the same states if they are equal, so cycles of the
+    /// machine can only be detected by comparing states at these cycles.
+    /// Returns None if the period or the end of the single events is too
+    /// large.
+    pub fn steady_state(&self) -> Option<(u64, u64)> {
+        let mut start = 0;
+        let mut period = 1u64;
+
+        for event in self.events.iter() {
+            match event.period {
+                Some(length) => {
+                    start = start.max(event.cycle);
+                    period = period.checked_mul(length / gcd(period, length))?;
+                }
+                // Single events have to be triggered before
+                None => start = start.max(event.cycle.checked_add(1)?),
+            }
+        }
+
+        Some((start, period))
+    }
+}
+
+/// Events of a schedule ordered by the cycle they are triggered next.
+pub struct Queue<'a> {
+    events: &'a [Event],
+    pending: BinaryHeap<Reverse<(u64, usize)>>,
+}
+
+impl Queue<'_> {
+    /// Return the cycle of the next event
+    pub fn next_cycle(&self) -> Option<u64> {
+        self.pending.peek().map(|&Reverse((cycle, _))| cycle)
+    }
+
+    /// Trigger all interrupts due at (or before) the given cycle on the cpu.
+    pub fn trigger(&mut self, cycle: u64, cpu: &mut Cpu) {
+        self.trigger_with(cycle, |interrupt| interrupt.trigger(cpu));
+    }
+
+    /// Call `trigger` for all interrupts due at (or before) the given cycle
+    /// and schedule the next occurrence of periodic ones.
+    pub fn trigger_with<F: FnMut(Interrupt)>(&mut self, cycle: u64, mut trigger: F) {
+        while let Some(&Reverse((next, i))) = self.pending.peek() {
+            if next > cycle {
+                return;
+            }
+
+            self.pending.pop();
+            let event = &self.events[i];
+            trigger(event.interrupt);
+            if let Some(period) = event.period {
+                if let Some(next) = next.checked_add(period) {
+                    self.pending.push(Reverse((next, i)));
+                }
+            }
+        }
+    }
+}
+
+fn gcd(a: u64, b: u64) -> u64 {
+    if b == 0 { a } else { gcd(b, a % b) }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn parse() {
+        assert_eq!(Event::parse("INTB@1000").unwrap(),
+                   Event { interrupt: Interrupt::B, cycle: 1000, period: None });
+        assert_eq!(Event::parse(" INTA@5+37").unwrap(),
+                   Event { interrupt: Interrupt::A, cycle: 5, period: Some(37) });
+        assert_eq!(Event::parse("INTA+37").unwrap(),
+                   Event { interrupt: Interrupt::A, cycle: 37, period: Some(37) });
+
+        for invalid in ["INTC@1", "INTA", "INTA@", "INTA@x", "INTA+0", "INTA37", "INTA@1+"].iter() {
+            assert!(Event::parse(invalid).is_err(), "{}", invalid);
+        }
+    }
+
+    #[test]
+    fn queue() {
+        let mut schedule = Schedule::new();
+        schedule.add(Event::parse("INTA+3").unwrap());
+        schedule.add(Event::parse("INTB@4+2").unwrap());
+        schedule.add(Event::parse("INTB@5").unwrap());
+
+        let mut queue = schedule.queue();
+        let mut triggered = Vec::new();
+        while let Some(cycle) = queue.next_cycle().filter(|&cycle| cycle <= 9) {
+            queue.trigger_with(cycle, |interrupt| triggered.push((cycle, interrupt)));
+        }
+
+        assert_eq!(triggered, vec![
+            (3, Interrupt::A), (4, Interrupt::B), (5, Interrupt::B), (6, Interrupt::A),
+            (6, Interrupt::B), (8, Interrupt::B), (9, Interrupt::A),
+        ]);
+        assert_eq!(schedule.steady_state(), Some((6, 6)));
+        assert_eq!(Schedule::new().steady_state(), Some((0, 1)));
+
+        let mut schedule = Schedule::new();
+        schedule.add(Event::parse("INTB@18446744073709551615").unwrap());
+        assert_eq!(schedule.steady_state(), None);
+    }
+}
@@ -9,16 +9,32 @@ use std::io;
 use std::result;
 
 pub mod alu;
+pub mod binary;
 pub mod bus;
+pub mod cfg;
 pub mod cpu;
+pub mod cycle;
+pub mod device;
+pub mod explore;
+pub mod fuzz;
+pub mod history;
 pub mod instruction;
+pub mod interrupt;
+pub mod listing;
+pub mod lockstep;
+pub mod machine;
+pub mod observe;
 pub mod parse;
+pub mod profile;
+pub mod superblock;
+pub mod trace;
 
 // Re-exports
 pub use crate::alu::Flags;
 pub use crate::cpu::Cpu;
-pub use crate::instruction::Instruction;
-pub use crate::bus::{Bus, IoRegisters, Ram};
+pub use crate::instruction::{DecodedInstruction, Instruction};
+pub use crate::bus::{Bus, BusMut, IoRam, IoRegisters, Ram};
+pub use crate::machine::Machine;
 
 #[derive(Debug)]
 pub enum Error {
@@ -26,6 +42,7 @@ pub enum Error {
     Cpu(&'static str),
     Instruction(&'static str),
     Parse(&'static str),
+    Verify(u8, &'static str),
     Io(io::Error),
 }
 
@@ -36,6 +53,7 @@ impl fmt::Display for Error {
             &Error::Cpu(s) => write!(f, "Cpu error: {}", s),
             &Error::Instruction(s) => write!(f, "Instruction error: {}", s),
             &Error::Parse(s) => write!(f, "Parse error: {}", s),
+            &Error::Verify(a, s) => write!(f, "Verify error at {:05b}: {}", a, s),
             &Error::Io(ref s) => write!(f, "IO error: {}", s),
         }
     }
@@ -0,0 +1,167 @@
+//! Precomputed listings of programs.
+//!
+//! This module contains a view of a program with the mnemonic, the fields
+//! and the reachability of every instruction, which is computed once and
+//! can then be borrowed by everything that displays the program.
+
+use super::cfg::Cfg;
+use super::instruction::Instruction;
+
+/// Fields of an instruction in the order of the instruction format
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct Fields {
+    /// MAC0-1 (2 bit)
+    pub address_control: u8,
+    /// NA0-4 (5 bit)
+    pub next_address: u8,
+    /// BUSWR and BUSEN
+    pub bus_writable: bool,
+    pub bus_enabled: bool,
+    /// MRGAA0-2 (3 bit)
+    pub register_a: u8,
+    /// MRGAB0-3 (4 bit, also the register address b)
+    pub register_b: u8,
+    /// MRGWS and MRGWE
+    pub write_register_b: bool,
+    pub write_register: bool,
+    /// MALUIA and MALUIB
+    pub alu_input_a_bus: bool,
+    pub alu_input_b_const: bool,
+    /// MALUS0-3 (4 bit)
+    pub alu_instruction: u8,
+    /// MCHFLG
+    pub store_flags: bool,
+}
+
+impl Fields {
+    pub fn new(inst: Instruction) -> Fields {
+        Fields {
+            address_control: inst.get_address_control(),
+            next_address: inst.get_next_instruction_address(),
+            bus_writable: inst.is_bus_writable(),
+            bus_enabled: inst.is_bus_enabled(),
+            register_a: inst.get_register_address_a() as u8,
+            register_b: inst.get_constant_input() & 0b1111,
+            write_register_b: inst.should_write_register_b(),
+            write_register: inst.should_write_register(),
+            alu_input_a_bus: inst.is_alu_input_a_bus(),
+            alu_input_b_const: inst.is_alu_input_b_const(),
+            alu_instruction: inst.get_alu_instruction(),
+            store_flags: inst.should_store_flags(),
+        }
+    }
+}
+
+/// Mnemonics, fields and reachability of all instructions of a program.
+///
+/// All mnemonics are stored in a single string, so creating the listing
+/// only allocates once per program.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::listing::Listing;
+/// use emulator::parse::read_program;
+///
+/// let program = read_program(&b"
+///     00000: 00 00001 00 000 0110 01 01 0100 0
+///     00001: 00 00001 00 000 0000 00 00 0000 0"[..]).unwrap();
+/// let listing = Listing::new(&program);
+///
+/// assert_eq!(listing.mnemonic(0), "R0 = R0 + 6");
+/// assert_eq!(listing.mnemonic(1), "NOP; LOOP");
+/// assert_eq!(listing.fields(0).register_b, 6);
+/// assert_eq!(listing.reachable().collect::<Vec<_>>(), vec![0, 1]);
+/// ```
+#[derive(Clone, Debug)]
+pub struct Listing {
+    mnemonics: String,
+    /// End of the mnemonic of every address in `mnemonics`
+    ends: [usize; 32],
+    fields: [Fields; 32],
+    reachable: u32,
+}
+
+impl Listing {
+    /// Create the listing of a program and find the reachable instructions
+    pub fn new(program: &[Instruction; 32]) -> Listing {
+        let reachable = Cfg::new(program).reachable().fold(0, |bitmap, address| {
+            bitmap | 1 << address
+        });
+        Listing::with_reachable(program, reachable)
+    }
+
+    /// Create the listing of a program with the given bitmap of reachable
+    /// addresses (eg: from a `BinaryProgram`)
+    pub fn with_reachable(program: &[Instruction; 32], reachable: u32) -> Listing {
+        let mut listing = Listing {
+            mnemonics: String::with_capacity(32 * 24),
+            ends: [0; 32],
+            fields: [Fields::default(); 32],
+            reachable: reachable,
+        };
+
+        for (address, inst) in program.iter().enumerate() {
+            inst.write_mnemonic(Some(address), &mut listing.mnemonics).unwrap();
+            listing.ends[address] = listing.mnemonics.len();
+            listing.fields[address] = Fields::new(*inst);
+        }
+
+        listing
+    }
+
+    pub fn mnemonic(&self, address: usize) -> &str {
+        let start = if address == 0 { 0 } else { self.ends[address - 1] };
+        &self.mnemonics[start..self.ends[address]]
+    }
+
+    pub fn fields(&self, address: usize) -> &Fields {
+        &self.fields[address]
+    }
+
+    pub fn is_reachable(&self, address: usize) -> bool {
+        self.reachable & 1 << address != 0
+    }
+
+    /// All reachable addresses in ascending order
+    pub fn reachable(&self) -> impl Iterator<Item = usize> + '_ {
+        (0..32).filter(move |&address| self.is_reachable(address))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parse::read_program;
+
+    #[test]
+    fn matches_instructions() {
+        let program = read_program(&b"
+            00000: 00 00001 00 000 1100 01 01 1100 0
+            00001: 00 00010 01 000 0000 01 10 0001 0
+            00010: 10 00111 11 101 1010 11 11 1011 1
+            00110: 00 00111 00 000 0000 00 00 0000 0
+            00111: 00 00000 00 000 0000 00 00 0000 0"[..]).unwrap();
+        let listing = Listing::new(&program);
+
+        for (address, inst) in program.iter().enumerate() {
+            assert_eq!(listing.mnemonic(address), inst.to_mnemonic(Some(address)));
+        }
+        assert_eq!(listing.fields(2), &Fields {
+            address_control: 0b10,
+            next_address: 0b00111,
+            bus_writable: true,
+            bus_enabled: true,
+            register_a: 0b101,
+            register_b: 0b1010,
+            write_register_b: true,
+            write_register: true,
+            alu_input_a_bus: true,
+            alu_input_b_const: true,
+            alu_instruction: 0b1011,
+            store_flags: true,
+        });
+        assert_eq!(listing.reachable().collect::<Vec<_>>(), vec![0, 1, 2, 6, 7]);
+        assert!(! listing.is_reachable(3));
+    }
+}
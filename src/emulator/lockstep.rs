@@ -0,0 +1,553 @@
+//! Lockstep execution of many machines.
+//!
+//! This module contains a batch engine that executes the same program on up
+//! to 64 machines (lanes) at once, eg to test a program with many different
+//! inputs.
+
+use super::{Error, Flags};
+use super::instruction::{AddressControl, AluInputA, AluInputB, DecodedInstruction};
+
+const CARRY: u8 = 0b001;
+const NEGATIVE: u8 = 0b010;
+const ZERO: u8 = 0b100;
+
+/// `N` machines of the 2i executed in lockstep.
+///
+/// Each lane behaves exactly like a `Cpu` with an `IoRam`. The state is
+/// stored as a structure of arrays, so all lanes that are at the same
+/// instruction address execute it together using byte-wise operations over
+/// all lanes, which the compiler can vectorize. Lanes at different addresses
+/// are grouped by their address. Lanes are stopped when they reach an error.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::instruction::decode_program;
+/// use emulator::lockstep::Lockstep;
+/// use emulator::parse::read_program;
+///
+/// // Multiplication: (FE) = (FC) * (FD)
+/// let program = read_program(&b"
+///     00 00001 00 000 1100 01 01 1100 0
+///     00 00010 01 000 0000 01 10 0001 0
+///     00 00011 00 001 1101 01 01 1100 0
+///     00 00100 01 001 0000 01 10 0001 0
+///     00 00101 00 010 0000 01 00 0011 0
+///     10 00111 00 000 0000 00 00 0001 0
+///     00 01000 00 000 1111 01 01 0100 0
+///     00 01001 00 001 1110 01 01 1100 0
+///     00 00101 00 010 0001 01 00 0100 0
+///     00 00000 11 001 0010 00 00 1100 0"[..]).unwrap();
+/// let program = decode_program(&program);
+///
+/// let mut lanes = Lockstep::<8>::new();
+/// for lane in 0..8 {
+///     lanes.set_input(lane, 0, lane as u8);
+///     lanes.set_input(lane, 1, 3);
+/// }
+/// lanes.run(&program, 100, Some(9));
+/// assert_eq!(lanes.running(), 0);
+///
+/// // Stopped before writing the result, so it is still in R2
+/// assert_eq!(lanes.registers(5)[2], 15);
+/// ```
+pub struct Lockstep<const N: usize> {
+    registers: [[u8; N]; 8],
+    flag_register: [u8; N],
+    instruction_pointer: [u8; N],
+    volatile_interrupt: u64,
+    stored_interrupt: u64,
+    memory: Box<[[u8; N]; 256]>,
+    input: [[u8; N]; 4],
+    output: [[u8; N]; 2],
+    running: u64,
+    errors: Vec<Option<Error>>,
+}
+
+impl<const N: usize> Lockstep<N> {
+    /// Create `N` (at most 64) lanes with all registers, flags and memory set
+    /// to zero.
+    pub fn new() -> Lockstep<N> {
+        assert!(N > 0 && N <= 64, "Lockstep supports between 1 and 64 lanes");
+
+        Lockstep {
+            registers: [[0; N]; 8],
+            flag_register: [0; N],
+            instruction_pointer: [0; N],
+            volatile_interrupt: 0,
+            stored_interrupt: 0,
+            memory: Box::new([[0; N]; 256]),
+            input: [[0; N]; 4],
+            output: [[0; N]; 2],
+            running: u64::MAX >> (64 - N),
+            errors: (0..N).map(|_| None).collect(),
+        }
+    }
+
+    /// Set all registers, flags, memory and inputs of all lanes to zero
+    /// and start them again, without allocating new memory.
+    pub fn reset(&mut self) {
+        self.registers = [[0; N]; 8];
+        self.flag_register = [0; N];
+        self.instruction_pointer = [0; N];
+        self.volatile_interrupt = 0;
+        self.stored_interrupt = 0;
+        for address in self.memory.iter_mut() {
+            *address = [0; N];
+        }
+        self.input = [[0; N]; 4];
+        self.output = [[0; N]; 2];
+        self.running = u64::MAX >> (64 - N);
+        for error in self.errors.iter_mut() {
+            *error = None;
+        }
+    }
+
+    /// Set the input register (0-3 for FC-FF) of the given lane.
+    pub fn set_input(&mut self, lane: usize, register: usize, value: u8) {
+        self.input[register][lane] = value;
+    }
+
+    /// The output registers (FE and FF) of the given lane.
+    pub fn output(&self, lane: usize) -> [u8; 2] {
+        [self.output[0][lane], self.output[1][lane]]
+    }
+
+    /// The registers of the given lane.
+    pub fn registers(&self, lane: usize) -> [u8; 8] {
+        let mut registers = [0; 8];
+        for (register, lanes) in registers.iter_mut().zip(self.registers.iter()) {
+            *register = lanes[lane];
+        }
+        registers
+    }
+
+    /// The flag register of the given lane.
+    pub fn flags(&self, lane: usize) -> Flags {
+        let flags = self.flag_register[lane];
+        Flags::new(flags & CARRY != 0, flags & NEGATIVE != 0, flags & ZERO != 0)
+    }
+
+    /// The ram of the given lane at the given address.
+    pub fn memory(&self, lane: usize, address: u8) -> u8 {
+        self.memory[address as usize][lane]
+    }
+
+    /// The address of the next instruction of the given lane.
+    pub fn instruction_pointer(&self, lane: usize) -> usize {
+        self.instruction_pointer[lane] as usize
+    }
+
+    /// The error that stopped the given lane.
+    pub fn error(&self, lane: usize) -> Option<&Error> {
+        self.errors[lane].as_ref()
+    }
+
+    /// Bitmask of all lanes that are still running.
+    pub fn running(&self) -> u64 {
+        self.running
+    }
+
+    /// Stop the given lane.
+    pub fn stop(&mut self, lane: usize) {
+        self.running &= !(1 << lane);
+    }
+
+    /// Enable the volatile interrupt of the given lane for the next step.
+    pub fn trigger_volatile_interrupt(&mut self, lane: usize) {
+        self.volatile_interrupt |= 1 << lane;
+    }
+
+    /// Enable the stored interrupt of the given lane.
+    pub fn trigger_stored_interrupt(&mut self, lane: usize) {
+        self.stored_interrupt |= 1 << lane;
+    }
+
+    /// Execute at most `max_steps` instructions on all running lanes.
+    ///
+    /// Lanes are stopped before executing the instruction at
+    /// `until_address`. Returns the number of steps executed until all lanes
+    /// were stopped or the limit was reached.
+    pub fn run(&mut self, program: &[DecodedInstruction; 32], max_steps: u64,
+               until_address: Option<usize>) -> u64 {
+        let mut steps = 0;
+
+        loop {
+            if let Some(address) = until_address {
+                for lane in 0..N {
+                    if self.instruction_pointer[lane] as usize == address {
+                        self.stop(lane);
+                    }
+                }
+            }
+
+            if self.running == 0 || steps == max_steps {
+                return steps;
+            }
+
+            self.step(program);
+            steps += 1;
+        }
+    }
+
+    /// Execute the next instruction on all running lanes.
+    pub fn step(&mut self, program: &[DecodedInstruction; 32]) {
+        // Group the running lanes by their instruction address
+        let mut groups = [0u64; 32];
+        for lane in 0..N {
+            groups[self.instruction_pointer[lane] as usize & 0b11111] |=
+                (self.running >> lane & 1) << lane;
+        }
+
+        for (address, &lanes) in groups.iter().enumerate() {
+            if lanes != 0 {
+                self.execute(&program[address], lanes);
+            }
+        }
+    }
+
+    /// Execute the instruction on the given lanes
+    fn execute(&mut self, inst: &DecodedInstruction, lanes: u64) {
+        // Selection mask with one byte per lane
+        let mut select = [0u8; N];
+        for (lane, select) in select.iter_mut().enumerate() {
+            *select = 0u8.wrapping_sub((lanes >> lane & 1) as u8);
+        }
+
+        // Determine alu input a (bus or register)
+        let a = match inst.input_a {
+            AluInputA::Register(address) => self.registers[address],
+            AluInputA::Bus(address) => {
+                let mut a = [0; N];
+                for lane in 0..N {
+                    a[lane] = self.read(lane, self.registers[address][lane]);
+                }
+                a
+            }
+            AluInputA::Invalid(error) => {
+                return self.fail(lanes, || Error::Cpu(error));
+            }
+        };
+
+        // Determine alu input b (constant or register)
+        let b = match inst.input_b {
+            AluInputB::Register(address) => self.registers[address],
+            AluInputB::Constant(constant) => [constant; N],
+        };
+
+        let mut carry = [0; N];
+        for lane in 0..N {
+            carry[lane] = self.flag_register[lane] & CARRY;
+        }
+
+        let (result, flags) = calculate(inst.alu_instruction, &a, &b, &carry);
+
+        // Write result to registers
+        if let Some(address) = inst.write_register {
+            let registers = &mut self.registers[address];
+            for lane in 0..N {
+                registers[lane] = result[lane] & select[lane] | registers[lane] & !select[lane];
+            }
+        }
+
+        // Write results to the bus
+        if let Some(address) = inst.write_bus {
+            let mut remaining = lanes;
+            while remaining != 0 {
+                let lane = remaining.trailing_zeros() as usize;
+                remaining &= remaining - 1;
+
+                let bus_address = self.registers[address][lane];
+                if let Err(error) = self.write(lane, bus_address, result[lane]) {
+                    self.fail(1 << lane, || Error::Bus(error));
+                }
+            }
+        }
+
+        // Failed lanes keep their address, flags and interrupts like `Cpu`
+        let lanes = lanes & self.running;
+        for (lane, select) in select.iter_mut().enumerate() {
+            *select = 0u8.wrapping_sub((lanes >> lane & 1) as u8);
+        }
+
+        // Calculate the next instruction address
+        let (source, mask) = match inst.address_control {
+            AddressControl::Jump => (None, 0),
+            AddressControl::VolatileInterrupt => (Some(self.volatile_interrupt), 0),
+            AddressControl::StoredCarry => (None, CARRY),
+            AddressControl::Carry => (None, CARRY),
+            AddressControl::Zero => (None, ZERO),
+            AddressControl::Negative => (None, NEGATIVE),
+            AddressControl::StoredInterrupt => (Some(self.stored_interrupt), 0),
+        };
+        let condition_flags = if inst.address_control == AddressControl::StoredCarry {
+            self.flag_register
+        } else {
+            flags
+        };
+        for lane in 0..N {
+            let condition = match source {
+                Some(interrupts) => (interrupts >> lane & 1) as u8,
+                None => (condition_flags[lane] & mask != 0) as u8,
+            };
+            let next_address = inst.next_address | condition;
+            self.instruction_pointer[lane] = next_address & select[lane] |
+                self.instruction_pointer[lane] & !select[lane];
+        }
+
+        // Store flags in the flag register
+        if inst.store_flags {
+            for lane in 0..N {
+                self.flag_register[lane] = flags[lane] & select[lane] |
+                    self.flag_register[lane] & !select[lane];
+            }
+        }
+
+        // Reset interrupts (stored only if MAC = 111)
+        self.volatile_interrupt &= !lanes;
+        if inst.address_control == AddressControl::StoredInterrupt {
+            self.stored_interrupt &= !lanes;
+        }
+    }
+
+    /// Read from the bus (ram and input registers) of the given lane
+    fn read(&self, lane: usize, address: u8) -> u8 {
+        if address >= 0xFC {
+            self.input[(address - 0xFC) as usize][lane]
+        } else {
+            self.memory[address as usize][lane]
+        }
+    }
+
+    /// Write to the bus (ram and output registers) of the given lane
+    fn write(&mut self, lane: usize, address: u8, value: u8) -> Result<(), &'static str> {
+        if address < 0xFC {
+            self.memory[address as usize][lane] = value;
+            Ok(())
+        } else if address >= 0xFE {
+            self.output[(address - 0xFE) as usize][lane] = value;
+            Ok(())
+        } else {
+            Err("Cannot write to input register")
+        }
+    }
+
+    /// Stop the given lanes because of an error
+    fn fail<F: Fn() -> Error>(&mut self, lanes: u64, error: F) {
+        for lane in 0..N {
+            if lanes >> lane & 1 == 1 {
+                self.errors[lane] = Some(error());
+            }
+        }
+        self.running &= !lanes;
+    }
+}
+
+/// Calculate the alu instruction for all lanes.
+///
+/// The carry is passed as 0 or 1 for every lane. Returns the results and the
+/// resulting flags (bitmask of `CARRY`, `NEGATIVE` and `ZERO`).
+fn calculate<const N: usize>(instruction: u8, a: &[u8; N], b: &[u8; N], carry: &[u8; N])
+    -> ([u8; N], [u8; N]) {
+    let mut result = [0u8; N];
+    let mut carry_out = [0u8; N];
+
+    // Additions are calculated with 16 bit, the ninth bit is the carry
+    macro_rules! lanes {
+        (|$i:ident| $result:expr, $carry:expr) => {
+            for $i in 0..N {
+                result[$i] = $result;
+                carry_out[$i] = $carry;
+            }
+        };
+    }
+    let sum = |i: usize, c: u8| a[i] as u16 + b[i] as u16 + c as u16;
+
+    match instruction {
+        0b0000 => lanes!(|i| sum(i, 0) as u8, carry[i] | (sum(i, 0) >> 8) as u8),
+        0b0001 => lanes!(|i| a[i], 0),
+        0b0010 => lanes!(|i| !(a[i] | b[i]), 0),
+        0b0011 => lanes!(|i| 0, 0),
+        0b0100 => lanes!(|i| sum(i, 0) as u8, (sum(i, 0) >> 8) as u8),
+        0b0101 => lanes!(|i| sum(i, 1) as u8, 1 ^ (sum(i, 1) >> 8) as u8),
+        0b0110 => lanes!(|i| sum(i, carry[i]) as u8, (sum(i, carry[i]) >> 8) as u8),
+        0b0111 => lanes!(|i| sum(i, 1 ^ carry[i]) as u8, 1 ^ (sum(i, 1 ^ carry[i]) >> 8) as u8),
+        0b1000 => lanes!(|i| a[i] >> 1, a[i] & 1),
+        0b1001 => lanes!(|i| a[i].rotate_right(1), a[i] & 1),
+        0b1010 => lanes!(|i| a[i] >> 1 | carry[i] << 7, a[i] & 1),
+        0b1011 => lanes!(|i| a[i] >> 1 | a[i] & 0b10000000, a[i] & 1),
+        0b1100 => lanes!(|i| b[i], 0),
+        0b1101 => lanes!(|i| b[i], 1),
+        0b1110 => lanes!(|i| b[i], carry[i]),
+        0b1111 => lanes!(|i| b[i], 1 ^ carry[i]),
+        _ => panic!("Invalid alu instruction {}", instruction),
+    }
+
+    let mut flags = [0u8; N];
+    for i in 0..N {
+        flags[i] = carry_out[i] | (result[i] >> 7) << 1 | ((result[i] == 0) as u8) << 2;
+    }
+
+    (result, flags)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{Cpu, Instruction, IoRam};
+    use crate::alu::Alu;
+    use crate::instruction::decode_program;
+
+    /// Deterministic pseudo random numbers (xorshift)
+    fn random(state: &mut u32) -> u32 {
+        *state ^= *state << 13;
+        *state ^= *state >> 17;
+        *state ^= *state << 5;
+        *state
+    }
+
+    #[test]
+    fn alu() {
+        let mut state = 42;
+        let mut a = [0; 64];
+        let mut b = [0; 64];
+        let mut carry = [0; 64];
+        for lane in 0..64 {
+            a[lane] = random(&mut state) as u8;
+            b[lane] = random(&mut state) as u8;
+            carry[lane] = random(&mut state) as u8 & 1;
+        }
+        a[0] = 0;
+        b[0] = 0;
+
+        for instruction in 0..16 {
+            let (result, flags) = calculate(instruction, &a, &b, &carry);
+
+            for lane in 0..64 {
+                let (expected, expected_flags) = Alu::calculate(instruction, a[lane], b[lane], carry[lane] == 1);
+                assert_eq!(result[lane], expected);
+                assert_eq!(flags[lane] & CARRY != 0, expected_flags.carry());
+                assert_eq!(flags[lane] & NEGATIVE != 0, expected_flags.negative());
+                assert_eq!(flags[lane] & ZERO != 0, expected_flags.zero());
+            }
+        }
+    }
+
+    #[test]
+    fn random_programs() {
+        let mut state = 0x1234567;
+
+        for _ in 0..50 {
+            // Random instructions, but mostly valid bus accesses
+            let mut program = [Instruction::default(); 32];
+            for inst in program.iter_mut() {
+                let mut raw = random(&mut state) & 0x1FFFFFF;
+                if raw & 1 << 6 != 0 && random(&mut state) % 4 != 0 {
+                    raw = raw & !(1 << 17) | 1 << 16;
+                }
+                *inst = Instruction::new(raw).unwrap();
+            }
+            let decoded = decode_program(&program);
+
+            let mut lanes = Lockstep::<16>::new();
+            let mut machines: Vec<_> = (0..16).map(|_| (Cpu::new(), IoRam::new(), 0, false)).collect();
+            for (lane, machine) in machines.iter_mut().enumerate() {
+                for register in 0..4 {
+                    let value = random(&mut state) as u8;
+                    lanes.set_input(lane, register, value);
+                    machine.1.inspect_input()[register] = value;
+                }
+            }
+
+            for step in 0..200 {
+                for (lane, machine) in machines.iter_mut().enumerate() {
+                    if (step + lane) % 5 == 0 {
+                        lanes.trigger_volatile_interrupt(lane);
+                        machine.0.trigger_volatile_interrupt();
+                    }
+                    if (step * lane) % 7 == 3 {
+                        lanes.trigger_stored_interrupt(lane);
+                        machine.0.trigger_stored_interrupt();
+                    }
+                }
+
+                lanes.step(&decoded);
+
+                for (lane, machine) in machines.iter_mut().enumerate() {
+                    if machine.3 {
+                        continue;
+                    }
+
+                    // The state after an error must match as well
+                    let result = machine.0.execute_instruction(program[machine.2], &mut machine.1);
+                    match result {
+                        Ok((next_address, _)) => machine.2 = next_address,
+                        Err(_) => machine.3 = true,
+                    }
+                    assert_eq!(lanes.error(lane).is_some(), machine.3);
+                    assert_eq!(lanes.running() >> lane & 1 == 0, machine.3);
+
+                    assert_eq!(lanes.instruction_pointer(lane), machine.2);
+                    assert_eq!(&lanes.registers(lane), machine.0.inspect_registers());
+                    assert_eq!(lanes.flags(lane), *machine.0.inspect_flags());
+                    assert_eq!(&lanes.output(lane), machine.1.inspect_output());
+                    for address in 0..0xFC {
+                        assert_eq!(lanes.memory(lane, address), machine.1.inspect()[address as usize]);
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn write_error_keeps_state() {
+        // R0 = FC, (R0) = R0 + 1 with stored flags (fails, FC is read-only)
+        let mut program = [Instruction::default(); 32];
+        program[0] = Instruction::new(0b00_00001_00_000_1100_01_01_1100_0).unwrap();
+        program[1] = Instruction::new(0b00_00010_11_000_0001_00_00_0100_1).unwrap();
+        let decoded = decode_program(&program);
+
+        let mut lanes = Lockstep::<2>::new();
+        let mut cpu = Cpu::new();
+        let mut ram = IoRam::new();
+        let mut address = 0;
+        for _ in 0..2 {
+            lanes.trigger_volatile_interrupt(0);
+            cpu.trigger_volatile_interrupt();
+            lanes.step(&decoded);
+            if let Ok((next_address, _)) = cpu.execute_instruction(program[address], &mut ram) {
+                address = next_address;
+            }
+        }
+
+        assert!(lanes.error(0).is_some());
+        assert_eq!(lanes.instruction_pointer(0), address);
+        assert_eq!(lanes.instruction_pointer(0), 1);
+        assert_eq!(lanes.flags(0), *cpu.inspect_flags());
+        assert_eq!(&lanes.registers(0), cpu.inspect_registers());
+    }
+
+    #[test]
+    fn stop_at_address() {
+        // Count R0 down from FC and stop at address 1 once it is zero
+        let mut program = [Instruction::default(); 32];
+        program[0] = Instruction::new(0b00_00010_00_000_1100_01_01_1100_0).unwrap();
+        program[2] = Instruction::new(0b00_00011_01_000_0000_01_10_0001_0).unwrap();
+        program[3] = Instruction::new(0b10_00101_00_000_0000_00_00_0001_0).unwrap();
+        program[4] = Instruction::new(0b00_00011_00_000_1111_01_01_0100_0).unwrap();
+        program[5] = Instruction::new(0b00_00001_00_000_0000_00_00_0000_0).unwrap();
+        let program = decode_program(&program);
+
+        let mut lanes = Lockstep::<4>::new();
+        for lane in 0..4 {
+            lanes.set_input(lane, 0, lane as u8 * 3);
+        }
+
+        assert_eq!(lanes.run(&program, 1000, Some(1)), 4 + 9 * 2);
+        assert_eq!(lanes.running(), 0);
+        for lane in 0..4 {
+            assert_eq!(lanes.instruction_pointer(lane), 1);
+            assert!(lanes.error(lane).is_none());
+        }
+    }
+}
@@ -0,0 +1,153 @@
+//! Machines that own their complete state.
+//!
+//! This module contains a 2i that owns its cpu and bus, so it has no
+//! lifetime, can be cloned and compared and is `Send` for all buses that
+//! are. The bus is a type parameter, so the default `IoRam` and devices
+//! mapped using `bus::Mapped` are dispatched statically.
+
+use super::Result;
+use super::alu::Flags;
+use super::bus::{BusMut, IoRam};
+use super::cpu::Cpu;
+use super::history::MachineState;
+use super::instruction::{DecodedInstruction, VerifiedProgram};
+use super::observe::Observer;
+
+/// Complete 2i with the cpu, the instruction pointer and the bus.
+///
+/// The instruction pointer is the first field, so most comparisons of
+/// different states (eg: for detecting cycles) do not have to compare the
+/// bus.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::Machine;
+/// use emulator::instruction::decode_program;
+/// use emulator::parse::read_program;
+///
+/// let program = decode_program(&read_program(&b"
+///     00000: 00 00001 00 001 1110 01 01 1100 0
+///     00001: 00 00001 11 001 0101 00 01 1100 0"[..]).unwrap());
+///
+/// let mut machine: Machine = Machine::default();
+/// for _ in 0..2 {
+///     machine.step(&program).unwrap();
+/// }
+/// assert_eq!(machine.instruction_pointer, 1);
+/// assert_eq!(machine.bus.inspect_output()[0], 5);
+///
+/// // Machines can be moved to other threads
+/// let machine = std::thread::spawn(move || machine).join().unwrap();
+/// ```
+#[derive(Clone, Debug, Default, PartialEq)]
+pub struct Machine<B = IoRam> {
+    pub instruction_pointer: usize,
+    pub cpu: Cpu,
+    pub bus: B,
+}
+
+impl<B: BusMut> Machine<B> {
+    /// Create a machine with the given bus and the cpu and instruction
+    /// pointer set to zero
+    pub fn new(bus: B) -> Machine<B> {
+        Machine {
+            instruction_pointer: 0,
+            cpu: Cpu::new(),
+            bus: bus,
+        }
+    }
+
+    /// Execute the instruction at the instruction pointer and move it to the
+    /// next instruction. Returns the alu flags.
+    pub fn step(&mut self, program: &[DecodedInstruction; 32]) -> Result<Flags> {
+        // Only the lower five bits address an instruction (like in
+        // `Cpu::execute_verified`)
+        let instruction = &program[self.instruction_pointer & 0b11111];
+        let (next_address, flags) = self.cpu.execute_decoded(instruction, &mut self.bus)?;
+        self.instruction_pointer = next_address;
+        Ok(flags)
+    }
+
+    /// Execute the instruction at the instruction pointer like `step` and
+    /// call the hooks of the observer (see `Cpu::execute_observed`)
+    pub fn step_observed<O: Observer>(&mut self, program: &[DecodedInstruction; 32], observer: O) -> Result<Flags> {
+        let instruction = &program[self.instruction_pointer & 0b11111];
+        let (next_address, flags) = self.cpu.execute_observed(instruction, &mut self.bus, observer)?;
+        self.instruction_pointer = next_address;
+        Ok(flags)
+    }
+
+    /// Execute the instruction at the instruction pointer of a verified
+    /// program (see `Cpu::execute_verified`)
+    pub fn step_verified(&mut self, program: &VerifiedProgram) -> Result<Flags> {
+        let (next_address, flags) = self.cpu.execute_verified(program,
+            self.instruction_pointer, &mut self.bus)?;
+        self.instruction_pointer = next_address;
+        Ok(flags)
+    }
+}
+
+impl Machine<IoRam> {
+    /// Take a snapshot of the machine
+    pub fn snapshot(&self) -> MachineState {
+        MachineState::from_io_ram(&self.cpu, self.instruction_pointer, &self.bus)
+    }
+}
+
+impl From<MachineState> for Machine<IoRam> {
+    fn from(snapshot: MachineState) -> Machine<IoRam> {
+        let mut machine = Machine::default();
+        snapshot.restore_io_ram(&mut machine.cpu, &mut machine.instruction_pointer, &mut machine.bus);
+        machine
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::bus::Mapped;
+    use crate::device::{Advance, InputDevice};
+    use crate::instruction::{decode_program, Instruction};
+    use crate::parse::read_program;
+
+    fn is_send<T: Send>(_: &T) {}
+
+    #[test]
+    fn owned_devices() {
+        // (FE) = (FC), reading a new value of the stream every time
+        let program = decode_program(&read_program(&b"
+            00000: 00 00001 00 001 1100 01 01 1100 0
+            00001: 00 00010 00 010 1110 01 01 1100 0
+            00010: 00 00011 01 001 0000 11 10 0001 0
+            00011: 00 00010 11 010 0000 00 00 1100 0"[..]).unwrap());
+
+        let device = InputDevice::new(&[3u8, 5, 7][..], Advance::Read);
+        let mut machine = Machine::new(Mapped::<_, 0xFC, 0xFC>::new(device, IoRam::new()));
+        is_send(&machine);
+
+        let mut outputs = Vec::new();
+        for _ in 0..8 {
+            machine.step(&program).unwrap();
+            if machine.instruction_pointer == 2 {
+                outputs.push(machine.bus.inner.inspect_output()[0]);
+            }
+        }
+        assert_eq!(outputs, vec![0, 3, 5, 7]);
+        assert!(machine.step(&program).is_err());
+
+        let mut machine = Machine::<IoRam>::default();
+        machine.bus.inspect()[7] = 42;
+        machine.instruction_pointer = 5;
+        assert!(Machine::from(machine.snapshot()) == machine);
+    }
+
+    #[test]
+    fn masked_instruction_pointer() {
+        let program = decode_program(&[Instruction::new_looping(1).unwrap(); 32]);
+        let mut machine: Machine = Machine::default();
+        machine.instruction_pointer = 0b100001;
+        machine.step(&program).unwrap();
+        assert_eq!(machine.instruction_pointer, 1);
+    }
+}
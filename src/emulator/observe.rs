@@ -0,0 +1,162 @@
+//! Observers of executed instructions.
+//!
+//! This module contains the hooks that are called by `Cpu::execute_observed`
+//! for every register write, bus access and step. All hooks are empty by
+//! default and the observer is a type parameter, so unused hooks (and
+//! `NoObserver` entirely) are compiled away.
+
+use super::alu::Flags;
+use super::instruction::DecodedInstruction;
+
+/// Hooks called while executing an instruction.
+///
+/// The hooks are called in the order of the instruction execution: reading
+/// the bus, writing the register, writing the bus and the completed step.
+/// Bus hooks are only called for successful accesses and `step` only for
+/// instructions that were executed without errors.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::{Cpu, DecodedInstruction, Instruction, IoRam};
+/// use emulator::observe::Observer;
+///
+/// /// Count all writes to the output registers
+/// struct Outputs(u32);
+///
+/// impl Observer for Outputs {
+///     fn bus_write(&mut self, address: u8, _value: u8) {
+///         self.0 += (address >= 0xFE) as u32;
+///     }
+/// }
+///
+/// // R0 = FE, (R0) = 5
+/// let program = [
+///     DecodedInstruction::new(Instruction::new(0b00_00001_00_000_1110_01_01_1100_0).unwrap()),
+///     DecodedInstruction::new(Instruction::new(0b00_00001_11_000_0101_00_01_1100_0).unwrap()),
+/// ];
+///
+/// let mut cpu = Cpu::new();
+/// let mut ram = IoRam::new();
+/// let mut outputs = Outputs(0);
+/// let mut address = 0;
+/// for _ in 0..3 {
+///     address = cpu.execute_observed(&program[address], &mut ram, &mut outputs).unwrap().0;
+/// }
+/// assert_eq!(outputs.0, 2);
+/// ```
+pub trait Observer {
+    /// A value was read from the given bus address
+    #[inline(always)]
+    fn bus_read(&mut self, _address: u8, _value: u8) {}
+
+    /// The alu result was written to the given register
+    #[inline(always)]
+    fn register_write(&mut self, _register: usize, _value: u8) {}
+
+    /// The alu result was written to the given bus address
+    #[inline(always)]
+    fn bus_write(&mut self, _address: u8, _value: u8) {}
+
+    /// The instruction was executed and continues at `next_address`
+    #[inline(always)]
+    fn step(&mut self, _inst: &DecodedInstruction, _next_address: usize, _flags: Flags) {}
+}
+
+/// Observer without any hooks.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct NoObserver;
+
+impl Observer for NoObserver {}
+
+impl<'o, O: Observer> Observer for &'o mut O {
+    #[inline(always)]
+    fn bus_read(&mut self, address: u8, value: u8) {
+        (**self).bus_read(address, value)
+    }
+    #[inline(always)]
+    fn register_write(&mut self, register: usize, value: u8) {
+        (**self).register_write(register, value)
+    }
+    #[inline(always)]
+    fn bus_write(&mut self, address: u8, value: u8) {
+        (**self).bus_write(address, value)
+    }
+    #[inline(always)]
+    fn step(&mut self, inst: &DecodedInstruction, next_address: usize, flags: Flags) {
+        (**self).step(inst, next_address, flags)
+    }
+}
+
+/// Both observers are called, the first one before the second one
+impl<O: Observer, P: Observer> Observer for (O, P) {
+    #[inline(always)]
+    fn bus_read(&mut self, address: u8, value: u8) {
+        self.0.bus_read(address, value);
+        self.1.bus_read(address, value);
+    }
+    #[inline(always)]
+    fn register_write(&mut self, register: usize, value: u8) {
+        self.0.register_write(register, value);
+        self.1.register_write(register, value);
+    }
+    #[inline(always)]
+    fn bus_write(&mut self, address: u8, value: u8) {
+        self.0.bus_write(address, value);
+        self.1.bus_write(address, value);
+    }
+    #[inline(always)]
+    fn step(&mut self, inst: &DecodedInstruction, next_address: usize, flags: Flags) {
+        self.0.step(inst, next_address, flags);
+        self.1.step(inst, next_address, flags);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{Cpu, IoRam};
+    use crate::instruction::decode_program;
+    use crate::parse::read_program;
+
+    /// Observer that records every hook as a string
+    #[derive(Default)]
+    struct Log(Vec<String>);
+
+    impl Observer for Log {
+        fn bus_read(&mut self, address: u8, value: u8) {
+            self.0.push(format!("read {:02X} {:02X}", address, value));
+        }
+        fn register_write(&mut self, register: usize, value: u8) {
+            self.0.push(format!("R{} = {:02X}", register, value));
+        }
+        fn bus_write(&mut self, address: u8, value: u8) {
+            self.0.push(format!("write {:02X} {:02X}", address, value));
+        }
+        fn step(&mut self, _inst: &DecodedInstruction, next_address: usize, _flags: Flags) {
+            self.0.push(format!("next {}", next_address));
+        }
+    }
+
+    #[test]
+    fn hooks_in_order() {
+        // R0 = FC, R1 = (R0), (R0) = R0 + R1 (fails, FC is read-only)
+        let program = decode_program(&read_program(&b"
+            00000: 00 00001 00 000 1100 01 01 1100 0
+            00001: 00 00010 01 000 0001 11 10 0001 0
+            00010: 00 00010 11 000 0001 00 00 0100 0"[..]).unwrap());
+
+        let mut cpu = Cpu::new();
+        let mut ram = IoRam::new();
+        ram.inspect_input()[0] = 0x2A;
+        let mut observers = (Log::default(), NoObserver);
+
+        let mut address = 0;
+        for _ in 0..2 {
+            address = cpu.execute_observed(&program[address], &mut ram, &mut observers).unwrap().0;
+        }
+        assert!(cpu.execute_observed(&program[address], &mut ram, &mut observers).is_err());
+
+        assert_eq!((observers.0).0, vec!["R0 = FC", "next 1", "read FC 2A", "R1 = 2A", "next 2"]);
+    }
+}
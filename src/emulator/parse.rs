@@ -1,14 +1,18 @@
 //! Parse 2i programs.
 //!
-//! This module contains functions for parsing 2i programs.
+//! This module contains functions for parsing 2i programs and loading many
+//! program files at once.
 
-use std::io::BufReader;
-use std::io::prelude::*;
-
-use regex::Regex;
+use std::fs::File;
+use std::io::{self, Read};
+use std::path::Path;
+use std::str;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
 
 use super::{Error, Result};
-use super::instruction::Instruction;
+use super::cfg::Cfg;
+use super::instruction::{decode_program, AluInputA, Instruction, VerifiedProgram};
 
 /// Parse 2i programs in string representation into arrays of `Instruction`s.
 ///
@@ -30,7 +34,14 @@ use super::instruction::Instruction;
 /// 00001: 00,00000 01 000|0000 01 10,0001 0
 /// ```
 pub fn read_program<R: Read>(reader: R) -> Result<[Instruction; 32]> {
-    let instructions = parse_instructions(reader)?;
+    parse_program(&read_all(reader)?)
+}
+
+/// Parse a 2i program that is already in memory.
+///
+/// Behaves like `read_program`.
+pub fn parse_program(program: &[u8]) -> Result<[Instruction; 32]> {
+    let instructions = parse_instructions(program)?;
 
     let mut final_instructions = [Instruction::default(); 32];
 
@@ -49,17 +60,6 @@ pub fn read_program<R: Read>(reader: R) -> Result<[Instruction; 32]> {
     Ok(final_instructions)
 }
 
-/// Iterator stored on the stack with variable length and storage size of 2
-macro_rules! alternative_2 {
-    // TODO: Using a custom iterator instead of once would be more efficient
-    ($first:expr) => (
-        ::std::iter::once($first).chain(::std::iter::once($first)).take(1)
-    );
-    ($first:expr, $second:expr) => (
-        ::std::iter::once($first).chain(::std::iter::once($second)).take(2)
-    );
-}
-
 /// Parse 2i programs in string representation and return only the reachable
 /// instructions.
 ///
@@ -69,80 +69,138 @@ macro_rules! alternative_2 {
 ///
 /// For details on the syntax of the string representation see `read_program`.
 pub fn read_reachable_program<R: Read>(reader: R) -> Result<Vec<(u8, Instruction)>> {
-    #[derive(Clone, Copy)]
-    enum S {
-        Empty, // Not yet visited
-        Visited, // Visited, but instruction is missing (will get default one)
-        Instruction(Instruction), // Visited and containing a instruction
-    }
+    parse_reachable_program(&read_all(reader)?)
+}
 
-    let instructions = parse_instructions(reader)?;
-    let mut reachable_instructions = [S::Empty; 32];
+/// Parse a 2i program that is already in memory and return only the
+/// reachable instructions.
+///
+/// Behaves like `read_reachable_program`.
+pub fn parse_reachable_program(program: &[u8]) -> Result<Vec<(u8, Instruction)>> {
+    let instructions = parse_instructions(program)?;
 
     // The instruction at address 0 is reachable by definition if it exists
-    reachable_instructions[0] = if let Some(inst) = instructions[0] {
-        S::Instruction(inst)
-    } else {
+    if instructions[0].is_none() {
         return Err(Error::Parse("No instruction reachable"));
+    }
+
+    // Addresses which were visited but did not have a valid instruction get
+    // a looping one, which does not lead to other addresses
+    let mut program = [Instruction::default(); 32];
+    for (address, instruction) in program.iter_mut().enumerate() {
+        *instruction = instructions[address]
+            .unwrap_or_else(|| Instruction::new_looping(address).unwrap());
+    }
+
+    Ok(Cfg::new(&program).reachable().map(|address| {
+        (address, program[address as usize])
+    }).collect())
+}
+
+/// Read everything from the given reader
+fn read_all<R: Read>(mut reader: R) -> Result<Vec<u8>> {
+    let mut program = Vec::new();
+    reader.read_to_end(&mut program)?;
+    Ok(program)
+}
+
+/// Verify that no reachable instruction of the program accesses the bus in
+/// an invalid way.
+///
+/// Reading from the bus is only possible if it is enabled and not in write
+/// mode. Because this only depends on the instructions, checking it once for
+/// the whole program allows executing it using `Cpu::execute_verified`
+/// without checking it again in every step.
+pub fn verify_program(program: &[Instruction; 32]) -> Result<VerifiedProgram> {
+    let decoded = decode_program(program);
+    for address in Cfg::new(program).reachable() {
+        if let AluInputA::Invalid(error) = decoded[address as usize].input_a {
+            return Err(Error::Verify(address, error));
+        }
+    }
+
+    Ok(VerifiedProgram { decoded: decoded })
+}
+
+/// Read and parse many files in parallel.
+///
+/// The files are distributed over all available cores. Returns the results
+/// in the order of the given paths, where the outer error means that the file
+/// could not be opened and the inner one that `parse` failed (including
+/// errors while reading the opened file).
+///
+/// # Examples
+///
+/// ```no_run
+/// use emulator::parse::{load_files, parse_program};
+///
+/// for result in load_files(&["answer.2i", "multiply.2i"], parse_program) {
+///     match result {
+///         Ok(Ok(program)) => println!("{:?}", program[0]),
+///         Ok(Err(e)) => println!("Invalid program: {}", e),
+///         Err(e) => println!("Cannot open file: {}", e),
+///     }
+/// }
+/// ```
+pub fn load_files<P, T, F>(paths: &[P], parse: F) -> Vec<io::Result<Result<T>>>
+    where P: AsRef<Path> + Sync, T: Send, F: Fn(&[u8]) -> Result<T> + Sync {
+    let load = |path: &P| -> io::Result<Result<T>> {
+        let mut file = File::open(path)?;
+        let mut content = Vec::new();
+        Ok(match file.read_to_end(&mut content) {
+            Ok(_) => parse(&content),
+            Err(e) => Err(Error::Io(e)),
+        })
     };
 
-    // Since instructions can jump to earlier addresses, we have to iterate
-    // until no new instruction is found.
-    let mut finished = false;
-    while !finished {
-        finished = true;
-
-        for i in 0..reachable_instructions.len() {
-            if let S::Instruction(inst) = reachable_instructions[i] {
-                let na = inst.get_next_instruction_address();
-
-                // Consider both target addresses for conditional jumps
-                let target_addresses = if inst.get_address_control() == 0 {
-                    alternative_2!(na)
-                } else {
-                    alternative_2!(na & !1u8, na | 1u8)
-                };
-
-                for addr in target_addresses {
-                    let addr = addr as usize;
-                    // Only update instruction addresses that were not yet
-                    // visited. This ensures that the algorithm terminates
-                    if let S::Empty = reachable_instructions[addr] {
-                        finished = false;
-                        if let Some(inst) = instructions[addr] {
-                            reachable_instructions[addr] = S::Instruction(inst);
-                        } else {
-                            reachable_instructions[addr] = S::Visited;
-                        }
-                    }
+    let threads = thread::available_parallelism().map_or(1, |n| n.get()).min(paths.len());
+    if threads <= 1 {
+        return paths.iter().map(load).collect();
+    }
+
+    // Every thread takes the next unprocessed file, so a few large files do
+    // not delay the others
+    let next = AtomicUsize::new(0);
+    let mut results: Vec<(usize, io::Result<Result<T>>)> = thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads).map(|_| scope.spawn(|| {
+            let mut results = Vec::new();
+            loop {
+                let index = next.fetch_add(1, Ordering::Relaxed);
+                match paths.get(index) {
+                    Some(path) => results.push((index, load(path))),
+                    None => return results,
                 }
             }
-        }
-    }
+        })).collect();
+        workers.into_iter().flat_map(|worker| worker.join().unwrap()).collect()
+    });
 
-    // Addresses which were visited but did not have a valid instruction get
-    // a default one (NOP, JMP 0)
-    Ok(reachable_instructions.iter().enumerate().filter_map(|(i,inst)| {
-        match *inst {
-            S::Empty => None,
-            S::Visited => Some((i as u8, Instruction::new_looping(i).unwrap())),
-            S::Instruction(inst) => Some((i as u8, inst)),
-        }
-    }).collect())
+    results.sort_unstable_by_key(|&(index, _)| index);
+    results.into_iter().map(|(_, result)| result).collect()
 }
 
-/// Actually parse the instructions from the given reader
+/// Actually parse the instructions from the given program
 ///
 /// For details on the syntax of the string representation see `read_program`.
-fn parse_instructions<R: Read>(reader: R) -> Result<[Option<Instruction>; 32]> {
+fn parse_instructions(program: &[u8]) -> Result<[Option<Instruction>; 32]> {
+    Ok(parse_source(program)?.0)
+}
+
+/// Parse the instructions and the (1-based) line numbers they are defined in
+///
+/// The lines are only borrowed from the program, so parsing does not
+/// allocate. Missing instructions have the line number 0.
+pub(crate) fn parse_source(program: &[u8]) -> Result<([Option<Instruction>; 32], [u32; 32])> {
     let mut instructions = [None; 32];
+    let mut lines = [0; 32];
     let mut min_address = 0;
-    let explicit_address = Regex::new(r"^(?P<addr>[01]{5})\s*:\s*(?P<inst>.*)$").unwrap();
 
-    let reader = BufReader::new(reader);
-    for line in reader.lines() {
-        let line = line?;
+    // Programs are read as text (with the same error as BufRead::lines)
+    let program = str::from_utf8(program).map_err(|_| {
+        io::Error::new(io::ErrorKind::InvalidData, "stream did not contain valid UTF-8")
+    })?;
 
+    for (number, line) in program.split('\n').enumerate() {
         // Remove whitespace and comments that start with #
         let line = match line.find('#') {
             Some(start) => line[..start].trim(),
@@ -154,27 +212,25 @@ fn parse_instructions<R: Read>(reader: R) -> Result<[Option<Instruction>; 32]> {
             continue;
         }
 
-        // Check if an explicit address is given
-        let (instruction, address) = if line.contains(':') {
-            match explicit_address.captures(line) {
-                Some(matches) => {
-                    let inst = matches.name("inst").unwrap().as_str();
-                    let addr = matches.name("addr").unwrap().as_str();
-                    (inst, Some(addr))
+        // Check if an explicit address is given (five bits before the colon)
+        let (instruction, address) = match line.find(':') {
+            Some(colon) => {
+                let address = line[..colon].trim_end();
+                if address.len() != 5 || ! address.bytes().all(|b| b == b'0' || b == b'1') {
+                    return Err(Error::Parse("Invalid instruction address"));
                 }
-                None => return Err(Error::Parse("Invalid instruction address")),
+                (&line[colon + 1..], Some(address))
             }
-        } else {
-            (line, None)
+            None => (line, None),
         };
 
         // Parse Instruction
-        let raw_inst = convert_binary_string_to_int(&instruction);
+        let raw_inst = convert_binary_string_to_int(instruction);
         let instruction = Instruction::new(raw_inst)?;
 
         min_address = if let Some(address) = address {
             // Parse specified address
-            let address = convert_binary_string_to_int(&address) as usize;
+            let address = convert_binary_string_to_int(address) as usize;
             if address >= 32 {
                 return Err(Error::Parse("Specified instruction address too big"));
             }
@@ -185,6 +241,7 @@ fn parse_instructions<R: Read>(reader: R) -> Result<[Option<Instruction>; 32]> {
 
             if instructions[address].is_none() {
                 instructions[address] = Some(instruction);
+                lines[address] = number as u32 + 1;
                 address + 1
             } else {
                 return Err(Error::Parse("Two instructions with the same address"));
@@ -194,6 +251,7 @@ fn parse_instructions<R: Read>(reader: R) -> Result<[Option<Instruction>; 32]> {
             let address = min_address;
             if address < 32 {
                 instructions[address] = Some(instruction);
+                lines[address] = number as u32 + 1;
                 address + 1
             } else {
                 return Err(Error::Parse("Too many instructions in this program"));
@@ -201,7 +259,7 @@ fn parse_instructions<R: Read>(reader: R) -> Result<[Option<Instruction>; 32]> {
         }
     }
 
-    Ok(instructions)
+    Ok((instructions, lines))
 }
 
 /// Convert a binary string to a u32 ignoring any chars other than 0 and 1
@@ -211,14 +269,13 @@ fn parse_instructions<R: Read>(reader: R) -> Result<[Option<Instruction>; 32]> {
 fn convert_binary_string_to_int(s: &str) -> u32 {
     let mut result = 0u32;
 
-    for bit in s.chars().filter_map(|c| {
-        match c {
-            '0' => Some(0),
-            '1' => Some(1),
-            _ => None,
+    // Multi-byte chars never contain ascii bytes, so checking bytes is enough
+    for byte in s.bytes() {
+        match byte {
+            b'0' => result = result << 1,
+            b'1' => result = result << 1 | 1,
+            _ => (),
         }
-    }) {
-        result = result << 1 | bit;
     }
 
     result
@@ -231,7 +288,7 @@ mod tests {
 
     #[test]
     fn parser() {
-        let program = parse_instructions(Cursor::new("\
+        let program = parse_instructions("\
             # Simple program\n\
             \n\
             00000: 00 00001 000000000000000000 # first instruction\n\
@@ -239,7 +296,7 @@ mod tests {
             00011: 00 11111 000000000000000000\n\
           \n       00 00000 000000000000000000\n\
             11111 : 00 00011 | 00 | 000 1111 01 | 01 0100 | 0\n\
-        ".to_owned())).unwrap();
+        ".as_bytes()).unwrap();
 
         assert_eq!(program.iter().filter_map(|e| *e).collect::<Vec<_>>().as_slice(), &[
             Instruction::new(0b00_00001_000000000000000000).unwrap(),
@@ -253,27 +310,27 @@ mod tests {
     #[test]
     #[should_panic(expected = "Invalid instruction address")]
     fn invalid_address() {
-        let _ = parse_instructions(Cursor::new("\
+        let _ = parse_instructions("\
             0 0 0 0 0: 00 00001 000000000000000000\n\
-        ".to_owned())).unwrap();
+        ".as_bytes()).unwrap();
     }
 
     #[test]
     #[should_panic(expected = "Addresses must be nondecreasing")]
     fn decreasing_address() {
-        let _ = parse_instructions(Cursor::new("\
+        let _ = parse_instructions("\
             00001: 00 00000 000000000000000000\n\
             00000: 00 00001 000000000000000000\n\
-        ".to_owned())).unwrap();
+        ".as_bytes()).unwrap();
     }
 
     #[test]
     #[should_panic(expected = "Too many instructions in this program")]
     fn overflowing_address() {
-        let _ = parse_instructions(Cursor::new("\
+        let _ = parse_instructions("\
             11111: 00 00000 000000000000000000\n\
                    00 00000 000000000000000000\n\
-        ".to_owned())).unwrap();
+        ".as_bytes()).unwrap();
     }
 
     #[test]
@@ -333,10 +390,77 @@ mod tests {
         ]);
     }
 
+    #[test]
+    fn verify() {
+        let program = "\
+            00000: 00 00001 00 000 1100 01 01 1100 0\n\
+            00001: 00 00000 01 000 0000 01 10 0001 0\n\
+            00011: 00 00011 00 000 0000 01 10 0001 0\n\
+        ".to_owned();
+        let program = read_program(Cursor::new(&program)).unwrap();
+        assert!(verify_program(&program).is_ok());
+
+        // Reachable read from a disabled bus
+        let mut invalid = program;
+        invalid[0] = Instruction::new(0b01_00010_00_000_0000_01_00_0001_0).unwrap();
+        match verify_program(&invalid) {
+            Err(Error::Verify(3, "Cannot read from disabled bus")) => (),
+            _ => panic!("Invalid bus access not detected"),
+        }
+
+        // Reachable read from a bus in write mode
+        invalid[0] = Instruction::new(0b00_00001_11_000_0000_01_10_0001_0).unwrap();
+        match verify_program(&invalid) {
+            Err(Error::Verify(0, "Cannot read from bus while it is in write mode")) => (),
+            _ => panic!("Invalid bus access not detected"),
+        }
+    }
+
     #[test]
     #[should_panic(expected = "No instruction reachable")]
     fn reachable_empty() {
         let program = Cursor::new("".to_owned());
         read_reachable_program(program).unwrap();
     }
+
+    #[test]
+    fn invalid_utf8() {
+        match parse_instructions(b"00 00001 0000\xFF00000000000000") {
+            Err(Error::Io(ref e)) if e.kind() == io::ErrorKind::InvalidData => (),
+            _ => panic!("Invalid UTF-8 not detected"),
+        }
+    }
+
+    #[test]
+    fn unicode_whitespace() {
+        // Lines with only non-ascii whitespace are empty, other chars are
+        // ignored like all chars except 0, 1 and :
+        let program = parse_instructions("\u{a0}\n00001\u{2003}: 00 00011 000000000000000000 ü\n".as_bytes()).unwrap();
+        assert_eq!(program[0], None);
+        assert_eq!(program[1], Some(Instruction::new(0b00_00011_000000000000000000).unwrap()));
+    }
+
+    #[test]
+    fn load_multiple_files() {
+        let directory = std::env::temp_dir().join(format!("2i-parse-{}", std::process::id()));
+        std::fs::create_dir_all(&directory).unwrap();
+        let valid = directory.join("valid.2i");
+        let invalid = directory.join("invalid.2i");
+        std::fs::write(&valid, "00001: 00 00000 000000000000000000\n").unwrap();
+        std::fs::write(&invalid, "1: 00 00000 000000000000000000\n").unwrap();
+
+        let paths = vec![valid.clone(), directory.join("missing.2i"), invalid, valid];
+        let results = load_files(&paths, parse_program);
+        std::fs::remove_dir_all(&directory).unwrap();
+
+        assert_eq!(results.len(), 4);
+        assert_eq!(results[0].as_ref().unwrap().as_ref().unwrap()[1],
+                   Instruction::new(0b00_00000_000000000000000000).unwrap());
+        assert_eq!(results[1].as_ref().unwrap_err().kind(), io::ErrorKind::NotFound);
+        match results[2] {
+            Ok(Err(Error::Parse("Invalid instruction address"))) => (),
+            _ => panic!("Invalid program not detected"),
+        }
+        assert!(results[3].as_ref().unwrap().is_ok());
+    }
 }
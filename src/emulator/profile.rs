@@ -0,0 +1,247 @@
+//! Execution profiles of the 2i.
+//!
+//! This module contains counters of executed instructions, conditional jumps,
+//! bus accesses and loop iterations. All counters are fixed-size arrays that
+//! are indexed directly by the instruction or bus address, so recording a
+//! step costs only a few increments.
+
+use super::Result;
+use super::alu::Flags;
+use super::bus::BusMut;
+use super::cpu::Cpu;
+use super::instruction::{AddressControl, DecodedInstruction};
+
+/// Profile of an execution.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::{Cpu, DecodedInstruction, Instruction, IoRam};
+/// use emulator::profile::Profile;
+///
+/// let mut profile = Profile::new();
+/// let mut cpu = Cpu::new();
+/// let mut ram = IoRam::new();
+/// let mut instruction_pointer = 0;
+///
+/// // R0 = R0 + 1; LOOP
+/// let inst = DecodedInstruction::new(Instruction::new(0b00_00000_00_000_0001_01_01_0100_0).unwrap());
+/// for _ in 0..10 {
+///     profile.execute(&mut cpu, &mut instruction_pointer, &inst, &mut ram).unwrap();
+/// }
+///
+/// assert_eq!(profile.hits(0), 10);
+/// assert_eq!(profile.loop_iterations(0), 10);
+/// assert_eq!(profile.loop_cycles(0), 10);
+/// ```
+#[derive(Clone)]
+pub struct Profile {
+    steps: u64,
+    hits: [u64; 32],
+    /// Number of conditional jumps where the last bit was set (1) or not (0)
+    branches: [[u64; 2]; 32],
+    reads: [u64; 256],
+    writes: [u64; 256],
+    /// Number of backward jumps to every address
+    loop_iterations: [u64; 32],
+    /// Total number of steps from an address until jumping back to it
+    loop_cycles: [u64; 32],
+    /// Number of steps before the address was executed the last time
+    entered: [u64; 32],
+}
+
+impl Profile {
+    /// Create an empty profile.
+    pub fn new() -> Profile {
+        Profile {
+            steps: 0,
+            hits: [0; 32],
+            branches: [[0; 2]; 32],
+            reads: [0; 256],
+            writes: [0; 256],
+            loop_iterations: [0; 32],
+            loop_cycles: [0; 32],
+            entered: [0; 32],
+        }
+    }
+
+    /// Reset all counters.
+    pub fn clear(&mut self) {
+        *self = Profile::new();
+    }
+
+    /// Total number of recorded steps.
+    pub fn steps(&self) -> u64 {
+        self.steps
+    }
+
+    /// Number of times the instruction at the given address was executed.
+    pub fn hits(&self, address: usize) -> u64 {
+        self.hits[address & 0b11111]
+    }
+
+    /// Number of conditional jumps at the given address that were taken
+    /// (last bit of the next address set) and not taken.
+    ///
+    /// Both are always zero for instructions with unconditional jumps.
+    pub fn branches(&self, address: usize) -> (u64, u64) {
+        let branches = self.branches[address & 0b11111];
+        (branches[1], branches[0])
+    }
+
+    /// Number of reads from the given bus address.
+    pub fn reads(&self, address: u8) -> u64 {
+        self.reads[address as usize]
+    }
+
+    /// Number of writes to the given bus address.
+    pub fn writes(&self, address: u8) -> u64 {
+        self.writes[address as usize]
+    }
+
+    /// Number of iterations of the loop starting at the given address.
+    ///
+    /// Every jump to the same or a lower address counts as an iteration of
+    /// the loop starting at the target address.
+    pub fn loop_iterations(&self, address: usize) -> u64 {
+        self.loop_iterations[address & 0b11111]
+    }
+
+    /// Total number of steps spent in all iterations of the loop starting at
+    /// the given address, including nested loops.
+    pub fn loop_cycles(&self, address: usize) -> u64 {
+        self.loop_cycles[address & 0b11111]
+    }
+
+    /// Execute the given instruction and record it.
+    ///
+    /// Behaves like `Cpu::execute_decoded`, but also updates the instruction
+    /// pointer. Failed steps are not recorded (the bus accesses before the
+    /// error are).
+    pub fn execute<B: BusMut>(&mut self, cpu: &mut Cpu, instruction_pointer: &mut usize,
+                              inst: &DecodedInstruction, bus: &mut B) -> Result<Flags> {
+        let (next_address, flags) = cpu.execute_decoded(inst, &mut self.bus(bus))?;
+        self.record(*instruction_pointer, inst, next_address);
+        *instruction_pointer = next_address;
+        Ok(flags)
+    }
+
+    /// Wrap the given bus to count all accesses.
+    ///
+    /// Use this together with `record` to profile steps that are executed
+    /// differently, eg by `History::execute`.
+    pub fn bus<'p, B: BusMut>(&'p mut self, bus: &'p mut B) -> ProfiledBus<'p, B> {
+        ProfiledBus {
+            bus: bus,
+            reads: &mut self.reads,
+            writes: &mut self.writes,
+        }
+    }
+
+    /// Record a step at the given address that continues at `next_address`.
+    ///
+    /// Bus accesses are not recorded here, but by the bus returned by `bus`.
+    pub fn record(&mut self, address: usize, inst: &DecodedInstruction, next_address: usize) {
+        let (address, next_address) = (address & 0b11111, next_address & 0b11111);
+
+        self.entered[address] = self.steps;
+        self.steps += 1;
+        self.hits[address] += 1;
+
+        if inst.address_control() != AddressControl::Jump {
+            self.branches[address][next_address & 1] += 1;
+        }
+
+        if next_address <= address {
+            self.loop_iterations[next_address] += 1;
+            self.loop_cycles[next_address] += self.steps - self.entered[next_address];
+        }
+    }
+}
+
+impl Default for Profile {
+    fn default() -> Profile {
+        Profile::new()
+    }
+}
+
+/// Bus that counts the reads and writes of every address
+pub struct ProfiledBus<'p, B> {
+    bus: &'p mut B,
+    reads: &'p mut [u64; 256],
+    writes: &'p mut [u64; 256],
+}
+
+impl<'p, B> ProfiledBus<'p, B> {
+    /// Access the wrapped bus.
+    pub fn inner(&self) -> &B {
+        self.bus
+    }
+}
+
+impl<'p, B: BusMut> BusMut for ProfiledBus<'p, B> {
+    fn read(&mut self, address: u8) -> Result<u8> {
+        self.reads[address as usize] += 1;
+        self.bus.read(address)
+    }
+    fn write(&mut self, address: u8, value: u8) -> Result<()> {
+        self.writes[address as usize] += 1;
+        self.bus.write(address, value)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::IoRam;
+    use crate::instruction::decode_program;
+    use crate::parse::read_program;
+
+    #[test]
+    fn multiply() {
+        // (FE) = (FC) * (FD) using repeated addition
+        let program = read_program(&b"
+            00 00001 00 000 1100 01 01 1100 0
+            00 00010 01 000 0000 01 10 0001 0
+            00 00011 00 001 1101 01 01 1100 0
+            00 00100 01 001 0000 01 10 0001 0
+            00 00101 00 010 0000 01 00 0011 0
+            10 00111 00 000 0000 00 00 0001 0
+            00 01000 00 000 1111 01 01 0100 0
+            00 01001 00 001 1110 01 01 1100 0
+            00 00101 00 010 0001 01 00 0100 0
+            00 01001 11 001 0010 00 00 1100 0"[..]).unwrap();
+        let program = decode_program(&program);
+
+        let mut ram = IoRam::new();
+        ram.inspect_input()[0] = 7;
+        ram.inspect_input()[1] = 6;
+        let mut cpu = Cpu::new();
+        let mut instruction_pointer = 0;
+
+        let mut profile = Profile::new();
+        while profile.hits(0b01001) == 0 {
+            let inst = &program[instruction_pointer];
+            profile.execute(&mut cpu, &mut instruction_pointer, inst, &mut ram).unwrap();
+        }
+        assert_eq!(cpu.inspect_registers()[2], 42);
+
+        // Five instructions of setup, three per iteration and three for the exit
+        assert_eq!(profile.steps(), 5 + 7 * 3 + 3);
+        assert_eq!(profile.hits(0b00100), 1);
+        assert_eq!(profile.hits(0b00101), 8);
+        assert_eq!(profile.branches(0b00101), (1, 7));
+        assert_eq!(profile.branches(0b00110), (0, 0));
+        assert_eq!(profile.loop_iterations(0b00101), 7);
+        assert_eq!(profile.loop_cycles(0b00101), 7 * 3);
+        assert_eq!(profile.loop_iterations(0b01001), 1);
+        assert_eq!(profile.reads(0xFC), 1);
+        assert_eq!(profile.reads(0xFD), 1);
+        assert_eq!(profile.writes(0xFE), 1);
+        assert_eq!(profile.writes(0xFD), 0);
+
+        profile.clear();
+        assert_eq!(profile.steps(), 0);
+        assert_eq!(profile.hits(0b00101), 0);
+    }
+}
@@ -0,0 +1,426 @@
+//! Superblock translation of programs.
+//!
+//! This module contains an engine that translates a program into chains of
+//! instructions, which are executed without computing the next address and
+//! the flags in between.
+
+use super::{Error, Result};
+use super::alu::{self, Flags};
+use super::bus::BusMut;
+use super::cpu::Cpu;
+use super::instruction::{decode_program, AddressControl, AluInputA, AluInputB,
+    DecodedInstruction, Instruction};
+
+/// Instruction inside a superblock, which always continues with the next one
+type Operation<B> = Box<dyn Fn(&mut Cpu, &mut B) -> Result<()> + Send + Sync>;
+
+/// Last instruction of a superblock, which returns the next address
+type Exit<B> = Box<dyn Fn(&mut Cpu, &mut B) -> Result<usize> + Send + Sync>;
+
+/// Chain of instructions starting at a specific address
+struct Block<B> {
+    /// Instructions with an unconditional jump to the next one
+    body: Vec<Operation<B>>,
+    exit: Exit<B>,
+    /// Number of instructions (including the exit)
+    length: u64,
+    /// Bitmask of all addresses in the block but the first
+    inner: u32,
+}
+
+/// Program translated into superblocks.
+///
+/// Instructions with `MAC = 00` jump unconditionally, so a chain of them can
+/// be executed without dispatching on the next address after every
+/// instruction. Every address starts a superblock that follows these jumps
+/// until a conditional instruction (which ends the block) or an address
+/// already in the block is reached.
+///
+/// Every instruction is translated into a closure specialized for its
+/// operands. The flags are only calculated for instructions that store them
+/// or branch on them; all other instructions only calculate their result.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::{Cpu, Instruction, IoRam};
+/// use emulator::superblock::Superblocks;
+///
+/// // R0 = 6; R0 = R0 + R0; loop
+/// let mut program = [Instruction::default(); 32];
+/// program[0] = Instruction::new(0b00_00001_00_000_0110_01_01_1100_0).unwrap();
+/// program[1] = Instruction::new(0b00_00001_00_000_0000_01_00_0100_0).unwrap();
+///
+/// let superblocks = Superblocks::<IoRam>::new(&program);
+/// let mut cpu = Cpu::new();
+/// let mut ram = IoRam::new();
+///
+/// let mut address = 0;
+/// assert_eq!(superblocks.run(&mut cpu, &mut ram, &mut address, 3, None).unwrap(), 3);
+/// assert_eq!(cpu.inspect_registers()[0], 24);
+/// assert_eq!(address, 1);
+/// ```
+pub struct Superblocks<B> {
+    decoded: [DecodedInstruction; 32],
+    blocks: Vec<Block<B>>,
+}
+
+impl<B: BusMut> Superblocks<B> {
+    /// Translate the given program.
+    pub fn new(program: &[Instruction; 32]) -> Superblocks<B> {
+        let decoded = decode_program(program);
+        let blocks = (0..32).map(|address| translate(&decoded, address)).collect();
+
+        Superblocks {
+            decoded: decoded,
+            blocks: blocks,
+        }
+    }
+
+    /// Number of instructions executed by the superblock at the given address.
+    pub fn block_length(&self, address: usize) -> u64 {
+        self.blocks[address & 0b11111].length
+    }
+
+    /// Execute the complete superblock at the given address and return the
+    /// address of the next instruction.
+    ///
+    /// The state of the cpu and the bus is the same as after executing the
+    /// instructions of the block one by one with `Cpu::execute_instruction`.
+    pub fn execute_block(&self, cpu: &mut Cpu, address: usize, bus: &mut B) -> Result<usize> {
+        let block = &self.blocks[address & 0b11111];
+
+        if let Some((first, rest)) = block.body.split_first() {
+            first(cpu, bus)?;
+
+            // Only the first instruction can see the volatile interrupt
+            cpu.volatile_interrupt = false;
+
+            for operation in rest {
+                operation(cpu, bus)?;
+            }
+        }
+
+        (block.exit)(cpu, bus)
+    }
+
+    /// Execute at most `max_steps` instructions starting at `address`.
+    ///
+    /// Stops before the instruction at `until_address` is executed and
+    /// returns the number of executed instructions. Superblocks that would
+    /// exceed one of these limits are executed instruction by instruction, so
+    /// the limits are exactly the same as for single steps. `address` is
+    /// updated to the address of the next instruction.
+    pub fn run(&self, cpu: &mut Cpu, bus: &mut B, address: &mut usize, max_steps: u64,
+               until_address: Option<usize>) -> Result<u64> {
+        let stop_mask = until_address.map_or(0, |address| 1u32 << address);
+        let mut steps = 0;
+
+        loop {
+            if until_address == Some(*address) || steps == max_steps {
+                return Ok(steps);
+            }
+
+            let block = &self.blocks[*address & 0b11111];
+            if block.length <= max_steps - steps && block.inner & stop_mask == 0 {
+                *address = self.execute_block(cpu, *address, bus)?;
+                steps += block.length;
+            } else {
+                *address = cpu.execute_decoded(&self.decoded[*address & 0b11111], bus)?.0;
+                steps += 1;
+            }
+        }
+    }
+}
+
+/// Build the superblock starting at the given address
+fn translate<B: BusMut>(program: &[DecodedInstruction; 32], start: usize) -> Block<B> {
+    let mut addresses = vec![start];
+    let mut visited = 1u32 << start;
+
+    loop {
+        let inst = &program[*addresses.last().unwrap()];
+        if inst.address_control != AddressControl::Jump {
+            break;
+        }
+
+        let next = inst.next_address as usize;
+        if visited & 1 << next != 0 {
+            break;
+        }
+        addresses.push(next);
+        visited |= 1 << next;
+    }
+
+    let (&exit, body) = addresses.split_last().unwrap();
+
+    Block {
+        body: body.iter().map(|&address| translate_operation(&program[address])).collect(),
+        exit: translate_exit(&program[exit]),
+        length: addresses.len() as u64,
+        inner: visited & !(1 << start),
+    }
+}
+
+/// Create a specialized closure for every combination of the alu inputs.
+///
+/// The body is evaluated with `$cpu`, `$bus` and both alu inputs `$a` and `$b`
+/// in scope. Invalid bus accesses return their error.
+macro_rules! specialize {
+    ($inst:expr, |$cpu:ident, $bus:ident, $a:ident, $b:ident| $body:expr) => {
+        match ($inst.input_a, $inst.input_b) {
+            (AluInputA::Invalid(error), _) => {
+                Box::new(move |_: &mut Cpu, _: &mut B| Err(Error::Cpu(error)))
+            }
+            (AluInputA::Register(a), AluInputB::Register(b)) => {
+                Box::new(move |$cpu: &mut Cpu, $bus: &mut B| {
+                    let ($a, $b) = ($cpu.registers[a], $cpu.registers[b]);
+                    $body
+                })
+            }
+            (AluInputA::Register(a), AluInputB::Constant(constant)) => {
+                Box::new(move |$cpu: &mut Cpu, $bus: &mut B| {
+                    let ($a, $b) = ($cpu.registers[a], constant);
+                    $body
+                })
+            }
+            (AluInputA::Bus(a), AluInputB::Register(b)) => {
+                Box::new(move |$cpu: &mut Cpu, $bus: &mut B| {
+                    let $a = $bus.read($cpu.registers[a])?;
+                    let $b = $cpu.registers[b];
+                    $body
+                })
+            }
+            (AluInputA::Bus(a), AluInputB::Constant(constant)) => {
+                Box::new(move |$cpu: &mut Cpu, $bus: &mut B| {
+                    let ($a, $b) = ($bus.read($cpu.registers[a])?, constant);
+                    $body
+                })
+            }
+        }
+    };
+}
+
+/// Translate an instruction inside a superblock (which always jumps)
+fn translate_operation<B: BusMut>(inst: &DecodedInstruction) -> Operation<B> {
+    let instruction = inst.alu_instruction;
+    let write_register = inst.write_register;
+    let write_bus = inst.write_bus;
+
+    if inst.store_flags {
+        let alu = inst.alu;
+        specialize!(inst, |cpu, bus, a, b| {
+            let (result, flags) = alu(instruction, a, b, cpu.flag_register.carry());
+            write(cpu, bus, write_register, write_bus, result)?;
+            cpu.flag_register = flags;
+            Ok(())
+        })
+    } else {
+        let alu = alu::result_function(instruction);
+        specialize!(inst, |cpu, bus, a, b| {
+            let result = alu(a, b, cpu.flag_register.carry());
+            write(cpu, bus, write_register, write_bus, result)
+        })
+    }
+}
+
+/// Translate the last instruction of a superblock
+fn translate_exit<B: BusMut>(inst: &DecodedInstruction) -> Exit<B> {
+    let instruction = inst.alu_instruction;
+    let write_register = inst.write_register;
+    let write_bus = inst.write_bus;
+    let address_control = inst.address_control;
+    let next_address = inst.next_address;
+    let store_flags = inst.store_flags;
+
+    let uses_flags = match address_control {
+        AddressControl::Carry | AddressControl::Zero | AddressControl::Negative => true,
+        _ => false,
+    };
+
+    if store_flags || uses_flags {
+        let alu = inst.alu;
+        specialize!(inst, |cpu, bus, a, b| {
+            let (result, flags) = alu(instruction, a, b, cpu.flag_register.carry());
+            write(cpu, bus, write_register, write_bus, result)?;
+            let next_address = next_address | condition(cpu, address_control, flags);
+            if store_flags {
+                cpu.flag_register = flags;
+            }
+            Ok(finish(cpu, address_control, next_address))
+        })
+    } else {
+        let alu = alu::result_function(instruction);
+        specialize!(inst, |cpu, bus, a, b| {
+            let result = alu(a, b, cpu.flag_register.carry());
+            write(cpu, bus, write_register, write_bus, result)?;
+            let next_address = next_address | condition(cpu, address_control, Flags::default());
+            Ok(finish(cpu, address_control, next_address))
+        })
+    }
+}
+
+/// Write the result to the registers and the bus
+#[inline(always)]
+fn write<B: BusMut>(cpu: &mut Cpu, bus: &mut B, register: Option<usize>,
+                    bus_register: Option<usize>, result: u8) -> Result<()> {
+    if let Some(address) = register {
+        cpu.registers[address] = result;
+    }
+    if let Some(address) = bus_register {
+        bus.write(cpu.registers[address], result)?;
+    }
+    Ok(())
+}
+
+/// Last bit of the next address (the flags are only valid if they are used)
+#[inline(always)]
+fn condition(cpu: &Cpu, address_control: AddressControl, flags: Flags) -> u8 {
+    (match address_control {
+        AddressControl::Jump => false,
+        AddressControl::VolatileInterrupt => cpu.volatile_interrupt,
+        AddressControl::StoredCarry => cpu.flag_register.carry(),
+        AddressControl::Carry => flags.carry(),
+        AddressControl::Zero => flags.zero(),
+        AddressControl::Negative => flags.negative(),
+        AddressControl::StoredInterrupt => cpu.stored_interrupt,
+    }) as u8
+}
+
+/// Reset the interrupts after the last instruction
+#[inline(always)]
+fn finish(cpu: &mut Cpu, address_control: AddressControl, next_address: u8) -> usize {
+    cpu.volatile_interrupt = false;
+    if address_control == AddressControl::StoredInterrupt {
+        cpu.stored_interrupt = false;
+    }
+    next_address as usize
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::IoRam;
+
+    /// Deterministic pseudo random numbers (xorshift)
+    fn random(state: &mut u32) -> u32 {
+        *state ^= *state << 13;
+        *state ^= *state >> 17;
+        *state ^= *state << 5;
+        *state
+    }
+
+    /// Random program with mostly unconditional jumps and valid bus accesses
+    fn random_program(state: &mut u32) -> [Instruction; 32] {
+        let mut program = [Instruction::default(); 32];
+        for inst in program.iter_mut() {
+            let mut raw = random(state) & 0x1FFFFFF;
+            if raw & 1 << 6 != 0 && random(state) % 4 != 0 {
+                raw = raw & !(1 << 17) | 1 << 16;
+            }
+            if random(state) % 3 != 0 {
+                raw &= !(0b11 << 23);
+            }
+            *inst = Instruction::new(raw).unwrap();
+        }
+        program
+    }
+
+    #[test]
+    fn blocks() {
+        // 0 -> 1 -> 2 (conditional), 3 -> 3
+        let mut program = [Instruction::default(); 32];
+        program[0] = Instruction::new(0b00_00001_00_000_0000_00_00_0000_0).unwrap();
+        program[1] = Instruction::new(0b00_00010_00_000_0000_00_00_0000_0).unwrap();
+        program[2] = Instruction::new(0b10_00000_00_000_0000_00_00_0000_0).unwrap();
+        program[3] = Instruction::new(0b00_00011_00_000_0000_00_00_0000_0).unwrap();
+
+        let superblocks = Superblocks::<IoRam>::new(&program);
+        assert_eq!(superblocks.block_length(0), 3);
+        assert_eq!(superblocks.block_length(1), 2);
+        assert_eq!(superblocks.block_length(2), 1);
+        assert_eq!(superblocks.block_length(3), 1);
+        // 4 -> 0 -> 1 -> 2
+        assert_eq!(superblocks.block_length(4), 4);
+    }
+
+    #[test]
+    fn random_programs() {
+        let mut state = 0xC0FFEE;
+
+        for _ in 0..200 {
+            let program = random_program(&mut state);
+            let superblocks = Superblocks::<IoRam>::new(&program);
+
+            let mut reference = (Cpu::new(), IoRam::new());
+            for register in 0..4 {
+                reference.1.inspect_input()[register] = random(&mut state) as u8;
+            }
+            let mut translated = reference.clone();
+            let mut address = 0;
+
+            for step in 0..100 {
+                if step % 7 == 0 {
+                    reference.0.trigger_volatile_interrupt();
+                    translated.0.trigger_volatile_interrupt();
+                }
+                if step % 11 == 0 {
+                    reference.0.trigger_stored_interrupt();
+                    translated.0.trigger_stored_interrupt();
+                }
+
+                let result = superblocks.execute_block(&mut translated.0, address, &mut translated.1);
+
+                let mut expected = Ok(address);
+                for _ in 0..superblocks.block_length(address) {
+                    let inst = program[*expected.as_ref().unwrap()];
+                    expected = reference.0.execute_instruction(inst, &mut reference.1).map(|r| r.0);
+                    if expected.is_err() {
+                        break;
+                    }
+                }
+
+                match (result, expected) {
+                    (Ok(next), Ok(expected)) => {
+                        assert_eq!(next, expected);
+                        assert!(translated.0 == reference.0);
+                        assert!(translated.1 == reference.1);
+                        address = next;
+                    }
+                    (Err(_), Err(_)) => break,
+                    _ => panic!("Superblock and reference differ in errors"),
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn limits() {
+        let mut state = 0xBEEF;
+
+        for _ in 0..100 {
+            let program = random_program(&mut state);
+            let superblocks = Superblocks::<IoRam>::new(&program);
+            let max_steps = random(&mut state) as u64 % 50;
+            let until_address = Some(random(&mut state) as usize % 32);
+
+            let mut reference = (Cpu::new(), IoRam::new());
+            let mut expected = (0, 0);
+            while expected.1 < max_steps && Some(expected.0) != until_address {
+                match reference.0.execute_instruction(program[expected.0], &mut reference.1) {
+                    Ok((next, _)) => expected = (next, expected.1 + 1),
+                    Err(_) => break,
+                }
+            }
+
+            let mut cpu = Cpu::new();
+            let mut ram = IoRam::new();
+            let mut address = 0;
+            if let Ok(steps) = superblocks.run(&mut cpu, &mut ram, &mut address, max_steps, until_address) {
+                assert_eq!((address, steps), expected);
+                assert!(cpu == reference.0);
+                assert!(ram == reference.1);
+            }
+        }
+    }
+}
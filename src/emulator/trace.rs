@@ -0,0 +1,463 @@
+//! Execution traces of the 2i.
+//!
+//! This module contains a compact binary format for recording every step of
+//! an execution, a writer for it and a reader that can restore the state of
+//! the machine at any step without executing the program again.
+//!
+//! A trace starts with an 8 byte header (`2itr`, the version, a reserved
+//! byte and the keyframe interval as little endian `u16`). It is followed by
+//! blocks, each consisting of a keyframe with the complete state and up to
+//! `interval` records of 8 bytes. Because all parts have a fixed size, the
+//! position of every step can be calculated directly.
+
+use std::io::{self, BufWriter, Read, Write};
+
+use super::{Error, Result};
+use super::alu::Flags;
+use super::bus::BusMut;
+use super::cpu::Cpu;
+use super::history::MachineState;
+use super::instruction::DecodedInstruction;
+use super::observe::Observer;
+
+const MAGIC: &[u8; 4] = b"2itr";
+const VERSION: u8 = 1;
+const HEADER_SIZE: usize = 8;
+
+/// Size of a single step in bytes
+pub const RECORD_SIZE: usize = 8;
+
+/// Size of the complete state in bytes
+pub const KEYFRAME_SIZE: usize = 272;
+
+/// Changes of a single executed step.
+#[derive(Copy, Clone, Debug, Default, PartialEq)]
+pub struct Record {
+    /// Address of the executed instruction
+    pub address: u8,
+    pub next_address: u8,
+    /// Flags calculated by the alu
+    pub flags: Flags,
+    /// Flag register after the step
+    pub flag_register: Flags,
+    /// Interrupts when the instruction was executed
+    pub volatile_interrupt: bool,
+    pub stored_interrupt: bool,
+    /// Stored interrupt after the step (the volatile one is always reset)
+    pub stored_interrupt_after: bool,
+    /// Index and new value of the written register
+    pub register: Option<(u8, u8)>,
+    /// Address and new value of the written bus address
+    pub bus: Option<(u8, u8)>,
+}
+
+impl Record {
+    fn encode(&self) -> [u8; RECORD_SIZE] {
+        let (register, register_value) = self.register.map_or((0, 0), |(r, v)| (0x80 | r, v));
+        let (bus, bus_address, bus_value) = self.bus.map_or((0, 0, 0), |(a, v)| (1, a, v));
+
+        [
+            self.address | (self.volatile_interrupt as u8) << 5 |
+                (self.stored_interrupt as u8) << 6 | (self.stored_interrupt_after as u8) << 7,
+            self.next_address,
+            encode_flags(self.flag_register) | encode_flags(self.flags) << 3,
+            register,
+            register_value,
+            bus,
+            bus_address,
+            bus_value,
+        ]
+    }
+
+    fn decode(bytes: &[u8]) -> Record {
+        Record {
+            address: bytes[0] & 0b11111,
+            next_address: bytes[1],
+            flags: decode_flags(bytes[2] >> 3),
+            flag_register: decode_flags(bytes[2]),
+            volatile_interrupt: bytes[0] & 1 << 5 != 0,
+            stored_interrupt: bytes[0] & 1 << 6 != 0,
+            stored_interrupt_after: bytes[0] & 1 << 7 != 0,
+            register: if bytes[3] & 0x80 != 0 {
+                Some((bytes[3] & 0b111, bytes[4]))
+            } else {
+                None
+            },
+            bus: if bytes[5] != 0 {
+                Some((bytes[6], bytes[7]))
+            } else {
+                None
+            },
+        }
+    }
+
+    /// Apply the changes of the step to the given state.
+    pub fn apply(&self, state: &mut MachineState) {
+        state.instruction_pointer = self.next_address;
+        if let Some((register, value)) = self.register {
+            state.cpu.registers[register as usize] = value;
+        }
+        if let Some((address, value)) = self.bus {
+            if address >= 0xFE {
+                state.output[(address - 0xFE) as usize] = value;
+            } else {
+                state.memory[address as usize] = value;
+            }
+        }
+        state.cpu.flag_register = self.flag_register;
+        state.cpu.volatile_interrupt = false;
+        state.cpu.stored_interrupt = self.stored_interrupt_after;
+    }
+}
+
+/// Execute the given instruction and record its changes.
+///
+/// Behaves like `Cpu::execute_decoded`, but also updates the instruction
+/// pointer.
+pub fn execute_traced<B: BusMut>(cpu: &mut Cpu, instruction_pointer: &mut usize,
+                                 inst: &DecodedInstruction, bus: &mut B) -> Result<Record> {
+    let mut record = Record {
+        address: *instruction_pointer as u8,
+        volatile_interrupt: cpu.volatile_interrupt,
+        stored_interrupt: cpu.stored_interrupt,
+        ..Record::default()
+    };
+
+    let mut written = Written(None);
+    let (next_address, flags) = cpu.execute_observed(inst, bus, &mut written)?;
+
+    record.next_address = next_address as u8;
+    record.flags = flags;
+    record.flag_register = cpu.flag_register;
+    record.stored_interrupt_after = cpu.stored_interrupt;
+    record.register = inst.write_register.map(|r| (r as u8, cpu.registers[r]));
+    record.bus = written.0;
+
+    *instruction_pointer = next_address;
+    Ok(record)
+}
+
+/// Observer that remembers the written bus address and value
+struct Written(Option<(u8, u8)>);
+
+impl Observer for Written {
+    #[inline(always)]
+    fn bus_write(&mut self, address: u8, value: u8) {
+        self.0 = Some((address, value));
+    }
+}
+
+/// Writer for traces.
+///
+/// All records are buffered and a keyframe with the complete state is
+/// written every `interval` steps.
+pub struct TraceWriter<W: Write> {
+    writer: BufWriter<W>,
+    interval: u16,
+    /// Records written since the last keyframe
+    block: u16,
+}
+
+impl<W: Write> TraceWriter<W> {
+    /// Start a trace with the given initial state and keyframe interval.
+    pub fn new(writer: W, interval: u16, initial: &MachineState) -> io::Result<TraceWriter<W>> {
+        let interval = interval.max(1);
+        let mut writer = BufWriter::new(writer);
+
+        let mut header = [0; HEADER_SIZE];
+        header[..4].copy_from_slice(MAGIC);
+        header[4] = VERSION;
+        header[6..].copy_from_slice(&interval.to_le_bytes());
+        writer.write_all(&header)?;
+        writer.write_all(&encode_keyframe(initial))?;
+
+        Ok(TraceWriter {
+            writer: writer,
+            interval: interval,
+            block: 0,
+        })
+    }
+
+    /// Write the record of the next step.
+    ///
+    /// `state` returns the state after the step and is only called when a
+    /// keyframe is written.
+    pub fn write<F>(&mut self, record: &Record, state: F) -> io::Result<()>
+        where F: FnOnce() -> MachineState {
+        self.writer.write_all(&record.encode())?;
+
+        self.block += 1;
+        if self.block == self.interval {
+            self.writer.write_all(&encode_keyframe(&state()))?;
+            self.block = 0;
+        }
+
+        Ok(())
+    }
+
+    /// Flush the buffer and return the underlying writer.
+    pub fn finish(self) -> io::Result<W> {
+        self.writer.into_inner().map_err(|e| e.into_error())
+    }
+}
+
+/// Trace loaded completely into memory.
+///
+/// # Examples
+///
+/// ```
+/// use emulator::{Cpu, DecodedInstruction, Instruction, IoRam};
+/// use emulator::history::MachineState;
+/// use emulator::trace::{execute_traced, Trace, TraceWriter};
+///
+/// // R0 = R0 + 1; LOOP
+/// let inst = Instruction::new(0b00_00000_00_000_0001_01_01_0100_0).unwrap();
+/// let inst = DecodedInstruction::new(inst);
+///
+/// let mut cpu = Cpu::new();
+/// let mut ram = IoRam::new();
+/// let mut instruction_pointer = 0;
+///
+/// let initial = MachineState::from_io_ram(&cpu, instruction_pointer, &ram);
+/// let mut writer = TraceWriter::new(Vec::new(), 4, &initial).unwrap();
+/// for _ in 0..10 {
+///     let record = execute_traced(&mut cpu, &mut instruction_pointer, &inst, &mut ram).unwrap();
+///     writer.write(&record, || MachineState::from_io_ram(&cpu, instruction_pointer, &ram)).unwrap();
+/// }
+///
+/// let trace = Trace::read(&writer.finish().unwrap()[..]).unwrap();
+/// assert_eq!(trace.len(), 10);
+/// assert_eq!(trace.state(7).unwrap().cpu.inspect_registers()[0], 7);
+/// ```
+pub struct Trace {
+    data: Vec<u8>,
+    interval: u64,
+    len: u64,
+}
+
+impl Trace {
+    /// Read a complete trace.
+    pub fn read<R: Read>(mut reader: R) -> Result<Trace> {
+        let mut data = Vec::new();
+        reader.read_to_end(&mut data)?;
+
+        if data.len() < HEADER_SIZE || &data[..4] != MAGIC {
+            return Err(Error::Parse("Not a trace file"));
+        } else if data[4] != VERSION {
+            return Err(Error::Parse("Unsupported trace version"));
+        }
+
+        let interval = u16::from_le_bytes([data[6], data[7]]) as u64;
+        if interval == 0 {
+            return Err(Error::Parse("Invalid keyframe interval"));
+        }
+
+        // Every block starts with a keyframe, the last one may be incomplete
+        let block_size = KEYFRAME_SIZE as u64 + interval * RECORD_SIZE as u64;
+        let body = (data.len() - HEADER_SIZE) as u64;
+        let last_block = body % block_size;
+        if last_block < KEYFRAME_SIZE as u64 ||
+           (last_block - KEYFRAME_SIZE as u64) % RECORD_SIZE as u64 != 0 {
+            return Err(Error::Parse("Truncated trace"));
+        }
+
+        Ok(Trace {
+            len: body / block_size * interval + (last_block - KEYFRAME_SIZE as u64) / RECORD_SIZE as u64,
+            interval: interval,
+            data: data,
+        })
+    }
+
+    /// Number of recorded steps.
+    pub fn len(&self) -> u64 {
+        self.len
+    }
+
+    /// Check if the trace contains no steps.
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// The record of the given step (starting at 0).
+    pub fn record(&self, step: u64) -> Option<Record> {
+        if step >= self.len {
+            return None;
+        }
+
+        let offset = self.block_offset(step / self.interval) + KEYFRAME_SIZE +
+            (step % self.interval) as usize * RECORD_SIZE;
+        Some(Record::decode(&self.data[offset..offset + RECORD_SIZE]))
+    }
+
+    /// The state before the given step was executed (the final state for
+    /// `len()`).
+    ///
+    /// Starts at the last keyframe before the step, so at most `interval`
+    /// records have to be applied.
+    pub fn state(&self, step: u64) -> Option<MachineState> {
+        if step > self.len {
+            return None;
+        }
+
+        let block = step / self.interval;
+        let offset = self.block_offset(block);
+        let mut state = decode_keyframe(&self.data[offset..offset + KEYFRAME_SIZE]);
+        for step in block * self.interval..step {
+            self.record(step).unwrap().apply(&mut state);
+        }
+
+        Some(state)
+    }
+
+    /// All records starting at the given step.
+    pub fn records(&self, first: u64) -> impl Iterator<Item = Record> + '_ {
+        (first..self.len).map(move |step| self.record(step).unwrap())
+    }
+
+    /// Find the first step in which both traces differ.
+    ///
+    /// Returns the length of the shorter trace if one is a prefix of the
+    /// other and `None` if they are equal.
+    pub fn first_difference(&self, other: &Trace) -> Option<u64> {
+        if self.state(0) != other.state(0) {
+            return Some(0);
+        }
+
+        let step = self.records(0).zip(other.records(0)).position(|(a, b)| a != b);
+        match step {
+            Some(step) => Some(step as u64),
+            None if self.len != other.len => Some(self.len.min(other.len)),
+            None => None,
+        }
+    }
+
+    /// Offset of the keyframe of the given block
+    fn block_offset(&self, block: u64) -> usize {
+        HEADER_SIZE + block as usize * (KEYFRAME_SIZE + self.interval as usize * RECORD_SIZE)
+    }
+}
+
+fn encode_flags(flags: Flags) -> u8 {
+    flags.carry() as u8 | (flags.negative() as u8) << 1 | (flags.zero() as u8) << 2
+}
+
+fn decode_flags(bits: u8) -> Flags {
+    Flags::new(bits & 1 != 0, bits & 2 != 0, bits & 4 != 0)
+}
+
+fn encode_keyframe(state: &MachineState) -> [u8; KEYFRAME_SIZE] {
+    let mut keyframe = [0; KEYFRAME_SIZE];
+    keyframe[..8].copy_from_slice(&state.cpu.registers);
+    keyframe[8] = encode_flags(state.cpu.flag_register) |
+        (state.cpu.volatile_interrupt as u8) << 3 | (state.cpu.stored_interrupt as u8) << 4;
+    keyframe[9] = state.instruction_pointer;
+    keyframe[10..266].copy_from_slice(&state.memory);
+    keyframe[266..270].copy_from_slice(&state.input);
+    keyframe[270..].copy_from_slice(&state.output);
+    keyframe
+}
+
+fn decode_keyframe(keyframe: &[u8]) -> MachineState {
+    let mut state = MachineState {
+        cpu: Cpu::new(),
+        instruction_pointer: keyframe[9],
+        memory: [0; 256],
+        input: [0; 4],
+        output: [0; 2],
+    };
+    state.cpu.registers.copy_from_slice(&keyframe[..8]);
+    state.cpu.flag_register = decode_flags(keyframe[8]);
+    state.cpu.volatile_interrupt = keyframe[8] & 1 << 3 != 0;
+    state.cpu.stored_interrupt = keyframe[8] & 1 << 4 != 0;
+    state.memory.copy_from_slice(&keyframe[10..266]);
+    state.input.copy_from_slice(&keyframe[266..270]);
+    state.output.copy_from_slice(&keyframe[270..]);
+    state
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::IoRam;
+    use crate::instruction::decode_program;
+    use crate::parse::read_program;
+
+    const MULTIPLY: &[u8] = b"
+        00 00001 00 000 1100 01 01 1100 0
+        00 00010 01 000 0000 01 10 0001 0
+        00 00011 00 001 1101 01 01 1100 0
+        00 00100 01 001 0000 01 10 0001 0
+        00 00101 00 010 0000 01 00 0011 0
+        10 00111 00 000 0000 00 00 0001 0
+        00 01000 00 000 1111 01 01 0100 0
+        00 01001 00 001 1110 01 01 1100 0
+        00 00101 00 010 0001 01 00 0100 0
+        00 00000 11 001 0010 00 00 1100 0";
+
+    /// Trace the multiplication and return the trace and all states
+    fn trace(a: u8, b: u8, steps: usize, interval: u16) -> (Trace, Vec<MachineState>) {
+        let program = decode_program(&read_program(MULTIPLY).unwrap());
+        let mut cpu = Cpu::new();
+        let mut ram = IoRam::new();
+        ram.inspect_input()[0] = a;
+        ram.inspect_input()[1] = b;
+        let mut instruction_pointer = 0;
+
+        let mut states = vec![MachineState::from_io_ram(&cpu, instruction_pointer, &ram)];
+        let mut writer = TraceWriter::new(Vec::new(), interval, &states[0]).unwrap();
+        for step in 0..steps {
+            if step % 13 == 5 {
+                cpu.trigger_stored_interrupt();
+            }
+            let inst = &program[instruction_pointer];
+            let record = execute_traced(&mut cpu, &mut instruction_pointer, inst, &mut ram).unwrap();
+            let state = MachineState::from_io_ram(&cpu, instruction_pointer, &ram);
+            writer.write(&record, || state).unwrap();
+            states.push(state);
+        }
+
+        (Trace::read(&writer.finish().unwrap()[..]).unwrap(), states)
+    }
+
+    #[test]
+    fn replay() {
+        for &(steps, interval) in [(0, 1), (100, 1), (100, 7), (96, 32), (100, 1000)].iter() {
+            let (trace, states) = trace(5, 12, steps, interval);
+            assert_eq!(trace.len(), steps as u64);
+
+            for (step, state) in states.iter().enumerate() {
+                assert_eq!(trace.state(step as u64).as_ref(), Some(state));
+            }
+            assert!(trace.state(steps as u64 + 1).is_none());
+            assert!(trace.record(steps as u64).is_none());
+        }
+    }
+
+    #[test]
+    fn difference() {
+        let (a, _) = trace(5, 12, 100, 16);
+        let (b, _) = trace(5, 12, 100, 8);
+        let (c, _) = trace(5, 12, 50, 16);
+        let (d, _) = trace(5, 13, 100, 16);
+
+        assert_eq!(a.first_difference(&b), None);
+        assert_eq!(a.first_difference(&c), Some(50));
+        assert_eq!(a.first_difference(&d), Some(0));
+
+        // Change the value written to a register in the fourth step
+        let (e, _) = trace(5, 12, 100, 16);
+        let mut data = e.data.clone();
+        let offset = e.block_offset(0) + KEYFRAME_SIZE + 3 * RECORD_SIZE + 4;
+        data[offset] ^= 1;
+        let e = Trace::read(&data[..]).unwrap();
+        assert_eq!(a.first_difference(&e), Some(3));
+    }
+
+    #[test]
+    fn invalid() {
+        let (a, _) = trace(5, 12, 10, 4);
+        assert!(Trace::read(&a.data[..a.data.len() - 1]).is_err());
+        assert!(Trace::read(&b"2itx\x01\x00\x04\x00"[..]).is_err());
+        assert!(Trace::read(&b"2itr\x01\x00\x04\x00"[..]).is_err());
+    }
+}